@@ -0,0 +1,88 @@
+#!/bin/bash
+# Compiler throughput and scaling benchmark
+# Compiles each synthetic program shape from bench/gen_program.sh at its base
+# size and at 4x that size with -O2 -ftime-report, and reports CPU ms per
+# phase (best of 3 runs). Two things are flagged:
+#   - a phase that grows more than 8x when the input grows 4x (a linear
+#     phase grows about 4x; this is what catches quadratic behaviour)
+#   - a phase more than 50% slower than in bench/baseline.txt
+# Phases under 5 ms are too noisy to judge and are only reported.
+# It then times codegen alone on the 4x funcs program at -j1, -j2 and one
+# thread per CPU, which is reported but not judged.
+#
+# Usage: ./bench/compile_bench.sh [--update-baseline] [scale]   (default scale 1)
+# Exits with status 1 if anything was flagged.
+
+set -e
+cd "$(dirname "$0")/.."
+
+UPDATE=0
+if [ "$1" = "--update-baseline" ]; then
+    UPDATE=1
+    shift
+fi
+SCALE=${1:-1}
+BASELINE=bench/baseline.txt
+SHAPES="funcs:2000 exprs:1000 globals:3000 structs:2000 strings:5000 locals:1000"
+PHASES="parse types codegen assemble output total"
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+CHRONOS=$WORK/chronos_v10
+echo "Building chronos_v10..."
+gcc -O2 -pthread -o "$CHRONOS" chronos_v10.c
+
+# Best CPU ms per phase over 3 compiles, as "phase ms" lines
+measure() {
+    for run in 1 2 3; do
+        "$CHRONOS" -O2 -ftime-report -o "$WORK/prog" "$1" 2>&1 >/dev/null |
+            awk '/^  [a-z]+ +[0-9.]+ +[0-9.]+ / { print $1, $3 }'
+    done | awk '!($1 in best) || $2 < best[$1] { best[$1] = $2 } END { for (p in best) print p, best[p] }'
+}
+
+phase_ms() { awk -v p="$2" '$1 == p { print $2 }' "$1"; }
+
+flagged=0
+[ $UPDATE = 1 ] && : > "$WORK/baseline"
+printf "%-8s %7s %-9s %10s %10s %7s %10s\n" shape size phase "cpu ms" "4x ms" growth baseline
+for entry in $SHAPES; do
+    shape=${entry%%:*}
+    size=$((${entry##*:} * SCALE))
+    ./bench/gen_program.sh "$shape" "$size" > "$WORK/small.ch"
+    ./bench/gen_program.sh "$shape" $((size * 4)) > "$WORK/large.ch"
+    measure "$WORK/small.ch" > "$WORK/small.txt"
+    measure "$WORK/large.ch" > "$WORK/large.txt"
+    for phase in $PHASES; do
+        small=$(phase_ms "$WORK/small.txt" "$phase")
+        large=$(phase_ms "$WORK/large.txt" "$phase")
+        [ -z "$small" ] && continue
+        base=$(awk -v s="$shape" -v n="$size" -v p="$phase" '$1 == s && $2 == n && $3 == p { print $4 }' "$BASELINE" 2>/dev/null || true)
+        note=$(awk -v a="$small" -v b="$large" -v base="$base" 'BEGIN {
+            if (b >= 5 && b > 8 * (a > 0.01 ? a : 0.01)) printf " SUPERLINEAR"
+            if (base != "" && a >= 5 && a > 1.5 * base) printf " SLOWER THAN BASELINE"
+        }')
+        printf "%-8s %7d %-9s %10.3f %10.3f %6.1fx %10s%s\n" "$shape" "$size" "$phase" "$small" "$large" \
+            "$(awk -v a="$small" -v b="$large" 'BEGIN { print (a > 0 ? b / a : 0) }')" "${base:--}" "$note"
+        [ -n "$note" ] && flagged=1
+        [ $UPDATE = 1 ] && echo "$shape $size $phase $small" >> "$WORK/baseline"
+    done
+done
+
+# Thread scaling of codegen: wall ms per run from --bench-codegen
+./bench/gen_program.sh funcs $((2000 * SCALE * 4)) > "$WORK/threads.ch"
+CPUS=$(nproc 2>/dev/null || echo 1)
+echo
+printf "%-8s %10s %8s\n" threads "wall ms" speedup
+one=
+for j in $(printf "%s\n" 1 2 "$CPUS" | sort -nu); do
+    ms=$("$CHRONOS" -O2 -j"$j" --bench-codegen "$WORK/threads.ch" | sed -n 's/.*(\([0-9.]*\) ms\/run.*/\1/p')
+    [ -z "$one" ] && one=$ms
+    printf "%-8s %10.2f %7.2fx\n" "-j$j" "$ms" "$(awk -v a="$one" -v b="$ms" 'BEGIN { print (b > 0 ? a / b : 0) }')"
+done
+[ "$CPUS" -lt 2 ] && echo "(one CPU: thread scaling cannot be measured on this machine)"
+
+if [ $UPDATE = 1 ]; then
+    { echo "# shape size phase cpu_ms  (bench/compile_bench.sh --update-baseline)"; cat "$WORK/baseline"; } > "$BASELINE"
+    echo "Baseline written to $BASELINE"
+fi
+exit $flagged
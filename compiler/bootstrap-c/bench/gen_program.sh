@@ -0,0 +1,118 @@
+#!/bin/bash
+# Synthetic Chronos program generator for compiler benchmarks
+#
+# Usage: ./bench/gen_program.sh <shape> <size> > program.ch
+#
+# Shapes (each stresses one part of the compiler; <size> scales it linearly):
+#   funcs    <size> small functions, each calling the one before it
+#   exprs    <size> statements, each one expression nested 40 levels deep
+#   globals  <size> globals (scalars, initialized arrays, .bss arrays),
+#            all read from functions
+#   structs  a struct with <size> fields, built and read field by field
+#   strings  <size> distinct string literals, plus a repeated one
+#   locals   functions with <size> locals in nested blocks
+
+SHAPE=$1
+SIZE=${2:-1000}
+
+if [ -z "$SHAPE" ]; then
+    echo "Usage: $0 <funcs|exprs|globals|structs|strings|locals> <size>" >&2
+    exit 1
+fi
+
+awk -v shape="$SHAPE" -v n="$SIZE" '
+function main_returning(v) {
+    print ""
+    print "fn main() -> i64 {"
+    print "    return " v ";"
+    print "}"
+}
+BEGIN {
+    print "// Synthetic benchmark program: shape " shape ", size " n
+    if (shape == "funcs") {
+        print "fn f0(a: i64, b: i64) -> i64 {"
+        print "    return a + b;"
+        print "}"
+        for (i = 1; i < n; i++) {
+            print ""
+            print "fn f" i "(a: i64, b: i64) -> i64 {"
+            print "    let t: i64 = a * " i % 13 + 1 " - b;"
+            print "    if (t > 1000) { t = t % 1000; }"
+            print "    return f" i - 1 "(t, b + 1);"
+            print "}"
+        }
+        main_returning("f" n - 1 "(1, 2) % 256")
+    } else if (shape == "exprs") {
+        print "fn calc(x: i64, y: i64) -> i64 {"
+        print "    let acc: i64 = 0;"
+        for (i = 0; i < n; i++) {
+            e = "x"
+            for (d = 0; d < 40; d++) e = "(" e (d % 3 == 0 ? " + " : d % 3 == 1 ? " * " : " - ") (d % 2 ? "y" : d + 1) ")"
+            print "    acc = acc + " e ";"
+        }
+        print "    return acc;"
+        print "}"
+        main_returning("calc(3, 4) % 256")
+    } else if (shape == "globals") {
+        for (i = 0; i < n; i++) {
+            if (i % 3 == 0) print "let g" i ": i64 = " i ";"
+            else if (i % 3 == 1) print "let g" i ": [i32; 4] = [" i ", 1, 2, 3];"
+            else print "let g" i ": [i8; 64];"
+        }
+        for (i = 0; i < n; i += 30) {
+            print ""
+            print "fn touch" i "() -> i64 {"
+            print "    let s: i64 = 0;"
+            for (j = i; j < i + 30 && j < n; j++) {
+                if (j % 3 == 0) print "    s = s + g" j ";"
+                else if (j % 3 == 1) print "    s = s + g" j "[2];"
+                else print "    g" j "[1] = 7;"
+            }
+            print "    return s;"
+            print "}"
+        }
+        main_returning("touch0() % 256")
+    } else if (shape == "structs") {
+        print "struct Big {"
+        for (i = 0; i < n; i++) print "    f" i ": i64" (i < n - 1 ? "," : "")
+        print "}"
+        print ""
+        print "fn build() -> i64 {"
+        init = "    let b = Big { "
+        for (i = 0; i < n; i++) init = init "f" i ": " i (i < n - 1 ? ", " : " ")
+        print init "};"
+        print "    let s: i64 = 0;"
+        for (i = 0; i < n; i++) print "    s = s + b.f" i ";"
+        print "    return s;"
+        print "}"
+        main_returning("build() % 256")
+    } else if (shape == "strings") {
+        print "fn banner() -> i64 {"
+        for (i = 0; i < n; i++) {
+            print "    println(\"synthetic message number " i " with some padding text\");"
+            if (i % 10 == 0) print "    println(\"repeated line\");"
+        }
+        print "    return 0;"
+        print "}"
+        main_returning("0")
+    } else if (shape == "locals") {
+        for (f = 0; f < 4; f++) {
+            print "fn scope" f "(x: i64) -> i64 {"
+            print "    let v0: i64 = x;"
+            open = 0
+            for (i = 1; i < n; i++) {
+                if (i % 50 == 0) { print "    if (x > " i ") {"; open = 1 }
+                print "    let v" i ": i64 = " (open ? "x" : "v" i - 1) " + " i % 7 ";"
+                if (i % 50 == 49 && open) { print "    }"; open = 0 }
+            }
+            if (open) print "    }"
+            print "    return x;"
+            print "}"
+            print ""
+        }
+        main_returning("scope0(1) % 256")
+    } else {
+        print "Unknown shape: " shape > "/dev/stderr"
+        exit 1
+    }
+}'
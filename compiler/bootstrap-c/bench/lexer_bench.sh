@@ -0,0 +1,50 @@
+#!/bin/bash
+# Lexer throughput benchmark
+# Generates a large synthetic .ch file and reports MB/s for each lexer
+# kernel (avx2 / sse2 / scalar) the CPU supports.
+#
+# Usage: ./bench/lexer_bench.sh [functions]   (default: 40000, ~20 MB)
+
+set -e
+cd "$(dirname "$0")/.."
+
+FUNCS=${1:-40000}
+# Built from the current source into a scratch directory; the checked-in
+# chronos_v10 is left alone
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+CHRONOS=$WORK/chronos_v10
+echo "Building chronos_v10..."
+gcc -O2 -pthread -o "$CHRONOS" chronos_v10.c
+SRC=$WORK/lexer_bench.ch
+
+awk -v n="$FUNCS" 'BEGIN {
+    print "// Synthetic lexer benchmark input"
+    print "struct Point { x: i64, y: i64, next: *Point }"
+    print "let counter: i64 = 0;"
+    print "let table: [i32; 64];"
+    for (i = 0; i < n; i++) {
+        print ""
+        print "// Function " i ": mixes every token class the lexer handles"
+        print "fn compute_" i "(value: i64, ptr: *Point) -> i64 {"
+        print "    let result: i64 = value * " i % 97 " + 12345;"
+        print "    let message = \"iteration " i " of the synthetic \\\"benchmark\\\"\";"
+        print "    for (let k = 0; k < 16; k++) {"
+        print "        if (result % 2 == 0 && k != 3 || !(k >= 10)) {"
+        print "            result += k * 3;  // accumulate"
+        print "        } else {"
+        print "            result -= ptr->x / (k + 1);"
+        print "        }"
+        print "    }"
+        print "    while (result > 1000000) { result /= 7; }"
+        print "    counter = counter + 1;"
+        print "    return result;"
+        print "}"
+    }
+    print ""
+    print "fn main() -> i64 {"
+    print "    return 0;"
+    print "}"
+}' > "$SRC"
+
+"$CHRONOS" --bench-lexer "$SRC"
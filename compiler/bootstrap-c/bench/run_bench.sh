@@ -0,0 +1,42 @@
+#!/bin/bash
+# Generated-code runtime benchmark
+# Compiles a program (default: examples/benchmark_suite.ch) at -O0, -O1 and
+# -O2 and reports the cost of running it, best of N runs: CPU cycles from
+# `perf stat` when perf is available, otherwise wall-clock microseconds.
+#
+# Usage: ./bench/run_bench.sh [program.ch] [runs]   (default runs 20)
+
+set -e
+cd "$(dirname "$0")/.."
+
+SRC=${1:-../../examples/benchmark_suite.ch}
+RUNS=${2:-20}
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+CHRONOS=$WORK/chronos_v10
+echo "Building chronos_v10..."
+gcc -O2 -pthread -o "$CHRONOS" chronos_v10.c
+
+if command -v perf >/dev/null && perf stat -x, -e cycles true >/dev/null 2>&1; then
+    UNIT=cycles
+    cost() { perf stat -x, -e cycles "$1" 2>&1 >/dev/null | awk -F, '/cycles/ { print $1 }'; }
+else
+    UNIT=us
+    cost() {
+        local t0 t1
+        t0=$(date +%s%N); "$1" >/dev/null; t1=$(date +%s%N)
+        echo $(((t1 - t0) / 1000))
+    }
+fi
+
+printf "%-4s %14s\n" opt "best $UNIT"
+for opt in -O0 -O1 -O2; do
+    "$CHRONOS" $opt -o "$WORK/prog" "$SRC" >/dev/null
+    best=
+    for run in $(seq "$RUNS"); do
+        c=$(cost "$WORK/prog" || true)
+        [ -z "$best" ] || [ "$c" -lt "$best" ] && best=$c
+    done
+    printf "%-4s %14s\n" $opt "$best"
+done
@@ -1,8 +1,17 @@
-/* CHRONOS v0.17 - COMPILER OPTIMIZATIONS
- * New: Constant folding, strength reduction, peephole optimization
- * Flags: -O0 (none), -O1 (basic), -O2 (all)
- * Previous: ++, --, +=, -=, *=, /=, %=, string literal indexing, %, &&, ||, !
- * Self-hosting ready: All critical features complete
+/* CHRONOS v0.17 - bootstrap compiler for Chronos (.ch) to x86-64 Linux
+ * Pipeline: memory-mapped source -> table-driven lexer (SSE2/AVX2 scanning)
+ *   -> recursive descent parser, folding constants -> flat AST, renumbered
+ *   in the order codegen walks it -> type table -> NASM-syntax text, one
+ *   function at a time (a thread pool with -j), optionally through the SSA
+ *   IR and then the peephole rules -> built-in assembler -> ELF writer: a
+ *   static executable, or a relocatable object plus a .chi module
+ *   interface with -c. --run loads the machine code in memory instead.
+ * Flags: -O0 (straight from the AST), -O1 (constant folding, hot locals in
+ *   registers, peephole rules), -O2 (adds the SSA IR with linear-scan
+ *   register allocation, and strength reduction)
+ * Also: --nasm (external nasm and ld), --cache-dir (per-function text
+ *   cache), --server/--connect (compile server with a parsed prelude),
+ *   -ftime-report. Sections are marked "// ==== NAME ====".
  * Author: Ignacio Peña
  */
 #include <stdio.h>
@@ -11,6 +20,25 @@
 #include <stdarg.h>
 #include <ctype.h>
 #include <math.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <errno.h>
+#include <spawn.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <elf.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 // Optimization level (0 = none, 1 = basic, 2 = aggressive)
 int optimization_level = 0;
@@ -18,7 +46,7 @@ int optimization_level = 0;
 // TOKENS
 typedef enum {
     T_EOF, T_IDENT, T_NUM, T_STR,
-    T_FN, T_LET, T_IF, T_ELSE, T_WHILE, T_FOR, T_RET, T_STRUCT, T_MUT,
+    T_FN, T_LET, T_IF, T_ELSE, T_WHILE, T_FOR, T_RET, T_STRUCT, T_MUT, T_CONST,
     T_LPAREN, T_RPAREN, T_LBRACE, T_RBRACE, T_LBRACKET, T_RBRACKET,
     T_SEMI, T_COLON, T_COMMA, T_DOT, T_AMP,
     T_PLUS, T_MINUS, T_STAR, T_SLASH, T_MOD,
@@ -27,8 +55,88 @@ typedef enum {
     T_PLUSPLUS, T_MINUSMINUS, T_PLUSEQ, T_MINUSEQ, T_STAREQ, T_SLASHEQ, T_MODEQ
 } TokType;
 
-typedef struct { TokType t; char* s; int len; int line; int col; } Tok;
-typedef struct { char* src; char* cur; int line; int col; } Lex;
+// ATOMS
+// Every identifier and type name is interned once; the rest of the
+// compiler passes and compares Atom IDs. 0 means "no name".
+typedef int Atom;
+
+// Names the back end dispatches on, interned first so their IDs are fixed
+#define PREDEFINED_ATOMS(X) \
+    X(print) X(println) X(print_int) X(exit) X(strcmp) X(strcpy) X(strlen) \
+    X(open) X(read) X(write) X(close) X(malloc) X(free) X(syscall) X(syscall6) \
+    X(i8) X(u8) X(i16) X(u16) X(i32) X(u32) X(i64) X(u64)
+
+enum {
+    ATOM_NONE,
+#define ATOM_ENUM(n) ATOM_##n,
+    PREDEFINED_ATOMS(ATOM_ENUM)
+#undef ATOM_ENUM
+    ATOM_PREDEFINED_COUNT
+};
+
+// Packed token (12 bytes). Identifier atoms are interned by the parser and
+// line/column are recovered from `off` only when an error is reported.
+typedef struct { uint8_t t; uint32_t off; uint32_t len; } Tok;
+typedef struct { char* src; char* cur; } Lex;
+
+// A run of the input text, as an offset into `src_text` (never copied)
+typedef struct { unsigned off; unsigned len; } SrcSlice;
+
+// NAME INDEX
+// Open-addressing hash from atoms to table entries, shared by the local,
+// global and struct type tables. `value` is table specific.
+typedef struct {
+    Atom name;         // 0 = empty slot
+    int value;
+} NameSlot;
+
+typedef enum { TAB_LOCALS, TAB_GLOBALS, TAB_TYPES, TAB_COUNT } TableKind;
+
+typedef struct {
+    NameSlot* slots;
+    int cap;           // Power of two (0 = not allocated yet)
+    int shift;         // 32 - log2(cap), for Fibonacci hashing
+    int used;
+    TableKind table;   // For lookup statistics
+} NameIndex;
+
+// Compiler phases (for statistics and -ftime-report). Lexing is streamed
+// into the parser, so it is part of PHASE_PARSE.
+typedef enum {
+    PHASE_READ, PHASE_PARSE, PHASE_TYPES, PHASE_CODEGEN,
+    PHASE_ASSEMBLE, PHASE_OUTPUT, PHASE_NASM, PHASE_LD, PHASE_COUNT
+} CompilePhase;
+
+typedef struct {
+    double wall, cpu;  // Seconds; cpu includes child processes (nasm, ld)
+    long allocs;       // malloc/realloc calls and arena allocations
+    long alloc_bytes;  // Bytes requested by those calls
+    int entered;
+} PhaseStats;
+
+// What the IR path did (-O2), per codegen thread and in total
+#define IR_MAX_PASSES 8
+typedef struct {
+    long funcs;        // Generated from the IR
+    long fallback;     // Left to the AST code generator
+    long straight;     // Of those, straight-line with nothing to fold
+    long spilled;      // Values kept on the stack for want of a register
+    long pass_changes[IR_MAX_PASSES];
+} IrStats;
+
+#define PH_MAX_RULES 16  // Peephole rules with a hit counter
+
+// Sizes reported by -ftime-report
+typedef struct {
+    long tokens, nodes, atoms, globals, const_globals, types, strings;
+    long functions, params, lets, max_locals;  // Local symbols, over all functions
+    long cache_hits, cache_misses;  // Functions from / not in the --cache-dir cache
+    long asm_bytes;    // Assembly text handed to the assembler (or written)
+    long sec_bytes[4]; // Machine code and data per assembler section
+    long out_bytes;
+    IrStats ir;
+    long peephole_hits[PH_MAX_RULES];  // Per rule in ph_rules
+} CompileCounts;
 
 // TYPE SYSTEM
 
@@ -44,7 +152,7 @@ typedef enum {
 typedef struct TypeInfo {
     TypeKind kind;
     int size;          // Size in bytes
-    char* name;        // For basic types and structs
+    Atom name;         // For basic types and structs
 
     // For arrays
     struct TypeInfo* elem_type;
@@ -57,22 +165,26 @@ typedef struct TypeInfo {
 
 // Struct definitions (kept for compatibility)
 typedef struct StructField {
-    char* name;
+    Atom name;
     int offset;
-    char* type_name;      // Type of the field (e.g., "i64", "*Token")
+    Atom type_name;       // Type of the field (e.g., "i64", "*Token")
     int is_pointer;       // 1 if pointer type, 0 otherwise
 } StructField;
 
 typedef struct StructType {
-    char* name;
+    Atom name;
     StructField* fields;
     int field_count;
+    int field_cap;
     int size;
+    NameIndex field_index;  // Field name -> index in `fields`
 } StructType;
 
 typedef struct TypeTable {
     StructType* types;
     int count;
+    int capacity;
+    NameIndex index;
 } TypeTable;
 
 // AST
@@ -85,86 +197,162 @@ typedef enum {
     AST_LOGICAL  // && and || operators with short-circuit evaluation
 } AstType;
 
-typedef struct AstNode {
-    AstType type;
-    char* name;
-    struct AstNode** children;
-    int child_count;
-    char* value;
-    char* op;
-    int offset;
+// Flat AST: node n is entry n of the parallel arrays in `ast` (0 = no node).
+// Fields used by only some kinds live in side tables reached through
+// `extra`. After ast_finish() nodes are numbered in the order codegen walks
+// them and the children of n are the nodes kids[n] .. kids[n] + nkids[n] - 1.
+typedef uint32_t Node;
+
+typedef struct {
+    SrcSlice lit;         // Literal text (empty for synthesized numbers)
+    long num;             // NUMBER value
+} AstLiteral;             // NUMBER, STRING
+
+typedef struct {
+    Atom type_name;       // Declared base type (let, global, parameter, struct field)
+    Atom struct_type;     // STRUCT_LITERAL type / struct-typed let
     int array_size;
-    char* struct_type;
-    int is_pointer;  // For type tracking
-    int is_forward_decl;  // For function forward declarations
-} AstNode;
+    uint8_t is_array;     // Declared as [T; N]
+    uint8_t is_pointer;   // Bit 0 = pointer, bit 1 = *mut (let / global)
+    uint8_t is_forward_decl;
+    uint8_t is_const;     // Global declared with `const`
+} AstDecl;                // Every kind except literals and operators
+
+typedef struct {
+    uint8_t* kind;        // AstType
+    Atom* name;
+    uint32_t* kids;       // First child (while parsing: first slot in kid_ids)
+    int* nkids;
+    uint32_t* extra;      // AstLiteral index, operator TokType, or AstDecl index (0 = none)
+    int count, cap;
+    Node* kid_ids;        // Only while parsing, see ast_node()
+    int kid_count, kid_cap;
+    AstLiteral* lits;
+    int lit_count, lit_cap;
+    AstDecl* decls;       // decls[0] stays zero for nodes without one
+    int decl_count, decl_cap;
+} Ast;
 
 // Symbol table
 typedef struct {
-    char* name;
+    Atom name;
     int offset;
     int size;
-    char* type_name;
+    Atom type_name;
     int is_pointer;
+    int shadowed;      // Symbol this one hides in an outer scope (-1 = none)
+    const char* reg;   // -O1+: register the variable lives in (NULL = its stack slot)
 } Symbol;
 
+// What register allocation knows about one local name of a function
+typedef struct {
+    Atom name;
+    int decls;         // Parameters and lets of that name
+    int weight;        // Reads and writes, x8 per enclosing loop
+    int fixed;         // Used where codegen needs its stack slot (&x, x[i], x.f)
+    int uninit;        // A let without a value
+    const char* reg;
+} RegVar;
+
+// Locals of the function being generated. `symbols` holds the live scopes
+// in declaration order; `index` maps a name to its innermost visible symbol.
 typedef struct {
     Symbol* symbols;
     int count;
+    int capacity;
     int stack_size;
+    NameIndex index;
+    int* scopes;       // symbols[] count at each open block
+    int scope_count;
+    int scope_cap;
+    RegVar* vars;      // -O1+: every local name of the function (regalloc_func)
+    int var_count;
+    int var_cap;
+    NameIndex var_index;
 } SymbolTable;
 
 // Global variable table
 typedef struct {
-    char* name;
-    char* type_name;    // Type: "i32", "i64", "u8", etc.
+    Atom name;
+    Atom type_name;     // Type: "i32", "i64", "u8", etc.
     int size;           // Size in bytes (calculated from type)
     int is_initialized; // 1 = .data, 0 = .bss
-    char* init_value;   // For initialized scalar data
+    Node init;          // NUMBER, ARRAY_LITERAL or STRING initializer
 
     // For arrays: [T; N]
     int is_array;
     int array_count;    // Number of elements
-    char* elem_type;    // Element type name
-    char** array_init_values;  // Array initialization values
-    int array_init_count;      // Number of init values
+    Atom elem_type;     // Element type name
 
     // For pointers: *T or *mut T
     int is_pointer;
     int is_mutable;     // For *mut T
-    char* pointee_type; // Type being pointed to
+    Atom pointee_type;  // Type being pointed to
+
+    int is_extern;      // Imported: storage lives in its module's object
+    int is_const;       // Declared const: cannot be assigned
+    int folded;         // Reads are `value` (see global_constants)
+    long value;
 } GlobalVar;
 
 typedef struct {
     GlobalVar* vars;
     int count;
     int capacity;
+    NameIndex index;
 } GlobalSymbolTable;
 
 // String table
 typedef struct {
     char* label;
-    char* value;
+    const char* value;  // Not copied: points into the input or static text
     int len;
+    unsigned hash;
 } StringEntry;
 
 typedef struct {
     StringEntry* strings;
     int count;
+    int capacity;
+    int* slots;         // Hash slots by content: entry index + 1 (0 = empty)
+    int slot_cap;
 } StringTable;
 
 // Type specification (temporary structure for parsing)
 typedef struct {
-    char* base_type;    // i32, i64, etc.
+    Atom base_type;     // i32, i64, etc.
     int is_array;
     int array_count;
     int is_pointer;
     int is_mutable;
 } TypeSpec;
 
-typedef struct { Tok* tokens; int pos, count; } Parser;
+// The parser pulls tokens from the lexer through a small ring. It looks at
+// most one token ahead and backs up at most one, so the ring only has to
+// hold a few tokens; `pos` and `lexed` count tokens from the start.
+#define PARSE_WINDOW 4
+typedef struct {
+    Lex lex;
+    Tok win[PARSE_WINDOW];
+    int pos;
+    int lexed;
+} Parser;
+
+// `import "name";` items, in source order (see MODULES)
+typedef struct {
+    SrcSlice* names;   // Contents of the string literal
+    int count, cap;
+} ImportList;
+typedef struct Asm Asm;
+typedef struct IrFunc IrFunc;
+typedef struct Peephole Peephole;
+
+// The text of finished functions is handed on (see codegen_flush) as the
+// buffer fills, so code_buf holds a few functions, never the whole program
 typedef struct {
-    FILE* out;
+    FILE* out;         // Text sink when not assembling; .data/.bss text
+    Asm* as;           // Built-in assembler fed the text directly, or NULL
+    long text_bytes;   // .text handed on so far
     int label_count;
     SymbolTable* symtab;
     GlobalSymbolTable* global_symtab;
@@ -173,10 +361,222 @@ typedef struct {
     char* code_buf;
     int code_len;
     int code_cap;
+    int bounds_trap_used;  // Some check jumps to __bounds_fail
+    int saved_regs;    // r12.. pushed by the current function's prologue
+    int temps;         // Scratch registers holding saved operands
+    IrFunc* ir;        // -O2: this thread's IR workspace, reused per function
+    IrStats ir_stats;
+    Peephole* peephole;  // -O1+: this thread's peephole workspace
+    long peephole_hits[PH_MAX_RULES];
 } Codegen;
 
+// Mid-level IR (-O2, see IR). A function is a CFG of basic blocks of
+// three-address instructions in SSA form: each value is defined by one
+// instruction and is named by that instruction's index (0 = no value).
+typedef enum {
+    IR_NOP,            // Deleted
+    IR_CONST,          // imm
+    IR_PARAM,          // Incoming argument number imm
+    IR_COPY,           // a; only while SSA is being built
+    IR_ADD, IR_SUB, IR_MUL, IR_DIV, IR_MOD,  // a op b; DIV and MOD by 0 give 0
+    IR_NEG, IR_NOT,    // -a, !a
+    IR_CMP,            // a cc b, as 0 or 1
+    IR_LOAD,           // [base + b * scale]; base is the value a or global sym
+    IR_STORE,          // c into the same address
+    IR_ADDR,           // Address of global sym, or of string literal label
+    IR_CALL,           // sym(ops...): a function or a builtin
+    IR_PHI,            // ops: one value per predecessor
+    IR_JMP, IR_BR, IR_RET  // Terminators; BR goes to succ[0] when a != 0
+} IrOp;
+
+typedef enum { IRT_VOID, IRT_I8, IRT_I16, IRT_I32, IRT_I64 } IrType;
+
+// A growable list of ints in IrFunc.pool
+typedef struct { int start, count, cap; } IrList;
+
+typedef struct {
+    uint8_t op;        // IrOp
+    uint8_t type;      // IrType of the result; the access width of LOAD/STORE
+    uint8_t cc;        // CMP: TokType of the comparison
+    uint8_t scale;     // LOAD/STORE: bytes per index step
+    uint8_t literal;   // DIV/MOD: the divisor is written as a number
+    uint8_t fused;     // CMP: emitted as part of the BR after it
+    int block;         // -1 for CONST and ADDR, which live in no block
+    int next;          // Next instruction of the block (0 = last)
+    int a, b, c;       // Operands
+    long imm;          // CONST value, PARAM number, print length
+    Atom sym;          // Global, or the function a CALL calls
+    const char* label; // String literal
+    IrList ops;        // PHI and CALL operands
+} IrInst;
+
+typedef struct {
+    int first, last;   // Instruction list, phis first
+    IrList preds;
+    int succ[2];
+    int nsucc;
+    IrList incomplete; // Phis added before the block was sealed
+    uint8_t sealed;    // All predecessors are known
+    uint8_t dead;      // Removed from the CFG
+    uint8_t depth;     // Loop nesting
+    uint8_t jumped_to; // Needs a label
+    uint8_t mark;      // Scratch flag for walks over the CFG
+    int order;         // Place in the layout
+    int start, end;    // Positions of the block's entry and of its exit
+    int live_in, live_out;  // Value last found live here
+    int label;
+} IrBlock;
+
+typedef struct { int start, end; } IrRange;  // Positions, both ends included
+typedef struct { int block, pos; } IrUse;
+typedef struct { int var, block, value; unsigned gen; } IrDef;
+typedef struct { int dst, src, value, done; } IrMove;  // src IR_NOWHERE: materialize value
+
+struct IrFunc {
+    IrInst* insts;
+    int ninsts, inst_cap;
+    IrBlock* blocks;
+    int nblocks, block_cap;
+    int* pool;         // IrList contents
+    int npool, pool_cap;
+    int cur;           // Block being filled while lowering
+    int zero;          // CONST 0, the value of a variable before any store
+    int depth;         // Loop nesting while lowering
+    int failed;        // The function uses something the IR does not express
+    int newline;       // println needs a frame byte for its newline
+    // SSA construction: (variable, block) -> current value
+    IrDef* defs;
+    int def_cap, def_used;
+    unsigned def_gen;  // Entries of earlier functions count as empty
+    // Passes, indexed by value
+    int pass_cap;
+    uint8_t* lattice;  // ir_sccp: IR_UNKNOWN, IR_KNOWN or IR_VARYING
+    long* known;       // ir_sccp: the value when IR_KNOWN
+    uint8_t* live;     // ir_dce
+    int* user_start;   // Instructions reading v: users[user_start[v] .. user_start[v + 1])
+    int* users;
+    int user_cap;
+    // Register allocation and instruction selection, indexed by value
+    int val_cap;
+    int* pos;          // Position of the defining instruction
+    int* loc;          // Register number, -(spill slot + 1), or IR_NOWHERE
+    int* uses;
+    int* weight;       // Uses, x8 per loop level
+    int* hint;         // Value whose register it would like, or -(register + 1)
+    int* rfirst;       // Live ranges: ranges[rfirst .. rfirst + rcount)
+    int* rcount;
+    int* rcur;         // First range not yet behind the allocator
+    int* use_start;    // Uses of value v: use_list[use_start[v] .. use_start[v + 1])
+    int* active;
+    int* inactive;
+    long* sorted;      // (start << 32 | value), the order values are allocated in
+    IrUse* use_list;
+    int use_cap;
+    IrRange* ranges;
+    int nranges, range_cap;
+    IrRange* tmp;      // Ranges of the value being analysed
+    int ntmp, tmp_cap;
+    int* order;        // Blocks in layout order
+    int norder, order_cap;
+    int* work;
+    int nwork, work_cap;
+    int* calls;        // Positions of calls, ascending
+    int ncalls, call_cap;
+    IrMove* moves;
+    int move_cap;
+    int slots;         // Spill slots
+    unsigned saved;    // Callee-saved registers used (bit per register number)
+    int moved_dst, moved_src, moved_end;  // Last mov emitted, and code_len after it
+};
+
+// Built-in assembler: turns the NASM text codegen produces into machine code
+// and symbols, so an ELF file (or memory image) can be written without nasm
+// and ld. Sections are fixed; a symbol's place is its section and a position
+// in the section's bytes. ".name" labels are local to the plain label before
+// them (a function) and only jumped to: they are kept only until the next
+// plain label, when the function's jumps to them are sized and put in place.
+enum { SEC_TEXT, SEC_COLD, SEC_DATA, SEC_BSS, SEC_COUNT };
+
+// A jump to a local label, not yet in the section bytes
+typedef struct {
+    long pos;
+    int sym;           // Index in Asm.locals
+    uint8_t cc;        // Condition code, or ASM_JMP
+    uint8_t is_long;   // rel32 instead of rel8
+} AsmBranch;
+
+typedef struct {
+    uint8_t* buf;      // Bytes; the current function's without its jumps (.bss has none)
+    long len, cap;
+    long bss;          // Reserved bytes in .bss
+    AsmBranch* br;     // The current function's jumps
+    int nbr, brcap;
+    long* grow;        // Bytes added by the jumps before jump i (brcap + 1 of them)
+    long size;         // Once finished
+    long addr;         // Assigned by the writer
+} AsmSection;
+
+typedef struct {
+    Atom name;
+    int8_t sec;        // -1 while undefined
+    uint8_t global;
+    uint8_t dotted;    // Section anchor of a linked module: not written to the symbol table
+    long pos;
+} AsmSymbol;
+
+// A label of the current function: its name in Asm.local_names, and its
+// place counted before the function's jumps plus how many of them precede it
+typedef struct {
+    int name, len;
+    unsigned hash;
+    int8_t sec;        // -1 while undefined
+    long pos;
+    int nbr;
+} AsmLocal;
+
+// A rel32 field to patch: target symbol + addend - address of the field
+typedef struct {
+    int8_t sec;
+    long pos;
+    int nbr;           // Jumps before it in the current function, as for locals
+    int sym;
+    long addend;
+} AsmFixup;
+
+struct Asm {
+    AsmSection sec[SEC_COUNT];
+    AsmSymbol* syms;
+    int nsyms, symcap;
+    int* sym_of;       // Atom -> symbol index + 1
+    int sym_of_cap;
+    AsmFixup* fix;
+    int nfix, fixcap;
+    int scope_fix;     // First fixup of the current function
+    AsmLocal* locals;  // The current function's ".name" labels
+    int nlocals, localcap;
+    int* local_slots;  // Hash slots: local index + 1
+    int local_slot_cap;
+    char* local_names;
+    int names_len, names_cap;
+    int cur;           // Current section
+    Atom scope;        // Last non-local label, for ".name" labels
+    int line;
+};
+
 // ==== MEMORY HELPERS ====
+CompilePhase compile_phase = PHASE_READ;
+PhaseStats phase_stats[PHASE_COUNT];
+CompileCounts compile_counts;
+__thread PhaseStats* worker_alloc_stats;  // Set in codegen worker threads
+
+void count_alloc(long bytes) {
+    PhaseStats* s = worker_alloc_stats ? worker_alloc_stats : &phase_stats[compile_phase];
+    s->allocs++;
+    s->alloc_bytes += bytes;
+}
+
 void* safe_realloc(void* ptr, size_t size) {
+    count_alloc(size);
     void* new_ptr = realloc(ptr, size);
     if (!new_ptr && size > 0) {
         fprintf(stderr, "Out of memory\n");
@@ -185,157 +585,500 @@ void* safe_realloc(void* ptr, size_t size) {
     return new_ptr;
 }
 
+// ==== ARENA ALLOCATOR ====
+// Bump allocator for everything that lives until the end of compilation:
+// AST nodes, child vectors, token text and the type/symbol tables.
+// Nothing allocated here is freed individually; arena_release() drops it all.
+// Each thread has its own arena, so codegen workers allocate without locking.
+#define ARENA_BLOCK_SIZE (256 * 1024)
+#define ARENA_ALIGN 16
+
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t used;
+    size_t cap;
+    char* last;             // Most recent allocation (can be grown in place)
+    _Alignas(ARENA_ALIGN) char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock* head;
+} Arena;
+
+__thread Arena compiler_arena;
+
+void* arena_alloc(Arena* a, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    count_alloc(size);
+    ArenaBlock* b = a->head;
+    if (!b || b->used + size > b->cap) {
+        size_t cap = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        b = malloc(sizeof(ArenaBlock) + cap);
+        if (!b) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        b->next = a->head;
+        b->used = 0;
+        b->cap = cap;
+        b->last = NULL;
+        a->head = b;
+    }
+    void* p = b->data + b->used;
+    b->used += size;
+    b->last = p;
+    memset(p, 0, size);
+    return p;
+}
+
+// Grow an arena allocation. Extends in place when it is the newest block
+// entry, otherwise copies; callers grow geometrically so waste stays bounded.
+void* arena_grow(Arena* a, void* old, size_t old_size, size_t new_size) {
+    ArenaBlock* b = a->head;
+    if (old && b && b->last == old) {
+        size_t start = (char*)old - b->data;
+        size_t need = (new_size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+        if (start + need <= b->cap) {
+            count_alloc(new_size - old_size);
+            memset(b->data + start + old_size, 0, need - old_size);
+            b->used = start + need;
+            return old;
+        }
+    }
+    void* p = arena_alloc(a, new_size);
+    if (old && old_size) memcpy(p, old, old_size);
+    return p;
+}
+
+void arena_release(Arena* a) {
+    ArenaBlock* b = a->head;
+    while (b) {
+        ArenaBlock* next = b->next;
+        free(b);
+        b = next;
+    }
+    a->head = NULL;
+}
+
+char* astrndup(const char* s, size_t n) {
+    char* d = arena_alloc(&compiler_arena, n + 1);
+    memcpy(d, s, n);
+    d[n] = '\0';
+    return d;
+}
+
+char* astrdup(const char* s) {
+    return astrndup(s, strlen(s));
+}
+
+// ==== ATOM TABLE ====
+typedef struct {
+    char* str;
+    int len;
+    unsigned hash;
+    Atom pointee;      // For "*T": the atom of T
+    Atom pointer_to;   // Cached atom of "*<this>"
+} AtomEntry;
+
+AtomEntry* atom_tab;
+int atom_count;
+int atom_cap;
+int* atom_slots;       // Hash slots: atom ID (0 = empty)
+int atom_slot_cap;
+
+unsigned str_hash(const char* s, int len) {
+    unsigned h = 2166136261u;  // FNV-1a
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void atom_rehash(int cap) {
+    atom_slots = arena_alloc(&compiler_arena, sizeof(int) * cap);
+    atom_slot_cap = cap;
+    for (Atom a = 1; a < atom_count; a++) {
+        unsigned i = atom_tab[a].hash & (cap - 1);
+        while (atom_slots[i]) i = (i + 1) & (cap - 1);
+        atom_slots[i] = a;
+    }
+}
+
+Atom atom_intern(const char* s, int len) {
+    unsigned h = str_hash(s, len);
+    unsigned mask = atom_slot_cap - 1;
+    unsigned i = h & mask;
+    while (atom_slots[i]) {
+        AtomEntry* e = &atom_tab[atom_slots[i]];
+        if (e->hash == h && e->len == len && !memcmp(e->str, s, len)) return atom_slots[i];
+        i = (i + 1) & mask;
+    }
+    if (atom_count == atom_cap) {
+        atom_tab = arena_grow(&compiler_arena, atom_tab, sizeof(AtomEntry) * atom_cap,
+                              sizeof(AtomEntry) * atom_cap * 2);
+        atom_cap *= 2;
+    }
+    Atom a = atom_count++;
+    AtomEntry* e = &atom_tab[a];
+    e->str = astrndup(s, len);
+    e->len = len;
+    e->hash = h;
+    e->pointee = (len > 1 && s[0] == '*') ? atom_intern(s + 1, len - 1) : ATOM_NONE;
+    e->pointer_to = ATOM_NONE;
+    atom_slots[i] = a;
+    if (atom_count * 2 > atom_slot_cap) atom_rehash(atom_slot_cap * 2);
+    return a;
+}
+
+void atoms_init() {
+    atom_cap = 1024;
+    atom_tab = arena_alloc(&compiler_arena, sizeof(AtomEntry) * atom_cap);
+    atom_count = 1;  // Atom 0 is "no name"
+    atom_tab[0].str = "";
+    atom_rehash(2048);
+#define ATOM_INTERN(n) atom_intern(#n, sizeof(#n) - 1);
+    PREDEFINED_ATOMS(ATOM_INTERN)
+#undef ATOM_INTERN
+}
+
+const char* atom_str(Atom a) { return atom_tab[a].str; }
+
+// "*T" -> T, or ATOM_NONE when `a` is not a pointer type name
+Atom atom_pointee(Atom a) { return atom_tab[a].pointee; }
+
+// T -> "*T" (pointer symbols and fields keep the starred name)
+Atom atom_pointer_to(Atom a) {
+    if (!atom_tab[a].pointer_to) {
+        int len = atom_tab[a].len;
+        char buf[256];
+        char* d = len + 1 <= (int)sizeof(buf) ? buf : arena_alloc(&compiler_arena, len + 1);
+        d[0] = '*';
+        memcpy(d + 1, atom_tab[a].str, len);
+        Atom p = atom_intern(d, len + 1);
+        atom_tab[a].pointer_to = p;
+    }
+    return atom_tab[a].pointer_to;
+}
+
+// Byte width of a primitive integer type, 0 for anything else
+int prim_size(Atom a) {
+    switch (a) {
+        case ATOM_i8: case ATOM_u8: return 1;
+        case ATOM_i16: case ATOM_u16: return 2;
+        case ATOM_i32: case ATOM_u32: return 4;
+        case ATOM_i64: case ATOM_u64: return 8;
+        default: return 0;
+    }
+}
+
+// ==== NAME INDEX ====
+typedef struct {
+    long lookups;
+    long probes;
+} SymStats;
+
+SymStats sym_stats[PHASE_COUNT][TAB_COUNT];
+__thread SymStats* worker_sym_stats;  // [TAB_COUNT], set in codegen worker threads
+
+const char* phase_names[PHASE_COUNT] = {"read", "parse", "types", "codegen", "assemble", "output", "nasm", "ld"};
+const char* table_names[TAB_COUNT] = {"locals", "globals", "types"};
+
+void name_index_init(NameIndex* ix, TableKind table) {
+    ix->slots = NULL;
+    ix->cap = 0;
+    ix->shift = 32;
+    ix->used = 0;
+    ix->table = table;
+}
+
+SymStats* sym_stats_for(TableKind table) {
+    return worker_sym_stats ? &worker_sym_stats[table] : &sym_stats[compile_phase][table];
+}
+
+// Slot holding `name`, or the empty slot where it would be inserted
+NameSlot* name_index_probe(NameIndex* ix, Atom name) {
+    SymStats* stats = sym_stats_for(ix->table);
+    unsigned mask = ix->cap - 1;
+    unsigned i = ((unsigned)name * 2654435769u) >> ix->shift;  // Fibonacci hashing
+    for (;;) {
+        stats->probes++;
+        NameSlot* slot = &ix->slots[i];
+        if (!slot->name || slot->name == name) return slot;
+        i = (i + 1) & mask;
+    }
+}
+
+void name_index_grow(NameIndex* ix) {
+    NameSlot* old = ix->slots;
+    int old_cap = ix->cap;
+    ix->cap = old_cap ? old_cap * 2 : 64;
+    ix->shift = 32 - __builtin_ctz(ix->cap);
+    ix->slots = arena_alloc(&compiler_arena, sizeof(NameSlot) * ix->cap);
+    unsigned mask = ix->cap - 1;
+    for (int i = 0; i < old_cap; i++) {
+        if (!old[i].name) continue;
+        unsigned j = ((unsigned)old[i].name * 2654435769u) >> ix->shift;
+        while (ix->slots[j].name) j = (j + 1) & mask;
+        ix->slots[j] = old[i];
+    }
+}
+
+// Value stored for `name`, or -1
+int name_index_get(NameIndex* ix, Atom name) {
+    sym_stats_for(ix->table)->lookups++;
+    if (!ix->cap || !name) return -1;
+    NameSlot* slot = name_index_probe(ix, name);
+    return slot->name ? slot->value : -1;
+}
+
+// Bind `name` to `value`; returns the previous value (-1 if unbound)
+int name_index_put(NameIndex* ix, Atom name, int value) {
+    if ((ix->used + 1) * 2 > ix->cap) name_index_grow(ix);
+    NameSlot* slot = name_index_probe(ix, name);
+    int prev = -1;
+    if (slot->name) {
+        prev = slot->value;
+    } else {
+        slot->name = name;
+        ix->used++;
+    }
+    slot->value = value;
+    return prev;
+}
+
+void name_index_clear(NameIndex* ix) {
+    if (ix->cap) memset(ix->slots, 0, sizeof(NameSlot) * ix->cap);
+    ix->used = 0;
+}
+
+void print_symtab_stats() {
+    fprintf(stderr, "Symbol table statistics:\n");
+    fprintf(stderr, "  %-8s %-8s %12s %12s %8s\n", "phase", "table", "lookups", "probes", "avg");
+    for (int ph = 0; ph < PHASE_COUNT; ph++) {
+        for (int t = 0; t < TAB_COUNT; t++) {
+            SymStats* s = &sym_stats[ph][t];
+            if (!s->lookups) continue;
+            fprintf(stderr, "  %-8s %-8s %12ld %12ld %8.2f\n", phase_names[ph], table_names[t],
+                    s->lookups, s->probes, (double)s->probes / s->lookups);
+        }
+    }
+}
+
 // ==== TYPE TABLE ====
 TypeTable* typetab_new() {
-    TypeTable* tt = calloc(1, sizeof(TypeTable));
+    TypeTable* tt = arena_alloc(&compiler_arena, sizeof(TypeTable));
+    name_index_init(&tt->index, TAB_TYPES);
     return tt;
 }
 
-StructType* typetab_lookup(TypeTable* tt, char* name) {
-    for (int i = 0; i < tt->count; i++) {
-        if (!strcmp(tt->types[i].name, name)) {
-            return &tt->types[i];
-        }
-    }
-    return NULL;
+StructType* typetab_lookup(TypeTable* tt, Atom name) {
+    int i = name_index_get(&tt->index, name);
+    return i >= 0 ? &tt->types[i] : NULL;
 }
 
-void typetab_add(TypeTable* tt, char* name) {
-    tt->count++;
-    tt->types = safe_realloc(tt->types, sizeof(StructType) * tt->count);
-    tt->types[tt->count - 1].name = strdup(name);
-    tt->types[tt->count - 1].fields = NULL;
-    tt->types[tt->count - 1].field_count = 0;
-    tt->types[tt->count - 1].size = 0;
+void typetab_add(TypeTable* tt, Atom name) {
+    if (tt->count == tt->capacity) {
+        int cap = tt->capacity ? tt->capacity * 2 : 16;
+        tt->types = arena_grow(&compiler_arena, tt->types,
+                               sizeof(StructType) * tt->capacity, sizeof(StructType) * cap);
+        tt->capacity = cap;
+    }
+    StructType* st = &tt->types[tt->count++];
+    st->name = name;
+    if (name_index_get(&tt->index, st->name) < 0) name_index_put(&tt->index, st->name, tt->count - 1);
+    st->fields = NULL;
+    st->field_count = 0;
+    st->field_cap = 0;
+    st->size = 0;
+    name_index_init(&st->field_index, TAB_TYPES);
 }
 
-void typetab_add_field(TypeTable* tt, char* struct_name, char* field_name, char* field_type, int is_pointer) {
+void typetab_add_field(TypeTable* tt, Atom struct_name, Atom field_name, Atom field_type, int is_pointer) {
     StructType* st = typetab_lookup(tt, struct_name);
     if (!st) return;
 
-    st->field_count++;
-    st->fields = safe_realloc(st->fields, sizeof(StructField) * st->field_count);
-    st->fields[st->field_count - 1].name = strdup(field_name);
-    st->fields[st->field_count - 1].offset = st->size;
-    st->fields[st->field_count - 1].type_name = field_type ? strdup(field_type) : NULL;
-    st->fields[st->field_count - 1].is_pointer = is_pointer;
+    if (st->field_count == st->field_cap) {
+        int cap = st->field_cap ? st->field_cap * 2 : 8;
+        st->fields = arena_grow(&compiler_arena, st->fields,
+                                sizeof(StructField) * st->field_cap, sizeof(StructField) * cap);
+        st->field_cap = cap;
+    }
+    if (name_index_get(&st->field_index, field_name) < 0)
+        name_index_put(&st->field_index, field_name, st->field_count);
+    StructField* f = &st->fields[st->field_count++];
+    f->name = field_name;
+    f->offset = st->size;
+    f->type_name = field_type;
+    f->is_pointer = is_pointer;
     st->size += 8;
 }
 
-int typetab_field_offset(TypeTable* tt, char* struct_name, char* field_name) {
+StructField* typetab_field(TypeTable* tt, Atom struct_name, Atom field_name) {
     StructType* st = typetab_lookup(tt, struct_name);
-    if (!st) return -1;
+    if (!st) return NULL;
 
-    for (int i = 0; i < st->field_count; i++) {
-        if (!strcmp(st->fields[i].name, field_name)) {
-            return st->fields[i].offset;
-        }
-    }
-    return -1;
+    int i = name_index_get(&st->field_index, field_name);
+    return i >= 0 ? &st->fields[i] : NULL;
 }
 
-// Get the type of a field in a struct
-char* typetab_field_type(TypeTable* tt, char* struct_name, char* field_name) {
-    StructType* st = typetab_lookup(tt, struct_name);
-    if (!st) return NULL;
+int typetab_field_offset(TypeTable* tt, Atom struct_name, Atom field_name) {
+    StructField* f = typetab_field(tt, struct_name, field_name);
+    return f ? f->offset : -1;
+}
 
-    for (int i = 0; i < st->field_count; i++) {
-        if (!strcmp(st->fields[i].name, field_name)) {
-            return st->fields[i].type_name;
-        }
-    }
-    return NULL;
+// Get the type of a field in a struct
+Atom typetab_field_type(TypeTable* tt, Atom struct_name, Atom field_name) {
+    StructField* f = typetab_field(tt, struct_name, field_name);
+    return f ? f->type_name : ATOM_NONE;
 }
 
 // ==== STRING TABLE ====
 StringTable* strtab_new() {
-    StringTable* st = calloc(1, sizeof(StringTable));
+    StringTable* st = arena_alloc(&compiler_arena, sizeof(StringTable));
     return st;
 }
 
-char* strtab_add(StringTable* st, char* value, int len) {
-    st->count++;
-    st->strings = safe_realloc(st->strings, sizeof(StringEntry) * st->count);
+void strtab_rehash(StringTable* st, int cap) {
+    st->slots = arena_alloc(&compiler_arena, sizeof(int) * cap);
+    st->slot_cap = cap;
+    for (int k = 0; k < st->count; k++) {
+        unsigned i = st->strings[k].hash & (cap - 1);
+        while (st->slots[i]) i = (i + 1) & (cap - 1);
+        st->slots[i] = k + 1;
+    }
+}
+
+// Identical literals share one entry and label
+char* strtab_add(StringTable* st, const char* value, int len) {
+    unsigned h = str_hash(value, len);
+    if (!st->slot_cap) strtab_rehash(st, 64);
+    unsigned i = h & (st->slot_cap - 1);
+    while (st->slots[i]) {
+        StringEntry* e = &st->strings[st->slots[i] - 1];
+        if (e->hash == h && e->len == len && !memcmp(e->value, value, len)) return e->label;
+        i = (i + 1) & (st->slot_cap - 1);
+    }
 
-    char* label = malloc(32);
-    snprintf(label, 32, "str_%d", st->count - 1);
+    if (st->count == st->capacity) {
+        int cap = st->capacity ? st->capacity * 2 : 64;
+        st->strings = arena_grow(&compiler_arena, st->strings,
+                                 sizeof(StringEntry) * st->capacity, sizeof(StringEntry) * cap);
+        st->capacity = cap;
+    }
+
+    char label[32];
+    snprintf(label, sizeof(label), "str_%d", st->count);
 
-    st->strings[st->count - 1].label = label;
-    st->strings[st->count - 1].value = strndup(value, len);
-    st->strings[st->count - 1].len = len;
+    StringEntry* e = &st->strings[st->count++];
+    e->label = astrdup(label);
+    e->value = value;
+    e->len = len;
+    e->hash = h;
+    st->slots[i] = st->count;
+    if (st->count * 2 > st->slot_cap) strtab_rehash(st, st->slot_cap * 2);
 
-    return label;
+    return e->label;
 }
 
 // ==== SYMBOL TABLE ====
 SymbolTable* symtab_new() {
-    SymbolTable* st = calloc(1, sizeof(SymbolTable));
+    SymbolTable* st = arena_alloc(&compiler_arena, sizeof(SymbolTable));
     st->stack_size = 0;
+    name_index_init(&st->index, TAB_LOCALS);
+    name_index_init(&st->var_index, TAB_LOCALS);
     return st;
 }
 
-int symtab_add(SymbolTable* st, char* name, int size) {
-    st->count++;
-    st->symbols = safe_realloc(st->symbols, sizeof(Symbol) * st->count);
+// Forget all locals (start of a new function); storage is reused
+void symtab_reset(SymbolTable* st) {
+    st->count = 0;
+    st->stack_size = 0;
+    st->scope_count = 0;
+    name_index_clear(&st->index);
+    st->var_count = 0;
+    name_index_clear(&st->var_index);
+}
+
+void symtab_enter_scope(SymbolTable* st) {
+    if (st->scope_count == st->scope_cap) {
+        int cap = st->scope_cap ? st->scope_cap * 2 : 16;
+        st->scopes = arena_grow(&compiler_arena, st->scopes,
+                                sizeof(int) * st->scope_cap, sizeof(int) * cap);
+        st->scope_cap = cap;
+    }
+    st->scopes[st->scope_count++] = st->count;
+}
+
+// Drop the symbols declared in the innermost block, un-hiding what they shadowed.
+// Their stack slots stay reserved so offsets never alias a live variable.
+void symtab_leave_scope(SymbolTable* st) {
+    int mark = st->scopes[--st->scope_count];
+    for (int i = st->count - 1; i >= mark; i--) {
+        name_index_put(&st->index, st->symbols[i].name, st->symbols[i].shadowed);
+    }
+    st->count = mark;
+}
+
+// Append a zeroed symbol slot (geometric growth in the arena)
+Symbol* symtab_push(SymbolTable* st, Atom name) {
+    if (st->count == st->capacity) {
+        int cap = st->capacity ? st->capacity * 2 : 16;
+        st->symbols = arena_grow(&compiler_arena, st->symbols,
+                                 sizeof(Symbol) * st->capacity, sizeof(Symbol) * cap);
+        st->capacity = cap;
+    }
+    Symbol* sym = &st->symbols[st->count++];
+    memset(sym, 0, sizeof(Symbol));
+    sym->name = name;
+    sym->shadowed = name_index_put(&st->index, sym->name, st->count - 1);
+    return sym;
+}
+
+int symtab_add(SymbolTable* st, Atom name, int size) {
+    Symbol* sym = symtab_push(st, name);
     int bytes = size * 8;
     st->stack_size += bytes;
-    st->symbols[st->count - 1].name = strdup(name);
-    st->symbols[st->count - 1].offset = -st->stack_size;
-    st->symbols[st->count - 1].size = size;
-    st->symbols[st->count - 1].type_name = NULL;
-    st->symbols[st->count - 1].is_pointer = 0;
+    sym->offset = -st->stack_size;
+    sym->size = size;
+    sym->type_name = ATOM_NONE;
+    sym->is_pointer = 0;
     return -st->stack_size;
 }
 
-int symtab_add_struct(SymbolTable* st, char* name, char* type_name, int size_bytes) {
-    st->count++;
-    st->symbols = safe_realloc(st->symbols, sizeof(Symbol) * st->count);
+int symtab_add_struct(SymbolTable* st, Atom name, Atom type_name, int size_bytes) {
+    Symbol* sym = symtab_push(st, name);
     st->stack_size += size_bytes;
-    st->symbols[st->count - 1].name = strdup(name);
-    st->symbols[st->count - 1].offset = -st->stack_size;
-    st->symbols[st->count - 1].size = size_bytes;
-    st->symbols[st->count - 1].type_name = strdup(type_name);
-    st->symbols[st->count - 1].is_pointer = 0;
+    sym->offset = -st->stack_size;
+    sym->size = size_bytes;
+    sym->type_name = type_name;
+    sym->is_pointer = 0;
     return -st->stack_size;
 }
 
-int symtab_add_pointer(SymbolTable* st, char* name) {
-    st->count++;
-    st->symbols = safe_realloc(st->symbols, sizeof(Symbol) * st->count);
+int symtab_add_pointer(SymbolTable* st, Atom name) {
+    Symbol* sym = symtab_push(st, name);
     st->stack_size += 8;  // Pointer is 8 bytes
-    st->symbols[st->count - 1].name = strdup(name);
-    st->symbols[st->count - 1].offset = -st->stack_size;
-    st->symbols[st->count - 1].size = 8;
-    st->symbols[st->count - 1].type_name = NULL;
-    st->symbols[st->count - 1].is_pointer = 1;
+    sym->offset = -st->stack_size;
+    sym->size = 8;
+    sym->type_name = ATOM_NONE;
+    sym->is_pointer = 1;
     return -st->stack_size;
 }
 
-Symbol* symtab_lookup_symbol(SymbolTable* st, char* name) {
-    for (int i = 0; i < st->count; i++) {
-        if (!strcmp(st->symbols[i].name, name)) {
-            return &st->symbols[i];
-        }
-    }
-    return NULL;
-}
-
-int symtab_lookup(SymbolTable* st, char* name) {
-    Symbol* sym = symtab_lookup_symbol(st, name);
-    return sym ? sym->offset : 0;
+// Innermost visible local named `name`, or NULL
+Symbol* symtab_lookup_symbol(SymbolTable* st, Atom name) {
+    int i = name_index_get(&st->index, name);
+    return i >= 0 ? &st->symbols[i] : NULL;
 }
 
 // ==== TYPE HELPERS ====
-int type_size(const char* type_name) {
-    if (!type_name) return 8;  // Default to 8 bytes
-    if (!strcmp(type_name, "i8") || !strcmp(type_name, "u8")) return 1;
-    if (!strcmp(type_name, "i16") || !strcmp(type_name, "u16")) return 2;
-    if (!strcmp(type_name, "i32") || !strcmp(type_name, "u32")) return 4;
-    if (!strcmp(type_name, "i64") || !strcmp(type_name, "u64")) return 8;
-    return 8;  // Default
+int type_size(Atom type_name) {
+    int size = prim_size(type_name);
+    return size ? size : 8;  // Default to 8 bytes
 }
 
-const char* type_asm_directive(const char* type_name) {
+const char* type_asm_directive(Atom type_name) {
     int size = type_size(type_name);
     if (size == 1) return "db";
     if (size == 2) return "dw";
@@ -347,34 +1090,39 @@ const char* type_asm_directive(const char* type_name) {
 void global_symtab_init(GlobalSymbolTable* gst) {
     gst->capacity = 64;
     gst->count = 0;
-    gst->vars = malloc(sizeof(GlobalVar) * gst->capacity);
+    gst->vars = arena_alloc(&compiler_arena, sizeof(GlobalVar) * gst->capacity);
+    name_index_init(&gst->index, TAB_GLOBALS);
 }
 
-void global_symtab_add_full(GlobalSymbolTable* gst, char* name, char* type_name, int size,
-                            int is_initialized, char* init_value,
+void global_symtab_add_full(GlobalSymbolTable* gst, Atom name, Atom type_name, int size,
+                            int is_initialized, Node init,
                             int is_array, int array_count, int is_pointer, int is_mutable) {
     if (gst->count >= gst->capacity) {
+        gst->vars = arena_grow(&compiler_arena, gst->vars, sizeof(GlobalVar) * gst->capacity,
+                               sizeof(GlobalVar) * gst->capacity * 2);
         gst->capacity *= 2;
-        gst->vars = realloc(gst->vars, sizeof(GlobalVar) * gst->capacity);
     }
 
     GlobalVar* gv = &gst->vars[gst->count++];
-    gv->name = strdup(name);
-    gv->type_name = type_name ? strdup(type_name) : strdup("i64");
+    gv->name = name;
+    // Keep the first definition visible, as the linear scan did
+    if (name_index_get(&gst->index, gv->name) < 0) name_index_put(&gst->index, gv->name, gst->count - 1);
+    gv->type_name = type_name ? type_name : ATOM_i64;
     gv->is_initialized = is_initialized;
-    gv->init_value = init_value ? strdup(init_value) : NULL;
+    gv->init = init;
 
     // Array info
     gv->is_array = is_array;
     gv->array_count = array_count;
-    gv->elem_type = is_array ? strdup(type_name) : NULL;
-    gv->array_init_values = NULL;  // Set later if initialized
-    gv->array_init_count = 0;
+    gv->elem_type = is_array ? type_name : ATOM_NONE;
 
     // Pointer info
     gv->is_pointer = is_pointer;
     gv->is_mutable = is_mutable;
-    gv->pointee_type = is_pointer ? strdup(type_name) : NULL;
+    gv->pointee_type = is_pointer ? type_name : ATOM_NONE;
+    gv->is_extern = 0;
+    gv->is_const = 0;
+    gv->folded = 0;
 
     // Calculate size
     if (is_array) {
@@ -386,285 +1134,936 @@ void global_symtab_add_full(GlobalSymbolTable* gst, char* name, char* type_name,
     }
 }
 
-GlobalVar* global_symtab_lookup(GlobalSymbolTable* gst, char* name) {
-    for (int i = 0; i < gst->count; i++) {
-        if (!strcmp(gst->vars[i].name, name)) {
-            return &gst->vars[i];
-        }
-    }
-    return NULL;
+GlobalVar* global_symtab_lookup(GlobalSymbolTable* gst, Atom name) {
+    int i = name_index_get(&gst->index, name);
+    return i >= 0 ? &gst->vars[i] : NULL;
 }
 
-// ==== LEXER ====
-void lex_init(Lex* l, char* s) {
-    l->src = l->cur = s;
-    l->line = 1;
-    l->col = 1;
+// ==== SOURCE INPUT ====
+// Regular files are mapped read-only and never copied: tokens and literal
+// AST nodes are slices of the mapping. The mapping is followed by a zero
+// page, so the text is NUL terminated even when its size is a multiple of
+// the page size. Pipes and other unmappable inputs are read into memory.
+typedef struct {
+    char* text;
+    long size;
+    size_t map_len;     // 0 = heap buffer
+} SourceFile;
+
+int source_read(SourceFile* sf, int fd) {
+    long cap = 65536;
+    sf->text = malloc(cap);
+    sf->size = 0;
+    for (;;) {
+        if (sf->size + 1 >= cap) sf->text = safe_realloc(sf->text, cap *= 2);
+        ssize_t n = read(fd, sf->text + sf->size, cap - sf->size - 1);
+        if (n < 0) return -1;
+        if (n == 0) break;
+        sf->size += n;
+    }
+    sf->text[sf->size] = '\0';
+    sf->map_len = 0;
+    return 0;
 }
 
-char peek(Lex* l) { return *l->cur; }
-char peek_next(Lex* l) { return l->cur[1]; }
+int source_open(SourceFile* sf, const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        int r = source_read(sf, fd);
+        close(fd);
+        return r;
+    }
 
-char adv(Lex* l) {
-    char c = *l->cur++;
-    if (c == '\n') {
-        l->line++;
-        l->col = 1;
-    } else {
-        l->col++;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t len = ((size_t)st.st_size + page - 1) / page * page + page;
+    char* base = mmap(NULL, len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base != MAP_FAILED && st.st_size > 0 &&
+        mmap(base, st.st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, len);
+        base = MAP_FAILED;
+    }
+    if (base == MAP_FAILED) {
+        int r = source_read(sf, fd);
+        close(fd);
+        return r;
     }
-    return c;
+    madvise(base, len, MADV_SEQUENTIAL);
+    close(fd);
+
+    sf->text = base;
+    sf->size = st.st_size;
+    sf->map_len = len;
+    return 0;
 }
 
-void skip(Lex* l) {
-    for (;;) {
-        char c = peek(l);
-        if (c == ' ' || c == '\t' || c == '\r' || c == '\n') adv(l);
-        else if (c == '/' && peek_next(l) == '/') {
-            while (peek(l) != '\n' && peek(l)) adv(l);
-        } else break;
-    }
-}
-
-TokType kw(char* s, int len) {
-    if (len == 2 && !memcmp(s, "fn", 2)) return T_FN;
-    if (len == 3 && !memcmp(s, "let", 3)) return T_LET;
-    if (len == 2 && !memcmp(s, "if", 2)) return T_IF;
-    if (len == 4 && !memcmp(s, "else", 4)) return T_ELSE;
-    if (len == 3 && !memcmp(s, "for", 3)) return T_FOR;
-    if (len == 3 && !memcmp(s, "mut", 3)) return T_MUT;
-    if (len == 5 && !memcmp(s, "while", 5)) return T_WHILE;
-    if (len == 6 && !memcmp(s, "return", 6)) return T_RET;
-    if (len == 6 && !memcmp(s, "struct", 6)) return T_STRUCT;
-    return T_IDENT;
+void source_close(SourceFile* sf) {
+    if (sf->map_len) munmap(sf->text, sf->map_len);
+    else free(sf->text);
 }
 
-Tok lex_tok(Lex* l) {
-    skip(l);
-    char* st = l->cur;
-    int tok_line = l->line;
-    int tok_col = l->col;
-    char c = adv(l);
+// ==== LEXER ====
+// Table-driven: one 256-entry class table classifies bytes, operators come
+// from a per-first-byte table, and keywords from a perfect hash. Long runs
+// (whitespace, comments, identifiers, string bodies) are scanned by the
+// kernels below, picked at startup for the CPU (AVX2, SSE2 or scalar).
+// Scanning stops at the source's NUL terminator.
 
-    if (!c) return (Tok){T_EOF, st, 0, tok_line, tok_col};
-    if (isalpha(c) || c == '_') {
-        while (isalnum(peek(l)) || peek(l) == '_') adv(l);
-        return (Tok){kw(st, l->cur - st), st, l->cur - st, tok_line, tok_col};
-    }
-    if (isdigit(c)) {
-        while (isdigit(peek(l))) adv(l);
-        return (Tok){T_NUM, st, l->cur - st, tok_line, tok_col};
-    }
-    if (c == '"') {
-        while (peek(l) && peek(l) != '"') {
-            if (peek(l) == '\\' && peek_next(l)) adv(l);  // Skip escape sequence
-            adv(l);
-        }
-        if (peek(l) != '"') {
-            fprintf(stderr, "Error at line %d, col %d: Unterminated string literal\n", tok_line, tok_col);
-            exit(1);
-        }
-        adv(l);  // Consume closing quote
-        return (Tok){T_STR, st, l->cur - st, tok_line, tok_col};
-    }
-
-    if (c == '(') return (Tok){T_LPAREN, st, 1, tok_line, tok_col};
-    if (c == ')') return (Tok){T_RPAREN, st, 1, tok_line, tok_col};
-    if (c == '{') return (Tok){T_LBRACE, st, 1, tok_line, tok_col};
-    if (c == '}') return (Tok){T_RBRACE, st, 1, tok_line, tok_col};
-    if (c == '[') return (Tok){T_LBRACKET, st, 1, tok_line, tok_col};
-    if (c == ']') return (Tok){T_RBRACKET, st, 1, tok_line, tok_col};
-    if (c == ';') return (Tok){T_SEMI, st, 1, tok_line, tok_col};
-    if (c == ':') return (Tok){T_COLON, st, 1, tok_line, tok_col};
-    if (c == ',') return (Tok){T_COMMA, st, 1, tok_line, tok_col};
-    if (c == '.') return (Tok){T_DOT, st, 1, tok_line, tok_col};
-    if (c == '&' && peek(l) == '&') { adv(l); return (Tok){T_AND_AND, st, 2, tok_line, tok_col}; }
-    if (c == '&') return (Tok){T_AMP, st, 1, tok_line, tok_col};
-    if (c == '|' && peek(l) == '|') { adv(l); return (Tok){T_OR_OR, st, 2, tok_line, tok_col}; }
-    if (c == '+' && peek(l) == '+') { adv(l); return (Tok){T_PLUSPLUS, st, 2, tok_line, tok_col}; }
-    if (c == '+' && peek(l) == '=') { adv(l); return (Tok){T_PLUSEQ, st, 2, tok_line, tok_col}; }
-    if (c == '+') return (Tok){T_PLUS, st, 1, tok_line, tok_col};
-    if (c == '-' && peek(l) == '-') { adv(l); return (Tok){T_MINUSMINUS, st, 2, tok_line, tok_col}; }
-    if (c == '-' && peek(l) == '=') { adv(l); return (Tok){T_MINUSEQ, st, 2, tok_line, tok_col}; }
-    if (c == '*' && peek(l) == '=') { adv(l); return (Tok){T_STAREQ, st, 2, tok_line, tok_col}; }
-    if (c == '*') return (Tok){T_STAR, st, 1, tok_line, tok_col};
-    if (c == '/' && peek(l) == '=') { adv(l); return (Tok){T_SLASHEQ, st, 2, tok_line, tok_col}; }
-    if (c == '/') return (Tok){T_SLASH, st, 1, tok_line, tok_col};
-    if (c == '%' && peek(l) == '=') { adv(l); return (Tok){T_MODEQ, st, 2, tok_line, tok_col}; }
-    if (c == '%') return (Tok){T_MOD, st, 1, tok_line, tok_col};
-    if (c == '=' && peek(l) == '=') { adv(l); return (Tok){T_EQEQ, st, 2, tok_line, tok_col}; }
-    if (c == '=') return (Tok){T_EQ, st, 1, tok_line, tok_col};
-    if (c == '!' && peek(l) == '=') { adv(l); return (Tok){T_NEQ, st, 2, tok_line, tok_col}; }
-    if (c == '!') return (Tok){T_BANG, st, 1, tok_line, tok_col};
-    if (c == '<' && peek(l) == '=') { adv(l); return (Tok){T_LTE, st, 2, tok_line, tok_col}; }
-    if (c == '<') return (Tok){T_LT, st, 1, tok_line, tok_col};
-    if (c == '>' && peek(l) == '=') { adv(l); return (Tok){T_GTE, st, 2, tok_line, tok_col}; }
-    if (c == '>') return (Tok){T_GT, st, 1, tok_line, tok_col};
-    if (c == '-' && peek(l) == '>') { adv(l); return (Tok){T_ARROW, st, 2, tok_line, tok_col}; }
-    if (c == '-') return (Tok){T_MINUS, st, 1, tok_line, tok_col};
-
-    return (Tok){T_EOF, st, 0, tok_line, tok_col};
-}
-
-Tok* tokenize(char* src, int* count) {
-    Lex l; lex_init(&l, src);
-    int cap = 2000;  // Initial capacity
-    Tok* toks = malloc(sizeof(Tok) * cap);
-    if (!toks) {
-        fprintf(stderr, "Out of memory\n");
-        exit(1);
-    }
-    *count = 0;
-    do {
-        if (*count >= cap) {
-            // Grow array dynamically
-            cap *= 2;
-            Tok* new_toks = safe_realloc(toks, sizeof(Tok) * cap);
-            if (!new_toks) {
-                fprintf(stderr, "Out of memory\n");
-                free(toks);
-                exit(1);
-            }
-            toks = new_toks;
-        }
-        toks[(*count)++] = lex_tok(&l);
-    } while (toks[*count - 1].t != T_EOF);
-    return toks;
-}
+enum { CC_SPACE = 1, CC_ALPHA = 2, CC_DIGIT = 4, CC_IDENT = CC_ALPHA | CC_DIGIT };
+unsigned char char_class[256];
 
-// ==== PARSER ====
-AstNode* ast_new(AstType type) {
-    AstNode* n = calloc(1, sizeof(AstNode));
-    n->type = type;
-    return n;
+// Operators and punctuation indexed by first byte: the one-byte token (T_EOF if
+// the byte alone is not a token) and up to three two-byte continuations.
+typedef struct {
+    TokType single;
+    char next[3];
+    TokType pair[3];
+} LexOp;
+LexOp lex_ops[256];
+
+typedef struct { const char* text; TokType t; } LexSpelling;
+
+LexSpelling lex_op_spellings[] = {
+    {"(", T_LPAREN}, {")", T_RPAREN}, {"{", T_LBRACE}, {"}", T_RBRACE},
+    {"[", T_LBRACKET}, {"]", T_RBRACKET}, {";", T_SEMI}, {":", T_COLON},
+    {",", T_COMMA}, {".", T_DOT}, {"&", T_AMP}, {"+", T_PLUS}, {"-", T_MINUS},
+    {"*", T_STAR}, {"/", T_SLASH}, {"%", T_MOD}, {"=", T_EQ}, {"!", T_BANG},
+    {"<", T_LT}, {">", T_GT},
+    {"&&", T_AND_AND}, {"||", T_OR_OR}, {"++", T_PLUSPLUS}, {"+=", T_PLUSEQ},
+    {"--", T_MINUSMINUS}, {"-=", T_MINUSEQ}, {"->", T_ARROW}, {"*=", T_STAREQ},
+    {"/=", T_SLASHEQ}, {"%=", T_MODEQ}, {"==", T_EQEQ}, {"!=", T_NEQ},
+    {"<=", T_LTE}, {">=", T_GTE},
+};
+
+// Keywords: (s[0]*3 + s[1]*2 + len) & 15 is collision-free over this set
+LexSpelling lex_keywords[] = {
+    {"fn", T_FN}, {"let", T_LET}, {"if", T_IF}, {"else", T_ELSE}, {"for", T_FOR},
+    {"mut", T_MUT}, {"while", T_WHILE}, {"return", T_RET}, {"struct", T_STRUCT},
+    {"const", T_CONST},
+};
+LexSpelling* kw_table[16];
+
+unsigned kw_hash(const char* s, int len) {
+    return ((unsigned char)s[0] * 3u + (unsigned char)s[1] * 2u + (unsigned)len) & 15;
 }
 
-void ast_add(AstNode* p, AstNode* c) {
-    p->child_count++;
-    p->children = safe_realloc(p->children, sizeof(AstNode*) * p->child_count);
-    p->children[p->child_count - 1] = c;
+TokType kw(const char* s, int len) {
+    if (len < 2 || len > 6) return T_IDENT;
+    LexSpelling* k = kw_table[kw_hash(s, len)];
+    if (k && !strncmp(k->text, s, len) && !k->text[len]) return k->t;
+    return T_IDENT;
 }
 
-// Token type to string for error messages
-const char* tok_name(TokType t) {
-    switch(t) {
-        case T_EOF: return "end of file";
-        case T_IDENT: return "identifier";
-        case T_NUM: return "number";
-        case T_STR: return "string";
-        case T_FN: return "'fn'";
-        case T_LET: return "'let'";
-        case T_IF: return "'if'";
-        case T_ELSE: return "'else'";
-        case T_FOR: return "'for'";
-        case T_WHILE: return "'while'";
-        case T_RET: return "'return'";
-        case T_STRUCT: return "'struct'";
-        case T_LPAREN: return "'('";
-        case T_RPAREN: return "')'";
-        case T_LBRACE: return "'{'";
-        case T_RBRACE: return "'}'";
-        case T_LBRACKET: return "'['";
-        case T_RBRACKET: return "']'";
-        case T_SEMI: return "';'";
-        case T_COLON: return "':'";
-        case T_COMMA: return "','";
-        case T_ARROW: return "'->'";
-        default: return "token";
-    }
+// Scanning kernels. Lines are not tracked here; see src_line_col().
+typedef struct {
+    const char* name;
+    const char* (*span_space)(const char* p);
+    const char* (*span_ident)(const char* p);
+    const char* (*find_eol)(const char* p);        // '\n' or NUL
+    const char* (*find_str_stop)(const char* p);   // '"', '\\' or NUL
+} LexKernels;
+
+const char* scalar_span_space(const char* p) {
+    while (char_class[(unsigned char)*p] & CC_SPACE) p++;
+    return p;
 }
 
-Tok peek_tok(Parser* p) { return p->tokens[p->pos]; }
-Tok advance_tok(Parser* p) { return p->tokens[p->pos++]; }
-int check_tok(Parser* p, TokType t) { return peek_tok(p).t == t; }
-int match_tok(Parser* p, TokType t) { if (check_tok(p, t)) { advance_tok(p); return 1; } return 0; }
-
-void expect(Parser* p, TokType t) {
-    if (!match_tok(p, t)) {
-        Tok got = peek_tok(p);
-        fprintf(stderr, "Parse error at line %d, col %d: expected %s, got %s\n",
-                got.line, got.col, tok_name(t), tok_name(got.t));
-        // Show a snippet of what we got
-        if (got.len > 0 && got.len < 50) {
-            fprintf(stderr, "  Got: '%.*s'\n", got.len, got.s);
-        }
-        exit(1);
-    }
+const char* scalar_span_ident(const char* p) {
+    while (char_class[(unsigned char)*p] & CC_IDENT) p++;
+    return p;
 }
 
-// ==== OPTIMIZATION HELPERS ====
+const char* scalar_find_eol(const char* p) {
+    while (*p && *p != '\n') p++;
+    return p;
+}
 
-// Check if both operands are compile-time constants
-int can_fold_constants(AstNode* left, AstNode* right) {
-    if (!left || !right) return 0;
-    return (left->type == AST_NUMBER && right->type == AST_NUMBER);
+const char* scalar_find_str_stop(const char* p) {
+    while (*p && *p != '"' && *p != '\\') p++;
+    return p;
 }
 
-// Fold binary operation at compile time
-AstNode* fold_binary_op(AstNode* left, AstNode* right, char* op) {
-    if (!can_fold_constants(left, right)) return NULL;
+LexKernels lex_kernels_scalar = {
+    "scalar", scalar_span_space, scalar_span_ident, scalar_find_eol, scalar_find_str_stop
+};
 
-    long left_val = atol(left->value);
-    long right_val = atol(right->value);
-    long result = 0;
+#if defined(__x86_64__)
+// SIMD kernels load aligned blocks, which never cross a page boundary, so
+// reading past the terminator is safe; bytes before `p` are masked off.
 
-    if (op[0] == '+') result = left_val + right_val;
-    else if (op[0] == '-') result = left_val - right_val;
-    else if (op[0] == '*') result = left_val * right_val;
-    else if (op[0] == '/' && right_val != 0) result = left_val / right_val;
-    else if (op[0] == '%' && right_val != 0) result = left_val % right_val;
-    else return NULL;  // Don't fold division by zero
+// Bytes of the block that belong to the class being spanned
+#define SSE2_SPACE(v) _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), \
+                                                _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))), \
+                                   _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')), \
+                                                _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))))
 
-    AstNode* folded = ast_new(AST_NUMBER);
-    char buf[32];
-    snprintf(buf, sizeof(buf), "%ld", result);
-    folded->value = strdup(buf);
+const char* sse2_span_space(const char* p) {
+    unsigned skip = (uintptr_t)p & 15;
+    const char* b = p - skip;
+    unsigned before = (1u << skip) - 1;
+    for (;;) {
+        __m128i v = _mm_load_si128((const __m128i*)b);
+        unsigned stop = ~((unsigned)_mm_movemask_epi8(SSE2_SPACE(v)) | before) & 0xFFFF;
+        if (stop) return b + __builtin_ctz(stop);
+        b += 16;
+        before = 0;
+    }
+}
 
-    return folded;
+const char* sse2_span_ident(const char* p) {
+    unsigned skip = (uintptr_t)p & 15;
+    const char* b = p - skip;
+    unsigned before = (1u << skip) - 1;
+    for (;;) {
+        __m128i v = _mm_load_si128((const __m128i*)b);
+        __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                      _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+        __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                      _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+        __m128i ident = _mm_or_si128(_mm_or_si128(alpha, digit), _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+        unsigned stop = ~((unsigned)_mm_movemask_epi8(ident) | before) & 0xFFFF;
+        if (stop) return b + __builtin_ctz(stop);
+        b += 16;
+        before = 0;
+    }
 }
 
-// Check if a number is a power of 2
-int is_power_of_2(long n) {
-    return n > 0 && (n & (n - 1)) == 0;
+const char* sse2_find_eol(const char* p) {
+    unsigned skip = (uintptr_t)p & 15;
+    const char* b = p - skip;
+    unsigned before = (1u << skip) - 1;
+    for (;;) {
+        __m128i v = _mm_load_si128((const __m128i*)b);
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                                   _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+        unsigned stop = (unsigned)_mm_movemask_epi8(hit) & ~before;
+        if (stop) return b + __builtin_ctz(stop);
+        b += 16;
+        before = 0;
+    }
 }
 
-// Get log2 of a power of 2
-int get_log2(long n) {
-    int log = 0;
-    while (n > 1) {
-        n >>= 1;
-        log++;
+const char* sse2_find_str_stop(const char* p) {
+    unsigned skip = (uintptr_t)p & 15;
+    const char* b = p - skip;
+    unsigned before = (1u << skip) - 1;
+    for (;;) {
+        __m128i v = _mm_load_si128((const __m128i*)b);
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                                                _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))),
+                                   _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+        unsigned stop = (unsigned)_mm_movemask_epi8(hit) & ~before;
+        if (stop) return b + __builtin_ctz(stop);
+        b += 16;
+        before = 0;
     }
-    return log;
 }
 
-AstNode* parse_expr(Parser* p);
-AstNode* parse_stmt(Parser* p);
-TypeSpec parse_type(Parser* p);
+LexKernels lex_kernels_sse2 = {
+    "sse2", sse2_span_space, sse2_span_ident, sse2_find_eol, sse2_find_str_stop
+};
 
-AstNode* parse_primary(Parser* p) {
-    if (check_tok(p, T_NUM)) {
-        Tok t = advance_tok(p);
-        AstNode* n = ast_new(AST_NUMBER);
-        n->value = strndup(t.s, t.len);
-        return n;
+#define AVX2_SPACE(v) _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), \
+                                                      _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))), \
+                                      _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')), \
+                                                      _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'))))
+
+__attribute__((target("avx2")))
+const char* avx2_span_space(const char* p) {
+    unsigned skip = (uintptr_t)p & 31;
+    const char* b = p - skip;
+    unsigned before = skip ? (1u << skip) - 1 : 0;
+    for (;;) {
+        __m256i v = _mm256_load_si256((const __m256i*)b);
+        unsigned stop = ~((unsigned)_mm256_movemask_epi8(AVX2_SPACE(v)) | before);
+        if (stop) return b + __builtin_ctz(stop);
+        b += 32;
+        before = 0;
     }
-    if (check_tok(p, T_STR)) {
-        Tok t = advance_tok(p);
-        AstNode* n = ast_new(AST_STRING);
-        n->value = strndup(t.s + 1, t.len - 2);
-        return n;
+}
+
+__attribute__((target("avx2")))
+const char* avx2_span_ident(const char* p) {
+    unsigned skip = (uintptr_t)p & 31;
+    const char* b = p - skip;
+    unsigned before = skip ? (1u << skip) - 1 : 0;
+    for (;;) {
+        __m256i v = _mm256_load_si256((const __m256i*)b);
+        __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+        __m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+                                         _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), lower));
+        __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)),
+                                         _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+        __m256i ident = _mm256_or_si256(_mm256_or_si256(alpha, digit),
+                                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+        unsigned stop = ~((unsigned)_mm256_movemask_epi8(ident) | before);
+        if (stop) return b + __builtin_ctz(stop);
+        b += 32;
+        before = 0;
+    }
+}
+
+__attribute__((target("avx2")))
+const char* avx2_find_eol(const char* p) {
+    unsigned skip = (uintptr_t)p & 31;
+    const char* b = p - skip;
+    unsigned before = skip ? (1u << skip) - 1 : 0;
+    for (;;) {
+        __m256i v = _mm256_load_si256((const __m256i*)b);
+        __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                                      _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+        unsigned stop = (unsigned)_mm256_movemask_epi8(hit) & ~before;
+        if (stop) return b + __builtin_ctz(stop);
+        b += 32;
+        before = 0;
+    }
+}
+
+__attribute__((target("avx2")))
+const char* avx2_find_str_stop(const char* p) {
+    unsigned skip = (uintptr_t)p & 31;
+    const char* b = p - skip;
+    unsigned before = skip ? (1u << skip) - 1 : 0;
+    for (;;) {
+        __m256i v = _mm256_load_si256((const __m256i*)b);
+        __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                                                      _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))),
+                                      _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+        unsigned stop = (unsigned)_mm256_movemask_epi8(hit) & ~before;
+        if (stop) return b + __builtin_ctz(stop);
+        b += 32;
+        before = 0;
+    }
+}
+
+LexKernels lex_kernels_avx2 = {
+    "avx2", avx2_span_space, avx2_span_ident, avx2_find_eol, avx2_find_str_stop
+};
+#endif
+
+LexKernels* lex_kernels;
+
+// Most runs (indentation, names) are a few bytes long: walk the first
+// LEX_SHORT_RUN bytes with the class table and only then call a kernel.
+#define LEX_SHORT_RUN 16
+
+// Kernel sets usable on this CPU, best first
+int lex_available_kernels(LexKernels** out) {
+    int n = 0;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) out[n++] = &lex_kernels_avx2;
+    out[n++] = &lex_kernels_sse2;  // Baseline on x86-64
+#endif
+    out[n++] = &lex_kernels_scalar;
+    return n;
+}
+
+void lex_tables_init() {
+    for (int c = 0; c < 256; c++) {
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n') char_class[c] = CC_SPACE;
+        else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_') char_class[c] = CC_ALPHA;
+        else if (c >= '0' && c <= '9') char_class[c] = CC_DIGIT;
+    }
+    for (size_t i = 0; i < sizeof(lex_op_spellings) / sizeof(lex_op_spellings[0]); i++) {
+        LexSpelling* sp = &lex_op_spellings[i];
+        LexOp* op = &lex_ops[(unsigned char)sp->text[0]];
+        if (!sp->text[1]) {
+            op->single = sp->t;
+        } else {
+            int k = 0;
+            while (op->next[k]) k++;
+            op->next[k] = sp->text[1];
+            op->pair[k] = sp->t;
+        }
+    }
+    for (size_t i = 0; i < sizeof(lex_keywords) / sizeof(lex_keywords[0]); i++) {
+        LexSpelling* k = &lex_keywords[i];
+        kw_table[kw_hash(k->text, strlen(k->text))] = k;
+    }
+    if (!lex_kernels) {
+        LexKernels* avail[3];
+        lex_available_kernels(avail);
+        lex_kernels = avail[0];
+    }
+}
+
+char* src_text;  // Input being compiled; token offsets and SrcSlices index into it
+uint32_t src_origin;  // Start of the file being parsed in src_text (after a prelude)
+
+// Line starts of the file at src_origin, built on the first diagnostic
+int* line_starts;
+int line_count;
+
+// 1-based line and column of a source offset
+void src_line_col(uint32_t off, int* line, int* col) {
+    if (!line_starts) {
+        int cap = 1024;
+        line_starts = arena_alloc(&compiler_arena, sizeof(int) * cap);
+        line_starts[line_count++] = src_origin;
+        for (const char* q = src_text + src_origin; (q = strchr(q, '\n')); q++) {
+            if (line_count == cap) {
+                line_starts = arena_grow(&compiler_arena, line_starts, sizeof(int) * cap, sizeof(int) * cap * 2);
+                cap *= 2;
+            }
+            line_starts[line_count++] = q + 1 - src_text;
+        }
+    }
+    int lo = 0, hi = line_count - 1;  // Last line starting at or before off
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if ((uint32_t)line_starts[mid] <= off) lo = mid;
+        else hi = mid - 1;
+    }
+    *line = lo + 1;
+    *col = off - line_starts[lo] + 1;
+}
+
+void lex_init(Lex* l, char* s) {
+    l->src = l->cur = s;
+}
+
+// Writes through `t` rather than returning the packed Tok: gcc assembles a
+// returned Tok on the stack with a byte store and reloads it as one word,
+// which defeats store forwarding on every token.
+void lex_tok(Lex* l, Tok* t) {
+    LexKernels* k = lex_kernels;
+    const char* p = l->cur;
+
+    // Whitespace and // comments
+    for (;;) {
+        const char* short_end = p + LEX_SHORT_RUN;
+        while (p < short_end && (char_class[(unsigned char)*p] & CC_SPACE)) p++;
+        if (p == short_end) p = k->span_space(p);
+        if (p[0] == '/' && p[1] == '/') p = k->find_eol(p + 2);
+        else break;
+    }
+
+    const char* st = p;
+    TokType type = T_EOF;
+    uint32_t len = 0;
+    unsigned char c = *p;
+    unsigned char cls = char_class[c];
+
+    if (cls & CC_ALPHA) {
+        const char* short_end = p + LEX_SHORT_RUN;
+        p++;
+        while (p < short_end && (char_class[(unsigned char)*p] & CC_IDENT)) p++;
+        if (p == short_end) p = k->span_ident(p);
+        len = p - st;
+        type = kw(st, len);
+    } else if (cls & CC_DIGIT) {
+        p++;
+        while (char_class[(unsigned char)*p] & CC_DIGIT) p++;
+        type = T_NUM;
+        len = p - st;
+    } else if (c == '"') {
+        p++;
+        for (;;) {
+            p = k->find_str_stop(p);
+            if (*p != '\\') break;
+            p++;                       // Skip escape sequence
+            if (*p) p++;
+        }
+        if (*p != '"') {
+            int line, col;
+            src_line_col(st - l->src, &line, &col);
+            fprintf(stderr, "Error at line %d, col %d: Unterminated string literal\n", line, col);
+            exit(1);
+        }
+        p++;  // Consume closing quote
+        type = T_STR;
+        len = p - st;
+    } else if (c) {
+        // Operators; a byte that starts no token ends the stream (T_EOF)
+        LexOp* op = &lex_ops[c];
+        p++;
+        for (int i = 0; i < 3 && op->next[i]; i++) {
+            if (*p == op->next[i]) {
+                type = op->pair[i];
+                len = 2;
+                p++;
+                break;
+            }
+        }
+        if (!len && op->single) {
+            type = op->single;
+            len = 1;
+        }
+    }
+    l->cur = (char*)p;
+    t->t = type;
+    t->off = st - l->src;
+    t->len = len;
+}
+
+double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// --bench-lexer: lex `src` with every kernel set this CPU supports, check
+// they agree token for token, and report throughput
+void bench_lexer(char* src, long size) {
+    LexKernels* avail[3];
+    int n = lex_available_kernels(avail);
+    unsigned long ref_sum = 0;
+    printf("Lexer benchmark: %.2f MB\n", size / 1e6);
+    for (int k = 0; k < n; k++) {
+        lex_kernels = avail[k];
+        long tokens = 0;
+        unsigned long sum = 0;
+        int runs = 0;
+        double start = now_sec(), elapsed;
+        do {
+            Lex l; lex_init(&l, src);
+            Tok t;
+            tokens = 0;
+            sum = 0;
+            do {
+                lex_tok(&l, &t);
+                tokens++;
+                sum = sum * 31 + t.off * 7 + t.len * 5 + t.t;
+            } while (t.t != T_EOF);
+            runs++;
+            elapsed = now_sec() - start;
+        } while (elapsed < 1.0 || runs < 3);
+        if (k == 0) {
+            ref_sum = sum;
+        } else if (sum != ref_sum) {
+            fprintf(stderr, "Lexer benchmark: %s tokens differ from %s\n", avail[k]->name, avail[0]->name);
+            exit(1);
+        }
+        printf("  %-8s %9.1f MB/s  %10.1f Mtok/s  (%ld tokens, %d runs)\n", avail[k]->name,
+               size * runs / elapsed / 1e6, tokens * runs / elapsed / 1e6, tokens, runs);
+    }
+}
+
+// ==== AST ====
+Ast ast;
+
+// Children of the nodes being parsed. A parse function takes ast_mark(),
+// pushes each child as it is finished, and ast_node() moves them into
+// kid_ids; nested parses push and pop above the mark.
+Node* ast_scratch;
+int ast_scratch_count;
+int ast_scratch_cap;
+
+int kind_has_op(AstType k) {
+    return k == AST_BINOP || k == AST_COMPARE || k == AST_LOGICAL || k == AST_UNARY;
+}
+
+int kind_has_decl(AstType k) {
+    return k != AST_NUMBER && k != AST_STRING && !kind_has_op(k);
+}
+
+void ast_alloc_nodes(Ast* a, int cap) {
+    a->kind = safe_realloc(a->kind, cap);
+    a->name = safe_realloc(a->name, sizeof(Atom) * cap);
+    a->kids = safe_realloc(a->kids, sizeof(uint32_t) * cap);
+    a->nkids = safe_realloc(a->nkids, sizeof(int) * cap);
+    a->extra = safe_realloc(a->extra, sizeof(uint32_t) * cap);
+    a->cap = cap;
+}
+
+void ast_free_nodes(Ast* a) {
+    free(a->kind);
+    free(a->name);
+    free(a->kids);
+    free(a->nkids);
+    free(a->extra);
+}
+
+void ast_init() {
+    memset(&ast, 0, sizeof(ast));
+    ast_alloc_nodes(&ast, 1024);
+    ast.kind[0] = 0; ast.name[0] = 0; ast.kids[0] = 0; ast.nkids[0] = 0; ast.extra[0] = 0;
+    ast.count = 1;  // Node 0 = none
+    ast.decl_cap = 256;
+    ast.decls = safe_realloc(NULL, sizeof(AstDecl) * ast.decl_cap);
+    memset(&ast.decls[0], 0, sizeof(AstDecl));
+    ast.decl_count = 1;
+}
+
+int ast_mark() { return ast_scratch_count; }
+
+void ast_push(Node c) {
+    if (ast_scratch_count == ast_scratch_cap) {
+        ast_scratch_cap = ast_scratch_cap ? ast_scratch_cap * 2 : 256;
+        ast_scratch = safe_realloc(ast_scratch, sizeof(Node) * ast_scratch_cap);
+    }
+    ast_scratch[ast_scratch_count++] = c;
+}
+
+// New node whose children are the nodes pushed since `mark`
+Node ast_node(AstType kind, int mark) {
+    if (ast.count == ast.cap) ast_alloc_nodes(&ast, ast.cap * 2);
+    int n = ast_scratch_count - mark;
+    if (ast.kid_count + n > ast.kid_cap) {
+        while (ast.kid_count + n > ast.kid_cap) ast.kid_cap = ast.kid_cap ? ast.kid_cap * 2 : 1024;
+        ast.kid_ids = safe_realloc(ast.kid_ids, sizeof(Node) * ast.kid_cap);
+    }
+    memcpy(ast.kid_ids + ast.kid_count, ast_scratch + mark, sizeof(Node) * n);
+    ast_scratch_count = mark;
+
+    Node id = ast.count++;
+    ast.kind[id] = kind;
+    ast.name[id] = ATOM_NONE;
+    ast.kids[id] = ast.kid_count;
+    ast.nkids[id] = n;
+    ast.extra[id] = 0;
+    ast.kid_count += n;
+    return id;
+}
+
+Node ast_leaf(AstType kind) { return ast_node(kind, ast_mark()); }
+
+Node ast_node1(AstType kind, Node a) {
+    int mark = ast_mark();
+    ast_push(a);
+    return ast_node(kind, mark);
+}
+
+Node ast_node2(AstType kind, Node a, Node b) {
+    int mark = ast_mark();
+    ast_push(a);
+    ast_push(b);
+    return ast_node(kind, mark);
+}
+
+Node ast_literal(AstType kind, SrcSlice lit, long num) {
+    if (ast.lit_count == ast.lit_cap) {
+        ast.lit_cap = ast.lit_cap ? ast.lit_cap * 2 : 256;
+        ast.lits = safe_realloc(ast.lits, sizeof(AstLiteral) * ast.lit_cap);
+    }
+    Node n = ast_leaf(kind);
+    ast.extra[n] = ast.lit_count;
+    ast.lits[ast.lit_count++] = (AstLiteral){ lit, num };
+    return n;
+}
+
+// Child i of a node that is still being parsed
+Node ast_parse_kid(Node n, int i) { return ast.kid_ids[ast.kids[n] + i]; }
+
+// Child i of a finished node
+Node ast_child(Node n, int i) { return ast.kids[n] + i; }
+
+AstLiteral* ast_lit(Node n) { return &ast.lits[ast.extra[n]]; }
+
+TokType ast_op(Node n) { return kind_has_op(ast.kind[n]) ? (TokType)ast.extra[n] : T_EOF; }
+
+void ast_set_op(Node n, TokType op) { ast.extra[n] = op; }
+
+// Declaration info; nodes without any read as all zeros
+AstDecl* ast_decl(Node n) { return &ast.decls[kind_has_decl(ast.kind[n]) ? ast.extra[n] : 0]; }
+
+// Declaration info for the parser to fill in, allocated on first use
+AstDecl* ast_set_decl(Node n) {
+    if (!ast.extra[n]) {
+        if (ast.decl_count == ast.decl_cap) {
+            ast.decl_cap *= 2;
+            ast.decls = safe_realloc(ast.decls, sizeof(AstDecl) * ast.decl_cap);
+        }
+        memset(&ast.decls[ast.decl_count], 0, sizeof(AstDecl));
+        ast.extra[n] = ast.decl_count++;
+    }
+    return &ast.decls[ast.extra[n]];
+}
+
+// Copy the children of `src` (in `from`) as a consecutive run after the
+// nodes already in `to`; returns the first
+Node ast_layout_run(Ast* to, Ast* from, Node src, Node dst) {
+    int n = from->nkids[src];
+    Node first = to->count;
+    if (to->count + n > to->cap) ast_alloc_nodes(to, (to->count + n) * 2);
+    to->count += n;
+    to->kids[dst] = first;
+    to->nkids[dst] = n;
+    Node* kid = from->kid_ids + from->kids[src];
+    for (int i = 0; i < n; i++) {
+        to->kind[first + i] = from->kind[kid[i]];
+        to->name[first + i] = from->name[kid[i]];
+        to->extra[first + i] = from->extra[kid[i]];
+    }
+    return first;
+}
+
+// Lay out the children of `src` as a run, then their subtrees in turn
+void ast_layout(Ast* to, Ast* from, Node src, Node dst) {
+    Node first = ast_layout_run(to, from, src, dst);
+    Node* kid = from->kid_ids + from->kids[src];
+    for (int i = 0; i < from->nkids[src]; i++) ast_layout(to, from, kid[i], first + i);
+}
+
+// Hand the whole pages of [p, p + len) back to the system; they read as
+// zeros if touched again
+void mem_drop(void* p, size_t len) {
+    static uintptr_t page;
+    if (!page) page = sysconf(_SC_PAGESIZE);
+    uintptr_t lo = ((uintptr_t)p + page - 1) & ~(page - 1);
+    uintptr_t hi = ((uintptr_t)p + len) & ~(page - 1);
+    if (hi > lo) madvise((void*)lo, hi - lo, MADV_DONTNEED);
+}
+
+// Nodes are dropped in runs of at least this many, so each run frees whole
+// pages of every array
+#define AST_DROP_NODES 65536
+
+// Drop nodes [lo, hi) of `a`
+void ast_drop_nodes(Ast* a, Node lo, Node hi) {
+    mem_drop(a->kind + lo, hi - lo);
+    mem_drop(a->name + lo, sizeof(Atom) * (hi - lo));
+    mem_drop(a->kids + lo, sizeof(uint32_t) * (hi - lo));
+    mem_drop(a->nkids + lo, sizeof(int) * (hi - lo));
+    mem_drop(a->extra + lo, sizeof(uint32_t) * (hi - lo));
+}
+
+// Renumber the tree under `root` in the order codegen walks it, with each
+// node's children consecutive. Nodes the parser dropped (folded operands,
+// desugared wrappers) are left behind. Returns the new root.
+Node ast_finish(Node root) {
+    Ast from = ast;
+    Ast* to = &ast;
+    to->kind = NULL; to->name = NULL; to->kids = NULL; to->nkids = NULL; to->extra = NULL;
+    ast_alloc_nodes(to, from.count);
+    to->kind[0] = 0; to->name[0] = 0; to->kids[0] = 0; to->nkids[0] = 0; to->extra[0] = 0;
+    to->kind[1] = from.kind[root];
+    to->name[1] = from.name[root];
+    to->extra[1] = from.extra[root];
+    to->count = 2;
+    // The parser makes an item's nodes and kid slots after those of the items
+    // before it, so once an item is laid out everything up to it can go and
+    // the two copies of the tree are never both whole
+    Node first = ast_layout_run(to, &from, root, 1);
+    Node* item = from.kid_ids + from.kids[root];
+    Node done = 0;
+    int kids_done = 0;
+    for (int i = 0; i < from.nkids[root]; i++) {
+        ast_layout(to, &from, item[i], first + i);
+        Node end = item[i] + 1;
+        int kids_end = from.kids[item[i]] + from.nkids[item[i]];
+        if (end - done >= AST_DROP_NODES && kids_end > kids_done) {
+            ast_drop_nodes(&from, done, end);
+            mem_drop(from.kid_ids + kids_done, sizeof(Node) * (kids_end - kids_done));
+            done = end;
+            kids_done = kids_end;
+        }
+    }
+
+    ast_free_nodes(&from);
+    free(from.kid_ids);
+    to->kid_ids = NULL;
+    to->kid_count = to->kid_cap = 0;
+    free(ast_scratch);
+    ast_scratch = NULL;
+    ast_scratch_count = ast_scratch_cap = 0;
+    return 1;
+}
+
+// Top-level subtrees are laid out one after another, so the nodes of item i
+// of the program run from its first child up to the next item's first child
+Node program_item_end(Node prog, int i) {
+    for (int j = i + 1; j < ast.nkids[prog]; j++) {
+        if (ast.nkids[ast_child(prog, j)]) return ast.kids[ast_child(prog, j)];
+    }
+    return ast.count;
+}
+
+void ast_release() {
+    ast_free_nodes(&ast);
+    free(ast.kid_ids);
+    free(ast.lits);
+    free(ast.decls);
+    memset(&ast, 0, sizeof(ast));
+}
+
+// ==== PARSER ====
+// Token type to string for error messages
+const char* tok_name(TokType t) {
+    switch(t) {
+        case T_EOF: return "end of file";
+        case T_IDENT: return "identifier";
+        case T_NUM: return "number";
+        case T_STR: return "string";
+        case T_FN: return "'fn'";
+        case T_LET: return "'let'";
+        case T_IF: return "'if'";
+        case T_ELSE: return "'else'";
+        case T_FOR: return "'for'";
+        case T_WHILE: return "'while'";
+        case T_RET: return "'return'";
+        case T_STRUCT: return "'struct'";
+        case T_CONST: return "'const'";
+        case T_LPAREN: return "'('";
+        case T_RPAREN: return "')'";
+        case T_LBRACE: return "'{'";
+        case T_RBRACE: return "'}'";
+        case T_LBRACKET: return "'['";
+        case T_RBRACKET: return "']'";
+        case T_SEMI: return "';'";
+        case T_COLON: return "':'";
+        case T_COMMA: return "','";
+        case T_ARROW: return "'->'";
+        default: return "token";
+    }
+}
+
+const char* tok_text(Tok t) { return src_text + t.off; }
+
+// Name carried by an identifier (or keyword used as a name)
+Atom tok_atom(Tok t) { return atom_intern(tok_text(t), t.len); }
+
+void parser_init(Parser* p, char* src) {
+    lex_init(&p->lex, src);
+    p->pos = p->lexed = 0;
+}
+
+Tok peek_tok(Parser* p) {
+    Tok* slot = &p->win[p->pos & (PARSE_WINDOW - 1)];
+    if (p->pos == p->lexed) {
+        // The stream ends at the first T_EOF; keep returning it
+        Tok* last = &p->win[(p->lexed - 1) & (PARSE_WINDOW - 1)];
+        if (p->lexed && last->t == T_EOF) *slot = *last;
+        else lex_tok(&p->lex, slot);
+        p->lexed++;
+    }
+    return *slot;
+}
+
+Tok advance_tok(Parser* p) { Tok t = peek_tok(p); p->pos++; return t; }
+int check_tok(Parser* p, TokType t) { return peek_tok(p).t == t; }
+int match_tok(Parser* p, TokType t) { if (check_tok(p, t)) { advance_tok(p); return 1; } return 0; }
+
+void expect(Parser* p, TokType t) {
+    if (!match_tok(p, t)) {
+        Tok got = peek_tok(p);
+        int line, col;
+        src_line_col(got.off, &line, &col);
+        fprintf(stderr, "Parse error at line %d, col %d: expected %s, got %s\n",
+                line, col, tok_name(t), tok_name(got.t));
+        // Show a snippet of what we got
+        if (got.len > 0 && got.len < 50) {
+            fprintf(stderr, "  Got: '%.*s'\n", (int)got.len, tok_text(got));
+        }
+        exit(1);
+    }
+}
+
+// ==== OPTIMIZATION HELPERS ====
+
+// Check if both operands are compile-time constants
+int can_fold_constants(Node left, Node right) {
+    if (!left || !right) return 0;
+    return (ast.kind[left] == AST_NUMBER && ast.kind[right] == AST_NUMBER);
+}
+
+int fold_div(int mod, int literal, long x, long d, long* out);
+
+// Fold binary operation at compile time
+Node fold_binary_op(Node left, Node right, TokType op) {
+    if (!can_fold_constants(left, right)) return 0;
+
+    // Wrapping, as the machine does
+    unsigned long left_val = ast_lit(left)->num;
+    unsigned long right_val = ast_lit(right)->num;
+    long result = 0;
+
+    if (op == T_PLUS) result = left_val + right_val;
+    else if (op == T_MINUS) result = left_val - right_val;
+    else if (op == T_STAR) result = left_val * right_val;
+    else if (op == T_SLASH || op == T_MOD) {
+        if (!fold_div(op == T_MOD, 1, left_val, right_val, &result)) return 0;  // Traps at run time
+    }
+    else return 0;
+
+    return ast_literal(AST_NUMBER, (SrcSlice){ 0, 0 }, result);
+}
+
+// Check if a number is a power of 2
+int is_power_of_2(long n) {
+    return n > 0 && (n & (n - 1)) == 0;
+}
+
+// Get log2 of a power of 2
+int get_log2(long n) {
+    int log = 0;
+    while (n > 1) {
+        n >>= 1;
+        log++;
+    }
+    return log;
+}
+
+// x / d and x % d as the generated code computes them: a literal power of
+// 2 divisor at -O2 is a shift or mask, otherwise idiv with rdx cleared
+// divides x taken as unsigned, and a divisor of 0 gives 0. Returns 0 when
+// the quotient does not fit and idiv traps, which is left to run time
+int fold_div(int mod, int literal, long x, long d, long* out) {
+    if (!d) {
+        *out = 0;
+    } else if (literal && optimization_level >= 2 && is_power_of_2(d)) {
+        *out = mod ? x & (d - 1) : x >> get_log2(d);
+    } else {
+        unsigned long u = x, ud = d < 0 ? -(unsigned long)d : (unsigned long)d, q = u / ud;
+        if (q > (unsigned long)LONG_MAX + (d < 0)) return 0;
+        *out = mod ? (long)(u % ud) : d < 0 ? (long)-q : (long)q;
+    }
+    return 1;
+}
+
+// Value of a const initializer: numbers under + - * / % and unary minus,
+// at every -O level, computed as the generated code would. A division
+// that traps has none.
+int const_eval(Node n, long* v) {
+    long a, b;
+    if (ast.kind[n] == AST_NUMBER) {
+        *v = ast_lit(n)->num;
+        return 1;
+    }
+    if (ast.kind[n] == AST_UNARY && ast_op(n) == T_MINUS && ast.nkids[n] && const_eval(ast_parse_kid(n, 0), &a)) {
+        *v = -(unsigned long)a;
+        return 1;
+    }
+    if (ast.kind[n] != AST_BINOP || !const_eval(ast_parse_kid(n, 0), &a) || !const_eval(ast_parse_kid(n, 1), &b))
+        return 0;
+    // Wrapping, as the machine does
+    int literal = ast.kind[ast_parse_kid(n, 1)] == AST_NUMBER;
+    switch (ast_op(n)) {
+        case T_PLUS: *v = (unsigned long)a + b; return 1;
+        case T_MINUS: *v = (unsigned long)a - b; return 1;
+        case T_STAR: *v = (unsigned long)a * b; return 1;
+        case T_SLASH: case T_MOD: return fold_div(ast_op(n) == T_MOD, literal, a, b, v);
+        default: return 0;
+    }
+}
+
+Node parse_expr(Parser* p);
+Node parse_stmt(Parser* p);
+TypeSpec parse_type(Parser* p);
+
+Node parse_primary(Parser* p) {
+    if (check_tok(p, T_NUM)) {
+        Tok t = advance_tok(p);
+        return ast_literal(AST_NUMBER, (SrcSlice){ t.off, t.len }, atol(tok_text(t)));
+    }
+    if (check_tok(p, T_STR)) {
+        Tok t = advance_tok(p);
+        return ast_literal(AST_STRING, (SrcSlice){ t.off + 1, t.len - 2 }, 0);
     }
     if (check_tok(p, T_LBRACKET)) {
         // Array literal
         advance_tok(p);
-        AstNode* arr = ast_new(AST_ARRAY_LITERAL);
+        int mark = ast_mark();
         while (!check_tok(p, T_RBRACKET)) {
-            ast_add(arr, parse_expr(p));
+            ast_push(parse_expr(p));
             if (!check_tok(p, T_RBRACKET)) expect(p, T_COMMA);
         }
         expect(p, T_RBRACKET);
-        arr->array_size = arr->child_count;
+        Node arr = ast_node(AST_ARRAY_LITERAL, mark);
+        ast_set_decl(arr)->array_size = ast.nkids[arr];
         return arr;
     }
     if (check_tok(p, T_IDENT)) {
@@ -673,93 +2072,92 @@ AstNode* parse_primary(Parser* p) {
         // Struct literal
         if (check_tok(p, T_LBRACE)) {
             advance_tok(p);
-            AstNode* struct_lit = ast_new(AST_STRUCT_LITERAL);
-            struct_lit->struct_type = strndup(t.s, t.len);
+            Atom struct_type = tok_atom(t);
+            int mark = ast_mark();
 
             while (!check_tok(p, T_RBRACE)) {
                 Tok field_name = advance_tok(p);
                 expect(p, T_COLON);
-                AstNode* field_val = parse_expr(p);
-
-                AstNode* field = ast_new(AST_IDENT);
-                field->name = strndup(field_name.s, field_name.len);
-                ast_add(field, field_val);
-                ast_add(struct_lit, field);
+                Node field = ast_node1(AST_IDENT, parse_expr(p));
+                ast.name[field] = tok_atom(field_name);
+                ast_push(field);
 
                 if (!check_tok(p, T_RBRACE)) expect(p, T_COMMA);
             }
             expect(p, T_RBRACE);
+            Node struct_lit = ast_node(AST_STRUCT_LITERAL, mark);
+            ast_set_decl(struct_lit)->struct_type = struct_type;
             return struct_lit;
         }
 
         // Function call
         if (check_tok(p, T_LPAREN)) {
-            AstNode* call = ast_new(AST_CALL);
-            call->name = strndup(t.s, t.len);
+            Atom name = tok_atom(t);
+            int mark = ast_mark();
             advance_tok(p);
             while (!check_tok(p, T_RPAREN)) {
-                ast_add(call, parse_expr(p));
+                ast_push(parse_expr(p));
                 if (!check_tok(p, T_RPAREN)) expect(p, T_COMMA);
             }
             expect(p, T_RPAREN);
+            Node call = ast_node(AST_CALL, mark);
+            ast.name[call] = name;
             return call;
         }
 
         // Assignment
         if (check_tok(p, T_EQ)) {
             advance_tok(p);
-            AstNode* assign = ast_new(AST_ASSIGN);
-            assign->name = strndup(t.s, t.len);
-            ast_add(assign, parse_expr(p));
+            Atom name = tok_atom(t);
+            Node assign = ast_node1(AST_ASSIGN, parse_expr(p));
+            ast.name[assign] = name;
             return assign;
         }
 
         // Identifier
-        AstNode* n = ast_new(AST_IDENT);
-        n->name = strndup(t.s, t.len);
+        Node n = ast_leaf(AST_IDENT);
+        ast.name[n] = tok_atom(t);
         return n;
     }
     if (match_tok(p, T_LPAREN)) {
-        AstNode* n = parse_expr(p);
+        Node n = parse_expr(p);
         expect(p, T_RPAREN);
         return n;
     }
     Tok err = peek_tok(p);
+    int line, col;
+    src_line_col(err.off, &line, &col);
     fprintf(stderr, "Parse error at line %d, col %d: unexpected %s\n",
-            err.line, err.col, tok_name(err.t));
+            line, col, tok_name(err.t));
     if (err.len > 0 && err.len < 50) {
-        fprintf(stderr, "  Got: '%.*s'\n", err.len, err.s);
+        fprintf(stderr, "  Got: '%.*s'\n", (int)err.len, tok_text(err));
     }
     exit(1);
 }
 
 // Forward declarations
-AstNode* parse_postfix(Parser* p);
+Node parse_postfix(Parser* p);
 
 // Parse unary operators: &x, *ptr
-AstNode* parse_unary(Parser* p) {
+Node parse_unary(Parser* p) {
     if (check_tok(p, T_MINUS)) {
         // Unary minus: -expr
         advance_tok(p);
-        AstNode* neg = ast_new(AST_UNARY);
-        neg->op = strdup("-");
-        ast_add(neg, parse_unary(p));  // Allow chaining
+        Node neg = ast_node1(AST_UNARY, parse_unary(p));  // Allow chaining
+        ast_set_op(neg, T_MINUS);
         return neg;
     }
     if (check_tok(p, T_BANG)) {
         // Logical NOT: !x
         advance_tok(p);
-        AstNode* not_node = ast_new(AST_UNARY);
-        not_node->op = strdup("!");
-        ast_add(not_node, parse_unary(p));  // Allow chaining (!(!x))
+        Node not_node = ast_node1(AST_UNARY, parse_unary(p));  // Allow chaining (!(!x))
+        ast_set_op(not_node, T_BANG);
         return not_node;
     }
     if (check_tok(p, T_AMP)) {
         // Address-of: &variable
         advance_tok(p);
-        AstNode* addr_of = ast_new(AST_ADDR_OF);
-        ast_add(addr_of, parse_unary(p));  // Allow chaining
-        return addr_of;
+        return ast_node1(AST_ADDR_OF, parse_unary(p));  // Allow chaining
     }
     if (check_tok(p, T_STAR)) {
         // Dereference: *ptr (need to distinguish from multiplication)
@@ -769,9 +2167,7 @@ AstNode* parse_unary(Parser* p) {
         if (check_tok(p, T_IDENT) || check_tok(p, T_LPAREN) ||
             check_tok(p, T_STAR) || check_tok(p, T_AMP)) {
             // It's dereference
-            AstNode* deref = ast_new(AST_DEREF);
-            ast_add(deref, parse_unary(p));
-            return deref;
+            return ast_node1(AST_DEREF, parse_unary(p));
         } else {
             // It's multiplication, backtrack
             p->pos = saved_pos;
@@ -782,13 +2178,11 @@ AstNode* parse_unary(Parser* p) {
 }
 
 // Parse postfix base (handles unary in postfix context)
-AstNode* parse_postfix_base(Parser* p) {
+Node parse_postfix_base(Parser* p) {
     if (check_tok(p, T_AMP)) {
         // Address-of: &variable or &array[index] or &struct.field
         advance_tok(p);
-        AstNode* addr_of = ast_new(AST_ADDR_OF);
-        ast_add(addr_of, parse_postfix(p));  // Recursive to handle postfix ops
-        return addr_of;
+        return ast_node1(AST_ADDR_OF, parse_postfix(p));  // Recursive to handle postfix ops
     }
     if (check_tok(p, T_STAR)) {
         // Dereference: *ptr
@@ -796,9 +2190,7 @@ AstNode* parse_postfix_base(Parser* p) {
         advance_tok(p);
         if (check_tok(p, T_IDENT) || check_tok(p, T_LPAREN) ||
             check_tok(p, T_STAR) || check_tok(p, T_AMP)) {
-            AstNode* deref = ast_new(AST_DEREF);
-            ast_add(deref, parse_postfix(p));  // Recursive to handle postfix ops
-            return deref;
+            return ast_node1(AST_DEREF, parse_postfix(p));  // Recursive to handle postfix ops
         } else {
             p->pos = saved_pos;
             return parse_primary(p);
@@ -807,35 +2199,30 @@ AstNode* parse_postfix_base(Parser* p) {
     return parse_unary(p);
 }
 
-AstNode* parse_postfix(Parser* p) {
-    AstNode* left = parse_postfix_base(p);
+Node parse_postfix(Parser* p) {
+    Node left = parse_postfix_base(p);
     while (1) {
         if (check_tok(p, T_LBRACKET)) {
             // Array indexing
             advance_tok(p);
-            AstNode* index_node = ast_new(AST_INDEX);
-            ast_add(index_node, left);
-            ast_add(index_node, parse_expr(p));
+            Node index = parse_expr(p);
+            left = ast_node2(AST_INDEX, left, index);
             expect(p, T_RBRACKET);
-            left = index_node;
         } else if (check_tok(p, T_ARROW)) {
             // Arrow operator: ptr->field
             advance_tok(p);
             Tok field = advance_tok(p);
             // Desugar: ptr->field becomes (*ptr).field
-            AstNode* deref = ast_new(AST_DEREF);
-            ast_add(deref, left);
-            AstNode* field_node = ast_new(AST_FIELD_ACCESS);
-            field_node->name = strndup(field.s, field.len);
-            ast_add(field_node, deref);
+            Node deref = ast_node1(AST_DEREF, left);
+            Node field_node = ast_node1(AST_FIELD_ACCESS, deref);
+            ast.name[field_node] = tok_atom(field);
             left = field_node;
         } else if (check_tok(p, T_DOT)) {
             // Field access
             advance_tok(p);
             Tok field = advance_tok(p);
-            AstNode* field_node = ast_new(AST_FIELD_ACCESS);
-            field_node->name = strndup(field.s, field.len);
-            ast_add(field_node, left);
+            Node field_node = ast_node1(AST_FIELD_ACCESS, left);
+            ast.name[field_node] = tok_atom(field);
             left = field_node;
         } else {
             break;
@@ -844,234 +2231,194 @@ AstNode* parse_postfix(Parser* p) {
     return left;
 }
 
-AstNode* parse_multiplicative(Parser* p) {
-    AstNode* left = parse_postfix(p);
+Node parse_multiplicative(Parser* p) {
+    Node left = parse_postfix(p);
     while (check_tok(p, T_STAR) || check_tok(p, T_SLASH) || check_tok(p, T_MOD)) {
         Tok op = advance_tok(p);
-        AstNode* right = parse_postfix(p);
+        Node right = parse_postfix(p);
 
         // Constant folding optimization (O1+)
         if (optimization_level >= 1) {
-            char op_str[2] = {op.s[0], '\0'};
-            AstNode* folded = fold_binary_op(left, right, op_str);
+            Node folded = fold_binary_op(left, right, op.t);
             if (folded) {
                 left = folded;
                 continue;
             }
         }
 
-        AstNode* binop = ast_new(AST_BINOP);
-        binop->op = strndup(op.s, op.len);
-        ast_add(binop, left);
-        ast_add(binop, right);
+        Node binop = ast_node2(AST_BINOP, left, right);
+        ast_set_op(binop, op.t);
         left = binop;
     }
     return left;
 }
 
-AstNode* parse_additive(Parser* p) {
-    AstNode* left = parse_multiplicative(p);
+Node parse_additive(Parser* p) {
+    Node left = parse_multiplicative(p);
     while (check_tok(p, T_PLUS) || check_tok(p, T_MINUS)) {
         Tok op = advance_tok(p);
-        AstNode* right = parse_multiplicative(p);
+        Node right = parse_multiplicative(p);
 
         // Constant folding optimization (O1+)
         if (optimization_level >= 1) {
-            char op_str[2] = {op.s[0], '\0'};
-            AstNode* folded = fold_binary_op(left, right, op_str);
+            Node folded = fold_binary_op(left, right, op.t);
             if (folded) {
                 left = folded;
                 continue;
             }
         }
 
-        AstNode* binop = ast_new(AST_BINOP);
-        binop->op = strndup(op.s, op.len);
-        ast_add(binop, left);
-        ast_add(binop, right);
+        Node binop = ast_node2(AST_BINOP, left, right);
+        ast_set_op(binop, op.t);
         left = binop;
     }
     return left;
 }
 
-AstNode* parse_comparison(Parser* p) {
-    AstNode* left = parse_additive(p);
+Node parse_comparison(Parser* p) {
+    Node left = parse_additive(p);
     while (check_tok(p, T_EQEQ) || check_tok(p, T_NEQ) ||
            check_tok(p, T_LT) || check_tok(p, T_GT) ||
            check_tok(p, T_LTE) || check_tok(p, T_GTE)) {
         Tok op = advance_tok(p);
-        AstNode* right = parse_additive(p);
-        AstNode* cmp = ast_new(AST_COMPARE);
-        cmp->op = strndup(op.s, op.len);
-        ast_add(cmp, left);
-        ast_add(cmp, right);
+        Node right = parse_additive(p);
+        Node cmp = ast_node2(AST_COMPARE, left, right);
+        ast_set_op(cmp, op.t);
         left = cmp;
     }
     return left;
 }
 
-AstNode* parse_logical_and(Parser* p) {
-    AstNode* left = parse_comparison(p);
+Node parse_logical_and(Parser* p) {
+    Node left = parse_comparison(p);
     while (check_tok(p, T_AND_AND)) {
         advance_tok(p);  // consume &&
-        AstNode* right = parse_comparison(p);
-        AstNode* logical = ast_new(AST_LOGICAL);
-        logical->op = strdup("&&");
-        ast_add(logical, left);
-        ast_add(logical, right);
+        Node right = parse_comparison(p);
+        Node logical = ast_node2(AST_LOGICAL, left, right);
+        ast_set_op(logical, T_AND_AND);
         left = logical;
     }
     return left;
 }
 
-AstNode* parse_logical_or(Parser* p) {
-    AstNode* left = parse_logical_and(p);
+Node parse_logical_or(Parser* p) {
+    Node left = parse_logical_and(p);
     while (check_tok(p, T_OR_OR)) {
         advance_tok(p);  // consume ||
-        AstNode* right = parse_logical_and(p);
-        AstNode* logical = ast_new(AST_LOGICAL);
-        logical->op = strdup("||");
-        ast_add(logical, left);
-        ast_add(logical, right);
+        Node right = parse_logical_and(p);
+        Node logical = ast_node2(AST_LOGICAL, left, right);
+        ast_set_op(logical, T_OR_OR);
         left = logical;
     }
     return left;
 }
 
-AstNode* parse_expr(Parser* p) {
+Node parse_expr(Parser* p) {
     return parse_logical_or(p);
 }
 
-AstNode* parse_block(Parser* p);
+Node parse_block(Parser* p);
 
-AstNode* parse_stmt(Parser* p) {
+Node parse_stmt(Parser* p) {
     if (match_tok(p, T_RET)) {
-        AstNode* ret = ast_new(AST_RETURN);
-        if (!check_tok(p, T_SEMI)) ast_add(ret, parse_expr(p));
+        int mark = ast_mark();
+        if (!check_tok(p, T_SEMI)) ast_push(parse_expr(p));
         expect(p, T_SEMI);
-        return ret;
+        return ast_node(AST_RETURN, mark);
     }
     if (match_tok(p, T_LET)) {
         Tok name = advance_tok(p);
-        AstNode* let = ast_new(AST_LET);
-        let->name = strndup(name.s, name.len);
+        Atom let_name = tok_atom(name);
 
         // Optional type annotation: let x: i32 or let arr: [i32; 10] or let ptr: *i32 or let p: Point
-        if (match_tok(p, T_COLON)) {
-            TypeSpec spec = parse_type(p);
+        int typed = match_tok(p, T_COLON);
+        TypeSpec spec = {0};
+        if (typed) spec = parse_type(p);
+
+        int mark = ast_mark();
+        if (match_tok(p, T_EQ)) ast_push(parse_expr(p));
+        expect(p, T_SEMI);
 
+        Node let = ast_node(AST_LET, mark);
+        ast.name[let] = let_name;
+        if (typed) {
             // Store type info in AST node (similar to global vars)
-            let->value = spec.base_type;          // Base type name
-            let->array_size = spec.array_count;   // Array count (0 if not array)
-            let->is_pointer = spec.is_pointer | (spec.is_mutable << 1);  // Pointer flags
-
-            // For arrays, mark as array in struct_type field
-            if (spec.is_array) {
-                let->struct_type = strdup("__array__");  // Marker for array
-            } else if (!spec.is_pointer && spec.base_type) {
+            AstDecl* d = ast_set_decl(let);
+            d->type_name = spec.base_type;      // Base type name
+            d->array_size = spec.array_count;   // Array count (0 if not array)
+            d->is_pointer = spec.is_pointer | (spec.is_mutable << 1);  // Pointer flags
+            d->is_array = spec.is_array;
+
+            if (!spec.is_array && !spec.is_pointer && spec.base_type) {
                 // Check if it's a known struct type (not a primitive)
                 // We'll store the type name and codegen will check if it's a struct
-                let->struct_type = strdup(spec.base_type);  // Store potential struct name
+                d->struct_type = spec.base_type;  // Store potential struct name
             }
         }
-
-        if (match_tok(p, T_EQ)) ast_add(let, parse_expr(p));
-        expect(p, T_SEMI);
         return let;
     }
     if (match_tok(p, T_IF)) {
-        AstNode* ifnode = ast_new(AST_IF);
+        int mark = ast_mark();
         expect(p, T_LPAREN);
-        ast_add(ifnode, parse_expr(p));
+        ast_push(parse_expr(p));
         expect(p, T_RPAREN);
-        ast_add(ifnode, parse_block(p));
-        if (match_tok(p, T_ELSE)) ast_add(ifnode, parse_block(p));
-        return ifnode;
+        ast_push(parse_block(p));
+        if (match_tok(p, T_ELSE)) ast_push(parse_block(p));
+        return ast_node(AST_IF, mark);
     }
     if (match_tok(p, T_WHILE)) {
-        AstNode* whilenode = ast_new(AST_WHILE);
+        int mark = ast_mark();
         expect(p, T_LPAREN);
-        ast_add(whilenode, parse_expr(p));
+        ast_push(parse_expr(p));
         expect(p, T_RPAREN);
-        ast_add(whilenode, parse_block(p));
-        return whilenode;
+        ast_push(parse_block(p));
+        return ast_node(AST_WHILE, mark);
     }
     if (match_tok(p, T_FOR)) {
         // for (init; cond; inc) body → { init; while (cond) { body; inc; } }
         expect(p, T_LPAREN);
 
         // Parse init statement (usually let i = 0)
-        AstNode* init = parse_stmt(p);
+        Node init = parse_stmt(p);
 
         // Parse condition (i < 10)
-        AstNode* cond = parse_expr(p);
+        Node cond = parse_expr(p);
         expect(p, T_SEMI);
 
         // Parse increment (i = i + 1)
-        AstNode* inc = parse_expr(p);
+        Node inc = parse_expr(p);
         expect(p, T_RPAREN);
 
         // Parse body
-        AstNode* body = parse_block(p);
+        Node body = parse_block(p);
 
         // Desugar to: { init; while (cond) { body; inc; } }
-        AstNode* block = ast_new(AST_BLOCK);
-        ast_add(block, init);
-
-        AstNode* whilenode = ast_new(AST_WHILE);
-        ast_add(whilenode, cond);
-
-        // Create new body block with original body + increment
-        AstNode* while_body = ast_new(AST_BLOCK);
-        // Copy all statements from body
-        for (int i = 0; i < body->child_count; i++) {
-            ast_add(while_body, body->children[i]);
+        // New body block with the original statements + increment
+        int mark = ast_mark();
+        for (int i = 0; i < ast.nkids[body]; i++) {
+            ast_push(ast_parse_kid(body, i));
         }
         // Add increment as expression statement
-        AstNode* inc_stmt = ast_new(AST_BLOCK);  // Wrap in statement node
-        ast_add(inc_stmt, inc);
-        ast_add(while_body, inc_stmt);
-
-        ast_add(whilenode, while_body);
-        ast_add(block, whilenode);
+        ast_push(ast_node1(AST_BLOCK, inc));  // Wrap in statement node
+        Node while_body = ast_node(AST_BLOCK, mark);
 
-        return block;
+        Node whilenode = ast_node2(AST_WHILE, cond, while_body);
+        return ast_node2(AST_BLOCK, init, whilenode);
     }
-    AstNode* expr = parse_expr(p);
+    Node expr = parse_expr(p);
 
     // Check for increment/decrement operators: x++ or x--
-    if (expr && expr->type == AST_IDENT) {
-        if (check_tok(p, T_PLUSPLUS)) {
-            advance_tok(p);  // Consume '++'
-            // Desugar: x++ => x = x + 1
-            AstNode* assign = ast_new(AST_ASSIGN);
-            assign->name = strdup(expr->name);
-            AstNode* add = ast_new(AST_BINOP);
-            add->op = strdup("+");
-            AstNode* ident = ast_new(AST_IDENT);
-            ident->name = strdup(expr->name);
-            ast_add(add, ident);
-            AstNode* one = ast_new(AST_NUMBER);
-            one->value = strdup("1");
-            ast_add(add, one);
-            ast_add(assign, add);
-            expect(p, T_SEMI);
-            return assign;
-        }
-        if (check_tok(p, T_MINUSMINUS)) {
-            advance_tok(p);  // Consume '--'
-            // Desugar: x-- => x = x - 1
-            AstNode* assign = ast_new(AST_ASSIGN);
-            assign->name = strdup(expr->name);
-            AstNode* sub = ast_new(AST_BINOP);
-            sub->op = strdup("-");
-            AstNode* ident = ast_new(AST_IDENT);
-            ident->name = strdup(expr->name);
-            ast_add(sub, ident);
-            AstNode* one = ast_new(AST_NUMBER);
-            one->value = strdup("1");
-            ast_add(sub, one);
-            ast_add(assign, sub);
+    if (expr && ast.kind[expr] == AST_IDENT) {
+        if (check_tok(p, T_PLUSPLUS) || check_tok(p, T_MINUSMINUS)) {
+            // Desugar: x++ => x = x + 1, x-- => x = x - 1
+            TokType op = advance_tok(p).t == T_PLUSPLUS ? T_PLUS : T_MINUS;
+            Node ident = ast_leaf(AST_IDENT);
+            ast.name[ident] = ast.name[expr];
+            Node one = ast_literal(AST_NUMBER, (SrcSlice){ 0, 0 }, 1);
+            Node binop = ast_node2(AST_BINOP, ident, one);
+            ast_set_op(binop, op);
+            Node assign = ast_node1(AST_ASSIGN, binop);
+            ast.name[assign] = ast.name[expr];
             expect(p, T_SEMI);
             return assign;
         }
@@ -1079,54 +2426,51 @@ AstNode* parse_stmt(Parser* p) {
         if (check_tok(p, T_PLUSEQ) || check_tok(p, T_MINUSEQ) ||
             check_tok(p, T_STAREQ) || check_tok(p, T_SLASHEQ) || check_tok(p, T_MODEQ)) {
 
-            char* op = NULL;
-            if (check_tok(p, T_PLUSEQ)) { op = "+"; }
-            else if (check_tok(p, T_MINUSEQ)) { op = "-"; }
-            else if (check_tok(p, T_STAREQ)) { op = "*"; }
-            else if (check_tok(p, T_SLASHEQ)) { op = "/"; }
-            else if (check_tok(p, T_MODEQ)) { op = "%"; }
+            TokType op = T_EOF;
+            if (check_tok(p, T_PLUSEQ)) { op = T_PLUS; }
+            else if (check_tok(p, T_MINUSEQ)) { op = T_MINUS; }
+            else if (check_tok(p, T_STAREQ)) { op = T_STAR; }
+            else if (check_tok(p, T_SLASHEQ)) { op = T_SLASH; }
+            else if (check_tok(p, T_MODEQ)) { op = T_MOD; }
 
             advance_tok(p);  // Consume compound assignment operator
 
             // Desugar: x += expr => x = x + expr
-            AstNode* assign = ast_new(AST_ASSIGN);
-            assign->name = strdup(expr->name);
-            AstNode* binop = ast_new(AST_BINOP);
-            binop->op = strdup(op);
-            AstNode* ident = ast_new(AST_IDENT);
-            ident->name = strdup(expr->name);
-            ast_add(binop, ident);
-            ast_add(binop, parse_expr(p));  // Right-hand side
-            ast_add(assign, binop);
+            Node ident = ast_leaf(AST_IDENT);
+            ast.name[ident] = ast.name[expr];
+            Node rhs = parse_expr(p);  // Right-hand side
+            Node binop = ast_node2(AST_BINOP, ident, rhs);
+            ast_set_op(binop, op);
+            Node assign = ast_node1(AST_ASSIGN, binop);
+            ast.name[assign] = ast.name[expr];
             expect(p, T_SEMI);
             return assign;
         }
     }
 
     // Check for array assignment: array[index] = value
-    if (expr && expr->type == AST_INDEX && check_tok(p, T_EQ)) {
+    if (expr && ast.kind[expr] == AST_INDEX && check_tok(p, T_EQ)) {
         advance_tok(p);  // Consume '='
-        AstNode* array_assign = ast_new(AST_ARRAY_ASSIGN);
         // children[0] = array base (from INDEX)
         // children[1] = index expression (from INDEX)
         // children[2] = value expression
-        ast_add(array_assign, expr->children[0]);  // array
-        ast_add(array_assign, expr->children[1]);  // index
-        ast_add(array_assign, parse_expr(p));      // value
+        int mark = ast_mark();
+        ast_push(ast_parse_kid(expr, 0));  // array
+        ast_push(ast_parse_kid(expr, 1));  // index
+        ast_push(parse_expr(p));           // value
         expect(p, T_SEMI);
-        return array_assign;
+        return ast_node(AST_ARRAY_ASSIGN, mark);
     }
 
     // Check for field assignment: struct.field = value
-    if (expr && expr->type == AST_FIELD_ACCESS && check_tok(p, T_EQ)) {
+    if (expr && ast.kind[expr] == AST_FIELD_ACCESS && check_tok(p, T_EQ)) {
         advance_tok(p);  // Consume '='
-        AstNode* field_assign = ast_new(AST_FIELD_ASSIGN);
         // name = field name
         // children[0] = struct object
         // children[1] = value expression
-        field_assign->name = strdup(expr->name);   // Field name
-        ast_add(field_assign, expr->children[0]);  // Struct object
-        ast_add(field_assign, parse_expr(p));      // Value expression
+        Node value = parse_expr(p);
+        Node field_assign = ast_node2(AST_FIELD_ASSIGN, ast_parse_kid(expr, 0), value);
+        ast.name[field_assign] = ast.name[expr];  // Field name
         expect(p, T_SEMI);
         return field_assign;
     }
@@ -1135,21 +2479,21 @@ AstNode* parse_stmt(Parser* p) {
     return expr;
 }
 
-AstNode* parse_block(Parser* p) {
+Node parse_block(Parser* p) {
     expect(p, T_LBRACE);
-    AstNode* block = ast_new(AST_BLOCK);
+    int mark = ast_mark();
     while (!check_tok(p, T_RBRACE) && !check_tok(p, T_EOF)) {
-        ast_add(block, parse_stmt(p));
+        ast_push(parse_stmt(p));
     }
     expect(p, T_RBRACE);
-    return block;
+    return ast_node(AST_BLOCK, mark);
 }
 
-AstNode* parse_struct_def(Parser* p) {
+Node parse_struct_def(Parser* p) {
     expect(p, T_STRUCT);
     Tok name = advance_tok(p);
-    AstNode* struct_def = ast_new(AST_STRUCT_DEF);
-    struct_def->name = strndup(name.s, name.len);
+    Atom struct_name = tok_atom(name);
+    int mark = ast_mark();
 
     expect(p, T_LBRACE);
     while (!check_tok(p, T_RBRACE)) {
@@ -1159,16 +2503,19 @@ AstNode* parse_struct_def(Parser* p) {
         // Parse field type (handles i32, *i8, [i32; 10], etc.)
         TypeSpec field_type = parse_type(p);
 
-        AstNode* field = ast_new(AST_IDENT);
-        field->name = strndup(field_name.s, field_name.len);
-        field->value = field_type.base_type;      // Store type name
-        field->is_pointer = field_type.is_pointer;  // Store if it's a pointer
-        ast_add(struct_def, field);
+        Node field = ast_leaf(AST_IDENT);
+        ast.name[field] = tok_atom(field_name);
+        AstDecl* d = ast_set_decl(field);
+        d->type_name = field_type.base_type;  // Store type name
+        d->is_pointer = field_type.is_pointer;  // Store if it's a pointer
+        ast_push(field);
 
         if (!check_tok(p, T_RBRACE)) expect(p, T_COMMA);
     }
     expect(p, T_RBRACE);
 
+    Node struct_def = ast_node(AST_STRUCT_DEF, mark);
+    ast.name[struct_def] = struct_name;
     return struct_def;
 }
 
@@ -1189,7 +2536,7 @@ TypeSpec parse_type(Parser* p) {
 
         // Get pointee type
         Tok type = advance_tok(p);
-        spec.base_type = strndup(type.s, type.len);
+        spec.base_type = tok_atom(type);
         return spec;
     }
 
@@ -1200,13 +2547,13 @@ TypeSpec parse_type(Parser* p) {
 
         // Get element type
         Tok elem_type = advance_tok(p);
-        spec.base_type = strndup(elem_type.s, elem_type.len);
+        spec.base_type = tok_atom(elem_type);
 
         expect(p, T_SEMI);
 
         // Get array count
         Tok count = advance_tok(p);
-        spec.array_count = atoi(count.s);
+        spec.array_count = atoi(tok_text(count));
 
         expect(p, T_RBRACKET);
         return spec;
@@ -1214,1770 +2561,8446 @@ TypeSpec parse_type(Parser* p) {
 
     // Basic type or struct name (i32, i64, Point, Vector, etc.)
     Tok type = advance_tok(p);
-    spec.base_type = strndup(type.s, type.len);
+    spec.base_type = tok_atom(type);
     return spec;
 }
 
-AstNode* parse_global_var(Parser* p) {
-    expect(p, T_LET);
+// let NAME[: type] [= value]; or const NAME[: type] = value; (a global that
+// cannot be assigned, with a value known at compile time)
+Node parse_global_var(Parser* p) {
+    int is_const = match_tok(p, T_CONST);
+    if (!is_const) expect(p, T_LET);
     Tok name = advance_tok(p);
-
-    AstNode* global_var = ast_new(AST_GLOBAL_VAR);
-    global_var->name = strndup(name.s, name.len);
+    Atom var_name = tok_atom(name);
 
     // Optional type annotation: let x: i32 = ... or let arr: [i32; 10];
-    if (match_tok(p, T_COLON)) {
-        TypeSpec spec = parse_type(p);
-
-        // Store type info in AST node (creative use of fields)
-        global_var->value = spec.base_type;          // Base type
-        global_var->array_size = spec.array_count;   // Array count
-        global_var->is_pointer = spec.is_pointer | (spec.is_mutable << 1);  // Flags
-        // Note: is_pointer bit 0 = is_pointer, bit 1 = is_mutable
-
-        // For arrays, mark as array in struct_type field
-        if (spec.is_array) {
-            global_var->struct_type = strdup("__array__");  // Marker for array
-        }
-    }
+    int typed = match_tok(p, T_COLON);
+    TypeSpec spec = {0};
+    if (typed) spec = parse_type(p);
 
     // Initialization value (optional for arrays)
+    int mark = ast_mark();
+    Node init = 0;
     if (match_tok(p, T_EQ)) {
-        ast_add(global_var, parse_expr(p));
+        init = parse_expr(p);
+        long v;
+        if (is_const && ast.kind[init] != AST_NUMBER && const_eval(init, &v))
+            init = ast_literal(AST_NUMBER, (SrcSlice){ 0, 0 }, v);
+        ast_push(init);
+    }
+    if (is_const && (!init || ast.kind[init] != AST_NUMBER)) {
+        int line, col;
+        src_line_col(name.off, &line, &col);
+        fprintf(stderr, "Parse error at line %d, col %d: const '%s' needs a constant value\n",
+                line, col, atom_str(var_name));
+        exit(1);
     }
-
     expect(p, T_SEMI);
+
+    Node global_var = ast_node(AST_GLOBAL_VAR, mark);
+    ast.name[global_var] = var_name;
+    if (is_const) ast_set_decl(global_var)->is_const = 1;
+    if (typed) {
+        AstDecl* d = ast_set_decl(global_var);
+        d->type_name = spec.base_type;      // Base type
+        d->array_size = spec.array_count;   // Array count
+        d->is_pointer = spec.is_pointer | (spec.is_mutable << 1);  // Flags
+        // Note: is_pointer bit 0 = is_pointer, bit 1 = is_mutable
+        d->is_array = spec.is_array;
+    }
     return global_var;
 }
 
-AstNode* parse_func(Parser* p) {
+Node parse_func(Parser* p) {
     expect(p, T_FN);
     Tok name = advance_tok(p);
-    AstNode* func = ast_new(AST_FUNCTION);
-    func->name = strndup(name.s, name.len);
+    Atom func_name = tok_atom(name);
+    int mark = ast_mark();
 
     expect(p, T_LPAREN);
     while (!check_tok(p, T_RPAREN)) {
         Tok param = advance_tok(p);
-        AstNode* par = ast_new(AST_IDENT);
-        par->name = strndup(param.s, param.len);
-        ast_add(func, par);
+        Node par = ast_leaf(AST_IDENT);
+        ast.name[par] = tok_atom(param);
+        ast_push(par);
         if (match_tok(p, T_COLON)) {
             // Handle pointer types: *Type
-            if (match_tok(p, T_STAR)) {
-                par->is_pointer = 1;
-                Tok type_tok = advance_tok(p);  // Get base type
-                par->value = strndup(type_tok.s, type_tok.len);  // Save type name
-            } else {
-                Tok type_tok = advance_tok(p);  // Get type
-                par->value = strndup(type_tok.s, type_tok.len);  // Save type name
-            }
+            int is_pointer = match_tok(p, T_STAR);
+            Tok type_tok = advance_tok(p);  // Get (base) type
+            AstDecl* d = ast_set_decl(par);
+            d->is_pointer = is_pointer;
+            d->type_name = tok_atom(type_tok);  // Save type name
         }
         if (!check_tok(p, T_RPAREN)) expect(p, T_COMMA);
     }
     expect(p, T_RPAREN);
 
-    if (match_tok(p, T_ARROW)) advance_tok(p);
+    Atom ret_type = match_tok(p, T_ARROW) ? tok_atom(advance_tok(p)) : ATOM_NONE;
 
     // Check if this is a forward declaration (ends with ;) or full definition (has body)
-    if (check_tok(p, T_SEMI)) {
+    int is_forward_decl = check_tok(p, T_SEMI);
+    if (is_forward_decl) {
         // Forward declaration
         expect(p, T_SEMI);
-        func->is_forward_decl = 1;
         // Add empty block as placeholder
-        ast_add(func, ast_new(AST_BLOCK));
+        ast_push(ast_leaf(AST_BLOCK));
     } else {
         // Full function definition
-        ast_add(func, parse_block(p));
+        ast_push(parse_block(p));
+    }
+    Node func = ast_node(AST_FUNCTION, mark);
+    ast.name[func] = func_name;
+    if (is_forward_decl || ret_type) {
+        AstDecl* d = ast_set_decl(func);
+        d->type_name = ret_type;  // Only written to module interfaces
+        d->is_forward_decl = is_forward_decl;
     }
     return func;
 }
 
-AstNode* parse(Parser* p) {
-    AstNode* prog = ast_new(AST_PROGRAM);
+ImportList parsed_imports;
+
+// import "name";  (no node: the module's interface is loaded after parsing)
+void parse_import(Parser* p) {
+    advance_tok(p);
+    Tok name = peek_tok(p);
+    expect(p, T_STR);
+    expect(p, T_SEMI);
+    ImportList* l = &parsed_imports;
+    if (l->count == l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 8;
+        l->names = safe_realloc(l->names, sizeof(SrcSlice) * l->cap);
+    }
+    l->names[l->count++] = (SrcSlice){ name.off + 1, name.len - 2 };
+}
+
+// Parse top-level items up to the end of the input onto the AST stack
+void parse_items(Parser* p) {
     while (!check_tok(p, T_EOF)) {
-        if (check_tok(p, T_STRUCT)) {
-            ast_add(prog, parse_struct_def(p));
-        } else if (check_tok(p, T_LET)) {
-            ast_add(prog, parse_global_var(p));
+        Tok t = peek_tok(p);
+        if (t.t == T_IDENT && t.len == 6 && !memcmp(tok_text(t), "import", 6)) {
+            parse_import(p);
+        } else if (check_tok(p, T_STRUCT)) {
+            ast_push(parse_struct_def(p));
+        } else if (check_tok(p, T_LET) || check_tok(p, T_CONST)) {
+            ast_push(parse_global_var(p));
         } else {
-            ast_add(prog, parse_func(p));
+            ast_push(parse_func(p));
         }
     }
-    return prog;
 }
 
-// ==== CODEGEN ====
-void emit(Codegen* cg, const char* fmt, ...) {
-    va_list args;
-    va_start(args, fmt);
+// Parse the whole program and lay the tree out for codegen
+Node parse(Parser* p) {
+    int mark = ast_mark();
+    parse_items(p);
+    return ast_finish(ast_node(AST_PROGRAM, mark));
+}
 
-    va_list args_copy;
-    va_copy(args_copy, args);
-    int needed = vsnprintf(NULL, 0, fmt, args_copy);
-    va_end(args_copy);
+// ==== CODEGEN CACHE ====
+// --cache-dir: the text of each generated function is kept on disk, keyed
+// by a hash of everything gen_func reads for it: the function's nodes
+// (kinds, names, literals, operators, declarations), the label of each
+// string it uses, and the signature of every global and the layout of every
+// struct its names can refer to. The key also covers the compiler binary and
+// -O level. Unchanged functions are copied from the cache, the others are
+// generated, and the file is rewritten with this compile's functions only.
+// One cache file per source file, mapped on load and written whole. Each
+// entry carries a hash of its text; one that does not match is generated
+// again, and text that fails to assemble drops the file (see cache_fork).
+#define CACHE_MAGIC "CHRCGC2"
 
-    while (cg->code_len + needed + 1 > cg->code_cap) {
-        cg->code_cap = cg->code_cap ? cg->code_cap * 2 : 4096;
-        cg->code_buf = safe_realloc(cg->code_buf, cg->code_cap);
-    }
+typedef struct {
+    uint64_t key;
+    uint32_t off, len;   // Text in `data`
+    uint32_t flags;      // CACHE_BOUNDS: jumps to __bounds_fail
+    uint64_t check;      // hash_text of the text
+} CacheEntry;
 
-    vsnprintf(cg->code_buf + cg->code_len, needed + 1, fmt, args);
-    cg->code_len += needed;
+enum { CACHE_BOUNDS = 1 };
 
-    va_end(args);
+typedef struct {
+    char* data;          // The whole file, mapped
+    size_t size;
+    CacheEntry* entries;
+    int count;
+    int* slots;          // Hash slots by key: entry index + 1 (0 = empty)
+    int slot_cap;
+    uint64_t salt;       // Build and options part of every key
+    struct AtomKey* atom_keys;  // Per atom, filled as keys are computed
+    uint64_t* struct_keys;      // Per struct type: own layout (0 = not yet)
+    int* seen;                  // Per struct type: last function that hashed it
+    int stamp;
+} CodegenCache;
+
+const char* codegen_cache_path = NULL;  // Set from --cache-dir
+CodegenCache codegen_cache;
+
+FILE* output_open(const char* path, char** tmp);
+void output_commit(FILE* f, char* tmp, const char* path, int mode);
+double cpu_sec();
+extern double phase_cpu0;
+
+uint64_t hash_u64(uint64_t h, uint64_t v) {
+    h = (h ^ v) * 0x9e3779b97f4a7c15ull;
+    return h ^ (h >> 32);
 }
 
-int new_label(Codegen* cg) { return cg->label_count++; }
+uint64_t hash_bytes(uint64_t h, const char* s, int len) {
+    uint64_t f = 14695981039346656037ull;  // FNV-1a
+    for (int i = 0; i < len; i++) f = (f ^ (unsigned char)s[i]) * 1099511628211ull;
+    return hash_u64(h, f ^ (uint64_t)len);
+}
 
-void gen_expr(Codegen* cg, AstNode* n);
+uint64_t hash_atom(uint64_t h, Atom a) { return hash_bytes(h, atom_tab[a].str, atom_tab[a].len); }
 
-// Helper: Generate builtin function calls
-void gen_builtin_call(Codegen* cg, AstNode* n) {
-    if (!strcmp(n->name, "print")) {
-        if (n->child_count > 0) {
-            gen_expr(cg, n->children[0]);
-            emit(cg, "    mov rsi, rax\n    mov rdx, rbx\n");
-            emit(cg, "    mov rdi, 1\n    mov rax, 1\n    syscall\n");
-        }
-    } else if (!strcmp(n->name, "println")) {
-        if (n->child_count > 0) {
-            gen_expr(cg, n->children[0]);
-            emit(cg, "    mov rsi, rax\n    mov rdx, rbx\n");
-            emit(cg, "    mov rdi, 1\n    mov rax, 1\n    syscall\n");
-        }
-        emit(cg, "    mov byte [rbp-256], 10\n");
-        emit(cg, "    lea rsi, [rbp-256]\n");
-        emit(cg, "    mov rdi, 1\n    mov rdx, 1\n    mov rax, 1\n    syscall\n");
-    } else if (!strcmp(n->name, "print_int")) {
-        if (n->child_count > 0) {
-            gen_expr(cg, n->children[0]);
-            emit(cg, "    call __print_int\n");
-        }
-    } else if (!strcmp(n->name, "exit")) {
-        if (n->child_count > 0) {
-            gen_expr(cg, n->children[0]);
-            emit(cg, "    mov rdi, rax\n");
-        } else {
-            emit(cg, "    xor rdi, rdi\n");
-        }
-        emit(cg, "    mov rax, 60\n    syscall\n");
-    } else if (!strcmp(n->name, "strcmp")) {
-        if (n->child_count >= 2) {
-            gen_expr(cg, n->children[0]);
-            emit(cg, "    push rax\n");
-            gen_expr(cg, n->children[1]);
-            emit(cg, "    mov rsi, rax\n");
-            emit(cg, "    pop rdi\n");
-            emit(cg, "    call __strcmp\n");
-        }
-    } else if (!strcmp(n->name, "strcpy")) {
-        if (n->child_count >= 2) {
-            gen_expr(cg, n->children[0]);
-            emit(cg, "    push rax\n");
-            gen_expr(cg, n->children[1]);
-            emit(cg, "    mov rsi, rax\n");
-            emit(cg, "    pop rdi\n");
-            emit(cg, "    call __strcpy\n");
-        }
-    } else if (!strcmp(n->name, "strlen")) {
-        if (n->child_count >= 1) {
-            gen_expr(cg, n->children[0]);
-            emit(cg, "    mov rdi, rax\n");
-            emit(cg, "    call __strlen\n");
-        }
-    } else if (!strcmp(n->name, "open")) {
-        // open(filename, flags, mode) -> fd
-        // syscall 2: rax=2, rdi=filename, rsi=flags, rdx=mode
-        if (n->child_count >= 2) {
-            gen_expr(cg, n->children[0]);  // filename
-            emit(cg, "    mov rdi, rax\n");
-            gen_expr(cg, n->children[1]);  // flags
-            emit(cg, "    mov rsi, rax\n");
-            if (n->child_count >= 3) {
-                gen_expr(cg, n->children[2]);  // mode (optional)
-                emit(cg, "    mov rdx, rax\n");
-            } else {
-                emit(cg, "    mov rdx, 0644\n");  // Default permissions
-            }
-            emit(cg, "    mov rax, 2\n");  // sys_open
-            emit(cg, "    syscall\n");
-        }
-    } else if (!strcmp(n->name, "read")) {
-        // read(fd, buffer, count) -> bytes_read
-        // syscall 0: rax=0, rdi=fd, rsi=buffer, rdx=count
-        if (n->child_count >= 3) {
-            gen_expr(cg, n->children[0]);  // fd
-            emit(cg, "    mov rdi, rax\n");
-            gen_expr(cg, n->children[1]);  // buffer
-            emit(cg, "    mov rsi, rax\n");
-            gen_expr(cg, n->children[2]);  // count
-            emit(cg, "    mov rdx, rax\n");
-            emit(cg, "    mov rax, 0\n");  // sys_read
-            emit(cg, "    syscall\n");
-        }
-    } else if (!strcmp(n->name, "write")) {
-        // write(fd, buffer, count) -> bytes_written
-        // syscall 1: rax=1, rdi=fd, rsi=buffer, rdx=count
-        if (n->child_count >= 3) {
-            gen_expr(cg, n->children[0]);  // fd
-            emit(cg, "    mov rdi, rax\n");
-            gen_expr(cg, n->children[1]);  // buffer
-            emit(cg, "    mov rsi, rax\n");
-            gen_expr(cg, n->children[2]);  // count
-            emit(cg, "    mov rdx, rax\n");
-            emit(cg, "    mov rax, 1\n");  // sys_write
-            emit(cg, "    syscall\n");
-        }
-    } else if (!strcmp(n->name, "close")) {
-        // close(fd) -> status
-        // syscall 3: rax=3, rdi=fd
-        if (n->child_count >= 1) {
-            gen_expr(cg, n->children[0]);  // fd
-            emit(cg, "    mov rdi, rax\n");
-            emit(cg, "    mov rax, 3\n");  // sys_close
-            emit(cg, "    syscall\n");
-        }
-    } else if (!strcmp(n->name, "malloc")) {
-        // malloc(size) -> pointer
-        // Uses mmap syscall (9) with size tracking header
-        // Layout: [8 bytes size][allocated memory]
-        // Returns pointer to allocated memory (after header)
-        if (n->child_count >= 1) {
-            gen_expr(cg, n->children[0]);  // size requested by user
-            emit(cg, "    mov r12, rax\n");  // Save original size in r12
-            emit(cg, "    add rax, 8\n");    // Add 8 bytes for size header
-            emit(cg, "    mov rsi, rax\n");  // length = size + 8
-            emit(cg, "    xor rdi, rdi\n");  // addr = 0 (let kernel choose)
-            emit(cg, "    mov rdx, 3\n");    // prot = PROT_READ | PROT_WRITE
-            emit(cg, "    mov r10, 34\n");   // flags = MAP_PRIVATE | MAP_ANONYMOUS (0x22)
-            emit(cg, "    mov r8, -1\n");    // fd = -1
-            emit(cg, "    xor r9, r9\n");    // offset = 0
-            emit(cg, "    mov rax, 9\n");    // sys_mmap
-            emit(cg, "    syscall\n");
-            // Check if mmap failed (returns -1)
-            emit(cg, "    cmp rax, -1\n");
-            emit(cg, "    je .Lmalloc_failed_%d\n", new_label(cg));
-            // Store size in header
-            emit(cg, "    mov [rax], r12\n");  // Store original size in first 8 bytes
-            emit(cg, "    add rax, 8\n");      // Return pointer after header
-            emit(cg, ".Lmalloc_failed_%d:\n", cg->label_count - 1);
-            // Returns pointer in rax (ptr+8, or -1 on error which stays -1)
-        }
-    } else if (!strcmp(n->name, "free")) {
-        // free(ptr) -> status
-        // Uses munmap syscall (11): munmap(addr, length)
-        // Reads size from header at (ptr - 8)
-        if (n->child_count >= 1) {
-            gen_expr(cg, n->children[0]);  // ptr (user pointer)
-            emit(cg, "    ; free(ptr) - read size from header and munmap\n");
-            emit(cg, "    test rax, rax\n");  // Check if ptr is NULL
-            emit(cg, "    jz .Lfree_null_%d\n", new_label(cg));
-            emit(cg, "    mov rdi, rax\n");   // Save user pointer
-            emit(cg, "    sub rdi, 8\n");     // rdi = actual allocation start (header)
-            emit(cg, "    mov rsi, [rdi]\n"); // Load size from header
-            emit(cg, "    add rsi, 8\n");     // Add header size to get total allocation
-            emit(cg, "    mov rax, 11\n");    // sys_munmap
-            emit(cg, "    syscall\n");
-            // Returns 0 on success, -1 on error
-            emit(cg, "    jmp .Lfree_done_%d\n", cg->label_count - 1);
-            emit(cg, ".Lfree_null_%d:\n", cg->label_count - 1);
-            emit(cg, "    xor rax, rax\n");   // free(NULL) returns 0
-            emit(cg, ".Lfree_done_%d:\n", cg->label_count - 1);
-        }
-    } else if (!strcmp(n->name, "syscall") || !strcmp(n->name, "syscall6")) {
-        // Generic syscall: syscall6(num, arg1, arg2, arg3, arg4, arg5, arg6)
-        // This allows Chronos code to make ANY syscall directly
-        // rax=num, rdi=arg1, rsi=arg2, rdx=arg3, r10=arg4, r8=arg5, r9=arg6
-
-        if (n->child_count >= 1) {
-            // First, evaluate all arguments and push them to stack
-            // We need to do this in reverse order to pop them correctly
-            const char* regs[] = {"rdi", "rsi", "rdx", "r10", "r8", "r9"};
-
-            // Push all arguments
-            for (int i = 1; i < n->child_count && i <= 6; i++) {
-                gen_expr(cg, n->children[i]);
-                emit(cg, "    push rax\n");
-            }
-
-            // Pop arguments into registers (reverse order)
-            for (int i = (n->child_count - 1 < 6 ? n->child_count - 1 : 6); i >= 1; i--) {
-                emit(cg, "    pop %s\n", regs[i-1]);
-            }
-
-            // Syscall number in rax
-            gen_expr(cg, n->children[0]);  // syscall number
-            emit(cg, "    syscall\n");
-            // Result already in rax
-        }
+// Eight bytes a step, for whole files and function texts
+uint64_t hash_text(uint64_t h, const char* s, size_t len) {
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, s + i, 8);
+        h = hash_u64(h, w);
+    }
+    uint64_t w = 0;
+    memcpy(&w, s + i, len - i);
+    return hash_u64(hash_u64(h, w), len);
+}
+
+// Hash of the running compiler binary, so a rebuilt compiler never reuses
+// text from another build; the build time stands in if it cannot be read
+uint64_t cache_build_hash() {
+    static uint64_t built;
+    if (built) return built;
+    uint64_t h = hash_bytes(0, CACHE_MAGIC, sizeof(CACHE_MAGIC) - 1);
+    SourceFile exe;
+    if (source_open(&exe, "/proc/self/exe") < 0) {
+        h = hash_bytes(h, __DATE__ __TIME__, sizeof(__DATE__ __TIME__) - 1);
     } else {
-        // Regular function call
-        const char* regs[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
-        for (int i = 0; i < n->child_count && i < 6; i++) {
-            gen_expr(cg, n->children[i]);
-            emit(cg, "    mov %s, rax\n", regs[i]);
-        }
-        emit(cg, "    call %s\n", n->name);
+        h = hash_text(h, exe.text, exe.size);
+        source_close(&exe);
     }
+    return built = h | 1;
 }
 
-// Helper: Generate address-of operator (&)
-void gen_addr_of(Codegen* cg, AstNode* n) {
-    if (!n->children || n->child_count == 0) return;
-    AstNode* var = n->children[0];
-    if (!var) return;
+// "<dir>/<file name>-<hash of the full path>.cgc"
+char* cache_path_for(const char* dir, const char* src_path) {
+    if (mkdir(dir, 0777) && errno != EEXIST) {
+        fprintf(stderr, "Error: cannot create cache directory %s: %s\n", dir, strerror(errno));
+        exit(1);
+    }
+    char full[PATH_MAX];
+    if (!realpath(src_path, full)) snprintf(full, sizeof(full), "%s", src_path);
+    const char* base = strrchr(full, '/');
+    base = base ? base + 1 : full;
+    char* path = safe_realloc(NULL, strlen(dir) + strlen(base) + 32);
+    sprintf(path, "%s/%s-%016llx.cgc", dir, base, (unsigned long long)hash_bytes(0, full, strlen(full)));
+    return path;
+}
 
-    if (var->type == AST_IDENT) {
-        int off = symtab_lookup(cg->symtab, var->name);
-        if (off) {
-            // Check if this is already a pointer - if so, just load the value
-            Symbol* sym = symtab_lookup_symbol(cg->symtab, var->name);
-            if (sym && sym->is_pointer) {
-                // Variable is already a pointer - just load it
-                emit(cg, "    mov rax, [rbp%d]\n", off);
-            } else {
-                // Regular variable - take its address
-                emit(cg, "    lea rax, [rbp%d]\n", off);
-            }
+// ---- Up-to-date outputs ----
+// After a compile with --cache-dir has written its output, a stamp next to
+// the cache file lists the files the compile read and wrote (the source,
+// the interfaces and objects of imported modules, the output and its
+// interface) with a hash of each one's device, inode, size, mode and
+// change times, under a key of the compiler build, working directory and
+// command line. A compile whose key and files all still match has nothing
+// to do, and returns before reading its source.
+#define STAMP_MAGIC "CHRSTP1\n"
+
+typedef struct {
+    const char** paths;
+    uint64_t* states;
+    int count, cap;
+} CacheStamp;
+
+// 0 if the file cannot be stat'ed or is not a regular file
+uint64_t cache_file_state(const char* path) {
+    struct stat st;
+    if (stat(path, &st) || !S_ISREG(st.st_mode)) return 0;
+    uint64_t h = hash_u64(hash_u64(0, st.st_dev), st.st_ino);
+    h = hash_u64(hash_u64(h, st.st_size), st.st_mode);
+    h = hash_u64(hash_u64(h, st.st_mtim.tv_sec), st.st_mtim.tv_nsec);
+    h = hash_u64(hash_u64(h, st.st_ctim.tv_sec), st.st_ctim.tv_nsec);
+    return h | 1;
+}
+
+// Options that only change what is reported or how fast are left out
+uint64_t cache_stamp_key(int argc, char** argv) {
+    char cwd[PATH_MAX];
+    uint64_t h = hash_bytes(cache_build_hash(), STAMP_MAGIC, 8);
+    if (getcwd(cwd, sizeof(cwd))) h = hash_bytes(h, cwd, strlen(cwd));
+    for (int i = 1; i < argc; i++) {
+        if (!strncmp(argv[i], "-ftime-report", 13) || !strcmp(argv[i], "--symtab-stats")) continue;
+        if (!strncmp(argv[i], "-j", 2)) {
+            if (!argv[i][2]) i++;
+            continue;
         }
-    } else if (var->type == AST_INDEX) {
-        // &array[index] - compute address of element
-        if (!var->children || var->child_count < 2) return;
-        AstNode* arr = var->children[0];
-        if (!arr || !arr->name) return;
+        h = hash_bytes(h, argv[i], strlen(argv[i]) + 1);
+    }
+    return h;
+}
 
-        Symbol* sym = symtab_lookup_symbol(cg->symtab, arr->name);
-        if (sym) {
-            gen_expr(cg, var->children[1]);  // Index expression
+// Record `path` as it is now, or with `state` if that is nonzero; returns
+// 0 if it is not a regular file (then the compile gets no stamp)
+int cache_stamp_add(CacheStamp* st, const char* path, uint64_t state) {
+    if (!state) state = cache_file_state(path);
+    if (st->count == st->cap) {
+        st->cap = st->cap ? st->cap * 2 : 8;
+        st->paths = safe_realloc(st->paths, sizeof(char*) * st->cap);
+        st->states = safe_realloc(st->states, sizeof(uint64_t) * st->cap);
+    }
+    st->paths[st->count] = path;
+    st->states[st->count++] = state;
+    return state != 0;
+}
 
-            // Bounds checking for address-of
-            if (sym->size > 0) {
-                int array_count = sym->size / 8;
-                int ok_label = new_label(cg);
-
-                emit(cg, "    test rax, rax\n");
-                emit(cg, "    js .Lbounds_error_%d\n", ok_label);
-                emit(cg, "    cmp rax, %d\n", array_count);
-                emit(cg, "    jge .Lbounds_error_%d\n", ok_label);
-                emit(cg, "    jmp .Lbounds_ok_%d\n", ok_label);
-
-                emit(cg, ".Lbounds_error_%d:\n", ok_label);
-                char* err_msg = strtab_add(cg->strtab, "Array bounds error\\n", 19);
-                emit(cg, "    mov rsi, %s\n", err_msg);
-                emit(cg, "    mov rdx, 19\n");
-                emit(cg, "    mov rdi, 2\n");
-                emit(cg, "    mov rax, 1\n");
-                emit(cg, "    syscall\n");
-                emit(cg, "    mov rdi, 1\n");
-                emit(cg, "    mov rax, 60\n");
-                emit(cg, "    syscall\n");
-
-                emit(cg, ".Lbounds_ok_%d:\n", ok_label);
-            }
+// "<cache file>.stamp"
+char* cache_stamp_path(const char* cache_path) {
+    char* path = safe_realloc(NULL, strlen(cache_path) + 8);
+    sprintf(path, "%s.stamp", cache_path);
+    return path;
+}
 
-            // Calculate address: rbp + offset + (index * 8)
-            emit(cg, "    imul rax, 8\n");
-            emit(cg, "    lea rbx, [rbp%d]\n", sym->offset);
-            emit(cg, "    add rax, rbx\n");
-        }
+// Whether the stamp at `path` has `key` and all its files are unchanged
+int cache_stamp_fresh(const char* path, uint64_t key) {
+    SourceFile f;
+    if (source_open(&f, path) < 0) return 0;
+    const char* p = f.text;
+    const char* end = f.text + f.size;
+    uint64_t k;
+    uint32_t n;
+    int fresh = f.size >= 20 && !memcmp(p, STAMP_MAGIC, 8);
+    if (fresh) {
+        memcpy(&k, p + 8, 8);
+        memcpy(&n, p + 16, 4);
+        p += 20;
+        fresh = k == key && n > 0;
+    }
+    for (uint32_t i = 0; fresh && i < n; i++) {
+        uint64_t state;
+        uint32_t len;
+        if (end - p < 12) { fresh = 0; break; }
+        memcpy(&state, p, 8);
+        memcpy(&len, p + 8, 4);
+        p += 12;
+        if ((size_t)(end - p) <= len || p[len]) { fresh = 0; break; }
+        fresh = cache_file_state(p) == state;
+        p += len + 1;
     }
+    source_close(&f);
+    return fresh;
 }
 
-// Helper: Generate array indexing with bounds checking
-void gen_array_index(Codegen* cg, AstNode* n) {
-    AstNode* arr = n->children[0];
+void cache_stamp_write(const char* path, uint64_t key, CacheStamp* st) {
+    char* tmp;
+    FILE* f = output_open(path, &tmp);
+    uint32_t n = st->count;
+    fwrite(STAMP_MAGIC, 1, 8, f);
+    fwrite(&key, 8, 1, f);
+    fwrite(&n, 4, 1, f);
+    for (int i = 0; i < st->count; i++) {
+        uint32_t len = strlen(st->paths[i]);
+        fwrite(&st->states[i], 8, 1, f);
+        fwrite(&len, 4, 1, f);
+        fwrite(st->paths[i], 1, len + 1, f);
+    }
+    output_commit(f, tmp, path, 0644);
+}
 
-    // Handle field access indexing: lex.source[i]
-    if (arr->type == AST_FIELD_ACCESS) {
-        AstNode* obj = arr->children[0];
-        char* field_name = arr->name;
+CacheEntry* cache_lookup(CodegenCache* c, uint64_t key) {
+    if (!c->slot_cap) return NULL;
+    for (unsigned i = (unsigned)key & (c->slot_cap - 1); c->slots[i]; i = (i + 1) & (c->slot_cap - 1)) {
+        CacheEntry* e = &c->entries[c->slots[i] - 1];
+        if (e->key == key) return e;
+    }
+    return NULL;
+}
 
-        Symbol* sym = symtab_lookup_symbol(cg->symtab, obj->name);
-        if (sym && sym->type_name) {
-            // Get struct type (remove pointer if present)
-            char* struct_type = sym->type_name;
-            int is_pointer = 0;
-            if (struct_type[0] == '*') {
-                struct_type = struct_type + 1;
-                is_pointer = 1;
-            }
+// Read the cache file; a missing, damaged or stale (other build or -O level)
+// file just leaves the cache empty
+void cache_load(CodegenCache* c, const char* path) {
+    memset(c, 0, sizeof(*c));
+    c->salt = hash_u64(cache_build_hash(), optimization_level);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    struct stat st;
+    if (!fstat(fd, &st) && st.st_size >= 20) {
+        c->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (c->data == MAP_FAILED) c->data = NULL;
+        else c->size = st.st_size;
+    }
+    close(fd);
+    uint64_t salt;
+    uint32_t count;
+    if (!c->data || memcmp(c->data, CACHE_MAGIC, 8)) return;
+    memcpy(&salt, c->data + 8, 8);
+    memcpy(&count, c->data + 16, 4);
+    if (salt != c->salt || count > c->size / 24) return;
+
+    c->entries = safe_realloc(NULL, sizeof(CacheEntry) * (count + 1));
+    for (c->slot_cap = 16; c->slot_cap < (int)count * 2; c->slot_cap *= 2) {}
+    c->slots = calloc(c->slot_cap, sizeof(int));
+    size_t pos = 20;
+    for (uint32_t k = 0; k < count && pos + 24 <= c->size; k++) {
+        CacheEntry e;
+        memcpy(&e.key, c->data + pos, 8);
+        memcpy(&e.len, c->data + pos + 8, 4);
+        memcpy(&e.flags, c->data + pos + 12, 4);
+        memcpy(&e.check, c->data + pos + 16, 8);
+        e.off = pos + 24;
+        if (e.len > c->size - e.off) break;
+        pos = e.off + e.len;
+        if (cache_lookup(c, e.key)) continue;
+        c->entries[c->count++] = e;
+        unsigned i = (unsigned)e.key & (c->slot_cap - 1);
+        while (c->slots[i]) i = (i + 1) & (c->slot_cap - 1);
+        c->slots[i] = c->count;
+    }
+}
 
-            int field_off = typetab_field_offset(cg->types, struct_type, field_name);
-            if (field_off >= 0) {
-                // Get field type to determine element size
-                char* field_type = typetab_field_type(cg->types, struct_type, field_name);
-                int elem_size = 1;  // Default to i8
-                int is_struct_elem = 0;
+// Start a new cache file for the `count` functions of this compile; they
+// are added with cache_store_put as their text is generated, and the file
+// replaces the old one at output_commit
+FILE* cache_store_begin(CodegenCache* c, const char* path, int count, char** tmp) {
+    FILE* f = output_open(path, tmp);
+    uint32_t n = count;
+    fwrite(CACHE_MAGIC, 1, 8, f);
+    fwrite(&c->salt, 8, 1, f);
+    fwrite(&n, 4, 1, f);
+    return f;
+}
 
-                if (field_type) {
-                    char* base_type = field_type;
-                    if (base_type[0] == '*') base_type++;  // Skip '*' to get element type
-
-                    if (!strcmp(base_type, "i8") || !strcmp(base_type, "u8")) {
-                        elem_size = 1;
-                    } else if (!strcmp(base_type, "i16")) {
-                        elem_size = 2;
-                    } else if (!strcmp(base_type, "i32") || !strcmp(base_type, "u32")) {
-                        elem_size = 4;
-                    } else if (!strcmp(base_type, "i64") || !strcmp(base_type, "u64")) {
-                        elem_size = 8;
-                    } else {
-                        // Not a primitive type - check if it's a struct
-                        StructType* st = typetab_lookup(cg->types, base_type);
-                        if (st) {
-                            elem_size = st->size;
-                            is_struct_elem = 1;
-                        }
-                    }
-                }
+void cache_store_put(FILE* f, uint64_t key, const char* text, uint32_t len, uint32_t flags) {
+    fwrite(&key, 8, 1, f);
+    fwrite(&len, 4, 1, f);
+    fwrite(&flags, 4, 1, f);
+    uint64_t check = hash_text(0, text, len);
+    fwrite(&check, 8, 1, f);
+    fwrite(text, 1, len, f);
+}
 
-                // Generate index expression first
-                gen_expr(cg, n->children[1]);  // Index in rax
+void cache_free(CodegenCache* c) {
+    if (c->data) munmap(c->data, c->size);
+    free(c->entries);
+    free(c->slots);
+    free(c->atom_keys);
+    free(c->struct_keys);
+    free(c->seen);
+    memset(c, 0, sizeof(*c));
+}
 
-                // Scale index by element size
-                if (elem_size > 1) {
-                    emit(cg, "    imul rax, %d\n", elem_size);
-                }
+void print_code_generated() {
+    CompileCounts* c = &compile_counts;
+    if (codegen_cache_path) {
+        printf("✅ Code generated (%ld of %ld functions from cache)\n", c->cache_hits, c->cache_hits + c->cache_misses);
+    } else {
+        printf("✅ Code generated\n");
+    }
+}
 
-                emit(cg, "    push rax\n");     // Save scaled index
+// Per atom: its spelling plus the signature of a global of that name, and
+// the struct types it leads to
+typedef struct AtomKey {
+    uint64_t hash;       // 0 = not computed yet
+    int type;            // Struct named by the atom (or its pointee), or -1
+    int global_type;     // Struct type of the global of that name, or -1
+} AtomKey;
+
+int cache_struct_of(Codegen* cg, Atom a) {
+    if (atom_pointee(a)) a = atom_pointee(a);
+    StructType* st = a ? typetab_lookup(cg->types, a) : NULL;
+    return st ? st - cg->types->types : -1;
+}
 
-                // Load the pointer from struct field
-                if (is_pointer) {
-                    emit(cg, "    mov rbx, [rbp%d]\n", sym->offset);  // Load struct pointer
-                    if (field_off == 0) {
-                        emit(cg, "    mov rbx, [rbx]\n");  // Load field (pointer)
-                    } else {
-                        emit(cg, "    mov rbx, [rbx+%d]\n", field_off);  // Load field (pointer)
-                    }
-                } else {
-                    emit(cg, "    mov rbx, [rbp%d]\n", sym->offset + field_off);  // Load field (pointer)
-                }
+AtomKey* cache_atom_key(Codegen* cg, Atom a) {
+    AtomKey* k = &codegen_cache.atom_keys[a];
+    if (k->hash) return k;
+    uint64_t h = hash_atom(0, a);
+    k->type = cache_struct_of(cg, a);
+    k->global_type = -1;
+    GlobalVar* g = global_symtab_lookup(cg->global_symtab, a);
+    if (g) {
+        h = hash_u64(h, (uint64_t)g->size << 32 | g->array_count);
+        h = hash_u64(h, g->is_initialized | g->is_array << 1 | g->is_pointer << 2 | g->is_mutable << 3 |
+                            g->is_const << 4 | g->folded << 5);
+        if (g->folded) h = hash_u64(h, g->value);
+        h = hash_atom(hash_atom(hash_atom(h, g->type_name), g->elem_type), g->pointee_type);
+        Atom t = g->is_array ? g->elem_type : g->is_pointer ? g->pointee_type : g->type_name;
+        k->global_type = cache_struct_of(cg, t);
+    }
+    k->hash = h | 1;
+    return k;
+}
 
-                emit(cg, "    pop rax\n");      // Restore scaled index
-                emit(cg, "    add rbx, rax\n"); // Add scaled index to pointer
+// Layout of struct t and of the structs its fields lead to, each once per
+// function
+uint64_t cache_hash_struct(Codegen* cg, uint64_t h, int t) {
+    CodegenCache* c = &codegen_cache;
+    if (t < 0 || c->seen[t] == c->stamp) return h;
+    c->seen[t] = c->stamp;
+    StructType* st = &cg->types->types[t];
+    if (!c->struct_keys[t]) {
+        uint64_t sh = hash_u64(hash_atom(0, st->name), (uint64_t)st->size << 32 | st->field_count);
+        for (int i = 0; i < st->field_count; i++) {
+            StructField* fd = &st->fields[i];
+            sh = hash_atom(hash_atom(sh, fd->name), fd->type_name);
+            sh = hash_u64(sh, (uint64_t)fd->offset << 1 | fd->is_pointer);
+        }
+        c->struct_keys[t] = sh | 1;
+    }
+    h = hash_u64(h, c->struct_keys[t]);
+    for (int i = 0; i < st->field_count; i++) h = cache_hash_struct(cg, h, cache_struct_of(cg, st->fields[i].type_name));
+    return h;
+}
 
-                // For structs, return address; for primitives, load value
-                if (is_struct_elem) {
-                    emit(cg, "    mov rax, rbx\n");  // Return address of struct element
-                } else {
-                    // Load element based on size
-                    if (elem_size == 1) {
-                        emit(cg, "    movzx rax, byte [rbx]\n");
-                    } else if (elem_size == 2) {
-                        emit(cg, "    movzx rax, word [rbx]\n");
-                    } else if (elem_size == 4) {
-                        emit(cg, "    mov eax, [rbx]\n");
-                    } else {
-                        emit(cg, "    mov rax, [rbx]\n");
-                    }
-                }
-                return;
-            }
+uint64_t cache_hash_name(Codegen* cg, uint64_t h, Atom a) {
+    AtomKey* k = cache_atom_key(cg, a);
+    h = hash_u64(h, k->hash);
+    return cache_hash_struct(cg, cache_hash_struct(cg, h, k->type), k->global_type);
+}
+
+uint64_t cache_hash_node(Codegen* cg, uint64_t h, Node n) {
+    AstType k = ast.kind[n];
+    h = hash_u64(h, (uint64_t)ast.nkids[n] << 8 | k);
+    if (ast.name[n]) h = cache_hash_name(cg, h, ast.name[n]);
+    if (k == AST_NUMBER || k == AST_STRING) {
+        AstLiteral* l = ast_lit(n);
+        h = hash_bytes(hash_u64(h, l->num), src_text + l->lit.off, l->lit.len);
+        if (k == AST_STRING) {
+            const char* label = strtab_add(cg->strtab, src_text + l->lit.off, l->lit.len);
+            h = hash_bytes(h, label, strlen(label));
         }
+    } else if (kind_has_op(k)) {
+        h = hash_u64(h, ast.extra[n]);
+    } else if (ast.extra[n]) {
+        AstDecl* d = ast_decl(n);
+        h = hash_u64(h, (uint64_t)d->array_size << 24 | d->is_array << 16 | d->is_pointer << 8 | d->is_forward_decl);
+        if (d->type_name) h = cache_hash_name(cg, h, d->type_name);
+        if (d->struct_type) h = cache_hash_name(cg, h, d->struct_type);
     }
+    return h;
+}
 
-    // Handle string literal indexing: "Hello"[0]
-    if (arr->type == AST_STRING) {
-        char* label = strtab_add(cg->strtab, arr->value, strlen(arr->value));
-        int str_len = strlen(arr->value);
+// Key of the function at `f`, whose other nodes are [first, end)
+uint64_t cache_func_key(Codegen* cg, Node f, Node first, Node end) {
+    codegen_cache.stamp++;
+    uint64_t h = cache_hash_node(cg, codegen_cache.salt, f);
+    for (Node n = first; n < end; n++) h = cache_hash_node(cg, h, n);
+    return h;
+}
 
-        gen_expr(cg, n->children[1]);  // Index in rax
+// ==== MODULES ====
+// `import "name";` makes the declarations of a separately compiled module
+// visible. Compiling with -c writes a binary interface file next to the
+// object (net.o -> net.chi) with the module's struct layouts, globals and
+// function signatures; importers read that instead of the module's source,
+// so a module is parsed once however many files import it. An executable
+// links the objects of every module it imports, directly or not.
+#define MODULE_MAGIC "CHRMOD1\n"
 
-        // Bounds checking
-        int ok_label = new_label(cg);
-        emit(cg, "    test rax, rax\n");
-        emit(cg, "    js .Lbounds_error_%d\n", ok_label);
-        emit(cg, "    cmp rax, %d\n", str_len);
-        emit(cg, "    jge .Lbounds_error_%d\n", ok_label);
-        emit(cg, "    jmp .Lbounds_ok_%d\n", ok_label);
-
-        emit(cg, ".Lbounds_error_%d:\n", ok_label);
-        char* err_msg = strtab_add(cg->strtab, "Array bounds error\\n", 19);
-        emit(cg, "    mov rsi, %s\n", err_msg);
-        emit(cg, "    mov rdx, 19\n");
-        emit(cg, "    mov rdi, 2\n");
-        emit(cg, "    mov rax, 1\n");
-        emit(cg, "    syscall\n");
-        emit(cg, "    mov rdi, 1\n");
-        emit(cg, "    mov rax, 60\n");
-        emit(cg, "    syscall\n");
-
-        emit(cg, ".Lbounds_ok_%d:\n", ok_label);
+typedef struct {
+    Atom name, type_name;
+    int is_pointer;
+} ModuleParam;
 
-        // Load byte from string: string_label + index
-        emit(cg, "    lea rbx, [%s]\n", label);
-        emit(cg, "    add rbx, rax\n");
-        emit(cg, "    movzx rax, byte [rbx]\n");
-        return;
-    }
+typedef struct {
+    Atom name;
+    Atom ret_type;
+    ModuleParam* params;
+    int nparams;
+    int module;
+} ModuleFunc;
 
-    Symbol* sym = symtab_lookup_symbol(cg->symtab, arr->name);
+typedef struct {
+    Atom name, type_name;
+    int array_count;
+    uint8_t is_array, is_pointer, is_mutable, is_const;
+    int module;
+} ModuleGlobal;
 
-    // Try local array/pointer first
-    if (sym) {
-        gen_expr(cg, n->children[1]);  // Index in rax
+typedef struct {
+    char* name;        // As imported (for messages)
+    char* chi;         // Real path of the interface file
+    char* obj;         // Object the interface belongs to
+    int direct;        // Imported by the program itself
+} Module;
 
-        // Check if this is a pointer parameter (not an array)
-        if (sym->is_pointer) {
-            // This is a pointer - no bounds checking, just index through it
-            // Determine element size from type_name (e.g., "*i8", "*i64", "*Point")
-            int elem_size = 1;  // Default to i8
-            int is_struct = 0;
+typedef struct {
+    Module* mods;
+    int count, cap;
+    ModuleFunc* funcs;
+    int nfuncs, func_cap;
+    ModuleGlobal* globals;
+    int nglobals, global_cap;
+    int own_types;     // TypeTable entries defined by the program itself
+    const char** search;  // -I directories
+    int nsearch, search_cap;
+    int* sym_of;       // Atom -> function index + 1, or -(global index + 1)
+} ModuleSet;
+
+ModuleSet modules;
+
+// -c: every function and global is visible to the linker, and there is no
+// _start unless the module has a main
+int codegen_exports = 0;
+
+#define MODULE_GROW(arr, n, cap) \
+    if ((n) == (cap)) { (cap) = (cap) ? (cap) * 2 : 16; (arr) = safe_realloc((arr), sizeof(*(arr)) * (cap)); }
+
+// ---- Interface files ----
+typedef struct {
+    const uint8_t* p;
+    const uint8_t* end;
+    const char* path;
+} ChiReader;
+
+uint32_t chi_u32(ChiReader* r) {
+    if (r->end - r->p < 4) {
+        fprintf(stderr, "Error: %s: truncated module interface\n", r->path);
+        exit(1);
+    }
+    uint32_t v;
+    memcpy(&v, r->p, 4);
+    r->p += 4;
+    return v;
+}
 
-            if (sym->type_name) {
-                char* base_type = sym->type_name;
-                if (base_type[0] == '*') base_type++;  // Skip '*'
-
-                if (!strcmp(base_type, "i8") || !strcmp(base_type, "u8")) {
-                    elem_size = 1;
-                } else if (!strcmp(base_type, "i16")) {
-                    elem_size = 2;
-                } else if (!strcmp(base_type, "i32") || !strcmp(base_type, "u32")) {
-                    elem_size = 4;
-                } else if (!strcmp(base_type, "i64") || !strcmp(base_type, "u64")) {
-                    elem_size = 8;
-                } else {
-                    // Not a primitive type - check if it's a struct
-                    StructType* st = typetab_lookup(cg->types, base_type);
-                    if (st) {
-                        elem_size = st->size;
-                        is_struct = 1;
-                    }
-                }
-            }
+// Length-prefixed text, left in the file buffer; *len receives its length
+const char* chi_text(ChiReader* r, uint32_t* len) {
+    *len = chi_u32(r);
+    if ((uint32_t)(r->end - r->p) < *len) {
+        fprintf(stderr, "Error: %s: truncated module interface\n", r->path);
+        exit(1);
+    }
+    const char* s = (const char*)r->p;
+    r->p += *len;
+    return s;
+}
 
-            emit(cg, "    mov rbx, [rbp%d]\n", sym->offset);  // Load pointer
+Atom chi_atom(ChiReader* r) {
+    uint32_t len;
+    const char* s = chi_text(r, &len);
+    return len ? atom_intern(s, len) : ATOM_NONE;
+}
 
-            // Scale index by element size
-            if (elem_size > 1) {
-                emit(cg, "    imul rax, %d\n", elem_size);
-            }
+char* chi_str(ChiReader* r) {
+    uint32_t len;
+    const char* s = chi_text(r, &len);
+    return astrndup(s, len);
+}
 
-            emit(cg, "    add rbx, rax\n");  // Add scaled index
+void chi_put_u32(FILE* f, uint32_t v) { fwrite(&v, 4, 1, f); }
 
-            // For structs, return address in rax (for field access)
-            // For primitives, load the value
-            if (is_struct) {
-                emit(cg, "    mov rax, rbx\n");  // Return address of struct element
-            } else {
-                // Load element based on size
-                if (elem_size == 1) {
-                    emit(cg, "    movzx rax, byte [rbx]\n");
-                } else if (elem_size == 2) {
-                    emit(cg, "    movzx rax, word [rbx]\n");
-                } else if (elem_size == 4) {
-                    emit(cg, "    mov eax, [rbx]\n");
-                } else {
-                    emit(cg, "    mov rax, [rbx]\n");
-                }
-            }
-            return;
-        }
+void chi_put_str(FILE* f, const char* s, int len) {
+    chi_put_u32(f, len);
+    fwrite(s, 1, len, f);
+}
 
-        // It's a real array - do bounds checking
-        // Determine element size from type_name
-        int elem_size = 8;  // Default to 8 bytes (i64)
-        int array_count = sym->size;  // size is already the count for typed arrays
-        int is_struct = 0;
+void chi_put_atom(FILE* f, Atom a) { chi_put_str(f, atom_str(a), atom_tab[a].len); }
 
-        if (sym->type_name) {
-            if (!strcmp(sym->type_name, "i8") || !strcmp(sym->type_name, "u8")) {
-                elem_size = 1;
-            } else if (!strcmp(sym->type_name, "i16")) {
-                elem_size = 2;
-            } else if (!strcmp(sym->type_name, "i32") || !strcmp(sym->type_name, "u32")) {
-                elem_size = 4;
-            } else if (!strcmp(sym->type_name, "i64") || !strcmp(sym->type_name, "u64")) {
-                elem_size = 8;
-            } else {
-                // Not a primitive - check if struct
-                StructType* st = typetab_lookup(cg->types, sym->type_name);
-                if (st) {
-                    elem_size = st->size;
-                    is_struct = 1;
-                }
-            }
-        } else {
-            // If no type_name, assume old behavior (size is in qwords)
-            array_count = sym->size;
+// out.o -> out.chi (anything else gets .chi appended)
+char* module_interface_path(const char* obj_path) {
+    size_t n = strlen(obj_path);
+    if (n > 2 && !strcmp(obj_path + n - 2, ".o")) n -= 2;
+    char* path = safe_realloc(NULL, n + 5);
+    memcpy(path, obj_path, n);
+    strcpy(path + n, ".chi");
+    return path;
+}
+
+// Struct layouts, globals and signatures of the program's own definitions,
+// plus the interfaces it imported itself. Made before codegen, which drops
+// the function nodes, and written once the object is.
+char* module_interface(const char* obj_path, Node prog, TypeTable* types, size_t* len) {
+    char* text;
+    FILE* f = open_memstream(&text, len);
+    fwrite(MODULE_MAGIC, 1, 8, f);
+    const char* obj = strrchr(obj_path, '/');
+    obj = obj ? obj + 1 : obj_path;
+    chi_put_str(f, obj, strlen(obj));  // Lives next to the interface
+
+    int ndeps = 0;
+    for (int i = 0; i < modules.count; i++) ndeps += modules.mods[i].direct;
+    chi_put_u32(f, ndeps);
+    for (int i = 0; i < modules.count; i++) {
+        Module* m = &modules.mods[i];
+        if (!m->direct) continue;
+        chi_put_str(f, m->name, strlen(m->name));
+        chi_put_str(f, m->chi, strlen(m->chi));
+    }
+
+    chi_put_u32(f, modules.own_types);
+    for (int i = 0; i < modules.own_types; i++) {
+        StructType* st = &types->types[i];
+        chi_put_atom(f, st->name);
+        chi_put_u32(f, st->size);
+        chi_put_u32(f, st->field_count);
+        for (int j = 0; j < st->field_count; j++) {
+            StructField* fd = &st->fields[j];
+            chi_put_atom(f, fd->name);
+            chi_put_atom(f, fd->type_name);
+            chi_put_u32(f, fd->offset);
+            chi_put_u32(f, fd->is_pointer);
         }
+    }
 
-        // Bounds checking
-        if (sym->size > 0) {
-            int ok_label = new_label(cg);
+    int nglobals = 0, nfuncs = 0;
+    for (int i = 0; i < ast.nkids[prog]; i++) {
+        Node n = ast_child(prog, i);
+        nglobals += ast.kind[n] == AST_GLOBAL_VAR;
+        nfuncs += ast.kind[n] == AST_FUNCTION && !ast_decl(n)->is_forward_decl;
+    }
+    chi_put_u32(f, nglobals);
+    for (int i = 0; i < ast.nkids[prog]; i++) {
+        Node n = ast_child(prog, i);
+        if (ast.kind[n] != AST_GLOBAL_VAR) continue;
+        AstDecl* d = ast_decl(n);
+        chi_put_atom(f, ast.name[n]);
+        chi_put_atom(f, d->type_name);
+        chi_put_u32(f, d->array_size);
+        chi_put_u32(f, d->is_array | d->is_pointer << 1 | d->is_const << 3);  // is_pointer carries *mut in bit 1
+    }
+    chi_put_u32(f, nfuncs);
+    for (int i = 0; i < ast.nkids[prog]; i++) {
+        Node n = ast_child(prog, i);
+        if (ast.kind[n] != AST_FUNCTION || ast_decl(n)->is_forward_decl) continue;
+        chi_put_atom(f, ast.name[n]);
+        chi_put_atom(f, ast_decl(n)->type_name);
+        chi_put_u32(f, ast.nkids[n] - 1);
+        for (int j = 0; j < ast.nkids[n] - 1; j++) {
+            Node par = ast_child(n, j);
+            chi_put_atom(f, ast.name[par]);
+            chi_put_atom(f, ast_decl(par)->type_name);
+            chi_put_u32(f, ast_decl(par)->is_pointer);
+        }
+    }
+    fclose(f);
+    return text;
+}
 
-            emit(cg, "    test rax, rax\n");
-            emit(cg, "    js .Lbounds_error_%d\n", ok_label);
+void module_write_interface(const char* obj_path, const char* text, size_t len) {
+    char* path = module_interface_path(obj_path);
+    char* tmp;
+    FILE* f = output_open(path, &tmp);
+    fwrite(text, 1, len, f);
+    output_commit(f, tmp, path, 0644);
+    free(path);
+}
 
-            emit(cg, "    cmp rax, %d\n", array_count);
-            emit(cg, "    jge .Lbounds_error_%d\n", ok_label);
-            emit(cg, "    jmp .Lbounds_ok_%d\n", ok_label);
+void module_load(TypeTable* types, const char* path, const char* name, int direct);
 
-            emit(cg, ".Lbounds_error_%d:\n", ok_label);
-            char* err_msg = strtab_add(cg->strtab, "Array bounds error\\n", 19);
-            emit(cg, "    mov rsi, %s\n", err_msg);
-            emit(cg, "    mov rdx, 19\n");
-            emit(cg, "    mov rdi, 2\n");
-            emit(cg, "    mov rax, 1\n");
-            emit(cg, "    syscall\n");
-            emit(cg, "    mov rdi, 1\n");
-            emit(cg, "    mov rax, 60\n");
-            emit(cg, "    syscall\n");
+void module_read(TypeTable* types, int mi, const uint8_t* data, long size) {
+    ChiReader r = {data, data + size, modules.mods[mi].chi};
+    if (size < 8 || memcmp(data, MODULE_MAGIC, 8)) {
+        fprintf(stderr, "Error: %s is not a module interface of this compiler; rebuild module '%s'\n",
+                r.path, modules.mods[mi].name);
+        exit(1);
+    }
+    r.p += 8;
+
+    char* obj = chi_str(&r);
+    const char* dir_end = strrchr(r.path, '/');
+    int dir_len = dir_end ? dir_end - r.path + 1 : 0;
+    modules.mods[mi].obj = arena_alloc(&compiler_arena, dir_len + strlen(obj) + 1);
+    memcpy(modules.mods[mi].obj, r.path, dir_len);
+    strcpy(modules.mods[mi].obj + dir_len, obj);
+
+    uint32_t ndeps = chi_u32(&r);
+    for (uint32_t i = 0; i < ndeps; i++) {
+        char* dep_name = chi_str(&r);
+        char* dep_path = chi_str(&r);
+        module_load(types, dep_path, dep_name, 0);
+    }
 
-            emit(cg, ".Lbounds_ok_%d:\n", ok_label);
+    uint32_t nstructs = chi_u32(&r);
+    for (uint32_t i = 0; i < nstructs; i++) {
+        Atom sname = chi_atom(&r);
+        if (typetab_lookup(types, sname)) {
+            fprintf(stderr, "Error: struct '%s' from module '%s' is already defined\n",
+                    atom_str(sname), modules.mods[mi].name);
+            exit(1);
         }
-
-        // Calculate offset: index * elem_size
-        if (elem_size > 1) {
-            emit(cg, "    imul rax, %d\n", elem_size);
+        typetab_add(types, sname);
+        StructType* st = typetab_lookup(types, sname);
+        int struct_size = chi_u32(&r);
+        uint32_t nfields = chi_u32(&r);
+        for (uint32_t j = 0; j < nfields; j++) {
+            Atom fname = chi_atom(&r);
+            Atom ftype = chi_atom(&r);
+            int offset = chi_u32(&r);
+            typetab_add_field(types, sname, fname, ftype, chi_u32(&r));
+            st->fields[st->field_count - 1].offset = offset;
         }
-        emit(cg, "    mov rbx, rax\n");
+        st->size = struct_size;
+    }
 
-        // For structs, return address; for primitives, load value
-        if (is_struct) {
-            emit(cg, "    lea rax, [rbp%d+rbx]\n", sym->offset);
-        } else {
-            // Load value with correct width
-            if (elem_size == 1) {
-                emit(cg, "    movzx rax, byte [rbp%d+rbx]\n", sym->offset);
-            } else if (elem_size == 2) {
-                emit(cg, "    movzx rax, word [rbp%d+rbx]\n", sym->offset);
-            } else if (elem_size == 4) {
-                emit(cg, "    mov eax, [rbp%d+rbx]\n", sym->offset);
-            } else {
-                emit(cg, "    mov rax, [rbp%d+rbx]\n", sym->offset);
-            }
+    uint32_t nglobals = chi_u32(&r);
+    for (uint32_t i = 0; i < nglobals; i++) {
+        MODULE_GROW(modules.globals, modules.nglobals, modules.global_cap);
+        ModuleGlobal* g = &modules.globals[modules.nglobals++];
+        g->name = chi_atom(&r);
+        g->type_name = chi_atom(&r);
+        g->array_count = chi_u32(&r);
+        uint32_t flags = chi_u32(&r);
+        g->is_array = flags & 1;
+        g->is_pointer = (flags >> 1) & 1;
+        g->is_mutable = (flags >> 2) & 1;
+        g->is_const = (flags >> 3) & 1;
+        g->module = mi;
+    }
+
+    uint32_t nfuncs = chi_u32(&r);
+    for (uint32_t i = 0; i < nfuncs; i++) {
+        MODULE_GROW(modules.funcs, modules.nfuncs, modules.func_cap);
+        ModuleFunc* fn = &modules.funcs[modules.nfuncs++];
+        fn->name = chi_atom(&r);
+        fn->ret_type = chi_atom(&r);
+        fn->nparams = chi_u32(&r);
+        if (fn->nparams > (r.end - r.p) / 12) {
+            fprintf(stderr, "Error: %s: truncated module interface\n", r.path);
+            exit(1);
         }
-    } else {
-        // Try global array
-        GlobalVar* gvar = global_symtab_lookup(cg->global_symtab, arr->name);
-        if (gvar && gvar->is_array) {
-            gen_expr(cg, n->children[1]);  // Index in rax
+        fn->params = arena_alloc(&compiler_arena, sizeof(ModuleParam) * (fn->nparams + 1));
+        for (int j = 0; j < fn->nparams; j++) {
+            fn->params[j].name = chi_atom(&r);
+            fn->params[j].type_name = chi_atom(&r);
+            fn->params[j].is_pointer = chi_u32(&r);
+        }
+        fn->module = mi;
+    }
+    if (r.p != r.end) {
+        fprintf(stderr, "Error: %s: trailing data in module interface\n", r.path);
+        exit(1);
+    }
+}
 
-            // For i8 arrays, element size is 1 byte
-            // For i32/i64, element size is 4/8 bytes
-            int elem_size = 1;  // Default to byte for i8
-            if (gvar->elem_type) {
-                if (!strcmp(gvar->elem_type, "i32")) elem_size = 4;
-                else if (!strcmp(gvar->elem_type, "i64")) elem_size = 8;
-                else if (!strcmp(gvar->elem_type, "i16")) elem_size = 2;
-            }
+// Load an interface (and, first, the ones it imported) once
+void module_load(TypeTable* types, const char* path, const char* name, int direct) {
+    char full[PATH_MAX];
+    if (!realpath(path, full)) {
+        fprintf(stderr, "Error: cannot read module interface %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    for (int i = 0; i < modules.count; i++) {
+        if (!strcmp(modules.mods[i].chi, full)) {
+            modules.mods[i].direct |= direct;
+            return;
+        }
+    }
 
-            // Calculate offset: index * elem_size
-            if (elem_size > 1) {
-                emit(cg, "    imul rax, %d\n", elem_size);
-            }
+    FILE* f = fopen(full, "rb");
+    if (!f) {
+        fprintf(stderr, "Error: cannot read module interface %s: %s\n", full, strerror(errno));
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t* data = safe_realloc(NULL, size > 0 ? size : 1);
+    if (size < 0 || fread(data, 1, size, f) != (size_t)size) {
+        fprintf(stderr, "Error: cannot read module interface %s\n", full);
+        exit(1);
+    }
+    fclose(f);
 
-            // Load from global array: array_name + offset
-            emit(cg, "    lea rbx, [%s]\n", gvar->name);
-            emit(cg, "    add rbx, rax\n");
+    // Registered before its dependencies, so an import cycle ends here
+    MODULE_GROW(modules.mods, modules.count, modules.cap);
+    int mi = modules.count++;
+    modules.mods[mi] = (Module){astrdup(name), astrdup(full), NULL, direct};
+    module_read(types, mi, data, size);
+    free(data);
+}
 
-            // Load based on element size
-            if (elem_size == 1) {
-                emit(cg, "    movzx rax, byte [rbx]\n");
-            } else if (elem_size == 2) {
-                emit(cg, "    movzx rax, word [rbx]\n");
-            } else if (elem_size == 4) {
-                emit(cg, "    mov eax, [rbx]\n");
-            } else {
-                emit(cg, "    mov rax, [rbx]\n");
-            }
-        } else {
-            emit(cg, "    mov rax, 0  ; array not found\n");
+// <name>.chi in the importing file's directory, else in the -I directories
+void module_import(TypeTable* types, const char* src_path, SrcSlice name) {
+    char path[PATH_MAX];
+    const char* text = src_text + name.off;
+    const char* slash = strrchr(src_path, '/');
+    int dir_len = slash ? slash - src_path : 1;
+    const char* dir = slash ? src_path : ".";
+    for (int i = -1; i < modules.nsearch; i++) {
+        if (i >= 0) {
+            dir = modules.search[i];
+            dir_len = strlen(dir);
+        }
+        snprintf(path, sizeof(path), "%.*s/%.*s.chi", dir_len, dir, (int)name.len, text);
+        if (access(path, R_OK) == 0) {
+            char* mod_name = astrndup(text, name.len);
+            module_load(types, path, mod_name, 1);
+            return;
         }
     }
+    fprintf(stderr, "Error: module '%.*s' not found (%.*s.chi next to %s", (int)name.len, text,
+            (int)name.len, text, src_path);
+    for (int i = 0; i < modules.nsearch; i++) fprintf(stderr, ", in %s", modules.search[i]);
+    fprintf(stderr, "); compile it with -c first\n");
+    exit(1);
 }
 
-void gen_expr(Codegen* cg, AstNode* n) {
-    if (!n) return;  // Null safety guard
-    if (n->type == AST_NUMBER) {
-        emit(cg, "    mov rax, %s\n", n->value);
-    } else if (n->type == AST_STRING) {
-        char* label = strtab_add(cg->strtab, n->value, strlen(n->value));
-        emit(cg, "    mov rax, %s\n", label);
-        emit(cg, "    mov rbx, %d\n", (int)strlen(n->value));
-    } else if (n->type == AST_IDENT) {
-        // Try local variable first
-        int off = symtab_lookup(cg->symtab, n->name);
-        if (off) {
-            // Check if this is an array - if so, load address not value
-            Symbol* sym = symtab_lookup_symbol(cg->symtab, n->name);
-            if (sym && sym->size > 1 && sym->type_name && !sym->is_pointer) {
-                // This is an array - use lea to get address
-                emit(cg, "    lea rax, [rbp%d]\n", off);
+// A name may come from one place only, and calls into a module must pass
+// the parameters its interface declares
+void module_check(Node prog) {
+    modules.sym_of = arena_alloc(&compiler_arena, sizeof(int) * atom_count);
+    for (int i = 0; i < modules.nfuncs + modules.nglobals; i++) {
+        int is_func = i < modules.nfuncs;
+        int gi = i - modules.nfuncs;
+        Atom name = is_func ? modules.funcs[i].name : modules.globals[gi].name;
+        int mi = is_func ? modules.funcs[i].module : modules.globals[gi].module;
+        int prev = modules.sym_of[name];
+        if (prev) {
+            int pm = prev > 0 ? modules.funcs[prev - 1].module : modules.globals[-prev - 1].module;
+            fprintf(stderr, "Error: '%s' is defined in modules '%s' and '%s'\n",
+                    atom_str(name), modules.mods[pm].name, modules.mods[mi].name);
+            exit(1);
+        }
+        modules.sym_of[name] = is_func ? i + 1 : -(gi + 1);
+    }
+
+    for (int i = 0; i < ast.nkids[prog]; i++) {
+        Node item = ast_child(prog, i);
+        int kind = ast.kind[item];
+        if ((kind == AST_FUNCTION && !ast_decl(item)->is_forward_decl) || kind == AST_GLOBAL_VAR) {
+            int s = modules.sym_of[ast.name[item]];
+            if (s) {
+                int mi = s > 0 ? modules.funcs[s - 1].module : modules.globals[-s - 1].module;
+                fprintf(stderr, "Error: '%s' is already defined in module '%s'\n",
+                        atom_str(ast.name[item]), modules.mods[mi].name);
+                exit(1);
+            }
+        }
+        if (kind != AST_FUNCTION || !ast.nkids[item]) continue;
+        for (Node n = ast.kids[item], end = program_item_end(prog, i); n < end; n++) {
+            if (ast.kind[n] != AST_CALL || modules.sym_of[ast.name[n]] <= 0) continue;
+            ModuleFunc* fn = &modules.funcs[modules.sym_of[ast.name[n]] - 1];
+            if (ast.nkids[n] != fn->nparams) {
+                fprintf(stderr, "Error: in %s: %s() from module '%s' takes %d argument%s, %d given\n",
+                        atom_str(ast.name[item]), atom_str(fn->name), modules.mods[fn->module].name,
+                        fn->nparams, fn->nparams == 1 ? "" : "s", ast.nkids[n]);
+                exit(1);
+            }
+        }
+    }
+}
+
+// Types phase: load the interfaces named by `import` items
+void modules_load_imports(TypeTable* types, Node prog, const char* src_path) {
+    modules.own_types = types->count;
+    for (int i = 0; i < parsed_imports.count; i++)
+        module_import(types, src_path, parsed_imports.names[i]);
+    if (modules.count) module_check(prog);
+}
+
+// ==== CODEGEN ====
+// Fast path: append text straight to the code buffer. emit() below runs
+// every line through vsnprintf twice; these cover the fixed text, registers,
+// immediates, [rbp-N] operands and labels that make up nearly all output.
+char* emit_reserve(Codegen* cg, int n) {
+    if (cg->code_len + n + 1 > cg->code_cap) {
+        while (cg->code_len + n + 1 > cg->code_cap)
+            cg->code_cap = cg->code_cap ? cg->code_cap * 2 : 4096;
+        cg->code_buf = safe_realloc(cg->code_buf, cg->code_cap);
+    }
+    return cg->code_buf + cg->code_len;
+}
+
+void emit_raw(Codegen* cg, const char* s, int len) {
+    memcpy(emit_reserve(cg, len), s, len);
+    cg->code_len += len;
+}
+
+// Finished text is handed on once this much has built up
+#define CODEGEN_FLUSH_BYTES (64 * 1024)
+
+void asm_text(Asm* a, const char* p);
+void phase_begin(CompilePhase next);
+
+// Hand the buffered text (whole lines) to the assembler or the output file
+// and start the buffer over
+void codegen_flush(Codegen* cg) {
+    if (!cg->code_len) return;
+    if (cg->as) {
+        cg->code_buf[cg->code_len] = '\0';  // emit_reserve keeps room for it
+        phase_begin(PHASE_ASSEMBLE);
+        asm_text(cg->as, cg->code_buf);
+        phase_begin(PHASE_CODEGEN);
+    } else {
+        fwrite(cg->code_buf, 1, cg->code_len, cg->out);
+    }
+    cg->text_bytes += cg->code_len;
+    cg->code_len = 0;
+}
+
+// String literals only: the length is known at compile time
+#define emit_lit(cg, s) emit_raw((cg), "" s, (int)sizeof(s) - 1)
+
+void emit_str(Codegen* cg, const char* s) { emit_raw(cg, s, strlen(s)); }
+
+void emit_name(Codegen* cg, Atom a) { emit_raw(cg, atom_tab[a].str, atom_tab[a].len); }
+
+// Decimal text of v, two digits per step, ending just before `end`;
+// returns where it starts (at most 20 bytes back)
+char* num_text(char* end, long v) {
+    static const char pairs[201] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    char* p = end;
+    unsigned long u = v < 0 ? -(unsigned long)v : (unsigned long)v;
+    while (u >= 100) {
+        int d = (u % 100) * 2;
+        u /= 100;
+        *--p = pairs[d + 1];
+        *--p = pairs[d];
+    }
+    if (u >= 10) {
+        *--p = pairs[u * 2 + 1];
+        *--p = pairs[u * 2];
+    } else {
+        *--p = '0' + u;
+    }
+    if (v < 0) *--p = '-';
+    return p;
+}
+
+void emit_num(Codegen* cg, long v) {
+    char buf[24];
+    char* p = num_text(buf + sizeof(buf), v);
+    emit_raw(cg, p, buf + sizeof(buf) - p);
+}
+
+// pre, a number, post: "    mov rax, [rbp" off "]\n", "    jmp .L" lab "\n", ...
+#define emit_i(cg, pre, v, post) (emit_lit(cg, pre), emit_num((cg), (v)), emit_lit(cg, post))
+
+// pre, a string (register or symbol name), post
+#define emit_s(cg, pre, str, post) (emit_lit(cg, pre), emit_str((cg), (str)), emit_lit(cg, post))
+#define emit_n(cg, pre, atom, post) (emit_lit(cg, pre), emit_name((cg), (atom)), emit_lit(cg, post))
+
+// Names are Atom IDs now; let the compiler check every %s gets a string
+__attribute__((format(printf, 2, 3)))
+void emit(Codegen* cg, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+
+    va_list args_copy;
+    va_copy(args_copy, args);
+    int needed = vsnprintf(NULL, 0, fmt, args_copy);
+    va_end(args_copy);
+
+    vsnprintf(emit_reserve(cg, needed), needed + 1, fmt, args);
+    cg->code_len += needed;
+
+    va_end(args);
+}
+
+int new_label(Codegen* cg) { return cg->label_count++; }
+
+// Text of a NUMBER as written in the source; folded and desugared numbers
+// have none and are formatted into `buf`
+const char* number_text(Node n, char* buf, int* len) {
+    AstLiteral* l = ast_lit(n);
+    if (l->lit.len) {
+        *len = l->lit.len;
+        return src_text + l->lit.off;
+    }
+    *len = sprintf(buf, "%ld", l->num);
+    return buf;
+}
+
+// A variable reference resolved in one pass: innermost local, else global
+typedef struct {
+    Symbol* local;
+    GlobalVar* global;
+} VarRef;
+
+VarRef resolve_var(Codegen* cg, Atom name) {
+    VarRef ref = {symtab_lookup_symbol(cg->symtab, name), NULL};
+    if (!ref.local) ref.global = global_symtab_lookup(cg->global_symtab, name);
+    return ref;
+}
+
+void gen_expr(Codegen* cg, Node n);
+
+void global_assign_check(GlobalVar* g) {
+    if (!g->is_const) return;
+    fprintf(stderr, "Error: cannot assign to const '%s'\n", atom_str(g->name));
+    exit(1);
+}
+
+// Register allocation (-O1+). A local lives in one of r12-r15 when the
+// function declares its name once and only reads and assigns it, so no
+// code needs its stack slot; the heaviest such names (uses weighted x8
+// per enclosing loop) get the registers. Nothing else in generated code
+// writes r12-r15, so a function that uses them saves them in its prologue
+// and they survive calls. Operands held while the other side of an
+// expression is evaluated go to r10/r11 when that side has no call (calls
+// and syscalls clobber them), and to the stack otherwise.
+const char* regalloc_regs[] = {"r12", "r13", "r14", "r15"};
+const char* regalloc_temps[] = {"r10", "r11"};
+#define REGALLOC_REGS 4
+#define REGALLOC_TEMPS 2
+#define REGALLOC_MIN_WEIGHT 3  // Fewer uses don't pay for the save and restore
+#define REGALLOC_CALL_SCAN 64  // Larger operands are assumed to call
+
+RegVar* regalloc_var(SymbolTable* st, Atom name) {
+    int i = name_index_get(&st->var_index, name);
+    if (i < 0) {
+        if (st->var_count == st->var_cap) {
+            int cap = st->var_cap ? st->var_cap * 2 : 16;
+            st->vars = arena_grow(&compiler_arena, st->vars, sizeof(RegVar) * st->var_cap, sizeof(RegVar) * cap);
+            st->var_cap = cap;
+        }
+        i = st->var_count++;
+        st->vars[i] = (RegVar){name, 0, 0, 0, 0, NULL};
+        name_index_put(&st->var_index, name, i);
+    }
+    return &st->vars[i];
+}
+
+void regalloc_scan(Codegen* cg, Node n, int weight) {
+    SymbolTable* st = cg->symtab;
+    int kind = ast.kind[n];
+    if (kind == AST_IDENT || kind == AST_ASSIGN) {
+        regalloc_var(st, ast.name[n])->weight += weight;
+    } else if (kind == AST_LET) {
+        RegVar* v = regalloc_var(st, ast.name[n]);
+        Node init = ast.nkids[n] ? ast_child(n, 0) : 0;
+        v->decls++;
+        v->uninit = !init;
+        // struct_type holds any non-primitive declared type; only a struct needs the slot
+        if (ast_decl(n)->is_array || (ast_decl(n)->struct_type && typetab_lookup(cg->types, ast_decl(n)->struct_type)) ||
+            (init && (ast.kind[init] == AST_ARRAY_LITERAL || ast.kind[init] == AST_STRUCT_LITERAL)))
+            v->fixed = 1;
+    }
+    if (kind == AST_WHILE && weight < (1 << 20)) weight *= 8;
+    for (int i = 0; i < ast.nkids[n]; i++) {
+        Node c = ast_child(n, i);
+        // Operands that codegen reaches through the stack slot
+        if (ast.name[c] && (kind == AST_ADDR_OF || kind == AST_DEREF ||
+                            (i == 0 && (kind == AST_INDEX || kind == AST_ARRAY_ASSIGN ||
+                                        kind == AST_FIELD_ACCESS || kind == AST_FIELD_ASSIGN))))
+            regalloc_var(st, ast.name[c])->fixed = 1;
+        regalloc_scan(cg, c, weight);
+    }
+}
+
+// Pick the register locals of function `f`; returns how many registers
+// they use
+int regalloc_func(Codegen* cg, Node f) {
+    SymbolTable* st = cg->symtab;
+    int param_count = ast.nkids[f] - 1;
+    for (int i = 0; i < param_count && i < 6; i++) regalloc_var(st, ast.name[ast_child(f, i)])->decls++;
+    regalloc_scan(cg, ast_child(f, param_count), 1);
+
+    int used = 0;
+    while (used < REGALLOC_REGS) {
+        RegVar* best = NULL;
+        for (int i = 0; i < st->var_count; i++) {
+            RegVar* v = &st->vars[i];
+            if (v->decls == 1 && !v->fixed && !v->reg && v->weight >= REGALLOC_MIN_WEIGHT &&
+                (!best || v->weight > best->weight))
+                best = v;
+        }
+        if (!best) break;
+        best->reg = regalloc_regs[used++];
+    }
+    return used;
+}
+
+// Give the symbol just declared its register, if it has one
+void regalloc_bind(Codegen* cg) {
+    if (!cg->saved_regs) return;
+    Symbol* sym = &cg->symtab->symbols[cg->symtab->count - 1];
+    int i = name_index_get(&cg->symtab->var_index, sym->name);
+    if (i >= 0) sym->reg = cg->symtab->vars[i].reg;
+}
+
+// Store rax into a local
+void gen_store_local(Codegen* cg, Symbol* sym) {
+    if (sym->reg) emit_s(cg, "    mov ", sym->reg, ", rax\n");
+    else emit_i(cg, "    mov [rbp", sym->offset, "], rax\n");
+}
+
+// Restore the registers the prologue saved, and return
+void gen_epilogue(Codegen* cg) {
+    emit_lit(cg, "    leave\n");
+    for (int i = cg->saved_regs - 1; i >= 0; i--) emit_s(cg, "    pop ", regalloc_regs[i], "\n");
+    emit_lit(cg, "    ret\n");
+}
+
+// Does evaluating n stay clear of calls? Large expressions are not searched
+int expr_call_free(Node n, int* budget) {
+    if (--*budget < 0 || ast.kind[n] == AST_CALL) return 0;
+    for (int i = 0; i < ast.nkids[n]; i++)
+        if (!expr_call_free(ast_child(n, i), budget)) return 0;
+    return 1;
+}
+
+// Keep rax while `next` is evaluated: returns the scratch register holding
+// it, or NULL when it was pushed. Release it with gen_restore_rax.
+const char* gen_save_rax(Codegen* cg, Node next) {
+    int budget = REGALLOC_CALL_SCAN;
+    if (optimization_level >= 1 && cg->temps < REGALLOC_TEMPS && expr_call_free(next, &budget)) {
+        const char* reg = regalloc_temps[cg->temps++];
+        emit_s(cg, "    mov ", reg, ", rax\n");
+        return reg;
+    }
+    emit_lit(cg, "    push rax\n");
+    return NULL;
+}
+
+// Move the value saved by gen_save_rax into dst (e.g. "rax")
+void gen_restore_rax(Codegen* cg, const char* saved, const char* dst) {
+    if (saved) {
+        emit_s(cg, "    mov ", dst, ", ");
+        emit_str(cg, saved);
+        emit_lit(cg, "\n");
+        cg->temps--;
+    } else {
+        emit_s(cg, "    pop ", dst, "\n");
+    }
+}
+
+// pre, v and post as one string in buf, as sprintf "%s%ld%s" would write it
+const char* num_operand(char* buf, const char* pre, long v, const char* post) {
+    char digits[24];
+    char* d = num_text(digits + sizeof(digits), v);
+    size_t a = strlen(pre), len = digits + sizeof(digits) - d;
+    memcpy(buf, pre, a);
+    memcpy(buf + a, d, len);
+    strcpy(buf + a + len, post);
+    return buf;
+}
+
+// -O1+: the text of n as a direct operand (immediate, register or memory)
+// when it is a number or a scalar variable, else NULL. buf holds the text.
+const char* gen_leaf_operand(Codegen* cg, Node n, char* buf) {
+    if (optimization_level < 1) return NULL;
+    if (ast.kind[n] == AST_NUMBER) {
+        long v = ast_lit(n)->num;
+        if (v != (int32_t)v) return NULL;
+        return num_operand(buf, "", v, "");
+    }
+    if (ast.kind[n] == AST_FIELD_ACCESS && ast.kind[ast_child(n, 0)] == AST_IDENT) {
+        // A field of a struct held in the frame
+        Symbol* sym = symtab_lookup_symbol(cg->symtab, ast.name[ast_child(n, 0)]);
+        if (!sym || !sym->type_name || atom_pointee(sym->type_name)) return NULL;
+        int field_off = typetab_field_offset(cg->types, sym->type_name, ast.name[n]);
+        return field_off >= 0 ? num_operand(buf, "[rbp", sym->offset + field_off, "]") : NULL;
+    }
+    if (ast.kind[n] != AST_IDENT) return NULL;
+    VarRef ref = resolve_var(cg, ast.name[n]);
+    if (ref.local) {
+        if (ref.local->reg) return ref.local->reg;
+        if (ref.local->size > 1 && ref.local->type_name && !ref.local->is_pointer) return NULL;  // Array
+        return num_operand(buf, "[rbp", ref.local->offset, "]");
+    }
+    if (ref.global && ref.global->folded) {
+        if (ref.global->value != (int32_t)ref.global->value) return NULL;
+        return num_operand(buf, "", ref.global->value, "");
+    }
+    if (ref.global && !ref.global->is_array && atom_tab[ref.global->name].len < 100) {
+        sprintf(buf, "[%s]", atom_str(ref.global->name));
+        return buf;
+    }
+    return NULL;
+}
+
+// Evaluate the operands of a binary operator for `op rax, <operand>`:
+// the left one into rax, and returns the right one's operand text, which
+// is rbx unless it could be used directly (buf holds the text)
+const char* gen_operands(Codegen* cg, Node left, Node right, char* buf) {
+    const char* leaf = gen_leaf_operand(cg, right, buf);
+    if (leaf) {
+        gen_expr(cg, left);
+        return leaf;
+    }
+    if (optimization_level >= 1 && ast.kind[left] == AST_NUMBER && ast_lit(left)->num == (int32_t)ast_lit(left)->num) {
+        gen_expr(cg, right);  // A constant cannot change in between
+        emit_lit(cg, "    mov rbx, rax\n");
+        gen_expr(cg, left);
+        return "rbx";
+    }
+    gen_expr(cg, left);
+    const char* saved = gen_save_rax(cg, right);
+    gen_expr(cg, right);
+    emit_lit(cg, "    mov rbx, rax\n");
+    gen_restore_rax(cg, saved, "rax");
+    return "rbx";
+}
+
+// cmp of a comparison's operands; the result is left in the flags
+void gen_compare(Codegen* cg, Node n) {
+    char buf[128];
+    const char* right_op = gen_operands(cg, ast_child(n, 0), ast_child(n, 1), buf);
+    emit_s(cg, "    cmp rax, ", right_op, "\n");
+}
+
+// Jump to .L<label> when condition n is false. -O1+ branches on the flags
+// of a comparison instead of on the 0 or 1 it would make.
+void gen_branch_false(Codegen* cg, Node n, int label) {
+    const char* jump = NULL;
+    if (optimization_level >= 1 && ast.kind[n] == AST_COMPARE) {
+        int op = ast_op(n);
+        jump = op == T_EQEQ ? "jne" : op == T_NEQ ? "je" : op == T_LT ? "jge" :
+               op == T_GT ? "jle" : op == T_LTE ? "jg" : op == T_GTE ? "jl" : NULL;
+    }
+    if (jump) {
+        gen_compare(cg, n);
+        emit_s(cg, "    ", jump, " .L");
+    } else {
+        gen_expr(cg, n);
+        emit_lit(cg, "    test rax, rax\n    jz .L");
+    }
+    emit_num(cg, label);
+    emit_lit(cg, "\n");
+}
+
+// malloc(size) -> pointer, size in rax
+// Uses mmap syscall (9) with size tracking header
+// Layout: [8 bytes size][allocated memory]
+// Returns pointer to allocated memory (after header)
+void gen_malloc_rax(Codegen* cg) {
+    emit_lit(cg, "    mov rbx, rax\n");  // Save original size (syscall keeps rbx)
+    emit_lit(cg, "    add rax, 8\n");    // Add 8 bytes for size header
+    emit_lit(cg, "    mov rsi, rax\n");  // length = size + 8
+    emit_lit(cg, "    xor rdi, rdi\n");  // addr = 0 (let kernel choose)
+    emit_lit(cg, "    mov rdx, 3\n");    // prot = PROT_READ | PROT_WRITE
+    emit_lit(cg, "    mov r10, 34\n");   // flags = MAP_PRIVATE | MAP_ANONYMOUS (0x22)
+    emit_lit(cg, "    mov r8, -1\n");    // fd = -1
+    emit_lit(cg, "    xor r9, r9\n");    // offset = 0
+    emit_lit(cg, "    mov rax, 9\n");    // sys_mmap
+    emit_lit(cg, "    syscall\n");
+    // Check if mmap failed (returns -1)
+    emit_lit(cg, "    cmp rax, -1\n");
+    emit_i(cg, "    je .Lmalloc_failed_", new_label(cg), "\n");
+    // Store size in header
+    emit_lit(cg, "    mov [rax], rbx\n");  // Store original size in first 8 bytes
+    emit_lit(cg, "    add rax, 8\n");      // Return pointer after header
+    emit_i(cg, ".Lmalloc_failed_", cg->label_count - 1, ":\n");
+    // Returns pointer in rax (ptr+8, or -1 on error which stays -1)
+}
+
+// free(ptr) -> status, ptr in rax
+// Uses munmap syscall (11): munmap(addr, length)
+// Reads size from header at (ptr - 8)
+void gen_free_rax(Codegen* cg) {
+    emit_lit(cg, "    ; free(ptr) - read size from header and munmap\n");
+    emit_lit(cg, "    test rax, rax\n");  // Check if ptr is NULL
+    emit_i(cg, "    jz .Lfree_null_", new_label(cg), "\n");
+    emit_lit(cg, "    mov rdi, rax\n");   // Save user pointer
+    emit_lit(cg, "    sub rdi, 8\n");     // rdi = actual allocation start (header)
+    emit_lit(cg, "    mov rsi, [rdi]\n"); // Load size from header
+    emit_lit(cg, "    add rsi, 8\n");     // Add header size to get total allocation
+    emit_lit(cg, "    mov rax, 11\n");    // sys_munmap
+    emit_lit(cg, "    syscall\n");
+    // Returns 0 on success, -1 on error
+    emit_i(cg, "    jmp .Lfree_done_", cg->label_count - 1, "\n");
+    emit_i(cg, ".Lfree_null_", cg->label_count - 1, ":\n");
+    emit_lit(cg, "    xor rax, rax\n");   // free(NULL) returns 0
+    emit_i(cg, ".Lfree_done_", cg->label_count - 1, ":\n");
+}
+
+// Helper: Generate builtin function calls
+void gen_builtin_call(Codegen* cg, Node n) {
+    switch (ast.name[n]) {
+        case ATOM_print: {
+            if (ast.nkids[n] > 0) {
+                gen_expr(cg, ast_child(n, 0));
+                emit_lit(cg, "    mov rsi, rax\n    mov rdx, rbx\n");
+                emit_lit(cg, "    mov rdi, 1\n    mov rax, 1\n    syscall\n");
+            }
+            break;
+        }
+        case ATOM_println: {
+            if (ast.nkids[n] > 0) {
+                gen_expr(cg, ast_child(n, 0));
+                emit_lit(cg, "    mov rsi, rax\n    mov rdx, rbx\n");
+                emit_lit(cg, "    mov rdi, 1\n    mov rax, 1\n    syscall\n");
+            }
+            emit_lit(cg, "    mov byte [rbp-256], 10\n");
+            emit_lit(cg, "    lea rsi, [rbp-256]\n");
+            emit_lit(cg, "    mov rdi, 1\n    mov rdx, 1\n    mov rax, 1\n    syscall\n");
+            break;
+        }
+        case ATOM_print_int: {
+            if (ast.nkids[n] > 0) {
+                gen_expr(cg, ast_child(n, 0));
+                emit_lit(cg, "    call __print_int\n");
+            }
+            break;
+        }
+        case ATOM_exit: {
+            if (ast.nkids[n] > 0) {
+                gen_expr(cg, ast_child(n, 0));
+                emit_lit(cg, "    mov rdi, rax\n");
             } else {
-                // Regular variable or pointer - load value
-                emit(cg, "    mov rax, [rbp%d]\n", off);
+                emit_lit(cg, "    xor rdi, rdi\n");
             }
-        } else {
-            // Try global variable
-            GlobalVar* gvar = global_symtab_lookup(cg->global_symtab, n->name);
-            if (gvar) {
-                // For arrays, load address; for scalars, load value
-                if (gvar->is_array) {
-                    emit(cg, "    lea rax, [%s]\n", gvar->name);
+            emit_lit(cg, "    mov rax, 60\n    syscall\n");
+            break;
+        }
+        case ATOM_strcmp: {
+            if (ast.nkids[n] >= 2) {
+                gen_expr(cg, ast_child(n, 0));
+                emit_lit(cg, "    push rax\n");
+                gen_expr(cg, ast_child(n, 1));
+                emit_lit(cg, "    mov rsi, rax\n");
+                emit_lit(cg, "    pop rdi\n");
+                emit_lit(cg, "    call __strcmp\n");
+            }
+            break;
+        }
+        case ATOM_strcpy: {
+            if (ast.nkids[n] >= 2) {
+                gen_expr(cg, ast_child(n, 0));
+                emit_lit(cg, "    push rax\n");
+                gen_expr(cg, ast_child(n, 1));
+                emit_lit(cg, "    mov rsi, rax\n");
+                emit_lit(cg, "    pop rdi\n");
+                emit_lit(cg, "    call __strcpy\n");
+            }
+            break;
+        }
+        case ATOM_strlen: {
+            if (ast.nkids[n] >= 1) {
+                gen_expr(cg, ast_child(n, 0));
+                emit_lit(cg, "    mov rdi, rax\n");
+                emit_lit(cg, "    call __strlen\n");
+            }
+            break;
+        }
+        case ATOM_open: {
+            // open(filename, flags, mode) -> fd
+            // syscall 2: rax=2, rdi=filename, rsi=flags, rdx=mode
+            if (ast.nkids[n] >= 2) {
+                gen_expr(cg, ast_child(n, 0));  // filename
+                emit_lit(cg, "    mov rdi, rax\n");
+                gen_expr(cg, ast_child(n, 1));  // flags
+                emit_lit(cg, "    mov rsi, rax\n");
+                if (ast.nkids[n] >= 3) {
+                    gen_expr(cg, ast_child(n, 2));  // mode (optional)
+                    emit_lit(cg, "    mov rdx, rax\n");
                 } else {
-                    emit(cg, "    mov rax, [%s]\n", gvar->name);
+                    emit_lit(cg, "    mov rdx, 0644\n");  // Default permissions
+                }
+                emit_lit(cg, "    mov rax, 2\n");  // sys_open
+                emit_lit(cg, "    syscall\n");
+            }
+            break;
+        }
+        case ATOM_read: {
+            // read(fd, buffer, count) -> bytes_read
+            // syscall 0: rax=0, rdi=fd, rsi=buffer, rdx=count
+            if (ast.nkids[n] >= 3) {
+                gen_expr(cg, ast_child(n, 0));  // fd
+                emit_lit(cg, "    mov rdi, rax\n");
+                gen_expr(cg, ast_child(n, 1));  // buffer
+                emit_lit(cg, "    mov rsi, rax\n");
+                gen_expr(cg, ast_child(n, 2));  // count
+                emit_lit(cg, "    mov rdx, rax\n");
+                emit_lit(cg, "    mov rax, 0\n");  // sys_read
+                emit_lit(cg, "    syscall\n");
+            }
+            break;
+        }
+        case ATOM_write: {
+            // write(fd, buffer, count) -> bytes_written
+            // syscall 1: rax=1, rdi=fd, rsi=buffer, rdx=count
+            if (ast.nkids[n] >= 3) {
+                gen_expr(cg, ast_child(n, 0));  // fd
+                emit_lit(cg, "    mov rdi, rax\n");
+                gen_expr(cg, ast_child(n, 1));  // buffer
+                emit_lit(cg, "    mov rsi, rax\n");
+                gen_expr(cg, ast_child(n, 2));  // count
+                emit_lit(cg, "    mov rdx, rax\n");
+                emit_lit(cg, "    mov rax, 1\n");  // sys_write
+                emit_lit(cg, "    syscall\n");
+            }
+            break;
+        }
+        case ATOM_close: {
+            // close(fd) -> status
+            // syscall 3: rax=3, rdi=fd
+            if (ast.nkids[n] >= 1) {
+                gen_expr(cg, ast_child(n, 0));  // fd
+                emit_lit(cg, "    mov rdi, rax\n");
+                emit_lit(cg, "    mov rax, 3\n");  // sys_close
+                emit_lit(cg, "    syscall\n");
+            }
+            break;
+        }
+        case ATOM_malloc: {
+            if (ast.nkids[n] >= 1) {
+                gen_expr(cg, ast_child(n, 0));  // size requested by user
+                gen_malloc_rax(cg);
+            }
+            break;
+        }
+        case ATOM_free: {
+            if (ast.nkids[n] >= 1) {
+                gen_expr(cg, ast_child(n, 0));  // ptr (user pointer)
+                gen_free_rax(cg);
+            }
+            break;
+        }
+        case ATOM_syscall:
+        case ATOM_syscall6: {
+            // Generic syscall: syscall6(num, arg1, arg2, arg3, arg4, arg5, arg6)
+            // This allows Chronos code to make ANY syscall directly
+            // rax=num, rdi=arg1, rsi=arg2, rdx=arg3, r10=arg4, r8=arg5, r9=arg6
+
+            if (ast.nkids[n] >= 1) {
+                // First, evaluate all arguments and push them to stack
+                // We need to do this in reverse order to pop them correctly
+                const char* regs[] = {"rdi", "rsi", "rdx", "r10", "r8", "r9"};
+
+                // Push all arguments
+                for (int i = 1; i < ast.nkids[n] && i <= 6; i++) {
+                    gen_expr(cg, ast_child(n, i));
+                    emit_lit(cg, "    push rax\n");
+                }
+
+                // Pop arguments into registers (reverse order)
+                for (int i = (ast.nkids[n] - 1 < 6 ? ast.nkids[n] - 1 : 6); i >= 1; i--) {
+                    emit_s(cg, "    pop ", regs[i-1], "\n");
                 }
+
+                // Syscall number in rax
+                gen_expr(cg, ast_child(n, 0));  // syscall number
+                emit_lit(cg, "    syscall\n");
+                // Result already in rax
+            }
+            break;
+        }
+        default: {
+            // Regular function call
+            const char* regs[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+            for (int i = 0; i < ast.nkids[n] && i < 6; i++) {
+                gen_expr(cg, ast_child(n, i));
+                emit_s(cg, "    mov ", regs[i], ", rax\n");
+            }
+            emit_n(cg, "    call ", ast.name[n], "\n");
+            break;
+        }
+    }
+}
+
+// Index in rax must be in [0, count). One unsigned compare also catches
+// negative indices; failures go to the shared __bounds_fail trap.
+void gen_bounds_check(Codegen* cg, int count) {
+    emit_i(cg, "    cmp rax, ", count, "\n");
+    emit_lit(cg, "    jae __bounds_fail\n");
+    cg->bounds_trap_used = 1;
+}
+
+// Helper: Generate address-of operator (&)
+void gen_addr_of(Codegen* cg, Node n) {
+    if (ast.nkids[n] == 0) return;
+    Node var = ast_child(n, 0);
+    if (!var) return;
+
+    if (ast.kind[var] == AST_IDENT) {
+        Symbol* sym = symtab_lookup_symbol(cg->symtab, ast.name[var]);
+        if (sym) {
+            int off = sym->offset;
+            // Check if this is already a pointer - if so, just load the value
+            if (sym->is_pointer) {
+                // Variable is already a pointer - just load it
+                emit_i(cg, "    mov rax, [rbp", off, "]\n");
             } else {
-                emit(cg, "    mov rax, 0  ; unknown var %s\n", n->name);
+                // Regular variable - take its address
+                emit_i(cg, "    lea rax, [rbp", off, "]\n");
+            }
+        }
+    } else if (ast.kind[var] == AST_INDEX) {
+        // &array[index] - compute address of element
+        if (ast.nkids[var] < 2) return;
+        Node arr = ast_child(var, 0);
+        if (!arr || !ast.name[arr]) return;
+
+        Symbol* sym = symtab_lookup_symbol(cg->symtab, ast.name[arr]);
+        if (sym) {
+            gen_expr(cg, ast_child(var, 1));  // Index expression
+
+            // Bounds checking for address-of
+            if (sym->size > 0) gen_bounds_check(cg, sym->size / 8);
+
+            // Calculate address: rbp + offset + (index * 8)
+            emit_lit(cg, "    imul rax, 8\n");
+            emit_i(cg, "    lea rbx, [rbp", sym->offset, "]\n");
+            emit_lit(cg, "    add rax, rbx\n");
+        }
+    }
+}
+
+// Helper: Generate array indexing with bounds checking
+void gen_array_index(Codegen* cg, Node n) {
+    Node arr = ast_child(n, 0);
+
+    // Handle field access indexing: lex.source[i]
+    if (ast.kind[arr] == AST_FIELD_ACCESS) {
+        Node obj = ast_child(arr, 0);
+        Atom field_name = ast.name[arr];
+
+        Symbol* sym = symtab_lookup_symbol(cg->symtab, ast.name[obj]);
+        if (sym && sym->type_name) {
+            // Get struct type (remove pointer if present)
+            Atom struct_type = sym->type_name;
+            int is_pointer = 0;
+            if (atom_pointee(struct_type)) {
+                struct_type = atom_pointee(struct_type);
+                is_pointer = 1;
+            }
+
+            int field_off = typetab_field_offset(cg->types, struct_type, field_name);
+            if (field_off >= 0) {
+                // Get field type to determine element size
+                Atom field_type = typetab_field_type(cg->types, struct_type, field_name);
+                int elem_size = 1;  // Default to i8
+                int is_struct_elem = 0;
+
+                if (field_type) {
+                    Atom base_type = field_type;
+                    if (atom_pointee(base_type)) base_type = atom_pointee(base_type);  // Element type
+
+                    if (prim_size(base_type)) {
+                        elem_size = prim_size(base_type);
+                    } else {
+                        // Not a primitive type - check if it's a struct
+                        StructType* st = typetab_lookup(cg->types, base_type);
+                        if (st) {
+                            elem_size = st->size;
+                            is_struct_elem = 1;
+                        }
+                    }
+                }
+
+                // Generate index expression first
+                gen_expr(cg, ast_child(n, 1));  // Index in rax
+
+                // Scale index by element size
+                if (elem_size > 1) {
+                    emit_i(cg, "    imul rax, ", elem_size, "\n");
+                }
+
+                emit_lit(cg, "    push rax\n");     // Save scaled index
+
+                // Load the pointer from struct field
+                if (is_pointer) {
+                    emit_i(cg, "    mov rbx, [rbp", sym->offset, "]\n");  // Load struct pointer
+                    if (field_off == 0) {
+                        emit_lit(cg, "    mov rbx, [rbx]\n");  // Load field (pointer)
+                    } else {
+                        emit_i(cg, "    mov rbx, [rbx+", field_off, "]\n");  // Load field (pointer)
+                    }
+                } else {
+                    emit_i(cg, "    mov rbx, [rbp", sym->offset + field_off, "]\n");  // Load field (pointer)
+                }
+
+                emit_lit(cg, "    pop rax\n");      // Restore scaled index
+                emit_lit(cg, "    add rbx, rax\n"); // Add scaled index to pointer
+
+                // For structs, return address; for primitives, load value
+                if (is_struct_elem) {
+                    emit_lit(cg, "    mov rax, rbx\n");  // Return address of struct element
+                } else {
+                    // Load element based on size
+                    if (elem_size == 1) {
+                        emit_lit(cg, "    movzx rax, byte [rbx]\n");
+                    } else if (elem_size == 2) {
+                        emit_lit(cg, "    movzx rax, word [rbx]\n");
+                    } else if (elem_size == 4) {
+                        emit_lit(cg, "    mov eax, [rbx]\n");
+                    } else {
+                        emit_lit(cg, "    mov rax, [rbx]\n");
+                    }
+                }
+                return;
             }
         }
-    } else if (n->type == AST_ADDR_OF) {
-        gen_addr_of(cg, n);
-    } else if (n->type == AST_DEREF) {
-        // Dereference: *ptr
-        gen_expr(cg, n->children[0]);
-        emit(cg, "    mov rax, [rax]\n");  // Load value at address in rax
-    } else if (n->type == AST_UNARY) {
-        // Unary operators: '-' (negation) and '!' (logical NOT)
-        if (n->children && n->child_count > 0) {
-            gen_expr(cg, n->children[0]);
-            if (n->op && n->op[0] == '-') {
-                emit(cg, "    neg rax\n");  // Two's complement negation
-            } else if (n->op && n->op[0] == '!') {
-                // Logical NOT: convert non-zero to 0, zero to 1
-                emit(cg, "    test rax, rax\n");
-                emit(cg, "    setz al  ; Set al to 1 if rax was 0\n");
-                emit(cg, "    movzx rax, al\n");
+    }
+
+    // Handle string literal indexing: "Hello"[0]
+    if (ast.kind[arr] == AST_STRING) {
+        int str_len = ast_lit(arr)->lit.len;
+        char* label = strtab_add(cg->strtab, src_text + ast_lit(arr)->lit.off, str_len);
+
+        gen_expr(cg, ast_child(n, 1));  // Index in rax
+
+        // Bounds checking
+        gen_bounds_check(cg, str_len);
+
+        // Load byte from string: string_label + index
+        emit_s(cg, "    lea rbx, [", label, "]\n");
+        emit_lit(cg, "    add rbx, rax\n");
+        emit_lit(cg, "    movzx rax, byte [rbx]\n");
+        return;
+    }
+
+    Symbol* sym = symtab_lookup_symbol(cg->symtab, ast.name[arr]);
+
+    // Try local array/pointer first
+    if (sym) {
+        gen_expr(cg, ast_child(n, 1));  // Index in rax
+
+        // Check if this is a pointer parameter (not an array)
+        if (sym->is_pointer) {
+            // This is a pointer - no bounds checking, just index through it
+            // Determine element size from type_name (e.g., "*i8", "*i64", "*Point")
+            int elem_size = 1;  // Default to i8
+            int is_struct = 0;
+
+            if (sym->type_name) {
+                Atom base_type = sym->type_name;
+                if (atom_pointee(base_type)) base_type = atom_pointee(base_type);  // Skip '*'
+
+                if (prim_size(base_type)) {
+                    elem_size = prim_size(base_type);
+                } else {
+                    // Not a primitive type - check if it's a struct
+                    StructType* st = typetab_lookup(cg->types, base_type);
+                    if (st) {
+                        elem_size = st->size;
+                        is_struct = 1;
+                    }
+                }
+            }
+
+            emit_i(cg, "    mov rbx, [rbp", sym->offset, "]\n");  // Load pointer
+
+            // Scale index by element size
+            if (elem_size > 1) {
+                emit_i(cg, "    imul rax, ", elem_size, "\n");
+            }
+
+            emit_lit(cg, "    add rbx, rax\n");  // Add scaled index
+
+            // For structs, return address in rax (for field access)
+            // For primitives, load the value
+            if (is_struct) {
+                emit_lit(cg, "    mov rax, rbx\n");  // Return address of struct element
+            } else {
+                // Load element based on size
+                if (elem_size == 1) {
+                    emit_lit(cg, "    movzx rax, byte [rbx]\n");
+                } else if (elem_size == 2) {
+                    emit_lit(cg, "    movzx rax, word [rbx]\n");
+                } else if (elem_size == 4) {
+                    emit_lit(cg, "    mov eax, [rbx]\n");
+                } else {
+                    emit_lit(cg, "    mov rax, [rbx]\n");
+                }
+            }
+            return;
+        }
+
+        // It's a real array - do bounds checking
+        // Determine element size from type_name
+        int elem_size = 8;  // Default to 8 bytes (i64)
+        int array_count = sym->size;  // size is already the count for typed arrays
+        int is_struct = 0;
+
+        if (sym->type_name) {
+            if (prim_size(sym->type_name)) {
+                elem_size = prim_size(sym->type_name);
+            } else {
+                // Not a primitive - check if struct
+                StructType* st = typetab_lookup(cg->types, sym->type_name);
+                if (st) {
+                    elem_size = st->size;
+                    is_struct = 1;
+                }
+            }
+        } else {
+            // If no type_name, assume old behavior (size is in qwords)
+            array_count = sym->size;
+        }
+
+        // Bounds checking
+        if (sym->size > 0) gen_bounds_check(cg, array_count);
+
+        // Calculate offset: index * elem_size
+        if (elem_size > 1) {
+            emit_i(cg, "    imul rax, ", elem_size, "\n");
+        }
+        emit_lit(cg, "    mov rbx, rax\n");
+
+        // For structs, return address; for primitives, load value
+        if (is_struct) {
+            emit_i(cg, "    lea rax, [rbp", sym->offset, "+rbx]\n");
+        } else {
+            // Load value with correct width
+            if (elem_size == 1) {
+                emit_i(cg, "    movzx rax, byte [rbp", sym->offset, "+rbx]\n");
+            } else if (elem_size == 2) {
+                emit_i(cg, "    movzx rax, word [rbp", sym->offset, "+rbx]\n");
+            } else if (elem_size == 4) {
+                emit_i(cg, "    mov eax, [rbp", sym->offset, "+rbx]\n");
+            } else {
+                emit_i(cg, "    mov rax, [rbp", sym->offset, "+rbx]\n");
+            }
+        }
+    } else {
+        // Try global array
+        GlobalVar* gvar = global_symtab_lookup(cg->global_symtab, ast.name[arr]);
+        if (gvar && gvar->is_array) {
+            gen_expr(cg, ast_child(n, 1));  // Index in rax
+
+            // For i8 arrays, element size is 1 byte
+            // For i32/i64, element size is 4/8 bytes
+            int elem_size = 1;  // Default to byte for i8
+            if (prim_size(gvar->elem_type)) elem_size = prim_size(gvar->elem_type);
+
+            // Calculate offset: index * elem_size
+            if (elem_size > 1) {
+                emit_i(cg, "    imul rax, ", elem_size, "\n");
+            }
+
+            // Load from global array: array_name + offset
+            emit_n(cg, "    lea rbx, [", gvar->name, "]\n");
+            emit_lit(cg, "    add rbx, rax\n");
+
+            // Load based on element size
+            if (elem_size == 1) {
+                emit_lit(cg, "    movzx rax, byte [rbx]\n");
+            } else if (elem_size == 2) {
+                emit_lit(cg, "    movzx rax, word [rbx]\n");
+            } else if (elem_size == 4) {
+                emit_lit(cg, "    mov eax, [rbx]\n");
+            } else {
+                emit_lit(cg, "    mov rax, [rbx]\n");
+            }
+        } else {
+            emit_lit(cg, "    mov rax, 0  ; array not found\n");
+        }
+    }
+}
+
+void gen_expr(Codegen* cg, Node n) {
+    if (!n) return;  // Null safety guard
+    if (ast.kind[n] == AST_NUMBER) {
+        char buf[24];
+        int len;
+        const char* text = number_text(n, buf, &len);
+        emit_lit(cg, "    mov rax, ");
+        emit_raw(cg, text, len);
+        emit_lit(cg, "\n");
+    } else if (ast.kind[n] == AST_STRING) {
+        char* label = strtab_add(cg->strtab, src_text + ast_lit(n)->lit.off, ast_lit(n)->lit.len);
+        emit_s(cg, "    mov rax, ", label, "\n");
+        emit_i(cg, "    mov rbx, ", (int)ast_lit(n)->lit.len, "\n");
+    } else if (ast.kind[n] == AST_IDENT) {
+        // Try local variable first
+        VarRef ref = resolve_var(cg, ast.name[n]);
+        if (ref.local) {
+            Symbol* sym = ref.local;
+            int off = sym->offset;
+            // Check if this is an array - if so, load address not value
+            if (sym->reg) {
+                emit_s(cg, "    mov rax, ", sym->reg, "\n");
+            } else if (sym->size > 1 && sym->type_name && !sym->is_pointer) {
+                // This is an array - use lea to get address
+                emit_i(cg, "    lea rax, [rbp", off, "]\n");
+            } else {
+                // Regular variable or pointer - load value
+                emit_i(cg, "    mov rax, [rbp", off, "]\n");
+            }
+        } else {
+            // Try global variable
+            GlobalVar* gvar = ref.global;
+            if (gvar) {
+                // For arrays, load address; for scalars, load value
+                if (gvar->folded) {
+                    emit_i(cg, "    mov rax, ", gvar->value, "\n");
+                } else if (gvar->is_array) {
+                    emit_n(cg, "    lea rax, [", gvar->name, "]\n");
+                } else {
+                    emit_n(cg, "    mov rax, [", gvar->name, "]\n");
+                }
+            } else {
+                emit_n(cg, "    mov rax, 0  ; unknown var ", ast.name[n], "\n");
+            }
+        }
+    } else if (ast.kind[n] == AST_ADDR_OF) {
+        gen_addr_of(cg, n);
+    } else if (ast.kind[n] == AST_DEREF) {
+        // Dereference: *ptr
+        gen_expr(cg, ast_child(n, 0));
+        emit_lit(cg, "    mov rax, [rax]\n");  // Load value at address in rax
+    } else if (ast.kind[n] == AST_UNARY) {
+        // Unary operators: '-' (negation) and '!' (logical NOT)
+        if (ast.nkids[n] > 0) {
+            gen_expr(cg, ast_child(n, 0));
+            if (ast_op(n) == T_MINUS) {
+                emit_lit(cg, "    neg rax\n");  // Two's complement negation
+            } else if (ast_op(n) == T_BANG) {
+                // Logical NOT: convert non-zero to 0, zero to 1
+                emit_lit(cg, "    test rax, rax\n");
+                emit_lit(cg, "    setz al  ; Set al to 1 if rax was 0\n");
+                emit_lit(cg, "    movzx rax, al\n");
+            }
+        }
+    } else if (ast.kind[n] == AST_ASSIGN) {
+        gen_expr(cg, ast_child(n, 0));
+        // Local variable first, then global
+        VarRef ref = resolve_var(cg, ast.name[n]);
+        if (ref.local) {
+            gen_store_local(cg, ref.local);
+        } else if (ref.global) {
+            global_assign_check(ref.global);
+            emit_n(cg, "    mov [", ref.global->name, "], rax\n");
+        }
+    } else if (ast.kind[n] == AST_BINOP) {
+        // Strength reduction optimization (O2+): Check if right operand is power of 2
+        Node right = ast_child(n, 1);
+        int use_shift = 0;
+        long right_val = 0;
+        int shift_amount = 0;
+
+        if (optimization_level >= 2 && right && ast.kind[right] == AST_NUMBER) {
+            right_val = ast_lit(right)->num;
+            if (is_power_of_2(right_val)) {
+                use_shift = 1;
+                shift_amount = get_log2(right_val);
+            }
+        }
+
+        if (use_shift && (ast_op(n) == T_STAR || ast_op(n) == T_SLASH || ast_op(n) == T_MOD))
+            gen_expr(cg, ast_child(n, 0));
+
+        if (use_shift && ast_op(n) == T_STAR) {
+            // Multiplication by power of 2: use left shift
+            emit(cg, "    ; Optimized: x * %ld => x << %d\n", right_val, shift_amount);
+            emit_i(cg, "    shl rax, ", shift_amount, "\n");
+        } else if (use_shift && ast_op(n) == T_SLASH) {
+            // Division by power of 2: use arithmetic right shift
+            emit(cg, "    ; Optimized: x / %ld => x >> %d\n", right_val, shift_amount);
+            emit_i(cg, "    sar rax, ", shift_amount, "\n");
+        } else if (use_shift && ast_op(n) == T_MOD) {
+            // Modulo by power of 2: use AND mask
+            long mask = right_val - 1;
+            emit(cg, "    ; Optimized: x %% %ld => x & %ld\n", right_val, mask);
+            emit_i(cg, "    and rax, ", mask, "\n");
+        } else {
+            // Normal codegen: left in rax, right in rbx or used directly
+            char buf[128];
+            const char* right_op = gen_operands(cg, ast_child(n, 0), right, buf);
+            // -O1+: a nonzero constant divisor needs no check for zero
+            int nonzero = optimization_level >= 1 && ast.kind[right] == AST_NUMBER && ast_lit(right)->num;
+            if (ast_op(n) == T_SLASH || ast_op(n) == T_MOD) {
+                if (strcmp(right_op, "rbx")) emit_s(cg, "    mov rbx, ", right_op, "\n");
+            }
+            if (ast_op(n) == T_PLUS) emit_s(cg, "    add rax, ", right_op, "\n");
+            else if (ast_op(n) == T_MINUS) emit_s(cg, "    sub rax, ", right_op, "\n");
+            else if (ast_op(n) == T_STAR) emit_s(cg, "    imul rax, ", right_op, "\n");
+            else if ((ast_op(n) == T_SLASH || ast_op(n) == T_MOD) && nonzero) {
+                emit_lit(cg, "    xor rdx, rdx\n    idiv rbx\n");
+                if (ast_op(n) == T_MOD) emit_lit(cg, "    mov rax, rdx  ; Move remainder to rax\n");
+            }
+            else if (ast_op(n) == T_SLASH) {
+            // Division by zero check
+            int skip_label = new_label(cg);
+            emit_lit(cg, "    test rbx, rbx\n");
+            emit_i(cg, "    jnz .L", skip_label, "\n");
+            emit_lit(cg, "    ; Division by zero - return 0\n");
+            emit_lit(cg, "    xor rax, rax\n");
+            emit_i(cg, "    jmp .L", skip_label, "_end\n");
+            emit_i(cg, ".L", skip_label, ":\n");
+            emit_lit(cg, "    xor rdx, rdx\n    idiv rbx\n");
+            emit_i(cg, ".L", skip_label, "_end:\n");
+        }
+        else if (ast_op(n) == T_MOD) {
+            // Modulo operation (remainder after division)
+            int skip_label = new_label(cg);
+            emit_lit(cg, "    test rbx, rbx\n");
+            emit_i(cg, "    jnz .L", skip_label, "\n");
+            emit_lit(cg, "    ; Modulo by zero - return 0\n");
+            emit_lit(cg, "    xor rax, rax\n");
+            emit_i(cg, "    jmp .L", skip_label, "_end\n");
+            emit_i(cg, ".L", skip_label, ":\n");
+            emit_lit(cg, "    xor rdx, rdx\n    idiv rbx\n");
+            emit_lit(cg, "    mov rax, rdx  ; Move remainder to rax\n");
+            emit_i(cg, ".L", skip_label, "_end:\n");
+            }
+        }
+    } else if (ast.kind[n] == AST_COMPARE) {
+        gen_compare(cg, n);
+        if (ast_op(n) == T_EQEQ) emit_lit(cg, "    sete al\n");
+        else if (ast_op(n) == T_NEQ) emit_lit(cg, "    setne al\n");
+        else if (ast_op(n) == T_LT) emit_lit(cg, "    setl al\n");
+        else if (ast_op(n) == T_GT) emit_lit(cg, "    setg al\n");
+        else if (ast_op(n) == T_LTE) emit_lit(cg, "    setle al\n");
+        else if (ast_op(n) == T_GTE) emit_lit(cg, "    setge al\n");
+        emit_lit(cg, "    movzx rax, al\n");
+    } else if (ast.kind[n] == AST_LOGICAL) {
+        if (ast_op(n) == T_AND_AND) {
+            // Short-circuit AND: if left is false (0), don't evaluate right
+            int false_label = new_label(cg);
+            int end_label = new_label(cg);
+
+            gen_expr(cg, ast_child(n, 0));  // Evaluate left
+            emit_lit(cg, "    test rax, rax\n");
+            emit_i(cg, "    jz .L", false_label, "  ; Jump if left is false\n");
+
+            gen_expr(cg, ast_child(n, 1));  // Evaluate right
+            emit_lit(cg, "    test rax, rax\n");
+            emit_i(cg, "    jz .L", false_label, "  ; Jump if right is false\n");
+
+            emit_lit(cg, "    mov rax, 1  ; Both true\n");
+            emit_i(cg, "    jmp .L", end_label, "\n");
+
+            emit_i(cg, ".L", false_label, ":\n");
+            emit_lit(cg, "    xor rax, rax  ; Result is false\n");
+            emit_i(cg, ".L", end_label, ":\n");
+        } else if (ast_op(n) == T_OR_OR) {
+            // Short-circuit OR: if left is true (non-zero), don't evaluate right
+            int true_label = new_label(cg);
+            int end_label = new_label(cg);
+
+            gen_expr(cg, ast_child(n, 0));  // Evaluate left
+            emit_lit(cg, "    test rax, rax\n");
+            emit_i(cg, "    jnz .L", true_label, "  ; Jump if left is true\n");
+
+            gen_expr(cg, ast_child(n, 1));  // Evaluate right
+            emit_lit(cg, "    test rax, rax\n");
+            emit_i(cg, "    jnz .L", true_label, "  ; Jump if right is true\n");
+
+            emit_lit(cg, "    xor rax, rax  ; Both false\n");
+            emit_i(cg, "    jmp .L", end_label, "\n");
+
+            emit_i(cg, ".L", true_label, ":\n");
+            emit_lit(cg, "    mov rax, 1  ; Result is true\n");
+            emit_i(cg, ".L", end_label, ":\n");
+        }
+    } else if (ast.kind[n] == AST_CALL) {
+        gen_builtin_call(cg, n);
+    } else if (ast.kind[n] == AST_ARRAY_LITERAL) {
+        emit_lit(cg, "    ; array literal\n");
+        if (cg->symtab && cg->symtab->count > 0) {
+            Symbol* sym = &cg->symtab->symbols[cg->symtab->count - 1];
+            for (int i = 0; i < ast.nkids[n]; i++) {
+                gen_expr(cg, ast_child(n, i));
+                int elem_off = sym->offset + (i * 8);
+                emit_i(cg, "    mov [rbp", elem_off, "], rax\n");
+            }
+            emit_i(cg, "    lea rax, [rbp", sym->offset, "]\n");
+        }
+    } else if (ast.kind[n] == AST_INDEX) {
+        gen_array_index(cg, n);
+    } else if (ast.kind[n] == AST_STRUCT_LITERAL) {
+        emit_n(cg, "    ; struct literal ", ast_decl(n)->struct_type, "\n");
+        if (cg->symtab && cg->symtab->count > 0) {
+            Symbol* sym = &cg->symtab->symbols[cg->symtab->count - 1];
+            for (int i = 0; i < ast.nkids[n]; i++) {
+                Node field_assign = ast_child(n, i);
+                Atom field_name = ast.name[field_assign];
+                Node field_value = ast_child(field_assign, 0);
+
+                int field_off = typetab_field_offset(cg->types, ast_decl(n)->struct_type, field_name);
+                gen_expr(cg, field_value);
+                emit_i(cg, "    mov [rbp", sym->offset + field_off, "], rax\n");
+            }
+            emit_i(cg, "    lea rax, [rbp", sym->offset, "]\n");
+        }
+    } else if (ast.kind[n] == AST_FIELD_ACCESS) {
+        Node obj = ast_child(n, 0);
+        Atom field_name = ast.name[n];
+
+        // Check if object is a dereference (pointer access)
+        if (ast.kind[obj] == AST_DEREF) {
+            // ptr->field case (already desugared)
+            Node ptr = ast_child(obj, 0);
+            Symbol* sym = symtab_lookup_symbol(cg->symtab, ast.name[ptr]);
+            if (sym && sym->is_pointer && sym->type_name) {
+                int field_off = typetab_field_offset(cg->types, sym->type_name, field_name);
+                if (field_off >= 0) {
+                    emit_i(cg, "    mov rax, [rbp", sym->offset, "]\n");  // Load pointer
+                    emit_i(cg, "    mov rax, [rax+", field_off, "]\n");   // Access field
+                }
+            }
+        } else if (ast.kind[obj] == AST_IDENT) {
+            // Regular struct field access from identifier
+            Symbol* sym = symtab_lookup_symbol(cg->symtab, ast.name[obj]);
+            if (sym && sym->type_name) {
+                // Get the actual struct type name (remove pointer if present)
+                Atom struct_type = sym->type_name;
+                int is_pointer = 0;
+                if (atom_pointee(struct_type)) {
+                    struct_type = atom_pointee(struct_type);  // Skip the '*'
+                    is_pointer = 1;
+                }
+
+                int field_off = typetab_field_offset(cg->types, struct_type, field_name);
+                if (field_off >= 0) {
+                    if (is_pointer) {
+                        // For pointers: load pointer, then load field
+                        emit_i(cg, "    mov rax, [rbp", sym->offset, "]\n");  // Load pointer
+                        if (field_off == 0) {
+                            emit_lit(cg, "    mov rax, [rax]\n");  // Load field at offset 0
+                        } else {
+                            emit_i(cg, "    mov rax, [rax+", field_off, "]\n");  // Load field
+                        }
+                    } else {
+                        // For direct structs: load directly
+                        emit_i(cg, "    mov rax, [rbp", sym->offset + field_off, "]\n");
+                    }
+                }
+            }
+        } else {
+            // Field access from expression (e.g., array[index].field)
+            // Generate the expression first (should leave struct address in rax)
+            gen_expr(cg, obj);
+
+            // Now rax contains the address of the struct
+            // We need to know the struct type to get field offset
+            // For now, we'll try to infer it from the expression
+            // This is a simplified approach - full implementation needs type inference
+
+            // Try to get type from INDEX expression
+            if (ast.kind[obj] == AST_INDEX && ast.nkids[obj] > 0) {
+                Node base = ast_child(obj, 0);
+                Atom struct_type = ATOM_NONE;
+
+                if (ast.kind[base] == AST_IDENT) {
+                    // Simple case: array[index].field
+                    Symbol* base_sym = symtab_lookup_symbol(cg->symtab, ast.name[base]);
+                    if (base_sym && base_sym->type_name) {
+                        struct_type = base_sym->type_name;
+                        // Remove pointer prefix if present
+                        if (atom_pointee(struct_type)) struct_type = atom_pointee(struct_type);
+                    }
+                } else if (ast.kind[base] == AST_FIELD_ACCESS) {
+                    // Complex case: struct.field[index].field
+                    // E.g., container.tokens[0].value
+                    // base is AST_FIELD_ACCESS for "container.tokens"
+                    // Now we CAN determine the element type using type tracking!
+
+                    if (ast.nkids[base] > 0) {
+                        Node struct_obj = ast_child(base, 0);
+                        Atom field_name_inner = ast.name[base];  // "tokens"
+
+                        if (ast.kind[struct_obj] == AST_IDENT) {
+                            // Look up the struct variable
+                            Symbol* struct_sym = symtab_lookup_symbol(cg->symtab, ast.name[struct_obj]);
+                            if (struct_sym && struct_sym->type_name) {
+                                // Get the struct type (e.g., "Container" or "*Container")
+                                Atom container_type = struct_sym->type_name;
+                                if (atom_pointee(container_type)) container_type = atom_pointee(container_type);
+
+                                // Get the type of the field (e.g., "*Token" for tokens field)
+                                Atom field_type = typetab_field_type(cg->types, container_type, field_name_inner);
+                                if (field_type) {
+                                    // If it's a pointer type, extract base type
+                                    if (atom_pointee(field_type)) {
+                                        struct_type = atom_pointee(field_type);  // "*Token" -> "Token"
+                                    } else {
+                                        struct_type = field_type;
+                                    }
+                                }
+                            }
+                        }
+                    }
+                }
+
+                if (struct_type) {
+                    int field_off = typetab_field_offset(cg->types, struct_type, field_name);
+                    if (field_off >= 0) {
+                        if (field_off == 0) {
+                            emit_lit(cg, "    mov rax, [rax]\n");
+                        } else {
+                            emit_i(cg, "    mov rax, [rax+", field_off, "]\n");
+                        }
+                    }
+                }
+            }
+        }
+    } else if (ast.kind[n] == AST_ARRAY_ASSIGN) {
+        // Array assignment: array[index] = value
+        // children[0] = array base
+        // children[1] = index expression
+        // children[2] = value expression
+
+        if (ast.nkids[n] < 3) return;
+        Node arr = ast_child(n, 0);
+        Node index_expr = ast_child(n, 1);
+        Node value_expr = ast_child(n, 2);
+
+        if (!arr || !ast.name[arr]) return;
+
+        // Evaluate value expression and save it
+        gen_expr(cg, value_expr);
+        int temps = cg->temps;
+        const char* saved = gen_save_rax(cg, index_expr);
+
+        // Evaluate index expression
+        gen_expr(cg, index_expr);
+
+        // Try local array/pointer first
+        Symbol* sym = symtab_lookup_symbol(cg->symtab, ast.name[arr]);
+        if (sym) {
+            // Check if this is a pointer (not an array)
+            if (sym->is_pointer) {
+                // Pointer assignment: ptr[index] = value
+                // Determine element size from type_name
+                int elem_size = 8;  // Default to i64
+                if (sym->type_name) {
+                    Atom base_type = sym->type_name;
+                    if (atom_pointee(base_type)) base_type = atom_pointee(base_type);  // Skip '*'
+                    if (prim_size(base_type)) elem_size = prim_size(base_type);
+                }
+
+                // Scale index by element size
+                if (elem_size > 1) {
+                    emit_i(cg, "    imul rax, ", elem_size, "\n");
+                }
+
+                // Load pointer and add offset
+                emit_i(cg, "    mov rbx, [rbp", sym->offset, "]\n");  // Load pointer
+                emit_lit(cg, "    add rbx, rax\n");  // Add scaled index
+                gen_restore_rax(cg, saved, "rax");  // Restore value
+
+                // Store with correct width
+                if (elem_size == 1) {
+                    emit_lit(cg, "    mov byte [rbx], al\n");
+                } else if (elem_size == 2) {
+                    emit_lit(cg, "    mov word [rbx], ax\n");
+                } else if (elem_size == 4) {
+                    emit_lit(cg, "    mov dword [rbx], eax\n");
+                } else {
+                    emit_lit(cg, "    mov qword [rbx], rax\n");
+                }
+            } else {
+                // Local array assignment
+                // Determine element size from type_name
+                int elem_size = 8;  // Default to 8 bytes (i64)
+                if (prim_size(sym->type_name)) elem_size = prim_size(sym->type_name);
+
+                // Local array assignment with correct element size
+                if (elem_size > 1) {
+                    emit_i(cg, "    imul rax, ", elem_size, "\n");
+                }
+                emit_lit(cg, "    mov rbx, rax\n");
+                gen_restore_rax(cg, saved, "rax");  // Restore value
+
+                // Store with correct width
+                if (elem_size == 1) {
+                    emit_i(cg, "    mov byte [rbp", sym->offset, "+rbx], al\n");
+                } else if (elem_size == 2) {
+                    emit_i(cg, "    mov word [rbp", sym->offset, "+rbx], ax\n");
+                } else if (elem_size == 4) {
+                    emit_i(cg, "    mov dword [rbp", sym->offset, "+rbx], eax\n");
+                } else {
+                    emit_i(cg, "    mov qword [rbp", sym->offset, "+rbx], rax\n");
+                }
+            }
+        } else {
+            // Try global array
+            GlobalVar* gvar = global_symtab_lookup(cg->global_symtab, ast.name[arr]);
+            if (gvar && gvar->is_array) {
+                // Calculate element size
+                int elem_size = 1;  // i8
+                if (prim_size(gvar->elem_type)) elem_size = prim_size(gvar->elem_type);
+
+                // Calculate offset
+                if (elem_size > 1) {
+                    emit_i(cg, "    imul rax, ", elem_size, "\n");
+                }
+                emit_n(cg, "    lea rbx, [", gvar->name, "]\n");
+                emit_lit(cg, "    add rbx, rax\n");
+                gen_restore_rax(cg, saved, "rax");  // Restore value
+
+                // Store with correct width
+                if (elem_size == 1) {
+                    emit_lit(cg, "    mov byte [rbx], al\n");
+                } else if (elem_size == 2) {
+                    emit_lit(cg, "    mov word [rbx], ax\n");
+                } else if (elem_size == 4) {
+                    emit_lit(cg, "    mov dword [rbx], eax\n");
+                } else {
+                    emit_lit(cg, "    mov qword [rbx], rax\n");
+                }
+            }
+        }
+        cg->temps = temps;  // Also when no store was generated
+    } else if (ast.kind[n] == AST_FIELD_ASSIGN) {
+        // Field assignment: struct.field = value or array[index].field = value
+        // name = field name
+        // children[0] = struct object or array index expression
+        // children[1] = value expression
+
+        if (ast.nkids[n] < 2) return;
+        Node obj = ast_child(n, 0);
+        Node value_expr = ast_child(n, 1);
+        Atom field_name = ast.name[n];
+
+        if (!obj || !field_name) return;
+
+        // Evaluate value expression
+        gen_expr(cg, value_expr);
+        emit_lit(cg, "    push rax\n");  // Save value
+
+        // Check if object is an array index expression (e.g., arr[0])
+        if (ast.kind[obj] == AST_INDEX) {
+            // Field assignment to array element: arr[index].field = value
+            if (ast.nkids[obj] < 2) return;
+            Node arr_base = ast_child(obj, 0);
+            Node index_expr = ast_child(obj, 1);
+
+            if (!arr_base || !ast.name[arr_base]) return;
+
+            // Evaluate index expression
+            gen_expr(cg, index_expr);
+            emit_lit(cg, "    push rax\n");  // Save index
+
+            // Look up array in symbol table
+            Symbol* sym = symtab_lookup_symbol(cg->symtab, ast.name[arr_base]);
+            if (sym && sym->type_name) {
+                Atom type_name = sym->type_name;
+
+                // Determine element size and struct type
+                int elem_size = 8;
+                Atom struct_type = type_name;
+
+                // Check if it's a struct type
+                StructType* st = typetab_lookup(cg->types, type_name);
+                if (st) {
+                    elem_size = st->size;
+                    struct_type = type_name;
+                }
+
+                // Get field offset
+                int field_off = typetab_field_offset(cg->types, struct_type, field_name);
+                if (field_off >= 0) {
+                    emit_lit(cg, "    pop rbx\n");  // Restore index
+                    emit(cg, "    ; Array element field assignment: %s[index].%s (elem_size=%d, offset %d)\n",
+                         atom_str(ast.name[arr_base]), atom_str(field_name), elem_size, field_off);
+
+                    // Calculate array element address
+                    if (elem_size > 1) {
+                        emit_i(cg, "    imul rbx, ", elem_size, "\n");
+                    }
+                    emit_i(cg, "    lea rcx, [rbp", sym->offset, "+rbx]\n");  // rcx = address of array element
+
+                    // Add field offset
+                    if (field_off > 0) {
+                        emit_i(cg, "    add rcx, ", field_off, "\n");
+                    }
+
+                    emit_lit(cg, "    pop rax\n");  // Restore value
+                    emit_lit(cg, "    mov [rcx], rax\n");  // Store value at field location
+                }
+            }
+        } else if (ast.name[obj]) {
+            // Simple struct field assignment: struct.field = value
+            // Look up struct object in symbol table
+            Symbol* sym = symtab_lookup_symbol(cg->symtab, ast.name[obj]);
+            if (sym && sym->type_name) {
+                // Get the actual struct type name (remove pointer if present)
+                Atom struct_type = sym->type_name;
+                int is_pointer = 0;
+                if (atom_pointee(struct_type)) {
+                    struct_type = atom_pointee(struct_type);  // Skip the '*'
+                    is_pointer = 1;
+                }
+
+                // Get field offset
+                int field_off = typetab_field_offset(cg->types, struct_type, field_name);
+                if (field_off >= 0) {
+                    emit_lit(cg, "    pop rcx\n");  // Restore value into rcx
+                    emit(cg, "    ; Field assignment: %s.%s (offset %d)\n", atom_str(ast.name[obj]), atom_str(field_name), field_off);
+
+                    if (is_pointer) {
+                        // For pointers: load pointer, add offset, store
+                        emit_i(cg, "    mov rbx, [rbp", sym->offset, "]\n");  // Load pointer
+                        if (field_off == 0) {
+                            emit_lit(cg, "    mov [rbx], rcx\n");  // Store through pointer (no offset)
+                        } else {
+                            emit_i(cg, "    mov [rbx+", field_off, "], rcx\n");  // Store through pointer with offset
+                        }
+                    } else {
+                        // For direct structs: store directly
+                        emit_i(cg, "    mov [rbp", sym->offset + field_off, "], rcx\n");
+                    }
+                }
+            }
+        }
+    }
+}
+
+void gen_stmt(Codegen* cg, Node n);
+
+// Statements of a block in their own lexical scope
+void gen_block(Codegen* cg, Node block) {
+    symtab_enter_scope(cg->symtab);
+    for (int i = 0; i < ast.nkids[block]; i++)
+        gen_stmt(cg, ast_child(block, i));
+    symtab_leave_scope(cg->symtab);
+}
+
+void gen_stmt(Codegen* cg, Node n) {
+    if (!n) return;  // Null safety
+    if (ast.kind[n] == AST_BLOCK) {
+        // Handle block statements (for 'for' loop desugaring)
+        gen_block(cg, n);
+        return;
+    }
+    if (ast.kind[n] == AST_RETURN) {
+        if (ast.nkids[n] > 0) gen_expr(cg, ast_child(n, 0));
+        else emit_lit(cg, "    xor rax, rax\n");
+        gen_epilogue(cg);
+    } else if (ast.kind[n] == AST_LET) {
+        int size = 1;
+        Atom type_name = ATOM_NONE;
+
+        // Check if this is a typed array: let arr: [i32; 10];
+        if (ast_decl(n)->is_array) {
+            // Calculate size based on element type and array count
+            int elem_size = 8;  // Default to 8 bytes
+            if (prim_size(ast_decl(n)->type_name)) elem_size = prim_size(ast_decl(n)->type_name);
+
+            int total_size = elem_size * ast_decl(n)->array_size;
+            int off = symtab_add(cg->symtab, ast.name[n], ast_decl(n)->array_size);  // Use array_size as count
+
+            // Store element type in symbol table for later use
+            if (cg->symtab && cg->symtab->count > 0) {
+                cg->symtab->symbols[cg->symtab->count - 1].type_name = ast_decl(n)->type_name;  // Store element type
+            }
+
+            emit(cg, "    ; Array local: %s: [%s; %d] (%d bytes total)\n", atom_str(ast.name[n]),
+                 ast_decl(n)->type_name ? atom_str(ast_decl(n)->type_name) : "i64", ast_decl(n)->array_size, total_size);
+
+            // If there's an initializer, generate it
+            if (ast.nkids[n] > 0) {
+                gen_expr(cg, ast_child(n, 0));
+            }
+            return;
+        }
+
+        // Check if this is a struct type: let p: Point;
+        if (ast_decl(n)->struct_type) {
+            StructType* st = typetab_lookup(cg->types, ast_decl(n)->struct_type);
+            if (st) {
+                emit(cg, "    ; Struct local: %s: %s (%d bytes)\n", atom_str(ast.name[n]), atom_str(ast_decl(n)->struct_type), st->size);
+                int off = symtab_add_struct(cg->symtab, ast.name[n], ast_decl(n)->struct_type, st->size);
+
+                // If there's an initializer (struct literal), generate it
+                if (ast.nkids[n] > 0) {
+                    gen_expr(cg, ast_child(n, 0));
+                }
+                return;
+            }
+        }
+
+        if (ast.nkids[n] > 0) {
+            if (ast.kind[ast_child(n, 0)] == AST_ARRAY_LITERAL) {
+                size = ast_decl(ast_child(n, 0))->array_size;
+            } else if (ast.kind[ast_child(n, 0)] == AST_STRUCT_LITERAL) {
+                type_name = ast_decl(ast_child(n, 0))->struct_type;
+                StructType* st = typetab_lookup(cg->types, type_name);
+                if (st) {
+                    int off = symtab_add_struct(cg->symtab, ast.name[n], type_name, st->size);
+                    gen_expr(cg, ast_child(n, 0));
+                    return;
+                }
+            }
+        }
+
+        // Scalar initializers see the enclosing binding of the same name
+        // (let i = i - 1;), so evaluate them before declaring the new one.
+        int init_first = ast.nkids[n] > 0 && ast.kind[ast_child(n, 0)] != AST_ARRAY_LITERAL;
+        if (init_first) gen_expr(cg, ast_child(n, 0));
+
+        // Check if pointer type
+        if (ast_decl(n)->is_pointer) {
+            symtab_add_pointer(cg->symtab, ast.name[n]);
+
+            // Store type name for element size calculation
+            if (ast_decl(n)->type_name && cg->symtab && cg->symtab->count > 0) {
+                // Build type_name as "*BaseType"
+                cg->symtab->symbols[cg->symtab->count - 1].type_name = atom_pointer_to(ast_decl(n)->type_name);
+            }
+
+            regalloc_bind(cg);
+            Symbol* sym = &cg->symtab->symbols[cg->symtab->count - 1];
+
+            if (ast.nkids[n] > 0) {
+                if (!init_first) gen_expr(cg, ast_child(n, 0));
+                gen_store_local(cg, sym);
+            }
+            return;
+        }
+
+        symtab_add(cg->symtab, ast.name[n], size);
+        regalloc_bind(cg);
+        Symbol* sym = &cg->symtab->symbols[cg->symtab->count - 1];
+        if (ast.nkids[n] > 0) {
+            if (init_first) {
+                gen_store_local(cg, sym);
+            } else {
+                gen_expr(cg, ast_child(n, 0));
+            }
+        }
+    } else if (ast.kind[n] == AST_IF) {
+        int else_lab = new_label(cg);
+        int end_lab = new_label(cg);
+        gen_branch_false(cg, ast_child(n, 0), else_lab);
+        gen_block(cg, ast_child(n, 1));
+        emit_i(cg, "    jmp .L", end_lab, "\n");
+        emit_i(cg, ".L", else_lab, ":\n");
+        if (ast.nkids[n] > 2) {
+            gen_block(cg, ast_child(n, 2));
+        }
+        emit_i(cg, ".L", end_lab, ":\n");
+    } else if (ast.kind[n] == AST_WHILE) {
+        int start_lab = new_label(cg);
+        int end_lab = new_label(cg);
+        emit_i(cg, ".L", start_lab, ":\n");
+        gen_branch_false(cg, ast_child(n, 0), end_lab);
+        gen_block(cg, ast_child(n, 1));
+        emit_i(cg, "    jmp .L", start_lab, "\n");
+        emit_i(cg, ".L", end_lab, ":\n");
+    } else if (ast.kind[n] == AST_CALL || ast.kind[n] == AST_ASSIGN || ast.kind[n] == AST_ARRAY_ASSIGN || ast.kind[n] == AST_FIELD_ASSIGN) {
+        gen_expr(cg, n);
+    }
+}
+
+void gen_func(Codegen* cg, Node n) {
+    if (!n || !ast.name[n]) return;  // Null safety
+    int param_count = ast.nkids[n] - 1;
+    const char* regs[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+
+    // Parameters and the body's top-level lets share the function scope
+    symtab_reset(cg->symtab);
+    cg->saved_regs = optimization_level >= 1 ? regalloc_func(cg, n) : 0;
+
+    emit_n(cg, "\n", ast.name[n], ":\n");
+    for (int i = 0; i < cg->saved_regs; i++) emit_s(cg, "    push ", regalloc_regs[i], "\n");
+    emit_lit(cg, "    push rbp\n    mov rbp, rsp\n");
+
+    for (int i = 0; i < param_count && i < 6; i++) {
+        Node par = ast_child(n, i);
+        AstDecl* d = ast_decl(par);
+        int off;
+        if (d->is_pointer) {
+            off = symtab_add_pointer(cg->symtab, ast.name[par]);
+            // Set the type_name for pointer parameters (needed for struct field access)
+            if (d->type_name && cg->symtab && cg->symtab->count > 0) {
+                cg->symtab->symbols[cg->symtab->count - 1].type_name = atom_pointer_to(d->type_name);
+            }
+        } else {
+            off = symtab_add(cg->symtab, ast.name[par], 1);
+            // Set the type_name for non-pointer parameters
+            if (d->type_name && cg->symtab && cg->symtab->count > 0) {
+                cg->symtab->symbols[cg->symtab->count - 1].type_name = d->type_name;
+            }
+        }
+        regalloc_bind(cg);
+        const char* reg = cg->symtab->symbols[cg->symtab->count - 1].reg;
+        if (reg) emit_s(cg, "    mov ", reg, ", ");
+        else emit_i(cg, "    mov [rbp", off, "], ");
+        emit_str(cg, regs[i]);
+        emit_lit(cg, "\n");
+    }
+    // Register locals declared without a value start at 0
+    for (int i = 0; i < cg->symtab->var_count && cg->saved_regs; i++) {
+        RegVar* v = &cg->symtab->vars[i];
+        if (v->reg && v->uninit) emit_s(cg, "    xor ", v->reg, ", "), emit_str(cg, v->reg), emit_lit(cg, "\n");
+    }
+
+    // Allocate stack space based on actual usage (aligned to 16 bytes)
+    int stack_size = cg->symtab->stack_size;
+    // Add 1024 bytes for temporary operations (print_int buffer, debug code, etc.)
+    stack_size += 1024;
+    // Align to 16 bytes (required by x86-64 ABI)
+    stack_size = ((stack_size + 15) / 16) * 16;
+    if (stack_size > 0) {
+        emit_i(cg, "    sub rsp, ", stack_size, "\n");
+    }
+
+    Node body = ast_child(n, param_count);
+    for (int i = 0; i < ast.nkids[body]; i++)
+        gen_stmt(cg, ast_child(body, i));
+
+    emit_lit(cg, "    xor rax, rax\n");
+    gen_epilogue(cg);
+}
+
+void gen_helpers(Codegen* cg) {
+    emit_lit(cg, "\n__print_int:\n");
+    emit_lit(cg, "    push rbp\n    mov rbp, rsp\n");
+    emit_lit(cg, "    sub rsp, 32\n");
+
+    emit_lit(cg, "    mov rbx, rax\n");
+    emit_lit(cg, "    test rbx, rbx\n");
+    emit_lit(cg, "    jns .positive\n");
+    emit_lit(cg, "    neg rbx\n");
+    emit_lit(cg, "    push rbx\n");
+    emit_lit(cg, "    mov byte [rbp-1], 45\n");
+    emit_lit(cg, "    lea rsi, [rbp-1]\n");
+    emit_lit(cg, "    mov rdi, 1\n    mov rdx, 1\n    mov rax, 1\n    syscall\n");
+    emit_lit(cg, "    pop rbx\n");
+
+    emit_lit(cg, ".positive:\n");
+    emit_lit(cg, "    lea rdi, [rbp-32]\n");
+    emit_lit(cg, "    mov rax, rbx\n");
+    emit_lit(cg, "    mov rcx, 10\n");
+
+    emit_lit(cg, ".loop:\n");
+    emit_lit(cg, "    xor rdx, rdx\n");
+    emit_lit(cg, "    div rcx\n");
+    emit_lit(cg, "    add dl, 48\n");
+    emit_lit(cg, "    mov [rdi], dl\n");
+    emit_lit(cg, "    inc rdi\n");
+    emit_lit(cg, "    test rax, rax\n");
+    emit_lit(cg, "    jnz .loop\n");
+
+    emit_lit(cg, "    mov r8, rdi\n");
+    emit_lit(cg, "    dec rdi\n");
+    emit_lit(cg, ".print_loop:\n");
+    emit_lit(cg, "    lea rax, [rbp-32]\n");
+    emit_lit(cg, "    cmp rdi, rax\n");
+    emit_lit(cg, "    jl .done\n");
+    emit_lit(cg, "    push rdi\n");
+    emit_lit(cg, "    mov rsi, rdi\n");
+    emit_lit(cg, "    mov rdi, 1\n    mov rdx, 1\n    mov rax, 1\n    syscall\n");
+    emit_lit(cg, "    pop rdi\n");
+    emit_lit(cg, "    dec rdi\n");
+    emit_lit(cg, "    jmp .print_loop\n");
+
+    emit_lit(cg, ".done:\n");
+    emit_lit(cg, "    leave\n    ret\n");
+
+    // __strcmp: Compare two strings
+    // Input: rdi = s1, rsi = s2
+    // Output: rax = 0 if equal, -1 if s1 < s2, 1 if s1 > s2
+    emit_lit(cg, "\n__strcmp:\n");
+    emit_lit(cg, "    push rbp\n    mov rbp, rsp\n");
+    emit_lit(cg, ".strcmp_loop:\n");
+    emit_lit(cg, "    mov al, [rdi]\n");
+    emit_lit(cg, "    mov bl, [rsi]\n");
+    emit_lit(cg, "    cmp al, bl\n");
+    emit_lit(cg, "    jne .strcmp_diff\n");
+    emit_lit(cg, "    test al, al\n");
+    emit_lit(cg, "    jz .strcmp_equal\n");
+    emit_lit(cg, "    inc rdi\n");
+    emit_lit(cg, "    inc rsi\n");
+    emit_lit(cg, "    jmp .strcmp_loop\n");
+    emit_lit(cg, ".strcmp_equal:\n");
+    emit_lit(cg, "    xor rax, rax\n");
+    emit_lit(cg, "    leave\n    ret\n");
+    emit_lit(cg, ".strcmp_diff:\n");
+    emit_lit(cg, "    movzx rax, al\n");
+    emit_lit(cg, "    movzx rbx, bl\n");
+    emit_lit(cg, "    sub rax, rbx\n");
+    emit_lit(cg, "    leave\n    ret\n");
+
+    // __strcpy: Copy string from src to dest
+    // Input: rdi = dest, rsi = src
+    // Output: rax = dest
+    emit_lit(cg, "\n__strcpy:\n");
+    emit_lit(cg, "    push rbp\n    mov rbp, rsp\n");
+    emit_lit(cg, "    mov rax, rdi\n");  // Save dest for return
+    emit_lit(cg, ".strcpy_loop:\n");
+    emit_lit(cg, "    mov bl, [rsi]\n");
+    emit_lit(cg, "    mov [rdi], bl\n");
+    emit_lit(cg, "    test bl, bl\n");
+    emit_lit(cg, "    jz .strcpy_done\n");
+    emit_lit(cg, "    inc rdi\n");
+    emit_lit(cg, "    inc rsi\n");
+    emit_lit(cg, "    jmp .strcpy_loop\n");
+    emit_lit(cg, ".strcpy_done:\n");
+    emit_lit(cg, "    leave\n    ret\n");
+
+    // __strlen: Get string length
+    // Input: rdi = s
+    // Output: rax = length
+    emit_lit(cg, "\n__strlen:\n");
+    emit_lit(cg, "    push rbp\n    mov rbp, rsp\n");
+    emit_lit(cg, "    xor rax, rax\n");
+    emit_lit(cg, ".strlen_loop:\n");
+    emit_lit(cg, "    cmp byte [rdi+rax], 0\n");
+    emit_lit(cg, "    jz .strlen_done\n");
+    emit_lit(cg, "    inc rax\n");
+    emit_lit(cg, "    jmp .strlen_loop\n");
+    emit_lit(cg, ".strlen_done:\n");
+    emit_lit(cg, "    leave\n    ret\n");
+}
+
+void build_type_table(TypeTable* tt, Node prog) {
+    for (int i = 0; i < ast.nkids[prog]; i++) {
+        if (ast.kind[ast_child(prog, i)] == AST_STRUCT_DEF) {
+            Node struct_def = ast_child(prog, i);
+            typetab_add(tt, ast.name[struct_def]);
+
+            for (int j = 0; j < ast.nkids[struct_def]; j++) {
+                Node field = ast_child(struct_def, j);
+                // name = field name
+                // decl type_name = base type (e.g., "i64", "Token")
+                // decl is_pointer = 1 if pointer type
+                Atom field_type = ast_decl(field)->type_name;
+                int is_ptr = ast_decl(field)->is_pointer;
+
+                // Build full type name for pointer types (e.g., "*Token")
+                Atom full_type = (is_ptr && field_type) ? atom_pointer_to(field_type) : field_type;
+
+                typetab_add_field(tt, ast.name[struct_def], ast.name[field], full_type, is_ptr);
+            }
+        }
+    }
+}
+
+// db operands for `len` bytes: printable runs as one quoted string, other
+// bytes (and '"', which NASM strings can't escape) as decimals
+void data_bytes(FILE* out, const char* s, int len) {
+    for (int j = 0; j < len; ) {
+        if (j) fputs(", ", out);
+        int k = j;
+        while (k < len && s[k] >= ' ' && s[k] <= '~' && s[k] != '"') k++;
+        if (k > j) {
+            fprintf(out, "\"%.*s\"", k - j, s + j);
+            j = k;
+        } else {
+            fprintf(out, "%d", (unsigned char)s[j++]);
+        }
+    }
+}
+
+// ---- Function-parallel codegen ----
+// Functions are independent once the shared tables are frozen: each one
+// numbers its own .L labels from 0 (they are local to the function's label
+// in NASM), the string table is filled up front in node order and only
+// read while functions are generated, and pointer type atoms are interned
+// beforehand. Workers take functions in order from a shared counter, write
+// them into their own buffer, and the texts are joined in source order, so
+// the output does not depend on the number of workers.
+#define CODEGEN_FUNCS_PER_JOB 32  // Fewer functions per thread isn't worth a thread
+// Threads generate this many functions at a time, so the workers' buffers
+// hold one window's text rather than the whole program's
+#define CODEGEN_WINDOW 2048
+
+int codegen_jobs = 0;  // -j; 0 = one per online CPU
+
+typedef struct {
+    int worker;          // -1: from the cache
+    int start, len;      // In the worker's buffer (or the cache data)
+    uint8_t flags;       // CACHE_BOUNDS
+} FuncText;
+
+typedef struct CodegenJobs CodegenJobs;
+
+typedef struct {
+    Codegen cg;
+    CodegenJobs* jobs;
+    int index;
+    PhaseStats alloc;
+    SymStats sym[TAB_COUNT];
+} CodegenWorker;
+
+struct CodegenJobs {
+    Node* funcs;
+    FuncText* text;
+    int count;
+    int next;  // Next function to take (atomic)
+    int end;   // End of the current window
+    CodegenWorker* workers;
+};
+
+int ir_gen_func(Codegen* cg, Node fn);
+void ir_free(IrFunc* f);
+void ir_stats_add(IrStats* to, IrStats* from);
+void peephole_init(void);
+void peephole_func(Codegen* cg, int start);
+void peephole_free(Peephole* ph);
+
+// Generate one function into cg, resetting its label numbering
+void codegen_one(Codegen* cg, Node f, FuncText* t) {
+    int used = cg->bounds_trap_used;
+    cg->bounds_trap_used = 0;
+    cg->label_count = 0;
+    t->start = cg->code_len;
+    // -O2 goes through the IR, whose text the peephole has nothing to take
+    // out of; the peephole runs on the rest from -O1
+    if (optimization_level < 2 || !ir_gen_func(cg, f)) {
+        gen_func(cg, f);
+        if (optimization_level >= 1) peephole_func(cg, t->start);
+    }
+    t->len = cg->code_len - t->start;
+    t->flags = cg->bounds_trap_used ? CACHE_BOUNDS : 0;
+    cg->bounds_trap_used |= used;
+}
+
+void* codegen_thread(void* arg) {
+    CodegenWorker* w = arg;
+    CodegenJobs* jobs = w->jobs;
+    worker_alloc_stats = &w->alloc;
+    worker_sym_stats = w->sym;
+    w->cg.symtab = symtab_new();
+    int i;
+    while ((i = __atomic_fetch_add(&jobs->next, 1, __ATOMIC_RELAXED)) < jobs->end) {
+        if (jobs->text[i].worker < 0) continue;  // Cached
+        jobs->text[i].worker = w->index;
+        codegen_one(&w->cg, jobs->funcs[i], &jobs->text[i]);
+    }
+    arena_release(&compiler_arena);  // The worker's symbol table
+    ir_free(w->cg.ir);
+    w->cg.ir = NULL;
+    peephole_free(w->cg.peephole);
+    w->cg.peephole = NULL;
+    return NULL;
+}
+
+// Fill the string table in node order and intern every pointer type a
+// declaration can ask for, so neither changes while workers run
+void codegen_freeze_tables(Codegen* cg, Node prog) {
+    for (int i = 0; i < ast.nkids[prog]; i++) {
+        Node f = ast_child(prog, i);
+        if (ast.kind[f] != AST_FUNCTION || ast_decl(f)->is_forward_decl) continue;
+        for (Node n = ast.kids[f], end = program_item_end(prog, i); n < end; n++) {
+            if (ast.kind[n] == AST_STRING) {
+                strtab_add(cg->strtab, src_text + ast_lit(n)->lit.off, ast_lit(n)->lit.len);
+            } else if (kind_has_decl(ast.kind[n]) && ast_decl(n)->is_pointer && ast_decl(n)->type_name) {
+                atom_pointer_to(ast_decl(n)->type_name);
+            }
+        }
+    }
+}
+
+// Look every function up in the cache; hits whose text still matches its
+// hash are marked as taken from it
+void codegen_cache_lookup(Codegen* cg, Node prog, CodegenJobs* jobs, uint64_t* keys) {
+    CodegenCache* c = &codegen_cache;
+    cache_load(c, codegen_cache_path);
+    c->atom_keys = calloc(atom_count, sizeof(AtomKey));
+    c->struct_keys = calloc(cg->types->count + 1, sizeof(uint64_t));
+    c->seen = calloc(cg->types->count + 1, sizeof(int));
+    for (int i = 0, k = 0; i < ast.nkids[prog]; i++) {
+        Node f = ast_child(prog, i);
+        if (k == jobs->count || f != jobs->funcs[k]) continue;
+        keys[k] = cache_func_key(cg, f, ast.kids[f], program_item_end(prog, i));
+        CacheEntry* e = cache_lookup(c, keys[k]);
+        if (e && hash_text(0, c->data + e->off, e->len) == e->check) jobs->text[k] = (FuncText){-1, e->off, e->len, e->flags};
+        k++;
+    }
+}
+
+int codegen_assembles = 0;  // The text goes on to an assembler (not -S)
+int codegen_drops_ast = 0;  // Function bodies are dropped once generated (not by --bench-codegen)
+int cache_retry_fd = -1;    // In the child of cache_fork: write end of its pipe
+
+// Cached text that passes its hash but still fails to assemble must not
+// break every later build. With cache hits and an assembler to follow, the
+// compile goes on in a child; if its text fails to assemble (see
+// cache_assembly_failed) this process drops the cache file and returns 1 to
+// generate every function again. Otherwise it exits as the child did.
+int cache_fork(Codegen* cg) {
+    long pos = 0;
+    if (!cg->as) {
+        fflush(cg->out);
+        pos = ftell(cg->out);
+    }
+    fflush(NULL);
+    int fds[2];
+    if (pipe(fds)) return 0;
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);  // Not passed on to nasm, ld or run programs
+    double cpu = cpu_sec();
+    pid_t pid = fork();
+    if (pid <= 0) {
+        close(fds[0]);
+        if (pid < 0) {
+            close(fds[1]);
+        } else {
+            cache_retry_fd = fds[1];
+            phase_cpu0 += cpu_sec() - cpu;  // The child's CPU time starts from 0
+        }
+        return 0;
+    }
+    close(fds[1]);
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+    char c;
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);  // A program run with --run may hold it
+    int retry = read(fds[0], &c, 1) == 1;
+    close(fds[0]);
+    if (!retry) {
+        if (WIFSIGNALED(status)) {
+            signal(WTERMSIG(status), SIG_DFL);
+            raise(WTERMSIG(status));
+        }
+        _exit(WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+    }
+    fprintf(stderr, "note: dropping the codegen cache %s and generating all functions again\n",
+            codegen_cache_path);
+    unlink(codegen_cache_path);
+    if (!cg->as) {
+        fseek(cg->out, pos, SEEK_SET);
+        if (ftruncate(fileno(cg->out), pos)) {}
+    }
+    return 1;
+}
+
+// An assembler error in the child of cache_fork: hand the compile back
+void cache_assembly_failed() {
+    if (cache_retry_fd < 0) return;
+    char c = 1;
+    if (write(cache_retry_fd, &c, 1)) {}
+    _exit(1);
+}
+
+void codegen_functions(Codegen* cg, Node prog) {
+    CodegenJobs jobs = {0};
+    jobs.funcs = safe_realloc(NULL, sizeof(Node) * (ast.nkids[prog] + 1));
+    for (int i = 0; i < ast.nkids[prog]; i++) {
+        Node f = ast_child(prog, i);
+        // Skip forward declarations, only generate code for full definitions
+        if (ast.kind[f] == AST_FUNCTION && !ast_decl(f)->is_forward_decl) jobs.funcs[jobs.count++] = f;
+    }
+    jobs.text = calloc(jobs.count + 1, sizeof(FuncText));
+    codegen_freeze_tables(cg, prog);
+
+    uint64_t* keys = NULL;
+    int misses = jobs.count;
+    if (codegen_cache_path) {
+        keys = safe_realloc(NULL, sizeof(uint64_t) * (jobs.count + 1));
+        codegen_cache_lookup(cg, prog, &jobs, keys);
+        misses = 0;
+        for (int i = 0; i < jobs.count; i++) misses += jobs.text[i].worker >= 0;
+        if (misses < jobs.count && codegen_assembles && cache_fork(cg)) {
+            // Keep the salt: the new file is written for this build
+            CodegenCache* c = &codegen_cache;
+            if (c->data) munmap(c->data, c->size);
+            c->data = NULL;
+            c->size = 0;
+            c->count = c->slot_cap = 0;
+            memset(jobs.text, 0, sizeof(FuncText) * jobs.count);
+            misses = jobs.count;
+        }
+        compile_counts.cache_hits = jobs.count - misses;
+        compile_counts.cache_misses = misses;
+    }
+
+    // An explicit -j is taken as asked; by default small programs stay serial
+    int nworkers = codegen_jobs;
+    if (nworkers <= 0) {
+        nworkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (nworkers > misses / CODEGEN_FUNCS_PER_JOB) nworkers = misses / CODEGEN_FUNCS_PER_JOB;
+    }
+    if (nworkers > misses) nworkers = misses;
+
+    // Rewrite the cache unless it already holds exactly these functions;
+    // each function's text is added as it is placed
+    FILE* store = NULL;
+    char* store_tmp = NULL;
+    if (codegen_cache_path && (misses || codegen_cache.count != jobs.count))
+        store = cache_store_begin(&codegen_cache, codegen_cache_path, jobs.count, &store_tmp);
+
+    pthread_t* threads = NULL;
+    if (nworkers > 1) {
+        jobs.workers = calloc(nworkers, sizeof(CodegenWorker));
+        threads = safe_realloc(NULL, sizeof(pthread_t) * nworkers);
+        for (int w = 0; w < nworkers; w++) {
+            CodegenWorker* wk = &jobs.workers[w];
+            wk->cg = *cg;
+            wk->cg.code_buf = NULL;
+            wk->cg.code_len = wk->cg.code_cap = 0;
+            wk->cg.bounds_trap_used = 0;
+            wk->cg.ir = NULL;
+            memset(&wk->cg.ir_stats, 0, sizeof(IrStats));
+            wk->cg.peephole = NULL;
+            memset(wk->cg.peephole_hits, 0, sizeof(wk->cg.peephole_hits));
+            wk->jobs = &jobs;
+            wk->index = w;
+        }
+    }
+    // Serial is a single window generated straight into cg, with the same
+    // per-function numbering the workers use
+    int window = nworkers > 1 ? CODEGEN_WINDOW : jobs.count;
+    Node drop_lo = 0, drop_hi = 0;
+    for (int lo = 0; lo < jobs.count; lo += window) {
+        int hi = lo + window < jobs.count ? lo + window : jobs.count;
+        if (nworkers > 1) {
+            jobs.next = lo;
+            jobs.end = hi;
+            for (int w = 0; w < nworkers; w++) {
+                jobs.workers[w].cg.code_len = 0;
+                if (pthread_create(&threads[w], NULL, codegen_thread, &jobs.workers[w])) {
+                    fprintf(stderr, "Error: cannot start codegen thread\n");
+                    exit(1);
+                }
+            }
+            for (int w = 0; w < nworkers; w++) pthread_join(threads[w], NULL);
+        }
+        for (int i = lo; i < hi; i++) {
+            FuncText* t = &jobs.text[i];
+            int start = cg->code_len;
+            if (t->worker < 0) {
+                emit_raw(cg, codegen_cache.data + t->start, t->len);
+                if (t->flags & CACHE_BOUNDS) cg->bounds_trap_used = 1;
+            } else if (nworkers > 1) {
+                emit_raw(cg, jobs.workers[t->worker].cg.code_buf + t->start, t->len);
+                if (t->flags & CACHE_BOUNDS) cg->bounds_trap_used = 1;
+            } else {
+                codegen_one(cg, jobs.funcs[i], t);
+            }
+            if (store) cache_store_put(store, keys[i], cg->code_buf + start, cg->code_len - start, t->flags);
+            if (cg->code_len >= CODEGEN_FLUSH_BYTES) codegen_flush(cg);
+            if (codegen_drops_ast) {
+                // Nothing reads the function's nodes again; neighbours are
+                // gathered into one run
+                Node f = jobs.funcs[i];
+                Node from = ast.kids[f];
+                Node end = program_item_end(prog, f - ast.kids[prog]);
+                if (from != drop_hi || drop_hi - drop_lo >= AST_DROP_NODES) {
+                    ast_drop_nodes(&ast, drop_lo, drop_hi);
+                    drop_lo = from;
+                }
+                drop_hi = end;
+            }
+        }
+    }
+    ast_drop_nodes(&ast, drop_lo, drop_hi);
+    if (nworkers > 1) {
+        for (int w = 0; w < nworkers; w++) {
+            CodegenWorker* wk = &jobs.workers[w];
+            free(wk->cg.code_buf);
+            ir_stats_add(&cg->ir_stats, &wk->cg.ir_stats);
+            for (int r = 0; r < PH_MAX_RULES; r++) cg->peephole_hits[r] += wk->cg.peephole_hits[r];
+            phase_stats[compile_phase].allocs += wk->alloc.allocs;
+            phase_stats[compile_phase].alloc_bytes += wk->alloc.alloc_bytes;
+            for (int t = 0; t < TAB_COUNT; t++) {
+                sym_stats[compile_phase][t].lookups += wk->sym[t].lookups;
+                sym_stats[compile_phase][t].probes += wk->sym[t].probes;
+            }
+        }
+        free(threads);
+        free(jobs.workers);
+    }
+
+    if (store) output_commit(store, store_tmp, codegen_cache_path, 0644);
+    if (codegen_cache_path) {
+        cache_free(&codegen_cache);
+        free(keys);
+    }
+    free(jobs.funcs);
+    free(jobs.text);
+}
+
+// Text-section directives: exports with -c, extern for imported names
+void codegen_module_symbols(Codegen* cg, Node prog) {
+    if (codegen_exports) {
+        for (int i = 0; i < ast.nkids[prog]; i++) {
+            Node n = ast_child(prog, i);
+            if ((ast.kind[n] == AST_FUNCTION && !ast_decl(n)->is_forward_decl) || ast.kind[n] == AST_GLOBAL_VAR)
+                emit_n(cg, "    global ", ast.name[n], "\n");
+        }
+    }
+    for (int i = 0; i < modules.nfuncs; i++) emit_n(cg, "    extern ", modules.funcs[i].name, "\n");
+    for (int i = 0; i < modules.nglobals; i++) emit_n(cg, "    extern ", modules.globals[i].name, "\n");
+}
+
+// Globals whose reads are their initial value, which become immediates:
+// declared consts, and at -O1+ scalars initialized with a number that the
+// program assigns nowhere. Names are matched regardless of scope, so
+// assigning a local of the same name keeps the global in memory too.
+// Except in a module (-c), whose importers read its globals from memory
+// and may assign them, a folded global needs no storage.
+int global_constants(GlobalSymbolTable* gst, Node prog) {
+    int fold_lets = optimization_level >= 1 && !codegen_exports;
+    uint8_t* written = arena_alloc(&compiler_arena, atom_count);
+    for (int i = 0; i < ast.nkids[prog] && fold_lets; i++) {
+        Node item = ast_child(prog, i);
+        if (ast.kind[item] != AST_FUNCTION || !ast.nkids[item]) continue;
+        for (Node n = ast.kids[item], end = program_item_end(prog, i); n < end; n++) {
+            int kind = ast.kind[n];
+            if (kind == AST_ASSIGN || kind == AST_ARRAY_ASSIGN || kind == AST_FIELD_ASSIGN) {
+                written[ast.name[n]] = 1;
+            } else if (kind == AST_ADDR_OF && ast.nkids[n]) {
+                // &x, &x[i], &x.f
+                Node c = ast_child(n, 0);
+                written[ast.name[c]] = 1;
+                if (ast.nkids[c]) written[ast.name[ast_child(c, 0)]] = 1;
+            }
+        }
+    }
+    int count = 0;
+    for (int i = 0; i < gst->count; i++) {
+        GlobalVar* gv = &gst->vars[i];
+        if (gv->is_extern || !gv->is_initialized || ast.kind[gv->init] != AST_NUMBER) continue;
+        // Reads are 8 bytes wide, so a narrower global also reads what follows it
+        if (gv->is_const || (fold_lets && !written[gv->name] && !gv->is_array && gv->size == 8)) {
+            gv->folded = 1;
+            gv->value = ast_lit(gv->init)->num;
+            count++;
+        }
+    }
+    return count;
+}
+
+// Generates the program as NASM text, fed to `as` when it is non-NULL and
+// written to `out` otherwise. The text goes out a function at a time as it
+// is generated; .data and .bss follow at the end, once the string table is
+// complete. Returns the size of the text-section part in bytes
+long codegen(Node prog, FILE* out, Asm* as, StringTable* strtab, TypeTable* types) {
+    Codegen cg;
+    char* data = NULL;
+    size_t data_len = 0;
+    cg.out = as ? open_memstream(&data, &data_len) : out;
+    cg.as = as;
+    cg.text_bytes = 0;
+    cg.label_count = 0;
+    cg.symtab = symtab_new();
+    cg.strtab = strtab;
+    cg.types = types;
+    cg.code_buf = NULL;
+    cg.code_len = 0;
+    cg.code_cap = 0;
+    cg.bounds_trap_used = 0;
+    cg.saved_regs = 0;
+    cg.temps = 0;
+    cg.ir = NULL;
+    memset(&cg.ir_stats, 0, sizeof(IrStats));
+    cg.peephole = NULL;
+    memset(cg.peephole_hits, 0, sizeof(cg.peephole_hits));
+    if (optimization_level >= 1) peephole_init();
+
+    // Initialize global symbol table
+    GlobalSymbolTable global_symtab;
+    global_symtab_init(&global_symtab);
+    cg.global_symtab = &global_symtab;
+
+    // First pass: process global variables
+    for (int i = 0; i < ast.nkids[prog]; i++) {
+        if (ast.kind[ast_child(prog, i)] == AST_GLOBAL_VAR) {
+            Node gvar = ast_child(prog, i);
+            Atom type_name = ast_decl(gvar)->type_name;  // Base type
+            int is_initialized = (ast.nkids[gvar] > 0);
+
+            // Extract type info from AST
+            int is_array = ast_decl(gvar)->is_array;
+            int array_count = ast_decl(gvar)->array_size;
+            int is_pointer = (ast_decl(gvar)->is_pointer & 1);
+            int is_mutable = (ast_decl(gvar)->is_pointer & 2) >> 1;
+
+            // Initializers stay in the AST; their text is printed into .data below
+            global_symtab_add_full(&global_symtab, ast.name[gvar], type_name, 0, is_initialized,
+                                   is_initialized ? ast_child(gvar, 0) : 0,
+                                   is_array, array_count, is_pointer, is_mutable);
+            global_symtab.vars[global_symtab.count - 1].is_const = ast_decl(gvar)->is_const;
+        }
+    }
+    for (int i = 0; i < modules.nglobals; i++) {
+        ModuleGlobal* g = &modules.globals[i];
+        global_symtab_add_full(&global_symtab, g->name, g->type_name, 0, 0, 0,
+                               g->is_array, g->array_count, g->is_pointer, g->is_mutable);
+        global_symtab.vars[global_symtab.count - 1].is_extern = 1;
+        global_symtab.vars[global_symtab.count - 1].is_const = g->is_const;
+    }
+    compile_counts.const_globals = global_constants(&global_symtab, prog);
+
+    // A module compiled with -c has no entry point unless it defines main
+    int has_start = !codegen_exports;
+    for (int i = 0; i < ast.nkids[prog] && !has_start; i++) {
+        Node n = ast_child(prog, i);
+        has_start = ast.kind[n] == AST_FUNCTION && !ast_decl(n)->is_forward_decl &&
+                    !strcmp(atom_str(ast.name[n]), "main");
+    }
+    emit_lit(&cg, "\nsection .text\n");
+    if (has_start) emit_lit(&cg, "    global _start\n");
+    codegen_module_symbols(&cg, prog);
+    if (has_start) {
+        emit_lit(&cg, "\n_start:\n    call main\n    mov rdi, rax\n");
+        emit_lit(&cg, "    mov rax, 60\n    syscall\n");
+    }
+
+    gen_helpers(&cg);
+    codegen_functions(&cg, prog);
+
+    // Out of line, away from the functions' hot paths
+    if (cg.bounds_trap_used) {
+        char* err_msg = strtab_add(strtab, "Array bounds error\n", 19);
+        emit_lit(&cg, "\nsection .text.unlikely progbits alloc exec nowrite align=16\n");
+        emit_lit(&cg, "__bounds_fail:\n");
+        emit_s(&cg, "    mov rsi, ", err_msg, "\n");
+        emit_lit(&cg, "    mov rdx, 19\n");
+        emit_lit(&cg, "    mov rdi, 2\n");
+        emit_lit(&cg, "    mov rax, 1\n");
+        emit_lit(&cg, "    syscall\n");
+        emit_lit(&cg, "    mov rdi, 1\n");
+        emit_lit(&cg, "    mov rax, 60\n");
+        emit_lit(&cg, "    syscall\n");
+    }
+    codegen_flush(&cg);
+    long data_start = ftell(cg.out);
+
+    fprintf(cg.out, "\n; CHRONOS v0.11 - Global Variables\n\n");
+    fprintf(cg.out, "section .data\n");
+
+    // Emit string literals
+    for (int i = 0; i < strtab->count; i++) {
+        StringEntry* e = &strtab->strings[i];
+        fprintf(cg.out, "%s: db ", e->label);
+        data_bytes(cg.out, e->value, e->len);
+        fprintf(cg.out, e->len ? ", 0\n" : "0\n");  // Null terminator
+    }
+
+    // Emit initialized global variables
+    for (int i = 0; i < global_symtab.count; i++) {
+        GlobalVar* gv = &global_symtab.vars[i];
+        // Nothing reads a folded global's storage, except in other modules
+        if (gv->is_initialized && !gv->is_extern && (!gv->folded || codegen_exports)) {
+            Node init = gv->init;
+            // Elements covered by an array literal, or a string plus its NUL
+            int init_count = 0;
+            if (gv->is_array && ast.kind[init] == AST_ARRAY_LITERAL) init_count = ast.nkids[init];
+            if (gv->is_array && ast.kind[init] == AST_STRING) init_count = ast_lit(init)->lit.len + 1;
+
+            // Array with initialization values
+            if (init_count > 0) {
+                const char* directive = type_asm_directive(gv->elem_type);
+                fprintf(cg.out, "%s: %s ", atom_str(gv->name), directive);
+
+                // FIX Bug #11: Use declared array_count, not just array_init_count
+                // This allows: let buf: [i8; 1000] = "hello"; to allocate full 1000 bytes
+                int total_count = (gv->array_count > init_count) ? gv->array_count : init_count;
+
+                int j;
+                if (ast.kind[init] == AST_ARRAY_LITERAL) {
+                    // Initialized values (non-constant elements default to 0)
+                    for (j = 0; j < init_count; j++) {
+                        Node elem = ast_child(init, j);
+                        if (j) fputs(", ", cg.out);
+                        if (ast.kind[elem] == AST_NUMBER) {
+                            char buf[24];
+                            int len;
+                            const char* text = number_text(elem, buf, &len);
+                            fwrite(text, 1, len, cg.out);
+                        } else {
+                            fputc('0', cg.out);
+                        }
+                    }
+                } else {
+                    // String bytes; the terminator falls through to the padding.
+                    // Quoted runs only work for db: NASM pads each string to
+                    // a whole element for wider directives
+                    const char* str = src_text + ast_lit(init)->lit.off;
+                    j = ast_lit(init)->lit.len;
+                    if (!strcmp(directive, "db")) {
+                        data_bytes(cg.out, str, j);
+                    } else {
+                        for (int k = 0; k < j; k++)
+                            fprintf(cg.out, k ? ", %d" : "%d", (unsigned char)str[k]);
+                    }
+                }
+
+                // Pad remaining elements with zeros
+                if (j == 0) {
+                    fputc('0', cg.out);
+                    j++;
+                }
+                if (j < total_count) {
+                    fprintf(cg.out, "\n    times %d %s 0", total_count - j, directive);
+                }
+                fprintf(cg.out, "\n");
+            }
+            // Scalar or single value
+            else if (ast.kind[init] == AST_NUMBER) {
+                const char* directive = type_asm_directive(gv->type_name);
+                char buf[24];
+                int len;
+                const char* text = number_text(init, buf, &len);
+                fprintf(cg.out, "%s: %s %.*s\n", atom_str(gv->name), directive, len, text);
+            }
+        }
+    }
+
+    // Emit uninitialized global variables (.bss section)
+    int has_bss = 0;
+    for (int i = 0; i < global_symtab.count; i++) {
+        GlobalVar* gv = &global_symtab.vars[i];
+        if (!gv->is_initialized && !gv->is_extern) {
+            if (!has_bss) {
+                fprintf(cg.out, "\nsection .bss\n");
+                has_bss = 1;
+            }
+
+            // Calculate appropriate directive
+            const char* directive;
+            int count;
+            if (gv->is_array) {
+                // Array: reserve N elements of appropriate size
+                int elem_size = type_size(gv->elem_type);
+                if (elem_size == 1) directive = "resb";
+                else if (elem_size == 2) directive = "resw";
+                else if (elem_size == 4) directive = "resd";
+                else directive = "resq";
+                count = gv->array_count;
+            } else {
+                // Scalar or pointer: reserve appropriate size
+                int size = gv->is_pointer ? 8 : gv->size;
+                if (size == 1) { directive = "resb"; count = 1; }
+                else if (size == 2) { directive = "resw"; count = 1; }
+                else if (size == 4) { directive = "resd"; count = 1; }
+                else { directive = "resq"; count = 1; }
+            }
+
+            fprintf(cg.out, "%s: %s %d\n", atom_str(gv->name), directive, count);
+        }
+    }
+
+    compile_counts.globals = global_symtab.count;
+    compile_counts.ir = cg.ir_stats;
+    ir_free(cg.ir);
+    memcpy(compile_counts.peephole_hits, cg.peephole_hits, sizeof(cg.peephole_hits));
+    peephole_free(cg.peephole);
+    compile_counts.asm_bytes = cg.text_bytes + ftell(cg.out) - data_start;
+    if (as) {
+        fclose(cg.out);
+        phase_begin(PHASE_ASSEMBLE);
+        asm_text(as, data);
+        phase_begin(PHASE_CODEGEN);
+        free(data);
+    }
+    free(cg.code_buf);
+    return cg.text_bytes;
+}
+
+// ==== IR ====
+// -O2: a function is lowered from the AST to the SSA IR (IrFunc), improved
+// by the passes in ir_passes, and turned into assembly by instruction
+// selection over linear-scan register allocation. A function that uses
+// something the IR does not express (struct and array locals, field access,
+// &x, more than six parameters, ...) is left to gen_func.
+
+// ---- Building ----
+#define IR_NOWHERE 16                  // Location of a value that needs none
+#define IR_REG(loc) ((unsigned)(loc) < 16)
+#define IR_SLOT(loc) ((loc) < 0)
+#define IR_RAX 0
+#define IR_RCX 1
+#define IR_RDX 2
+
+// Room for n elements of `size` bytes in the array *p of capacity *cap
+void ir_reserve(void* p, int* cap, int n, size_t size) {
+    if (n <= *cap) return;
+    int c = *cap ? *cap : 64;
+    while (c < n) c *= 2;
+    *(void**)p = safe_realloc(*(void**)p, size * c);
+    *cap = c;
+}
+
+int ir_new_inst(IrFunc* f, int op, int type) {
+    ir_reserve(&f->insts, &f->inst_cap, f->ninsts + 1, sizeof(IrInst));
+    IrInst* in = &f->insts[f->ninsts];
+    memset(in, 0, sizeof(*in));
+    in->op = op;
+    in->type = type;
+    in->block = -1;
+    return f->ninsts++;
+}
+
+int ir_new_block(IrFunc* f) {
+    ir_reserve(&f->blocks, &f->block_cap, f->nblocks + 1, sizeof(IrBlock));
+    IrBlock* b = &f->blocks[f->nblocks];
+    memset(b, 0, sizeof(*b));
+    b->depth = f->depth < 255 ? f->depth : 255;
+    b->label = -1;
+    return f->nblocks++;
+}
+
+// A block whose predecessors are all known already: the entry, and the
+// unreachable code after a return
+int ir_new_sealed_block(IrFunc* f) {
+    int b = ir_new_block(f);
+    f->blocks[b].sealed = 1;
+    return b;
+}
+
+void ir_append(IrFunc* f, int b, int i) {
+    IrBlock* bl = &f->blocks[b];
+    f->insts[i].block = b;
+    f->insts[i].next = 0;
+    if (bl->last) f->insts[bl->last].next = i;
+    else bl->first = i;
+    bl->last = i;
+}
+
+// Phis go before everything else in the block
+void ir_prepend(IrFunc* f, int b, int i) {
+    IrBlock* bl = &f->blocks[b];
+    f->insts[i].block = b;
+    f->insts[i].next = bl->first;
+    bl->first = i;
+    if (!bl->last) bl->last = i;
+}
+
+int ir_terminated(IrFunc* f, int b) {
+    int last = f->blocks[b].last;
+    int op = last ? f->insts[last].op : IR_NOP;
+    return op == IR_JMP || op == IR_BR || op == IR_RET;
+}
+
+// New instruction at the end of the block being lowered
+int ir_emit(IrFunc* f, int op, int type, int a, int b) {
+    int i = ir_new_inst(f, op, type);
+    f->insts[i].a = a;
+    f->insts[i].b = b;
+    ir_append(f, f->cur, i);
+    return i;
+}
+
+// Constants and addresses produce no code where they are defined: they
+// are in no block and are materialized where they are used
+int ir_const(IrFunc* f, long v) {
+    int i = ir_new_inst(f, IR_CONST, IRT_I64);
+    f->insts[i].imm = v;
+    return i;
+}
+
+int ir_addr(IrFunc* f, Atom sym, const char* label) {
+    int i = ir_new_inst(f, IR_ADDR, IRT_I64);
+    f->insts[i].sym = sym;
+    f->insts[i].label = label;
+    return i;
+}
+
+int ir_floating(IrFunc* f, int v) { return f->insts[v].op == IR_CONST || f->insts[v].op == IR_ADDR; }
+
+int ir_type_of_size(int size) {
+    return size == 1 ? IRT_I8 : size == 2 ? IRT_I16 : size == 4 ? IRT_I32 : IRT_I64;
+}
+
+int ir_width(int type) {
+    return type == IRT_I8 ? 1 : type == IRT_I16 ? 2 : type == IRT_I32 ? 4 : 8;
+}
+
+// Lists live in f->pool; one that outgrows its room moves to the end
+void ir_list_push(IrFunc* f, IrList* l, int v) {
+    if (l->count == l->cap) {
+        int cap = l->cap ? l->cap * 2 : 2;
+        ir_reserve(&f->pool, &f->pool_cap, f->npool + cap, sizeof(int));
+        if (l->count) memcpy(f->pool + f->npool, f->pool + l->start, sizeof(int) * l->count);
+        l->start = f->npool;
+        l->cap = cap;
+        f->npool += cap;
+    }
+    f->pool[l->start + l->count++] = v;
+}
+
+#define IR_AT(f, l, k) ((f)->pool[(l).start + (k)])
+
+void ir_edge(IrFunc* f, int from, int to) {
+    IrBlock* b = &f->blocks[from];
+    b->succ[b->nsucc++] = to;
+    ir_list_push(f, &f->blocks[to].preds, from);
+}
+
+void ir_jump(IrFunc* f, int to) {
+    ir_emit(f, IR_JMP, IRT_VOID, 0, 0);
+    ir_edge(f, f->cur, to);
+}
+
+// Jump from the block being lowered unless it ended in a return
+void ir_goto(IrFunc* f, int to) {
+    if (!ir_terminated(f, f->cur)) ir_jump(f, to);
+}
+
+void ir_branch(IrFunc* f, int cond, int t, int e) {
+    ir_emit(f, IR_BR, IRT_VOID, cond, 0);
+    ir_edge(f, f->cur, t);
+    ir_edge(f, f->cur, e);
+}
+
+// ---- SSA construction ----
+// Braun et al., "Simple and Efficient Construction of Static Single
+// Assignment Form": a variable's current value is looked up per block,
+// through the predecessors, placing phis where they meet. A block is
+// sealed once all its predecessors are known; reads in unsealed blocks
+// (loop headers) get phis that are completed when it is sealed.
+unsigned ir_def_hash(int var, int b) { return (unsigned)var * 0x9E3779B1u ^ (unsigned)b * 0x85EBCA6Bu; }
+
+void ir_def_put(IrFunc* f, int var, int b, int v);
+
+void ir_defs_grow(IrFunc* f) {
+    IrDef* old = f->defs;
+    int old_cap = f->def_cap;
+    f->def_cap = old_cap ? old_cap * 2 : 256;
+    f->defs = safe_realloc(NULL, sizeof(IrDef) * f->def_cap);
+    memset(f->defs, 0, sizeof(IrDef) * f->def_cap);
+    f->def_used = 0;
+    for (int i = 0; i < old_cap; i++)
+        if (old[i].gen == f->def_gen) ir_def_put(f, old[i].var, old[i].block, old[i].value);
+    free(old);
+}
+
+void ir_def_put(IrFunc* f, int var, int b, int v) {
+    if ((f->def_used + 1) * 2 > f->def_cap) ir_defs_grow(f);
+    unsigned mask = f->def_cap - 1;
+    for (unsigned h = ir_def_hash(var, b) & mask;; h = (h + 1) & mask) {
+        IrDef* d = &f->defs[h];
+        if (d->gen != f->def_gen) {
+            *d = (IrDef){var, b, v, f->def_gen};
+            f->def_used++;
+            return;
+        }
+        if (d->var == var && d->block == b) {
+            d->value = v;
+            return;
+        }
+    }
+}
+
+int ir_def_get(IrFunc* f, int var, int b) {
+    if (!f->def_cap) return 0;
+    unsigned mask = f->def_cap - 1;
+    for (unsigned h = ir_def_hash(var, b) & mask;; h = (h + 1) & mask) {
+        IrDef* d = &f->defs[h];
+        if (d->gen != f->def_gen) return 0;
+        if (d->var == var && d->block == b) return d->value;
+    }
+}
+
+// The value a COPY chain ends in
+int ir_resolve(IrFunc* f, int v) {
+    while (v && f->insts[v].op == IR_COPY) v = f->insts[v].a;
+    return v;
+}
+
+void ir_write_var(IrFunc* f, int var, int b, int v) { ir_def_put(f, var, b, v); }
+
+int ir_read_var(IrFunc* f, int var, int b);
+
+// A phi whose operands are all the same value (or itself) is that value;
+// it becomes a COPY of it, which ir_resolve looks through
+int ir_trivial_phi(IrFunc* f, int phi) {
+    int same = 0;
+    for (int k = 0; k < f->insts[phi].ops.count; k++) {
+        int op = ir_resolve(f, IR_AT(f, f->insts[phi].ops, k));
+        if (op == same || op == phi) continue;
+        if (same) return phi;
+        same = op;
+    }
+    if (!same) same = f->zero;
+    f->insts[phi].op = IR_COPY;
+    f->insts[phi].a = same;
+    return same;
+}
+
+void ir_phi_operands(IrFunc* f, int var, int phi) {
+    int b = f->insts[phi].block;
+    for (int k = 0; k < f->blocks[b].preds.count; k++) {
+        int v = ir_read_var(f, var, IR_AT(f, f->blocks[b].preds, k));
+        ir_list_push(f, &f->insts[phi].ops, v);
+    }
+}
+
+int ir_new_phi(IrFunc* f, int var, int b) {
+    int phi = ir_new_inst(f, IR_PHI, IRT_I64);
+    f->insts[phi].imm = var;
+    ir_prepend(f, b, phi);
+    return phi;
+}
+
+int ir_read_var(IrFunc* f, int var, int b) {
+    int v = ir_def_get(f, var, b);
+    if (v) return ir_resolve(f, v);
+    IrBlock* bl = &f->blocks[b];
+    if (!bl->sealed) {
+        v = ir_new_phi(f, var, b);
+        ir_list_push(f, &f->blocks[b].incomplete, v);
+    } else if (bl->preds.count == 0) {
+        v = f->zero;  // Read before any store
+    } else if (bl->preds.count == 1) {
+        v = ir_read_var(f, var, IR_AT(f, bl->preds, 0));
+    } else {
+        v = ir_new_phi(f, var, b);
+        ir_write_var(f, var, b, v);
+        ir_phi_operands(f, var, v);
+        v = ir_trivial_phi(f, v);
+    }
+    ir_write_var(f, var, b, v);
+    return v;
+}
+
+void ir_seal(IrFunc* f, int b) {
+    for (int k = 0; k < f->blocks[b].incomplete.count; k++) {
+        int phi = IR_AT(f, f->blocks[b].incomplete, k);
+        ir_phi_operands(f, f->insts[phi].imm, phi);
+        ir_trivial_phi(f, phi);
+    }
+    f->blocks[b].incomplete.count = 0;
+    f->blocks[b].sealed = 1;
+}
+
+// Phis made trivial by later simplification go too; then every operand is
+// pointed past the copies, which leave the blocks
+void ir_cleanup(IrFunc* f) {
+    int changed;
+    do {
+        changed = 0;
+        for (int i = 1; i < f->ninsts; i++)
+            if (f->insts[i].op == IR_PHI && ir_trivial_phi(f, i) != i) changed = 1;
+    } while (changed);
+    for (int i = 1; i < f->ninsts; i++) {
+        IrInst* in = &f->insts[i];
+        in->a = ir_resolve(f, in->a);
+        in->b = ir_resolve(f, in->b);
+        in->c = ir_resolve(f, in->c);
+        for (int k = 0; k < in->ops.count; k++) IR_AT(f, in->ops, k) = ir_resolve(f, IR_AT(f, in->ops, k));
+    }
+    for (int b = 0; b < f->nblocks; b++) {
+        IrBlock* bl = &f->blocks[b];
+        int prev = 0;
+        for (int i = bl->first; i; i = f->insts[i].next) {
+            if (f->insts[i].op == IR_COPY || f->insts[i].op == IR_NOP) continue;
+            if (prev) f->insts[prev].next = i;
+            else bl->first = i;
+            prev = i;
+        }
+        if (prev) f->insts[prev].next = 0;
+        else bl->first = 0;
+        bl->last = prev;
+    }
+}
+
+// ---- Lowering ----
+// Lowering reads the AST the way gen_expr and gen_stmt do, so each function
+// means the same thing whichever code generator takes it: operands are
+// evaluated in the same order, globals are read and written the same way
+// and a call passes its first six arguments.
+int ir_lower_expr(Codegen* cg, IrFunc* f, Node n);
+void ir_lower_block(Codegen* cg, IrFunc* f, Node block);
+
+int ir_fail(IrFunc* f) {
+    f->failed = 1;
+    return f->zero;
+}
+
+// A local's variable number: its stack offset, unique in the function
+int ir_var(Symbol* sym) { return -sym->offset; }
+
+// Element type of pointer local `sym` (its type_name is *T): bytes per
+// element, 0 for a struct
+int ir_pointee_size(Codegen* cg, Symbol* sym, int fallback) {
+    if (!sym->type_name) return fallback;
+    Atom base = atom_pointee(sym->type_name) ? atom_pointee(sym->type_name) : sym->type_name;
+    if (prim_size(base)) return prim_size(base);
+    return typetab_lookup(cg->types, base) ? 0 : fallback;
+}
+
+int ir_mem(IrFunc* f, int op, int size, int base, Atom sym, int index, int value) {
+    int i = ir_emit(f, op, ir_type_of_size(size), base, index);
+    f->insts[i].sym = sym;
+    f->insts[i].scale = size;
+    f->insts[i].c = value;
+    return i;
+}
+
+int ir_lower_index(Codegen* cg, IrFunc* f, Node n) {
+    Node arr = ast_child(n, 0);
+    if (ast.nkids[n] < 2 || ast.kind[arr] != AST_IDENT) return ir_fail(f);
+    VarRef ref = resolve_var(cg, ast.name[arr]);
+    if (ref.local) {
+        // Local arrays are bounds checked on the stack: not in the IR
+        if (!ref.local->is_pointer) return ir_fail(f);
+        int size = ir_pointee_size(cg, ref.local, 1);
+        if (!size) return ir_fail(f);  // *Struct: the element's address
+        int index = ir_lower_expr(cg, f, ast_child(n, 1));
+        int base = ir_read_var(f, ir_var(ref.local), f->cur);
+        return ir_mem(f, IR_LOAD, size, base, ATOM_NONE, index, 0);
+    }
+    if (!ref.global || !ref.global->is_array) return f->zero;  // "array not found"
+    int size = prim_size(ref.global->elem_type) ? prim_size(ref.global->elem_type) : 1;
+    int index = ir_lower_expr(cg, f, ast_child(n, 1));
+    return ir_mem(f, IR_LOAD, size, 0, ref.global->name, index, 0);
+}
+
+int ir_lower_array_assign(Codegen* cg, IrFunc* f, Node n) {
+    if (ast.nkids[n] < 3) return f->zero;
+    Node arr = ast_child(n, 0);
+    if (!ast.name[arr]) return f->zero;
+    if (ast.kind[arr] != AST_IDENT) return ir_fail(f);
+    int value = ir_lower_expr(cg, f, ast_child(n, 2));
+    int index = ir_lower_expr(cg, f, ast_child(n, 1));
+    VarRef ref = resolve_var(cg, ast.name[arr]);
+    if (ref.local) {
+        if (!ref.local->is_pointer) return ir_fail(f);
+        int size = ir_pointee_size(cg, ref.local, 8);
+        if (!size) size = 8;
+        int base = ir_read_var(f, ir_var(ref.local), f->cur);
+        ir_mem(f, IR_STORE, size, base, ATOM_NONE, index, value);
+    } else if (ref.global && ref.global->is_array) {
+        int size = prim_size(ref.global->elem_type) ? prim_size(ref.global->elem_type) : 1;
+        ir_mem(f, IR_STORE, size, 0, ref.global->name, index, value);
+    }
+    return value;
+}
+
+// CALL of the builtin or function sym on the given argument values
+int ir_call(IrFunc* f, Atom sym, int* args, int nargs) {
+    int i = ir_emit(f, IR_CALL, IRT_I64, 0, 0);
+    f->insts[i].sym = sym;
+    for (int k = 0; k < nargs; k++) ir_list_push(f, &f->insts[i].ops, args[k]);
+    return i;
+}
+
+int ir_lower_call(Codegen* cg, IrFunc* f, Node n) {
+    Atom name = ast.name[n];
+    int nk = ast.nkids[n];
+    int args[7];
+    int nargs = 0, need = 0, max = 6;
+    switch (name) {
+        case ATOM_print:
+        case ATOM_println: {
+            // Only string literals have a length to print
+            Node s = nk ? ast_child(n, 0) : 0;
+            if (s ? ast.kind[s] != AST_STRING : name == ATOM_print) return ir_fail(f);
+            if (name == ATOM_println) f->newline = 1;
+            int i = ir_call(f, name, NULL, 0);
+            if (s) {
+                f->insts[i].label = strtab_add(cg->strtab, src_text + ast_lit(s)->lit.off, ast_lit(s)->lit.len);
+                f->insts[i].imm = ast_lit(s)->lit.len;
+            }
+            return i;
+        }
+        case ATOM_exit:
+            max = 1;
+            break;
+        case ATOM_print_int: case ATOM_strlen: case ATOM_close: case ATOM_malloc: case ATOM_free:
+            need = max = 1;
+            break;
+        case ATOM_strcmp: case ATOM_strcpy:
+            need = max = 2;
+            break;
+        case ATOM_open:
+            need = 2, max = 3;
+            break;
+        case ATOM_read: case ATOM_write:
+            need = max = 3;
+            break;
+        case ATOM_syscall: case ATOM_syscall6: {
+            // Arguments first, the number last, as gen_builtin_call does
+            if (nk < 1) return ir_fail(f);
+            for (int k = 1; k < nk && k <= 6; k++) args[k] = ir_lower_expr(cg, f, ast_child(n, k));
+            args[0] = ir_lower_expr(cg, f, ast_child(n, 0));
+            return ir_call(f, name, args, nk < 7 ? nk : 7);
+        }
+    }
+    // Builtins given too few arguments generate nothing: not in the IR
+    if (nk < need) return ir_fail(f);
+    for (; nargs < nk && nargs < max; nargs++) args[nargs] = ir_lower_expr(cg, f, ast_child(n, nargs));
+    if (name == ATOM_open && nargs == 2) args[nargs++] = ir_const(f, 644);  // As `mov rdx, 0644`
+    if (name == ATOM_exit && !nargs) args[nargs++] = f->zero;
+    return ir_call(f, name, args, nargs);
+}
+
+// Branch to t when n is true and to e when it is false. && || and ! are
+// control flow here rather than values.
+void ir_lower_cond(Codegen* cg, IrFunc* f, Node n, int t, int e) {
+    TokType op = ast_op(n);
+    if (ast.kind[n] == AST_LOGICAL && (op == T_AND_AND || op == T_OR_OR)) {
+        int mid = ir_new_block(f);
+        if (op == T_AND_AND) ir_lower_cond(cg, f, ast_child(n, 0), mid, e);
+        else ir_lower_cond(cg, f, ast_child(n, 0), t, mid);
+        ir_seal(f, mid);
+        f->cur = mid;
+        ir_lower_cond(cg, f, ast_child(n, 1), t, e);
+    } else if (ast.kind[n] == AST_UNARY && op == T_BANG && ast.nkids[n]) {
+        ir_lower_cond(cg, f, ast_child(n, 0), e, t);
+    } else {
+        ir_branch(f, ir_lower_expr(cg, f, n), t, e);
+    }
+}
+
+int ir_lower_expr(Codegen* cg, IrFunc* f, Node n) {
+    if (!n || f->failed) return f->zero;
+    switch (ast.kind[n]) {
+        case AST_NUMBER:
+            return ir_const(f, ast_lit(n)->num);
+        case AST_IDENT: {
+            VarRef ref = resolve_var(cg, ast.name[n]);
+            if (ref.local) return ir_read_var(f, ir_var(ref.local), f->cur);
+            if (!ref.global) return f->zero;  // "unknown var"
+            if (ref.global->folded) return ir_const(f, ref.global->value);
+            if (ref.global->is_array) return ir_addr(f, ref.global->name, NULL);
+            return ir_mem(f, IR_LOAD, 8, 0, ref.global->name, 0, 0);
+        }
+        case AST_ASSIGN: {
+            int v = ir_lower_expr(cg, f, ast_child(n, 0));
+            VarRef ref = resolve_var(cg, ast.name[n]);
+            if (ref.local) {
+                ir_write_var(f, ir_var(ref.local), f->cur, v);
+            } else if (ref.global) {
+                global_assign_check(ref.global);
+                ir_mem(f, IR_STORE, 8, 0, ref.global->name, 0, v);
+            }
+            return v;
+        }
+        case AST_BINOP: {
+            static const uint8_t ops[] = {[T_PLUS] = IR_ADD, [T_MINUS] = IR_SUB, [T_STAR] = IR_MUL,
+                                          [T_SLASH] = IR_DIV, [T_MOD] = IR_MOD};
+            TokType op = ast_op(n);
+            if (op < T_PLUS || op > T_MOD) return ir_fail(f);
+            int a = ir_lower_expr(cg, f, ast_child(n, 0));
+            int b = ir_lower_expr(cg, f, ast_child(n, 1));
+            int i = ir_emit(f, ops[op], IRT_I64, a, b);
+            // -O2 turns x / 2^k and x % 2^k into sar and and only for a
+            // number written in the source; they differ from idiv below 0
+            f->insts[i].literal = ast.kind[ast_child(n, 1)] == AST_NUMBER;
+            return i;
+        }
+        case AST_COMPARE: {
+            int a = ir_lower_expr(cg, f, ast_child(n, 0));
+            int b = ir_lower_expr(cg, f, ast_child(n, 1));
+            int i = ir_emit(f, IR_CMP, IRT_I64, a, b);
+            f->insts[i].cc = ast_op(n);
+            return i;
+        }
+        case AST_LOGICAL: {
+            if (ast_op(n) != T_AND_AND && ast_op(n) != T_OR_OR) return ir_fail(f);
+            int t = ir_new_block(f), e = ir_new_block(f), join = ir_new_block(f);
+            ir_lower_cond(cg, f, n, t, e);
+            ir_seal(f, t);
+            ir_seal(f, e);
+            f->cur = t;
+            ir_jump(f, join);
+            f->cur = e;
+            ir_jump(f, join);
+            ir_seal(f, join);
+            f->cur = join;
+            int one = ir_const(f, 1);
+            int phi = ir_new_phi(f, 0, join);
+            ir_list_push(f, &f->insts[phi].ops, one);
+            ir_list_push(f, &f->insts[phi].ops, f->zero);
+            return phi;
+        }
+        case AST_UNARY: {
+            TokType op = ast_op(n);
+            if (!ast.nkids[n] || (op != T_MINUS && op != T_BANG)) return ir_fail(f);
+            int a = ir_lower_expr(cg, f, ast_child(n, 0));
+            return ir_emit(f, op == T_MINUS ? IR_NEG : IR_NOT, IRT_I64, a, 0);
+        }
+        case AST_DEREF: {
+            int a = ir_lower_expr(cg, f, ast_child(n, 0));
+            return ir_mem(f, IR_LOAD, 8, a, ATOM_NONE, 0, 0);
+        }
+        case AST_STRING: {
+            AstLiteral* l = ast_lit(n);
+            return ir_addr(f, ATOM_NONE, strtab_add(cg->strtab, src_text + l->lit.off, l->lit.len));
+        }
+        case AST_INDEX:
+            return ir_lower_index(cg, f, n);
+        case AST_ARRAY_ASSIGN:
+            return ir_lower_array_assign(cg, f, n);
+        case AST_CALL:
+            return ir_lower_call(cg, f, n);
+    }
+    return ir_fail(f);
+}
+
+void ir_lower_stmt(Codegen* cg, IrFunc* f, Node n) {
+    if (!n || f->failed) return;
+    // Code after a return starts a block nothing jumps to
+    if (ir_terminated(f, f->cur)) f->cur = ir_new_sealed_block(f);
+    int nk = ast.nkids[n];
+    switch (ast.kind[n]) {
+        case AST_BLOCK:
+            ir_lower_block(cg, f, n);
+            break;
+        case AST_RETURN: {
+            int v = nk ? ir_lower_expr(cg, f, ast_child(n, 0)) : f->zero;
+            ir_emit(f, IR_RET, IRT_VOID, v, 0);
+            break;
+        }
+        case AST_LET: {
+            AstDecl* d = ast_decl(n);
+            Node init = nk ? ast_child(n, 0) : 0;
+            if (d->is_array || (d->struct_type && typetab_lookup(cg->types, d->struct_type)) ||
+                (init && (ast.kind[init] == AST_ARRAY_LITERAL || ast.kind[init] == AST_STRUCT_LITERAL))) {
+                ir_fail(f);
+                break;
+            }
+            // The value sees the enclosing binding of the same name
+            int v = init ? ir_lower_expr(cg, f, init) : 0;
+            if (d->is_pointer) {
+                symtab_add_pointer(cg->symtab, ast.name[n]);
+                if (d->type_name) cg->symtab->symbols[cg->symtab->count - 1].type_name = atom_pointer_to(d->type_name);
+            } else {
+                symtab_add(cg->symtab, ast.name[n], 1);
+            }
+            if (init) ir_write_var(f, ir_var(&cg->symtab->symbols[cg->symtab->count - 1]), f->cur, v);
+            break;
+        }
+        case AST_IF: {
+            int t = ir_new_block(f), e = ir_new_block(f);
+            int join = nk > 2 ? ir_new_block(f) : e;
+            ir_lower_cond(cg, f, ast_child(n, 0), t, e);
+            ir_seal(f, t);
+            f->cur = t;
+            ir_lower_block(cg, f, ast_child(n, 1));
+            ir_goto(f, join);
+            if (nk > 2) {
+                ir_seal(f, e);
+                f->cur = e;
+                ir_lower_block(cg, f, ast_child(n, 2));
+                ir_goto(f, join);
+            }
+            ir_seal(f, join);
+            f->cur = join;
+            break;
+        }
+        case AST_WHILE: {
+            // The header is sealed once the back edge is known
+            int exit = ir_new_block(f);
+            f->depth++;
+            int head = ir_new_block(f), body = ir_new_block(f);
+            ir_jump(f, head);
+            f->cur = head;
+            ir_lower_cond(cg, f, ast_child(n, 0), body, exit);
+            ir_seal(f, body);
+            f->cur = body;
+            ir_lower_block(cg, f, ast_child(n, 1));
+            ir_goto(f, head);
+            ir_seal(f, head);
+            f->depth--;
+            ir_seal(f, exit);
+            f->cur = exit;
+            break;
+        }
+        case AST_CALL:
+        case AST_ASSIGN:
+        case AST_ARRAY_ASSIGN:
+            ir_lower_expr(cg, f, n);
+            break;
+        case AST_FIELD_ASSIGN:
+            ir_fail(f);
+            break;
+    }
+}
+
+void ir_lower_block(Codegen* cg, IrFunc* f, Node block) {
+    symtab_enter_scope(cg->symtab);
+    for (int i = 0; i < ast.nkids[block]; i++) ir_lower_stmt(cg, f, ast_child(block, i));
+    symtab_leave_scope(cg->symtab);
+}
+
+// Function fn into f; 0 if it uses something the IR does not express
+int ir_lower_func(Codegen* cg, IrFunc* f, Node fn) {
+    int param_count = ast.nkids[fn] - 1;
+    if (param_count > 6) return 0;
+    f->ninsts = 1;  // Value 0 is "none"
+    f->nblocks = 0;
+    f->npool = 0;
+    f->depth = 0;
+    f->failed = 0;
+    f->newline = 0;
+    if (!++f->def_gen) f->def_gen = 1;
+    symtab_reset(cg->symtab);
+    f->cur = ir_new_sealed_block(f);
+    f->zero = ir_const(f, 0);
+    // Parameters and the body's top-level lets share the function scope
+    for (int i = 0; i < param_count; i++) {
+        Node par = ast_child(fn, i);
+        AstDecl* d = ast_decl(par);
+        if (d->is_pointer) symtab_add_pointer(cg->symtab, ast.name[par]);
+        else symtab_add(cg->symtab, ast.name[par], 1);
+        Symbol* sym = &cg->symtab->symbols[cg->symtab->count - 1];
+        if (d->type_name) sym->type_name = d->is_pointer ? atom_pointer_to(d->type_name) : d->type_name;
+        int v = ir_emit(f, IR_PARAM, IRT_I64, 0, 0);
+        f->insts[v].imm = i;
+        ir_write_var(f, ir_var(sym), f->cur, v);
+    }
+    Node body = ast_child(fn, param_count);
+    for (int i = 0; i < ast.nkids[body] && !f->failed; i++) ir_lower_stmt(cg, f, ast_child(body, i));
+    if (f->failed) return 0;
+    if (!ir_terminated(f, f->cur)) ir_emit(f, IR_RET, IRT_VOID, f->zero, 0);
+    ir_cleanup(f);
+    return 1;
+}
+
+// ---- Passes ----
+// Each pass returns how many changes it made (for -ftime-report); passes
+// run in table order, those whose min_level is above -O are skipped.
+typedef struct {
+    const char* name;
+    int min_level;
+    int (*run)(IrFunc* f);
+} IrPass;
+
+// Drop predecessor `from` of block b, and the matching phi operands
+void ir_remove_pred(IrFunc* f, int b, int from) {
+    IrBlock* bl = &f->blocks[b];
+    int k = 0;
+    while (k < bl->preds.count && IR_AT(f, bl->preds, k) != from) k++;
+    if (k == bl->preds.count) return;
+    for (int j = k + 1; j < bl->preds.count; j++) IR_AT(f, bl->preds, j - 1) = IR_AT(f, bl->preds, j);
+    bl->preds.count--;
+    for (int i = bl->first; i && f->insts[i].op == IR_PHI; i = f->insts[i].next) {
+        IrList* ops = &f->insts[i].ops;
+        for (int j = k + 1; j < ops->count; j++) IR_AT(f, *ops, j - 1) = IR_AT(f, *ops, j);
+        ops->count--;
+    }
+}
+
+void ir_replace_pred(IrFunc* f, int b, int old, int now) {
+    IrBlock* bl = &f->blocks[b];
+    for (int k = 0; k < bl->preds.count; k++)
+        if (IR_AT(f, bl->preds, k) == old) {
+            IR_AT(f, bl->preds, k) = now;
+            return;
+        }
+}
+
+int ir_has_phis(IrFunc* f, int b) {
+    int i = f->blocks[b].first;
+    return i && f->insts[i].op == IR_PHI;
+}
+
+void ir_kill_block(IrFunc* f, int b) {
+    IrBlock* bl = &f->blocks[b];
+    for (int i = bl->first; i; i = f->insts[i].next) f->insts[i].op = IR_NOP;
+    bl->first = bl->last = 0;
+    bl->nsucc = 0;
+    bl->preds.count = 0;
+    bl->dead = 1;
+}
+
+// Unreachable blocks are removed, a block is merged into its only
+// predecessor when that jumps nowhere else, and jumps to blocks holding
+// nothing but a jump go straight to its target
+int ir_simplify_cfg(IrFunc* f) {
+    int changes = 0;
+    // Reachability from the entry, marked in `mark`
+    for (int b = 0; b < f->nblocks; b++) f->blocks[b].mark = 0;
+    ir_reserve(&f->work, &f->work_cap, f->nblocks, sizeof(int));
+    f->nwork = 0;
+    f->work[f->nwork++] = 0;
+    f->blocks[0].mark = 1;
+    while (f->nwork) {
+        IrBlock* bl = &f->blocks[f->work[--f->nwork]];
+        for (int k = 0; k < bl->nsucc; k++)
+            if (!f->blocks[bl->succ[k]].mark) {
+                f->blocks[bl->succ[k]].mark = 1;
+                f->work[f->nwork++] = bl->succ[k];
+            }
+    }
+    for (int b = 0; b < f->nblocks; b++) {
+        IrBlock* bl = &f->blocks[b];
+        if (bl->dead || bl->mark) continue;
+        for (int k = 0; k < bl->nsucc; k++) ir_remove_pred(f, bl->succ[k], b);
+        ir_kill_block(f, b);
+        changes++;
+    }
+    // Phis left with one operand become copies before blocks are merged
+    if (changes) ir_cleanup(f);
+    for (int b = 0; b < f->nblocks; b++) {
+        for (;;) {
+            IrBlock* bl = &f->blocks[b];
+            if (bl->dead || !bl->last || f->insts[bl->last].op != IR_JMP) break;
+            int s = bl->succ[0];
+            IrBlock* sb = &f->blocks[s];
+            if (s == b || s == 0 || sb->preds.count != 1 || ir_has_phis(f, s)) break;
+            f->insts[bl->last].op = IR_NOP;
+            for (int i = sb->first; i; i = f->insts[i].next) f->insts[i].block = b;
+            f->insts[bl->last].next = sb->first;
+            bl->last = sb->last;
+            bl->nsucc = sb->nsucc;
+            for (int k = 0; k < sb->nsucc; k++) {
+                bl->succ[k] = sb->succ[k];
+                ir_replace_pred(f, sb->succ[k], s, b);
+            }
+            sb->first = sb->last = 0;
+            sb->nsucc = 0;
+            sb->preds.count = 0;
+            sb->dead = 1;
+            changes++;
+        }
+    }
+    for (int e = 1; e < f->nblocks; e++) {
+        IrBlock* eb = &f->blocks[e];
+        if (eb->dead || eb->first != eb->last || !eb->first || f->insts[eb->first].op != IR_JMP) continue;
+        int t = eb->succ[0];
+        if (t == e || ir_has_phis(f, t)) continue;
+        // A predecessor already going to t would reach it along two edges
+        int ok = 1;
+        for (int k = 0; k < eb->preds.count && ok; k++) {
+            IrBlock* p = &f->blocks[IR_AT(f, eb->preds, k)];
+            for (int j = 0; j < p->nsucc; j++)
+                if (p->succ[j] == t) ok = 0;
+        }
+        if (!ok) continue;
+        for (int k = 0; k < eb->preds.count; k++) {
+            int p = IR_AT(f, eb->preds, k);
+            IrBlock* pb = &f->blocks[p];
+            for (int j = 0; j < pb->nsucc; j++)
+                if (pb->succ[j] == e) pb->succ[j] = t;
+            ir_list_push(f, &f->blocks[t].preds, p);
+        }
+        ir_remove_pred(f, t, e);
+        ir_kill_block(f, e);
+        changes++;
+    }
+    if (changes) ir_cleanup(f);
+    return changes;
+}
+
+// ---- Constant propagation ----
+// Sparse conditional constant propagation (Wegman and Zadeck). Blocks
+// start unreached and values unknown; a value only ever moves down, to a
+// known constant and then to varying. A branch on a known condition
+// reaches one successor and a phi meets only the operands of reached
+// edges, so what the other side of `if (0)` or a loop that never runs
+// would assign cannot spoil a constant. Known values then become
+// constants and decided branches jumps; simplify-cfg removes the blocks
+// no longer reached.
+enum { IR_UNKNOWN, IR_KNOWN, IR_VARYING };
+
+// Room for the per-value arrays of the passes
+void ir_pass_reserve(IrFunc* f) {
+    if (f->ninsts + 1 <= f->pass_cap) return;
+    int cap = f->pass_cap ? f->pass_cap : 256;
+    while (cap < f->ninsts + 1) cap *= 2;
+    f->lattice = safe_realloc(f->lattice, cap);
+    f->live = safe_realloc(f->live, cap);
+    f->known = safe_realloc(f->known, sizeof(long) * cap);
+    f->user_start = safe_realloc(f->user_start, sizeof(int) * (cap + 1));
+    f->pass_cap = cap;
+}
+
+// The instructions in blocks reading each value, phis included
+void ir_find_users(IrFunc* f) {
+    int* start = f->user_start;
+    memset(start, 0, sizeof(int) * (f->ninsts + 1));
+    for (int b = 0; b < f->nblocks; b++)
+        for (int i = f->blocks[b].first; i; i = f->insts[i].next) {
+            IrInst* in = &f->insts[i];
+            start[in->a]++, start[in->b]++, start[in->c]++;
+            for (int k = 0; k < in->ops.count; k++) start[IR_AT(f, in->ops, k)]++;
+        }
+    start[0] = 0;  // "none"
+    int total = 0;
+    for (int v = 0; v <= f->ninsts; v++) {
+        int n = v < f->ninsts ? start[v] : 0;
+        start[v] = total;
+        total += n;
+    }
+    ir_reserve(&f->users, &f->user_cap, total, sizeof(int));
+    // Each user goes at the end of its value's run, which moves start[v]
+    // on to the next value's start; shifted back below
+    for (int b = 0; b < f->nblocks; b++)
+        for (int i = f->blocks[b].first; i; i = f->insts[i].next) {
+            IrInst* in = &f->insts[i];
+            if (in->a) f->users[start[in->a]++] = i;
+            if (in->b) f->users[start[in->b]++] = i;
+            if (in->c) f->users[start[in->c]++] = i;
+            for (int k = 0; k < in->ops.count; k++) f->users[start[IR_AT(f, in->ops, k)]++] = i;
+        }
+    for (int v = f->ninsts; v > 0; v--) start[v] = start[v - 1];
+    start[0] = 0;
+}
+
+void ir_work_push(IrFunc* f, int item) {
+    ir_reserve(&f->work, &f->work_cap, f->nwork + 1, sizeof(int));
+    f->work[f->nwork++] = item;
+}
+
+// Whether control can go from reached block `from` to block `to`
+int ir_edge_taken(IrFunc* f, int from, int to) {
+    IrBlock* bl = &f->blocks[from];
+    if (!bl->mark || !bl->last) return 0;
+    IrInst* in = &f->insts[bl->last];
+    if (in->op == IR_JMP) return 1;
+    if (in->op != IR_BR || f->lattice[in->a] == IR_UNKNOWN) return 0;
+    if (f->lattice[in->a] == IR_VARYING) return 1;
+    return bl->succ[f->known[in->a] ? 0 : 1] == to;
+}
+
+// The lattice state of instruction i from its operands, and its value in
+// *out when known
+int ir_sccp_eval(IrFunc* f, int i, long* out) {
+    IrInst* in = &f->insts[i];
+    switch (in->op) {
+        case IR_PHI: {
+            int state = IR_UNKNOWN;
+            IrList preds = f->blocks[in->block].preds;
+            for (int k = 0; k < in->ops.count; k++) {
+                int v = IR_AT(f, in->ops, k);
+                if (!ir_edge_taken(f, IR_AT(f, preds, k), in->block) || f->lattice[v] == IR_UNKNOWN) continue;
+                if (f->lattice[v] == IR_VARYING || (state == IR_KNOWN && *out != f->known[v])) return IR_VARYING;
+                state = IR_KNOWN;
+                *out = f->known[v];
+            }
+            return state;
+        }
+        case IR_ADD: case IR_SUB: case IR_MUL: case IR_DIV: case IR_MOD:
+        case IR_CMP: case IR_NEG: case IR_NOT: {
+            int two = in->op != IR_NEG && in->op != IR_NOT;
+            int sa = f->lattice[in->a], sb = two ? f->lattice[in->b] : IR_KNOWN;
+            if (sa == IR_VARYING || sb == IR_VARYING) return IR_VARYING;
+            if (sa == IR_UNKNOWN || sb == IR_UNKNOWN) return IR_UNKNOWN;
+            // Wrapping, as the machine does
+            unsigned long x = f->known[in->a], y = two ? f->known[in->b] : 0;
+            switch (in->op) {
+                case IR_ADD: *out = x + y; break;
+                case IR_SUB: *out = x - y; break;
+                case IR_MUL: *out = x * y; break;
+                case IR_NEG: *out = -x; break;
+                case IR_NOT: *out = !x; break;
+                case IR_DIV: case IR_MOD:
+                    if (!fold_div(in->op == IR_MOD, in->literal, x, y, out)) return IR_VARYING;
+                    break;
+                default: {
+                    long a = x, b = y;
+                    switch (in->cc) {
+                        case T_EQEQ: *out = a == b; break;
+                        case T_NEQ: *out = a != b; break;
+                        case T_LT: *out = a < b; break;
+                        case T_GT: *out = a > b; break;
+                        case T_LTE: *out = a <= b; break;
+                        case T_GTE: *out = a >= b; break;
+                        default: return IR_VARYING;
+                    }
+                }
+            }
+            return IR_KNOWN;
+        }
+    }
+    return IR_VARYING;
+}
+
+// Visit instruction i of a reached block: a new state for its value goes
+// to the users, an edge newly taken reaches its block or re-visits the
+// phis of a block already reached
+void ir_sccp_visit(IrFunc* f, int i) {
+    IrInst* in = &f->insts[i];
+    if (in->op == IR_JMP || in->op == IR_BR) {
+        IrBlock* bl = &f->blocks[in->block];
+        for (int k = 0; k < bl->nsucc; k++) {
+            int s = bl->succ[k];
+            if (!ir_edge_taken(f, in->block, s)) continue;
+            if (!f->blocks[s].mark) {
+                f->blocks[s].mark = 1;
+                ir_work_push(f, -(s + 1));
+            } else {
+                for (int p = f->blocks[s].first; p && f->insts[p].op == IR_PHI; p = f->insts[p].next)
+                    ir_work_push(f, p);
+            }
+        }
+        return;
+    }
+    long v = 0;
+    int state = ir_sccp_eval(f, i, &v);
+    if (state == f->lattice[i]) return;
+    f->lattice[i] = state;
+    f->known[i] = v;
+    for (int u = f->user_start[i]; u < f->user_start[i + 1]; u++)
+        if (f->blocks[f->insts[f->users[u]].block].mark) ir_work_push(f, f->users[u]);
+}
+
+int ir_sccp(IrFunc* f) {
+    ir_pass_reserve(f);
+    ir_find_users(f);
+    int n = f->ninsts;
+    for (int i = 0; i < n; i++) {
+        int op = f->insts[i].op;
+        f->lattice[i] = op == IR_CONST ? IR_KNOWN : op == IR_ADDR ? IR_VARYING : IR_UNKNOWN;
+        f->known[i] = f->insts[i].imm;
+    }
+    for (int b = 0; b < f->nblocks; b++) f->blocks[b].mark = 0;
+    // Blocks newly reached go on the worklist as -(b + 1), values to
+    // re-visit as themselves
+    f->nwork = 0;
+    f->blocks[0].mark = 1;
+    ir_work_push(f, -1);
+    while (f->nwork) {
+        int item = f->work[--f->nwork];
+        if (item > 0) {
+            ir_sccp_visit(f, item);
+            continue;
+        }
+        for (int i = f->blocks[-item - 1].first; i; i = f->insts[i].next) ir_sccp_visit(f, i);
+    }
+    int changes = 0;
+    for (int b = 0; b < f->nblocks; b++) {
+        IrBlock* bl = &f->blocks[b];
+        if (!bl->mark) continue;
+        for (int i = bl->first; i; i = f->insts[i].next) {
+            IrInst* in = &f->insts[i];
+            if (i < n && f->lattice[i] == IR_KNOWN && in->op != IR_CONST) {
+                int c = ir_const(f, f->known[i]);
+                in = &f->insts[i];
+                in->op = IR_COPY;
+                in->a = c;
+                in->b = in->c = 0;
+                in->ops.count = 0;
+                changes++;
+            } else if (in->op == IR_BR && f->lattice[in->a] == IR_KNOWN) {
+                int taken = bl->succ[f->known[in->a] ? 0 : 1], other = bl->succ[f->known[in->a] ? 1 : 0];
+                if (other != taken) ir_remove_pred(f, other, b);
+                in->op = IR_JMP;
+                in->a = 0;
+                bl->succ[0] = taken;
+                bl->nsucc = 1;
+                changes++;
+            }
+        }
+    }
+    if (changes) ir_cleanup(f);
+    return changes;
+}
+
+// ---- Dead code elimination ----
+// Values nothing with an effect needs are removed: stores, calls, loads
+// (which may fault), control flow and parameters are kept, and with them
+// everything they read. A division is kept unless its divisor is a
+// constant other than 1 and -1, which cannot trap.
+int ir_dce_removable(IrFunc* f, IrInst* in) {
+    switch (in->op) {
+        case IR_ADD: case IR_SUB: case IR_MUL: case IR_NEG: case IR_NOT: case IR_CMP: case IR_PHI:
+            return 1;
+        case IR_DIV: case IR_MOD:
+            return f->insts[in->b].op == IR_CONST && f->insts[in->b].imm != 1 && f->insts[in->b].imm != -1;
+    }
+    return 0;
+}
+
+void ir_dce_mark(IrFunc* f, int v) {
+    if (!v || f->live[v]) return;
+    f->live[v] = 1;
+    ir_work_push(f, v);
+}
+
+int ir_dce(IrFunc* f) {
+    ir_pass_reserve(f);
+    memset(f->live, 0, f->ninsts);
+    f->nwork = 0;
+    for (int b = 0; b < f->nblocks; b++)
+        for (int i = f->blocks[b].first; i; i = f->insts[i].next)
+            if (!ir_dce_removable(f, &f->insts[i])) ir_dce_mark(f, i);
+    while (f->nwork) {
+        IrInst* in = &f->insts[f->work[--f->nwork]];
+        ir_dce_mark(f, in->a);
+        ir_dce_mark(f, in->b);
+        ir_dce_mark(f, in->c);
+        for (int k = 0; k < in->ops.count; k++) ir_dce_mark(f, IR_AT(f, in->ops, k));
+    }
+    int changes = 0;
+    for (int b = 0; b < f->nblocks; b++)
+        for (int i = f->blocks[b].first; i; i = f->insts[i].next)
+            if (!f->live[i]) {
+                f->insts[i].op = IR_NOP;
+                changes++;
+            }
+    if (changes) ir_cleanup(f);
+    return changes;
+}
+
+IrPass ir_passes[] = {
+    {"sccp", 1, ir_sccp},
+    {"dce", 1, ir_dce},
+    {"simplify-cfg", 1, ir_simplify_cfg},
+};
+#define IR_PASS_COUNT (int)(sizeof(ir_passes) / sizeof(ir_passes[0]))
+
+void ir_run_passes(Codegen* cg, IrFunc* f) {
+    for (int i = 0; i < IR_PASS_COUNT && i < IR_MAX_PASSES; i++)
+        if (optimization_level >= ir_passes[i].min_level) cg->ir_stats.pass_changes[i] += ir_passes[i].run(f);
+}
+
+// ---- Register allocation ----
+// Linear scan over SSA values, with lifetime holes (Wimmer and Mössenböck).
+// Blocks are laid out in reverse postorder and their instructions numbered
+// in steps of two: a block's phis sit at its start, a value is live from
+// just after its definition, and a phi operand is used at the end of its
+// predecessor. A value live across a call can only have r12-r15, which the
+// function saves; when no register is free, the value or the holders of the
+// cheapest register, whichever weighs less, go to stack slots. rax, rcx and
+// rdx are never allocated: instruction selection uses them as scratch.
+const char* ir_regs[4][16] = {
+    {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"},
+    {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi", "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"},
+    {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di", "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w"},
+    {"al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil", "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b"},
+};
+const int ir_alloc_order[] = {3, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+#define IR_ALLOC_REGS 11
+#define IR_FIRST_SAVED 7   // ir_alloc_order[IR_FIRST_SAVED..] survive calls
+#define IR_MAX_DEPTH 5     // Loops deeper than this weigh the same
+const int ir_arg_regs[] = {7, 6, 2, 1, 8, 9};         // rdi rsi rdx rcx r8 r9
+const int ir_syscall_regs[] = {0, 7, 6, 2, 10, 8, 9};  // rax rdi rsi rdx r10 r8 r9
+const int ir_rax_reg[] = {0};
+
+// Registers CALL i takes its operands in
+const int* ir_call_regs(IrFunc* f, int i) {
+    switch (f->insts[i].sym) {
+        case ATOM_print_int: case ATOM_malloc: case ATOM_free:
+            return ir_rax_reg;
+        case ATOM_syscall: case ATOM_syscall6:
+            return ir_syscall_regs;
+    }
+    return ir_arg_regs;
+}
+
+// An edge from a branch to a block with phis gets a block of its own,
+// where the phi moves go
+void ir_split_edges(IrFunc* f) {
+    int n = f->nblocks;
+    for (int b = 0; b < n; b++) {
+        if (f->blocks[b].dead || f->blocks[b].nsucc < 2) continue;
+        for (int k = 0; k < 2; k++) {
+            int s = f->blocks[b].succ[k];
+            if (!ir_has_phis(f, s)) continue;
+            f->depth = f->blocks[b].depth;
+            int mid = ir_new_sealed_block(f);
+            ir_append(f, mid, ir_new_inst(f, IR_JMP, IRT_VOID));
+            f->blocks[mid].succ[0] = s;
+            f->blocks[mid].nsucc = 1;
+            ir_list_push(f, &f->blocks[mid].preds, b);
+            ir_replace_pred(f, s, b, mid);
+            f->blocks[b].succ[k] = mid;
+        }
+    }
+}
+
+// Blocks in reverse postorder; a branch's false successor is visited
+// first, so its true successor comes right after it
+void ir_layout(IrFunc* f) {
+    ir_reserve(&f->order, &f->order_cap, f->nblocks, sizeof(int));
+    ir_reserve(&f->work, &f->work_cap, 2 * f->nblocks, sizeof(int));
+    for (int b = 0; b < f->nblocks; b++) f->blocks[b].mark = 0;
+    int n = 0;
+    f->nwork = 0;
+    f->work[f->nwork++] = 0;
+    f->work[f->nwork++] = 0;
+    f->blocks[0].mark = 1;
+    while (f->nwork) {
+        IrBlock* bl = &f->blocks[f->work[f->nwork - 2]];
+        int k = f->work[f->nwork - 1];
+        if (k < bl->nsucc) {
+            f->work[f->nwork - 1]++;
+            int s = bl->succ[bl->nsucc - 1 - k];
+            if (!f->blocks[s].mark) {
+                f->blocks[s].mark = 1;
+                f->work[f->nwork++] = s;
+                f->work[f->nwork++] = 0;
+            }
+        } else {
+            f->order[n++] = f->work[f->nwork - 2];
+            f->nwork -= 2;
+        }
+    }
+    for (int k = 0; k < n / 2; k++) {
+        int t = f->order[k];
+        f->order[k] = f->order[n - 1 - k];
+        f->order[n - 1 - k] = t;
+    }
+    f->norder = n;
+    for (int k = 0; k < n; k++) f->blocks[f->order[k]].order = k;
+}
+
+void ir_values_reserve(IrFunc* f) {
+    if (f->ninsts + 1 <= f->val_cap) return;
+    int cap = f->val_cap ? f->val_cap : 256;
+    while (cap < f->ninsts + 1) cap *= 2;
+    int** arrays[] = {&f->pos, &f->loc, &f->uses, &f->weight, &f->hint, &f->rfirst, &f->rcount,
+                      &f->rcur, &f->use_start, &f->active, &f->inactive};
+    for (size_t k = 0; k < sizeof(arrays) / sizeof(arrays[0]); k++)
+        *arrays[k] = safe_realloc(*arrays[k], sizeof(int) * cap);
+    f->sorted = safe_realloc(f->sorted, sizeof(long) * cap);
+    f->val_cap = cap;
+}
+
+// Values instruction i reads where it is (a phi reads its operands at the
+// ends of its predecessors)
+int ir_operands(IrFunc* f, int i, int* out) {
+    IrInst* in = &f->insts[i];
+    int n = 0;
+    if (in->op == IR_PHI) return 0;
+    if (in->a) out[n++] = in->a;
+    if (in->b) out[n++] = in->b;
+    if (in->c) out[n++] = in->c;
+    for (int k = 0; k < in->ops.count; k++) out[n++] = IR_AT(f, in->ops, k);
+    return n;
+}
+
+int ir_depth_weight(IrFunc* f, int b) {
+    int d = f->blocks[b].depth;
+    return 1 << 3 * (d < IR_MAX_DEPTH ? d : IR_MAX_DEPTH);
+}
+
+void ir_add_weight(IrFunc* f, int v, int w) {
+    f->weight[v] = f->weight[v] + w < (1 << 30) ? f->weight[v] + w : 1 << 30;
+}
+
+void ir_add_use(IrFunc* f, int v, int b, int pos) {
+    f->use_list[f->rcur[v]++] = (IrUse){b, pos};
+}
+
+// Positions, use lists, weights and register hints
+void ir_number(IrFunc* f) {
+    int n = f->ninsts, ops[10];
+    ir_values_reserve(f);
+    memset(f->uses, 0, sizeof(int) * n);
+    memset(f->weight, 0, sizeof(int) * n);
+    memset(f->hint, 0, sizeof(int) * n);
+    for (int v = 0; v < n; v++) f->loc[v] = IR_NOWHERE;
+    for (int k = 0; k < f->norder; k++)
+        for (int i = f->blocks[f->order[k]].first; i; i = f->insts[i].next) {
+            IrInst* in = &f->insts[i];
+            int c = ir_operands(f, i, ops);
+            for (int j = 0; j < c; j++) f->uses[ops[j]]++;
+            for (int j = 0; j < in->ops.count && in->op == IR_PHI; j++) f->uses[IR_AT(f, in->ops, j)]++;
+        }
+    int pos = 0;
+    f->ncalls = 0;
+    for (int k = 0; k < f->norder; k++) {
+        IrBlock* bl = &f->blocks[f->order[k]];
+        bl->start = pos;
+        pos += 2;
+        for (int i = bl->first; i; i = f->insts[i].next) {
+            IrInst* in = &f->insts[i];
+            if (in->op == IR_PHI) {
+                f->pos[i] = bl->start;
+                continue;
+            }
+            // A compare only its branch reads becomes the branch's cmp
+            in->fused = in->op == IR_CMP && f->uses[i] == 1 && in->next &&
+                        f->insts[in->next].op == IR_BR && f->insts[in->next].a == i;
+            f->pos[i] = pos;
+            pos += 2;
+            if (in->op == IR_CALL) {
+                ir_reserve(&f->calls, &f->call_cap, f->ncalls + 1, sizeof(int));
+                f->calls[f->ncalls++] = f->pos[i];
+            }
+        }
+        bl->end = pos - 1;
+    }
+    // Uses grouped by value
+    int total = 0;
+    for (int v = 0; v < n; v++) {
+        f->use_start[v] = f->rcur[v] = total;
+        total += f->uses[v];
+    }
+    f->use_start[n] = total;
+    ir_reserve(&f->use_list, &f->use_cap, total, sizeof(IrUse));
+    for (int k = 0; k < f->norder; k++) {
+        int b = f->order[k], w = ir_depth_weight(f, b);
+        for (int i = f->blocks[b].first; i; i = f->insts[i].next) {
+            IrInst* in = &f->insts[i];
+            if (in->op == IR_PHI) {
+                for (int j = 0; j < in->ops.count; j++) {
+                    int v = IR_AT(f, in->ops, j), p = IR_AT(f, f->blocks[b].preds, j);
+                    ir_add_use(f, v, p, f->blocks[p].end - 1);
+                    ir_add_weight(f, v, ir_depth_weight(f, p));
+                }
+            } else {
+                int at = in->fused ? f->pos[in->next] : f->pos[i];
+                int c = ir_operands(f, i, ops);
+                for (int j = 0; j < c; j++) {
+                    ir_add_use(f, ops[j], b, at);
+                    ir_add_weight(f, ops[j], w);
+                }
+            }
+            ir_add_weight(f, i, w);
+            // Hints: a two-address result shares its left operand's
+            // register, phis share with their operands, arguments and
+            // parameters ask for the registers they are passed in
+            if (in->op == IR_ADD || in->op == IR_SUB || in->op == IR_MUL || in->op == IR_NEG) {
+                int a = in->op != IR_SUB && in->op != IR_NEG && ir_floating(f, in->a) ? in->b : in->a;
+                if (!ir_floating(f, a)) f->hint[i] = a;
+            } else if (in->op == IR_PHI) {
+                for (int j = 0; j < in->ops.count; j++) {
+                    int v = IR_AT(f, in->ops, j);
+                    if (ir_floating(f, v)) continue;
+                    if (!f->hint[i]) f->hint[i] = v;
+                    if (!f->hint[v]) f->hint[v] = i;
+                }
+            } else if (in->op == IR_CALL) {
+                const int* regs = ir_call_regs(f, i);
+                for (int j = 0; j < in->ops.count; j++) {
+                    int v = IR_AT(f, in->ops, j);
+                    if (!ir_floating(f, v) && !f->hint[v]) f->hint[v] = -(regs[j] + 1);
+                }
+            } else if (in->op == IR_PARAM) {
+                f->hint[i] = -(ir_arg_regs[in->imm] + 1);
+            }
+        }
+    }
+}
+
+// Does value v need a register or slot? Not constants and addresses, a
+// compare fused into its branch, or an unused call result or parameter.
+int ir_needs_loc(IrFunc* f, int v) {
+    IrInst* in = &f->insts[v];
+    switch (in->op) {
+        case IR_CMP:
+            return !in->fused;
+        case IR_CALL: case IR_PARAM:
+            return f->uses[v] > 0;
+        case IR_ADD: case IR_SUB: case IR_MUL: case IR_DIV: case IR_MOD:
+        case IR_NEG: case IR_NOT: case IR_LOAD: case IR_PHI:
+            return 1;
+    }
+    return 0;
+}
+
+void ir_add_range(IrFunc* f, int start, int end) {
+    ir_reserve(&f->tmp, &f->tmp_cap, f->ntmp + 1, sizeof(IrRange));
+    f->tmp[f->ntmp++] = (IrRange){start, end};
+}
+
+void ir_push_preds(IrFunc* f, int b) {
+    IrList preds = f->blocks[b].preds;
+    ir_reserve(&f->work, &f->work_cap, f->nwork + preds.count, sizeof(int));
+    for (int k = 0; k < preds.count; k++) f->work[f->nwork++] = IR_AT(f, preds, k);
+}
+
+// v, defined in block d from position ds, is live into block b: it is live
+// through every block on the way back to d
+void ir_live_in(IrFunc* f, int v, int b, int d, int ds) {
+    if (f->blocks[b].live_in == v) return;
+    f->blocks[b].live_in = v;
+    f->nwork = 0;
+    ir_push_preds(f, b);
+    while (f->nwork) {
+        int p = f->work[--f->nwork];
+        IrBlock* pb = &f->blocks[p];
+        if (pb->live_out == v) continue;
+        pb->live_out = v;
+        if (p == d) {
+            ir_add_range(f, ds, pb->end);
+            continue;
+        }
+        ir_add_range(f, pb->start, pb->end);
+        if (pb->live_in != v) {
+            pb->live_in = v;
+            ir_push_preds(f, p);
+        }
+    }
+}
+
+int ir_range_cmp(const void* x, const void* y) {
+    return ((const IrRange*)x)->start - ((const IrRange*)y)->start;
+}
+
+// Live ranges of every value that needs a location, sorted and merged
+void ir_liveness(IrFunc* f) {
+    for (int k = 0; k < f->norder; k++) f->blocks[f->order[k]].live_in = f->blocks[f->order[k]].live_out = 0;
+    f->nranges = 0;
+    for (int v = 1; v < f->ninsts; v++) {
+        f->rcount[v] = 0;
+        if (!ir_needs_loc(f, v)) continue;
+        IrInst* in = &f->insts[v];
+        int d = in->block;
+        int ds = in->op == IR_PHI || in->op == IR_PARAM ? f->blocks[d].start : f->pos[v] + 1;
+        f->ntmp = 0;
+        ir_add_range(f, ds, ds);
+        for (int k = 0; in->op == IR_PHI && k < f->blocks[d].preds.count; k++) {
+            int end = f->blocks[IR_AT(f, f->blocks[d].preds, k)].end;
+            ir_add_range(f, end, end);
+        }
+        for (int u = f->use_start[v]; u < f->use_start[v + 1]; u++) {
+            IrUse use = f->use_list[u];
+            if (use.block == d && use.pos >= ds) {
+                ir_add_range(f, ds, use.pos);
+            } else {
+                ir_add_range(f, f->blocks[use.block].start, use.pos);
+                ir_live_in(f, v, use.block, d, ds);
+            }
+        }
+        // Usually a handful of ranges, nearly in order
+        if (f->ntmp > 16) {
+            qsort(f->tmp, f->ntmp, sizeof(IrRange), ir_range_cmp);
+        } else {
+            for (int k = 1; k < f->ntmp; k++) {
+                IrRange r = f->tmp[k];
+                int j = k;
+                for (; j > 0 && f->tmp[j - 1].start > r.start; j--) f->tmp[j] = f->tmp[j - 1];
+                f->tmp[j] = r;
+            }
+        }
+        ir_reserve(&f->ranges, &f->range_cap, f->nranges + f->ntmp, sizeof(IrRange));
+        f->rfirst[v] = f->nranges;
+        IrRange cur = f->tmp[0];
+        for (int k = 1; k < f->ntmp; k++) {
+            if (f->tmp[k].start <= cur.end + 1) {
+                if (f->tmp[k].end > cur.end) cur.end = f->tmp[k].end;
+            } else {
+                f->ranges[f->nranges++] = cur;
+                cur = f->tmp[k];
+            }
+        }
+        f->ranges[f->nranges++] = cur;
+        f->rcount[v] = f->nranges - f->rfirst[v];
+    }
+}
+
+int ir_last(IrFunc* f, int v) { return f->ranges[f->rfirst[v] + f->rcount[v] - 1].end; }
+
+// Is v live at pos? Positions only grow, so ranges behind are skipped for good
+int ir_covers(IrFunc* f, int v, int pos) {
+    int end = f->rfirst[v] + f->rcount[v];
+    while (f->rcur[v] < end && f->ranges[f->rcur[v]].end < pos) f->rcur[v]++;
+    return f->rcur[v] < end && f->ranges[f->rcur[v]].start <= pos;
+}
+
+// First position where both a and v are live, or -1
+int ir_intersect(IrFunc* f, int a, int v) {
+    int i = f->rcur[a], ie = f->rfirst[a] + f->rcount[a];
+    int j = f->rfirst[v], je = j + f->rcount[v];
+    while (i < ie && j < je) {
+        IrRange* x = &f->ranges[i];
+        IrRange* y = &f->ranges[j];
+        if (x->end < y->start) i++;
+        else if (y->end < x->start) j++;
+        else return x->start > y->start ? x->start : y->start;
+    }
+    return -1;
+}
+
+int ir_crosses_call(IrFunc* f, int v) {
+    for (int r = f->rfirst[v]; r < f->rfirst[v] + f->rcount[v]; r++) {
+        int lo = 0, hi = f->ncalls;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (f->calls[mid] < f->ranges[r].start) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo < f->ncalls && f->calls[lo] < f->ranges[r].end) return 1;
+    }
+    return 0;
+}
+
+int ir_cmp_long(const void* x, const void* y) {
+    long a = *(const long*)x, b = *(const long*)y;
+    return (a > b) - (a < b);
+}
+
+int ir_spill(IrFunc* f, IrStats* stats) {
+    stats->spilled++;
+    return -(++f->slots);
+}
+
+void ir_allocate(IrFunc* f, IrStats* stats) {
+    int n = 0, nactive = 0, ninactive = 0;
+    for (int v = 1; v < f->ninsts; v++)
+        if (f->rcount[v]) {
+            f->sorted[n++] = (long)f->ranges[f->rfirst[v]].start << 32 | v;
+            f->rcur[v] = f->rfirst[v];
+        }
+    // Values are mostly created in layout order already
+    int in_order = 1;
+    for (int k = 1; k < n && in_order; k++) in_order = f->sorted[k - 1] < f->sorted[k];
+    if (!in_order) qsort(f->sorted, n, sizeof(long), ir_cmp_long);
+    f->slots = 0;
+    f->saved = 0;
+    for (int s = 0; s < n; s++) {
+        int v = (int)(f->sorted[s] & 0xffffffff), pos = (int)(f->sorted[s] >> 32);
+        // Finished values leave; values in a lifetime hole wait in inactive
+        int k = 0;
+        for (int j = 0; j < nactive; j++) {
+            int a = f->active[j];
+            if (ir_last(f, a) < pos) continue;
+            if (ir_covers(f, a, pos)) f->active[k++] = a;
+            else f->inactive[ninactive++] = a;
+        }
+        nactive = k;
+        k = 0;
+        for (int j = 0; j < ninactive; j++) {
+            int a = f->inactive[j];
+            if (ir_last(f, a) < pos) continue;
+            if (ir_covers(f, a, pos)) f->active[nactive++] = a;
+            else f->inactive[k++] = a;
+        }
+        ninactive = k;
+
+        int free_until[16], end = ir_last(f, v);
+        int lo = ir_crosses_call(f, v) ? IR_FIRST_SAVED : 0;
+        for (int r = 0; r < 16; r++) free_until[r] = -1;
+        for (int j = lo; j < IR_ALLOC_REGS; j++) free_until[ir_alloc_order[j]] = INT_MAX;
+        for (int j = 0; j < nactive; j++)
+            if (free_until[f->loc[f->active[j]]] > 0) free_until[f->loc[f->active[j]]] = 0;
+        for (int j = 0; j < ninactive; j++) {
+            int r = f->loc[f->inactive[j]];
+            if (free_until[r] <= 0) continue;
+            int x = ir_intersect(f, f->inactive[j], v);
+            if (x >= 0 && x < free_until[r]) free_until[r] = x;
+        }
+        int reg = -1, h = f->hint[v];
+        int hr = h < 0 ? -h - 1 : h > 0 && IR_REG(f->loc[h]) ? f->loc[h] : -1;
+        if (hr >= 0 && free_until[hr] > end) {
+            reg = hr;
+        } else {
+            int best = ir_alloc_order[lo];
+            for (int j = lo; j < IR_ALLOC_REGS; j++)
+                if (free_until[ir_alloc_order[j]] > free_until[best]) best = ir_alloc_order[j];
+            if (free_until[best] > end) reg = best;
+        }
+        if (reg < 0) {
+            long cost[16] = {0};
+            for (int j = 0; j < nactive; j++) cost[f->loc[f->active[j]]] += f->weight[f->active[j]];
+            for (int j = 0; j < ninactive; j++)
+                if (ir_intersect(f, f->inactive[j], v) >= 0) cost[f->loc[f->inactive[j]]] += f->weight[f->inactive[j]];
+            int best = ir_alloc_order[lo];
+            for (int j = lo; j < IR_ALLOC_REGS; j++)
+                if (cost[ir_alloc_order[j]] < cost[best]) best = ir_alloc_order[j];
+            if (cost[best] >= f->weight[v]) {
+                f->loc[v] = ir_spill(f, stats);
+                continue;
+            }
+            // The values holding `best` while v is live move to the stack
+            k = 0;
+            for (int j = 0; j < nactive; j++) {
+                int a = f->active[j];
+                if (f->loc[a] == best) f->loc[a] = ir_spill(f, stats);
+                else f->active[k++] = a;
+            }
+            nactive = k;
+            k = 0;
+            for (int j = 0; j < ninactive; j++) {
+                int a = f->inactive[j];
+                if (f->loc[a] == best && ir_intersect(f, a, v) >= 0) f->loc[a] = ir_spill(f, stats);
+                else f->inactive[k++] = a;
+            }
+            ninactive = k;
+            reg = best;
+        }
+        f->loc[v] = reg;
+        f->active[nactive++] = v;
+    }
+    // A value made just for the ret or rax-argument call after it is made
+    // in rax, where that wants it
+    for (int v = 1; v < f->ninsts; v++) {
+        IrInst* in = &f->insts[v];
+        IrInst* use = &f->insts[in->next];
+        if (!in->next || f->uses[v] != 1 || f->loc[v] == IR_NOWHERE || in->op == IR_PHI || in->op == IR_PARAM)
+            continue;
+        if ((use->op == IR_RET && use->a == v) ||
+            (use->op == IR_CALL && ir_call_regs(f, in->next) == ir_rax_reg && use->ops.count == 1 &&
+             IR_AT(f, use->ops, 0) == v))
+            f->loc[v] = IR_RAX;
+    }
+    for (int v = 1; v < f->ninsts; v++)
+        if (IR_REG(f->loc[v]) && f->loc[v] >= 12) f->saved |= 1u << f->loc[v];
+}
+
+// ---- Instruction selection ----
+void ir_put_loc(Codegen* cg, int loc) {
+    if (IR_REG(loc)) emit_str(cg, ir_regs[0][loc]);
+    else emit_i(cg, "[rbp", 8 * loc, "]");
+}
+
+// v as an operand: its register or slot, or a constant that fits an imm32
+void ir_put(Codegen* cg, IrFunc* f, int v) {
+    if (f->insts[v].op == IR_CONST) emit_num(cg, f->insts[v].imm);
+    else ir_put_loc(cg, f->loc[v]);
+}
+
+int ir_imm32(IrFunc* f, int v) {
+    return f->insts[v].op == IR_CONST && f->insts[v].imm == (int32_t)f->insts[v].imm;
+}
+
+// Usable as a source operand as it is
+int ir_direct(IrFunc* f, int v) { return ir_imm32(f, v) || !ir_floating(f, v); }
+
+// mov dst, src, one of them a register; nothing when it would only undo
+// the mov just before it
+void ir_mov(Codegen* cg, IrFunc* f, int dst, int src) {
+    if (f->moved_end == cg->code_len && f->moved_dst == src && f->moved_src == dst) return;
+    emit_lit(cg, "    mov ");
+    ir_put_loc(cg, dst);
+    emit_lit(cg, ", ");
+    ir_put_loc(cg, src);
+    emit_lit(cg, "\n");
+    f->moved_dst = dst;
+    f->moved_src = src;
+    f->moved_end = cg->code_len;
+}
+
+// v into register r (nothing when it is there)
+void ir_load_reg(Codegen* cg, IrFunc* f, int r, int v) {
+    IrInst* in = &f->insts[v];
+    const char* name = ir_regs[0][r];
+    if (in->op == IR_CONST && !in->imm) {
+        emit_s(cg, "    xor ", name, ", ");
+        emit_str(cg, name);
+        emit_lit(cg, "\n");
+    } else if (in->op == IR_CONST) {
+        emit_s(cg, "    mov ", name, ", ");
+        emit_num(cg, in->imm);
+        emit_lit(cg, "\n");
+    } else if (in->op == IR_ADDR && in->label) {
+        emit_s(cg, "    mov ", name, ", ");
+        emit_s(cg, "", in->label, "\n");
+    } else if (in->op == IR_ADDR) {
+        emit_s(cg, "    lea ", name, ", ");
+        emit_n(cg, "[", in->sym, "]\n");
+    } else if (f->loc[v] != r) {
+        ir_mov(cg, f, r, f->loc[v]);
+    }
+}
+
+// Register holding v, loading it into `scratch` if it has none
+int ir_reg_of(Codegen* cg, IrFunc* f, int v, int scratch) {
+    if (!ir_floating(f, v) && IR_REG(f->loc[v])) return f->loc[v];
+    ir_load_reg(cg, f, scratch, v);
+    return scratch;
+}
+
+// Register to compute value i in: its own, or rax when it lives in a slot
+int ir_target(IrFunc* f, int i) { return IR_REG(f->loc[i]) ? f->loc[i] : IR_RAX; }
+
+// Value i, computed into register r, goes to its own location
+void ir_set(Codegen* cg, IrFunc* f, int i, int r) {
+    if (f->loc[i] == r || f->loc[i] == IR_NOWHERE) return;
+    ir_mov(cg, f, f->loc[i], r);
+}
+
+void ir_move(Codegen* cg, IrFunc* f, int dst, int src) {
+    if (IR_REG(dst) || IR_REG(src)) {
+        ir_mov(cg, f, dst, src);
+    } else {
+        emit_lit(cg, "    mov rdx, ");
+        ir_put_loc(cg, src);
+        emit_lit(cg, "\n    mov ");
+        ir_put_loc(cg, dst);
+        emit_lit(cg, ", rdx\n");
+    }
+}
+
+void ir_move_value(Codegen* cg, IrFunc* f, int dst, int v) {
+    if (IR_REG(dst)) {
+        ir_load_reg(cg, f, dst, v);
+    } else if (ir_imm32(f, v)) {
+        emit_lit(cg, "    mov qword ");
+        ir_put_loc(cg, dst);
+        emit_i(cg, ", ", f->insts[v].imm, "\n");
+    } else {
+        ir_load_reg(cg, f, IR_RDX, v);
+        emit_lit(cg, "    mov ");
+        ir_put_loc(cg, dst);
+        emit_lit(cg, ", rdx\n");
+    }
+}
+
+IrMove ir_move_of(IrFunc* f, int dst, int v) {
+    return (IrMove){dst, ir_floating(f, v) ? IR_NOWHERE : f->loc[v], v, 0};
+}
+
+// The moves m[0..n) as if all at once: a move waits until nothing still
+// needs its destination, a cycle is broken through `tmp`, and constants
+// are loaded last
+void ir_parallel_move(Codegen* cg, IrFunc* f, IrMove* m, int n, int tmp) {
+    for (;;) {
+        int progress = 0, waiting = -1;
+        for (int i = 0; i < n; i++) {
+            if (m[i].done || m[i].src == IR_NOWHERE) continue;
+            int blocked = 0;
+            for (int j = 0; j < n && !blocked && m[i].src != m[i].dst; j++)
+                blocked = j != i && !m[j].done && m[j].src == m[i].dst;
+            if (blocked) {
+                waiting = i;
+                continue;
+            }
+            if (m[i].src != m[i].dst) ir_move(cg, f, m[i].dst, m[i].src);
+            m[i].done = 1;
+            progress = 1;
+        }
+        if (waiting < 0) break;
+        if (!progress) {
+            int d = m[waiting].dst;
+            ir_move(cg, f, tmp, d);
+            for (int j = 0; j < n; j++)
+                if (!m[j].done && m[j].src == d) m[j].src = tmp;
+        }
+    }
+    for (int i = 0; i < n; i++)
+        if (m[i].src == IR_NOWHERE) ir_move_value(cg, f, m[i].dst, m[i].value);
+}
+
+// Phi copies on the edge from block `from` to block `to`
+void ir_phi_moves(Codegen* cg, IrFunc* f, int from, int to) {
+    if (!ir_has_phis(f, to)) return;
+    IrBlock* bl = &f->blocks[to];
+    int k = 0, n = 0;
+    while (IR_AT(f, bl->preds, k) != from) k++;
+    for (int i = bl->first; i && f->insts[i].op == IR_PHI; i = f->insts[i].next) {
+        ir_reserve(&f->moves, &f->move_cap, n + 1, sizeof(IrMove));
+        f->moves[n++] = ir_move_of(f, f->loc[i], IR_AT(f, f->insts[i].ops, k));
+    }
+    ir_parallel_move(cg, f, f->moves, n, IR_RAX);
+}
+
+const char* ir_cc_name(int cc) {
+    switch (cc) {
+        case T_EQEQ: return "e";
+        case T_NEQ: return "ne";
+        case T_LT: return "l";
+        case T_GT: return "g";
+        case T_LTE: return "le";
+    }
+    return "ge";
+}
+
+int ir_cc_negate(int cc) {
+    switch (cc) {
+        case T_EQEQ: return T_NEQ;
+        case T_NEQ: return T_EQEQ;
+        case T_LT: return T_GTE;
+        case T_GT: return T_LTE;
+        case T_LTE: return T_GT;
+    }
+    return T_LT;
+}
+
+// The condition with its operands the other way round
+int ir_cc_swap(int cc) {
+    switch (cc) {
+        case T_LT: return T_GT;
+        case T_GT: return T_LT;
+        case T_LTE: return T_GTE;
+        case T_GTE: return T_LTE;
+    }
+    return cc;
+}
+
+// cmp for CMP i; returns its condition, reversed if the operands were
+// swapped to put a constant on the right
+int ir_select_cmp(Codegen* cg, IrFunc* f, int i) {
+    IrInst* in = &f->insts[i];
+    int a = in->a, b = in->b, cc = in->cc, ra = -1, rb = -1;
+    if (ir_floating(f, a) && !ir_floating(f, b)) {
+        a = in->b;
+        b = in->a;
+        cc = ir_cc_swap(cc);
+    }
+    if (!ir_direct(f, b)) ir_load_reg(cg, f, rb = IR_RCX, b);
+    if (ir_floating(f, a) || (IR_SLOT(f->loc[a]) && IR_SLOT(f->loc[b]))) ir_load_reg(cg, f, ra = IR_RAX, a);
+    emit_lit(cg, "    cmp ");
+    if (ra >= 0) {
+        emit_str(cg, ir_regs[0][ra]);
+    } else {
+        if (IR_SLOT(f->loc[a]) && rb < 0 && ir_imm32(f, b)) emit_lit(cg, "qword ");
+        ir_put_loc(cg, f->loc[a]);
+    }
+    emit_lit(cg, ", ");
+    if (rb >= 0) emit_str(cg, ir_regs[0][rb]);
+    else ir_put(cg, f, b);
+    emit_lit(cg, "\n");
+    return cc;
+}
+
+// ADD, SUB and MUL are two-address: the result register is loaded with
+// the left operand first, so it must not hold the right one
+void ir_select_alu(Codegen* cg, IrFunc* f, int i) {
+    static const char* mnemonics[] = {[IR_ADD] = "    add ", [IR_SUB] = "    sub ", [IR_MUL] = "    imul "};
+    IrInst* in = &f->insts[i];
+    int a = in->a, b = in->b, r = ir_target(f, i);
+    if (in->op != IR_SUB && ((ir_floating(f, a) && !ir_floating(f, b)) || (f->loc[b] == r && a != b))) {
+        a = in->b;
+        b = in->a;
+    }
+    if (f->loc[b] == r && a != b) r = IR_RAX;
+    IrInst* bi = &f->insts[b];
+    const char* name = ir_regs[0][r];
+    if (in->op == IR_MUL && bi->op == IR_CONST && optimization_level >= 2 && is_power_of_2(bi->imm)) {
+        ir_load_reg(cg, f, r, a);
+        emit(cg, "    ; Optimized: x * %ld => x << %d\n", bi->imm, get_log2(bi->imm));
+        emit_s(cg, "    shl ", name, ", ");
+        emit_i(cg, "", get_log2(bi->imm), "\n");
+    } else if (in->op == IR_MUL && ir_imm32(f, b) && !ir_floating(f, a)) {
+        emit_s(cg, "    imul ", name, ", ");
+        ir_put(cg, f, a);
+        emit_i(cg, ", ", bi->imm, "\n");
+    } else if (in->op != IR_MUL && ir_imm32(f, b) && bi->imm != INT32_MIN && !ir_floating(f, a) &&
+               IR_REG(f->loc[a]) && f->loc[a] != r) {
+        long d = in->op == IR_ADD ? bi->imm : -bi->imm;
+        emit_s(cg, "    lea ", name, ", [");
+        emit_str(cg, ir_regs[0][f->loc[a]]);
+        if (d >= 0) emit_lit(cg, "+");
+        emit_i(cg, "", d, "]\n");
+    } else {
+        int rb = -1;
+        if (!ir_direct(f, b)) ir_load_reg(cg, f, rb = IR_RCX, b);
+        ir_load_reg(cg, f, r, a);
+        emit_str(cg, mnemonics[in->op]);
+        emit_s(cg, "", name, ", ");
+        if (rb >= 0) emit_str(cg, ir_regs[0][rb]);
+        else ir_put(cg, f, b);
+        emit_lit(cg, "\n");
+    }
+    ir_set(cg, f, i, r);
+}
+
+// Division and remainder in rax and rdx, by 0 giving 0 as in gen_expr
+void ir_select_div(Codegen* cg, IrFunc* f, int i) {
+    IrInst* in = &f->insts[i];
+    IrInst* d = &f->insts[in->b];
+    int mod = in->op == IR_MOD, r = ir_target(f, i);
+    const char* name = ir_regs[0][r];
+    if (d->op == IR_CONST && !d->imm) {
+        ir_load_reg(cg, f, r, in->b);
+    } else if (d->op == IR_CONST && in->literal && optimization_level >= 2 && is_power_of_2(d->imm)) {
+        int shift = get_log2(d->imm);
+        long mask = d->imm - 1;
+        ir_load_reg(cg, f, r, in->a);
+        if (!mod) {
+            emit(cg, "    ; Optimized: x / %ld => x >> %d\n", d->imm, shift);
+            emit_s(cg, "    sar ", name, ", ");
+            emit_i(cg, "", shift, "\n");
+        } else if (mask == (int32_t)mask) {
+            emit(cg, "    ; Optimized: x %% %ld => x & %ld\n", d->imm, mask);
+            emit_s(cg, "    and ", name, ", ");
+            emit_i(cg, "", mask, "\n");
+        } else {
+            emit(cg, "    ; Optimized: x %% %ld => x & %ld\n", d->imm, mask);
+            emit_i(cg, "    mov rcx, ", mask, "\n");
+            emit_s(cg, "    and ", name, ", rcx\n");
+        }
+    } else {
+        // A constant divisor is known not to be 0
+        int y = d->op == IR_CONST ? IR_RCX : ir_reg_of(cg, f, in->b, IR_RCX);
+        if (d->op == IR_CONST) ir_load_reg(cg, f, IR_RCX, in->b);
+        ir_load_reg(cg, f, IR_RAX, in->a);
+        int skip = d->op == IR_CONST ? -1 : new_label(cg);
+        if (skip >= 0) {
+            emit_s(cg, "    test ", ir_regs[0][y], ", ");
+            emit_s(cg, "", ir_regs[0][y], "\n");
+            emit_i(cg, "    jnz .L", skip, "\n");
+            if (mod) emit_lit(cg, "    ; Modulo by zero - return 0\n    xor rdx, rdx\n");
+            else emit_lit(cg, "    ; Division by zero - return 0\n    xor rax, rax\n");
+            emit_i(cg, "    jmp .L", skip, "_end\n");
+            emit_i(cg, ".L", skip, ":\n");
+        }
+        emit_s(cg, "    xor rdx, rdx\n    idiv ", ir_regs[0][y], "\n");
+        if (skip >= 0) emit_i(cg, ".L", skip, "_end:\n");
+        r = mod ? IR_RDX : IR_RAX;
+    }
+    ir_set(cg, f, i, r);
+}
+
+// Address of LOAD or STORE i: the base goes to rcx and the index to rdx
+// when they are not in registers, a constant index to the displacement
+typedef struct {
+    int base, index, scale;
+    long disp;
+    Atom sym;
+} IrAddr;
+
+IrAddr ir_address(Codegen* cg, IrFunc* f, int i) {
+    IrInst* in = &f->insts[i];
+    IrAddr m = {-1, -1, in->scale, 0, ATOM_NONE};
+    long disp = in->b && f->insts[in->b].op == IR_CONST ? f->insts[in->b].imm * in->scale : 0;
+    if (in->b && f->insts[in->b].op == IR_CONST && disp == (int32_t)disp) m.disp = disp;
+    else if (in->b) m.index = ir_reg_of(cg, f, in->b, IR_RDX);
+    if (in->a) {
+        m.base = ir_reg_of(cg, f, in->a, IR_RCX);
+    } else if (m.index >= 0) {
+        emit_n(cg, "    lea rcx, [", in->sym, "]\n");
+        m.base = IR_RCX;
+    } else {
+        m.sym = in->sym;
+    }
+    return m;
+}
+
+void ir_put_addr(Codegen* cg, IrAddr* m) {
+    emit_lit(cg, "[");
+    if (m->sym) emit_name(cg, m->sym);
+    else emit_str(cg, ir_regs[0][m->base]);
+    if (m->index >= 0) emit_s(cg, "+", ir_regs[0][m->index], "");
+    if (m->index >= 0 && m->scale > 1) emit_i(cg, "*", m->scale, "");
+    if (m->disp > 0) emit_lit(cg, "+");
+    if (m->disp) emit_num(cg, m->disp);
+    emit_lit(cg, "]");
+}
+
+void ir_select_load(Codegen* cg, IrFunc* f, int i) {
+    IrAddr m = ir_address(cg, f, i);
+    int r = ir_target(f, i), width = ir_width(f->insts[i].type);
+    if (width == 1) emit_s(cg, "    movzx ", ir_regs[0][r], ", byte ");
+    else if (width == 2) emit_s(cg, "    movzx ", ir_regs[0][r], ", word ");
+    else if (width == 4) emit_s(cg, "    mov ", ir_regs[1][r], ", ");
+    else emit_s(cg, "    mov ", ir_regs[0][r], ", ");
+    ir_put_addr(cg, &m);
+    emit_lit(cg, "\n");
+    ir_set(cg, f, i, r);
+}
+
+void ir_select_store(Codegen* cg, IrFunc* f, int i) {
+    static const char* sizes[] = {[1] = "byte ", [2] = "word ", [4] = "dword ", [8] = "qword "};
+    IrAddr m = ir_address(cg, f, i);
+    int v = f->insts[i].c, width = ir_width(f->insts[i].type);
+    int row = width == 8 ? 0 : width == 4 ? 1 : width == 2 ? 2 : 3;
+    if (ir_imm32(f, v)) {
+        long x = f->insts[v].imm;
+        x = width == 1 ? (int8_t)x : width == 2 ? (int16_t)x : width == 4 ? (int32_t)x : x;
+        emit_s(cg, "    mov ", sizes[width], "");
+        ir_put_addr(cg, &m);
+        emit_i(cg, ", ", x, "\n");
+    } else {
+        int r = ir_reg_of(cg, f, v, IR_RAX);
+        emit_s(cg, "    mov ", sizes[width], "");
+        ir_put_addr(cg, &m);
+        emit_s(cg, ", ", ir_regs[row][r], "\n");
+    }
+}
+
+void ir_select_call(Codegen* cg, IrFunc* f, int i) {
+    IrInst* in = &f->insts[i];
+    if (in->sym == ATOM_print || in->sym == ATOM_println) {
+        if (in->label) {
+            emit_s(cg, "    mov rsi, ", in->label, "\n");
+            emit_i(cg, "    mov rdx, ", in->imm, "\n");
+            emit_lit(cg, "    mov rdi, 1\n    mov rax, 1\n    syscall\n");
+        }
+        if (in->sym == ATOM_println) {
+            int off = -8 * (f->slots + 1);  // The byte after the spill slots
+            emit_i(cg, "    mov byte [rbp", off, "], 10\n");
+            emit_i(cg, "    lea rsi, [rbp", off, "]\n");
+            emit_lit(cg, "    mov rdi, 1\n    mov rdx, 1\n    mov rax, 1\n    syscall\n");
+        }
+        return;
+    }
+    const int* regs = ir_call_regs(f, i);
+    IrMove m[7];
+    for (int k = 0; k < in->ops.count; k++) m[k] = ir_move_of(f, regs[k], IR_AT(f, in->ops, k));
+    int syscall = in->sym == ATOM_syscall || in->sym == ATOM_syscall6;
+    ir_parallel_move(cg, f, m, in->ops.count, syscall ? IR_RCX : IR_RAX);
+    switch (in->sym) {
+        case ATOM_print_int: emit_lit(cg, "    call __print_int\n"); break;
+        case ATOM_exit: emit_lit(cg, "    mov rax, 60\n    syscall\n"); break;
+        case ATOM_strcmp: emit_lit(cg, "    call __strcmp\n"); break;
+        case ATOM_strcpy: emit_lit(cg, "    call __strcpy\n"); break;
+        case ATOM_strlen: emit_lit(cg, "    call __strlen\n"); break;
+        case ATOM_open: emit_lit(cg, "    mov rax, 2\n    syscall\n"); break;
+        case ATOM_read: emit_lit(cg, "    mov rax, 0\n    syscall\n"); break;
+        case ATOM_write: emit_lit(cg, "    mov rax, 1\n    syscall\n"); break;
+        case ATOM_close: emit_lit(cg, "    mov rax, 3\n    syscall\n"); break;
+        case ATOM_malloc: gen_malloc_rax(cg); break;
+        case ATOM_free: gen_free_rax(cg); break;
+        case ATOM_syscall: case ATOM_syscall6: emit_lit(cg, "    syscall\n"); break;
+        default: emit_n(cg, "    call ", in->sym, "\n"); break;
+    }
+    ir_set(cg, f, i, IR_RAX);
+}
+
+// Are the phi copies on the edge from block `from` to block `to` all in place?
+int ir_phi_moves_none(IrFunc* f, int from, int to) {
+    IrBlock* bl = &f->blocks[to];
+    int k = 0;
+    if (!ir_has_phis(f, to)) return 1;
+    while (IR_AT(f, bl->preds, k) != from) k++;
+    for (int i = bl->first; i && f->insts[i].op == IR_PHI; i = f->insts[i].next) {
+        int v = IR_AT(f, f->insts[i].ops, k);
+        if (ir_floating(f, v) || f->loc[v] != f->loc[i]) return 0;
+    }
+    return 1;
+}
+
+// Does falling into block `next` reach block b, through blocks that only
+// jump to the one after them?
+int ir_falls_to(IrFunc* f, int next, int b) {
+    for (int k = next < 0 ? f->norder : f->blocks[next].order; k < f->norder; k++) {
+        int x = f->order[k];
+        IrBlock* bl = &f->blocks[x];
+        if (x == b) return 1;
+        if (f->insts[bl->first].op != IR_JMP || k + 1 == f->norder || bl->succ[0] != f->order[k + 1] ||
+            !ir_phi_moves_none(f, x, bl->succ[0]))
+            return 0;
+    }
+    return 0;
+}
+
+void ir_jump_to(Codegen* cg, IrFunc* f, int b, int next) {
+    if (!ir_falls_to(f, next, b)) emit_i(cg, "    jmp .L", f->blocks[b].label, "\n");
+}
+
+void ir_select_branch(Codegen* cg, IrFunc* f, int i, int next) {
+    IrBlock* bl = &f->blocks[f->insts[i].block];
+    int c = f->insts[i].a, t = bl->succ[0], e = bl->succ[1], cc = T_NEQ;
+    IrInst* ci = &f->insts[c];
+    if (ci->op == IR_CMP && ci->fused) {
+        cc = ir_select_cmp(cg, f, c);
+    } else if (ir_floating(f, c)) {
+        ir_jump_to(cg, f, ci->op == IR_ADDR || ci->imm ? t : e, next);
+        return;
+    } else if (IR_SLOT(f->loc[c])) {
+        emit_lit(cg, "    cmp qword ");
+        ir_put_loc(cg, f->loc[c]);
+        emit_lit(cg, ", 0\n");
+    } else {
+        emit_s(cg, "    test ", ir_regs[0][f->loc[c]], ", ");
+        emit_s(cg, "", ir_regs[0][f->loc[c]], "\n");
+    }
+    if (t == next) {
+        emit_s(cg, "    j", ir_cc_name(ir_cc_negate(cc)), " .L");
+        emit_i(cg, "", f->blocks[e].label, "\n");
+    } else {
+        emit_s(cg, "    j", ir_cc_name(cc), " .L");
+        emit_i(cg, "", f->blocks[t].label, "\n");
+        ir_jump_to(cg, f, e, next);
+    }
+}
+
+void ir_select_inst(Codegen* cg, IrFunc* f, int i, int next) {
+    IrInst* in = &f->insts[i];
+    int r = ir_target(f, i);
+    switch (in->op) {
+        case IR_ADD: case IR_SUB: case IR_MUL:
+            ir_select_alu(cg, f, i);
+            break;
+        case IR_DIV: case IR_MOD:
+            ir_select_div(cg, f, i);
+            break;
+        case IR_NEG:
+            ir_load_reg(cg, f, r, in->a);
+            emit_s(cg, "    neg ", ir_regs[0][r], "\n");
+            ir_set(cg, f, i, r);
+            break;
+        case IR_NOT:
+        case IR_CMP:
+            if (in->fused) break;
+            if (in->op == IR_CMP) {
+                int cc = ir_select_cmp(cg, f, i);
+                emit_s(cg, "    set", ir_cc_name(cc), " al\n");
+            } else if (IR_SLOT(f->loc[in->a])) {
+                emit_lit(cg, "    cmp qword ");
+                ir_put_loc(cg, f->loc[in->a]);
+                emit_lit(cg, ", 0\n    sete al\n");
+            } else {
+                int x = ir_reg_of(cg, f, in->a, IR_RAX);
+                emit_s(cg, "    test ", ir_regs[0][x], ", ");
+                emit_s(cg, "", ir_regs[0][x], "\n    sete al\n");
+            }
+            emit_s(cg, "    movzx ", ir_regs[0][r], ", al\n");
+            ir_set(cg, f, i, r);
+            break;
+        case IR_LOAD:
+            ir_select_load(cg, f, i);
+            break;
+        case IR_STORE:
+            ir_select_store(cg, f, i);
+            break;
+        case IR_CALL:
+            ir_select_call(cg, f, i);
+            break;
+        case IR_JMP:
+            ir_phi_moves(cg, f, in->block, f->blocks[in->block].succ[0]);
+            ir_jump_to(cg, f, f->blocks[in->block].succ[0], next);
+            break;
+        case IR_BR:
+            ir_select_branch(cg, f, i, next);
+            break;
+        case IR_RET:
+            ir_load_reg(cg, f, IR_RAX, in->a);
+            emit_lit(cg, "    leave\n");
+            for (int reg = 15; reg >= 12; reg--)
+                if (f->saved >> reg & 1) emit_s(cg, "    pop ", ir_regs[0][reg], "\n");
+            emit_lit(cg, "    ret\n");
+            break;
+    }
+}
+
+void ir_emit_func(Codegen* cg, IrFunc* f, Node fn) {
+    // Labels for the blocks jumps go to, numbered in layout order
+    for (int k = 0; k < f->norder; k++) f->blocks[f->order[k]].jumped_to = 0;
+    for (int k = 0; k < f->norder; k++) {
+        IrBlock* bl = &f->blocks[f->order[k]];
+        int next = k + 1 < f->norder ? f->order[k + 1] : -1;
+        if (!bl->nsucc) continue;
+        // A branch jumps to its true successor unless that is next, and
+        // then to the false one
+        if (bl->nsucc == 2 && bl->succ[0] != next) f->blocks[bl->succ[0]].jumped_to = 1;
+        int last = bl->succ[bl->nsucc - 1];
+        if ((bl->nsucc == 2 && bl->succ[0] == next) || !ir_falls_to(f, next, last)) f->blocks[last].jumped_to = 1;
+    }
+    for (int k = 0; k < f->norder; k++)
+        if (f->blocks[f->order[k]].jumped_to) f->blocks[f->order[k]].label = new_label(cg);
+
+    emit_n(cg, "\n", ast.name[fn], ":\n");
+    f->moved_end = -1;
+    for (int r = 12; r < 16; r++)
+        if (f->saved >> r & 1) emit_s(cg, "    push ", ir_regs[0][r], "\n");
+    emit_lit(cg, "    push rbp\n    mov rbp, rsp\n");
+    int frame = (8 * (f->slots + f->newline) + 15) / 16 * 16;
+    if (frame) emit_i(cg, "    sub rsp, ", frame, "\n");
+    int n = 0;
+    for (int i = f->blocks[0].first; i; i = f->insts[i].next)
+        if (f->insts[i].op == IR_PARAM && f->loc[i] != IR_NOWHERE) {
+            ir_reserve(&f->moves, &f->move_cap, n + 1, sizeof(IrMove));
+            f->moves[n++] = (IrMove){f->loc[i], ir_arg_regs[f->insts[i].imm], i, 0};
+        }
+    ir_parallel_move(cg, f, f->moves, n, IR_RAX);
+
+    for (int k = 0; k < f->norder; k++) {
+        int b = f->order[k], next = k + 1 < f->norder ? f->order[k + 1] : -1;
+        if (f->blocks[b].jumped_to) emit_i(cg, ".L", f->blocks[b].label, ":\n");
+        for (int i = f->blocks[b].first; i; i = f->insts[i].next) ir_select_inst(cg, f, i, next);
+    }
+}
+
+// ---- Worth lowering ----
+// Branches and loops gain from the IR, and so does an operator whose
+// operands are all numbers once locals last assigned one and constant
+// globals are looked through. Otherwise the IR's cost is in the values
+// operators make: a straight-line function with many operators and nothing
+// to fold comes out of gen_func much the same for a fraction of the time.
+// One with few is still lowered, as it costs little and the IR keeps its
+// parameters in registers and often needs no frame.
+#define IR_SCAN_LOCALS 64
+#define IR_SCAN_OPS 64
+
+typedef struct {
+    Codegen* cg;
+    Atom consts[IR_SCAN_LOCALS];  // Locals whose last assignment was a number
+    int nconsts;
+    int ops;                      // Operators seen
+    int worth;
+} IrScan;
+
+void ir_scan_set(IrScan* s, Atom name, int known) {
+    int k = 0;
+    while (k < s->nconsts && s->consts[k] != name) k++;
+    if (known && k == s->nconsts) {
+        if (k == IR_SCAN_LOCALS) s->worth = 1;  // Too many to follow
+        else s->consts[s->nconsts++] = name;
+    } else if (!known && k < s->nconsts) {
+        s->consts[k] = s->consts[--s->nconsts];
+    }
+}
+
+// Whether n's value is a known number; sets s->worth on anything to fold
+int ir_scan(IrScan* s, Node n) {
+    if (!n || s->worth) return 0;
+    int known = 1;
+    switch (ast.kind[n]) {
+        case AST_NUMBER:
+            return 1;
+        case AST_IDENT: {
+            for (int k = 0; k < s->nconsts; k++)
+                if (s->consts[k] == ast.name[n]) return 1;
+            GlobalVar* g = global_symtab_lookup(s->cg->global_symtab, ast.name[n]);
+            return g && g->folded;
+        }
+        case AST_IF: case AST_WHILE: case AST_LOGICAL:
+            s->worth = 1;
+            return 0;
+        case AST_UNARY: case AST_BINOP: case AST_COMPARE:
+            s->ops++;
+            for (int i = 0; i < ast.nkids[n]; i++) known &= ir_scan(s, ast_child(n, i));
+            s->worth |= known;
+            return known;
+        case AST_LET: case AST_ASSIGN:
+            ir_scan_set(s, ast.name[n], ast.nkids[n] && ir_scan(s, ast_child(n, 0)));
+            return 0;
+        default:
+            for (int i = 0; i < ast.nkids[n]; i++) ir_scan(s, ast_child(n, i));
+            return 0;
+    }
+}
+
+int ir_worth_lowering(Codegen* cg, Node fn) {
+    IrScan s;
+    s.cg = cg;
+    s.nconsts = s.ops = s.worth = 0;
+    ir_scan(&s, ast_child(fn, ast.nkids[fn] - 1));
+    return s.worth || s.ops < IR_SCAN_OPS;
+}
+
+// -O2: function fn through the IR. Returns 0, having emitted nothing,
+// when it uses something the IR does not express or has nothing for the
+// IR to improve.
+int ir_gen_func(Codegen* cg, Node fn) {
+    if (!fn || !ast.name[fn]) return 0;
+    if (!ir_worth_lowering(cg, fn)) {
+        cg->ir_stats.fallback++;
+        cg->ir_stats.straight++;
+        return 0;
+    }
+    if (!cg->ir) {
+        cg->ir = safe_realloc(NULL, sizeof(IrFunc));
+        memset(cg->ir, 0, sizeof(IrFunc));
+    }
+    IrFunc* f = cg->ir;
+    if (!ir_lower_func(cg, f, fn)) {
+        cg->ir_stats.fallback++;
+        return 0;
+    }
+    ir_run_passes(cg, f);
+    ir_split_edges(f);
+    ir_layout(f);
+    ir_number(f);
+    ir_liveness(f);
+    ir_allocate(f, &cg->ir_stats);
+    ir_emit_func(cg, f, fn);
+    cg->ir_stats.funcs++;
+    return 1;
+}
+
+void ir_stats_add(IrStats* to, IrStats* from) {
+    to->funcs += from->funcs;
+    to->fallback += from->fallback;
+    to->straight += from->straight;
+    to->spilled += from->spilled;
+    for (int i = 0; i < IR_MAX_PASSES; i++) to->pass_changes[i] += from->pass_changes[i];
+}
+
+void ir_free(IrFunc* f) {
+    if (!f) return;
+    void* arrays[] = {f->insts, f->blocks, f->pool, f->defs, f->pos, f->loc, f->uses, f->weight, f->hint,
+                      f->rfirst, f->rcount, f->rcur, f->use_start, f->active, f->inactive, f->sorted,
+                      f->use_list, f->ranges, f->tmp, f->order, f->work, f->calls, f->moves,
+                      f->lattice, f->known, f->live, f->user_start, f->users};
+    for (size_t k = 0; k < sizeof(arrays) / sizeof(arrays[0]); k++) free(arrays[k]);
+    free(f);
+}
+
+// ==== PEEPHOLE ====
+// -O1+: the finished text of a function from gen_func is read back into a
+// list of instructions with decoded operands. The rules in ph_rules rewrite it
+// until none applies, and it is emitted again. Labels, comments and lines
+// the parser does not know are kept as written. Rules that delete a
+// register write ask ph_dead, which looks the register up in liveness found
+// once per function (ph_liveness); a register counts as used wherever it
+// cannot tell.
+typedef enum { PH_OTHER, PH_LABEL, PH_COMMENT, PH_INSN } PhKind;
+typedef enum { PHO_NONE, PHO_REG, PHO_IMM, PHO_MEM, PHO_SYM } PhOperandKind;
+typedef enum {
+    PHOP_OTHER, PHOP_MOV, PHOP_MOVX, PHOP_LEA, PHOP_ALU, PHOP_XOR, PHOP_CMP, PHOP_TEST, PHOP_UNARY, PHOP_IMUL,
+    PHOP_PUSH, PHOP_POP, PHOP_SETCC, PHOP_JMP, PHOP_JCC, PHOP_CALL, PHOP_RET, PHOP_LEAVE,
+    PHOP_SYSCALL, PHOP_DIV, PHOP_CQO, PHOP_NOP
+} PhOp;
+
+typedef struct {
+    uint8_t kind;
+    uint8_t size;      // Register size, or memory size when given (0 = not given)
+    int8_t reg;
+    uint16_t uses;     // PHO_MEM: registers the address reads
+    uint16_t len;
+    uint32_t at;       // Text as written in Peephole.src, size keyword included
+} PhOperand;
+
+typedef struct {
+    uint8_t kind, op, dead, changed, nops;
+    uint8_t cc;        // PHOP_JCC, PHOP_SETCC: index into ph_ccs
+    uint16_t len;      // The line in Peephole.src from at, newline included
+    uint32_t at;
+    uint16_t keep, rd; // How liveness passes through it (ph_set_flow)
+    int to;            // PHOP_JMP, PHOP_JCC: line of the label, else -1
+    PhOperand o[2];    // The third operand of imul is never needed
+} PhInsn;
+
+struct Peephole {
+    char* src;         // Copy of the function's text; operands point into it
+    int src_cap;
+    PhInsn* insns;
+    int n, cap;
+    int* labels;       // Hash of label names: instruction index + 1
+    int label_cap;
+    unsigned label_mask;  // This function's part of labels, less one
+    uint16_t* live;    // Per line: registers read from there on before written
+    int live_cap;
+    int live_valid;    // live filled in for this function
+    struct PhLine* lines;  // Short lines decoded before, kept across functions
+};
+
+// codegen writes the same few lines over and over ("    mov rax, r12"),
+// so a short line is decoded once and looked up by its text after that
+#define PH_LINE_BITS 10
+#define PH_LINE_SLOTS (1 << PH_LINE_BITS)
+#define PH_LINE_MAX 32
+
+typedef struct PhLine {
+    uint64_t key[PH_LINE_MAX / 8];  // The line without its newline, zero after
+    PhInsn insn;                    // Its `at`s relative to the line
+} PhLine;
+
+typedef struct { const char* name; uint8_t op; } PhMnemonic;
+
+PhMnemonic ph_mnemonics[] = {
+    {"mov", PHOP_MOV}, {"movzx", PHOP_MOVX}, {"movsx", PHOP_MOVX}, {"movsxd", PHOP_MOVX},
+    {"lea", PHOP_LEA}, {"add", PHOP_ALU}, {"sub", PHOP_ALU}, {"and", PHOP_ALU},
+    {"or", PHOP_ALU}, {"adc", PHOP_ALU}, {"sbb", PHOP_ALU}, {"shl", PHOP_ALU},
+    {"sal", PHOP_ALU}, {"shr", PHOP_ALU}, {"sar", PHOP_ALU}, {"rol", PHOP_ALU},
+    {"ror", PHOP_ALU}, {"xor", PHOP_XOR}, {"cmp", PHOP_CMP}, {"test", PHOP_TEST},
+    {"neg", PHOP_UNARY}, {"not", PHOP_UNARY}, {"inc", PHOP_UNARY}, {"dec", PHOP_UNARY},
+    {"imul", PHOP_IMUL}, {"push", PHOP_PUSH}, {"pop", PHOP_POP}, {"jmp", PHOP_JMP},
+    {"call", PHOP_CALL}, {"ret", PHOP_RET}, {"leave", PHOP_LEAVE}, {"syscall", PHOP_SYSCALL},
+    {"idiv", PHOP_DIV}, {"div", PHOP_DIV}, {"mul", PHOP_DIV}, {"cqo", PHOP_CQO},
+    {"nop", PHOP_NOP},
+};
+
+// Conditions in pairs, so cc ^ 1 is the opposite of cc
+const char* ph_ccs[] = {"e", "ne", "z", "nz", "l", "ge", "g", "le", "b", "ae", "a", "be", "s", "ns"};
+const char* ph_jccs[] = {"je", "jne", "jz", "jnz", "jl", "jge", "jg", "jle", "jb", "jae", "ja", "jbe", "js", "jns"};
+#define PH_CC_COUNT 14
+
+// Mnemonic (up to 8 letters, packed little-endian) -> opcode and condition,
+// for every entry above plus j<cc> and set<cc>; filled by peephole_init
+typedef struct { uint64_t key; uint8_t op, cc; } PhMnemonicSlot;
+#define PH_MNEMONIC_SLOTS 128
+PhMnemonicSlot ph_mnemonic_slots[PH_MNEMONIC_SLOTS];
+
+uint64_t ph_mnemonic_key(const char* m, int len) {
+    uint64_t key = 0;
+    for (int i = 0; i < len; i++) key |= (uint64_t)(unsigned char)m[i] << (8 * i);
+    return key;
+}
+
+int ph_mnemonic_slot(uint64_t key) {
+    int h = (key * 0x9e3779b97f4a7c15ull) >> 57;
+    while (ph_mnemonic_slots[h].key && ph_mnemonic_slots[h].key != key) h = (h + 1) & (PH_MNEMONIC_SLOTS - 1);
+    return h;
+}
+
+void ph_mnemonic_add(const char* name, int op, int cc) {
+    uint64_t key = ph_mnemonic_key(name, strlen(name));
+    PhMnemonicSlot* s = &ph_mnemonic_slots[ph_mnemonic_slot(key)];
+    s->key = key;
+    s->op = op;
+    s->cc = cc;
+}
+
+// Once, before any codegen thread starts
+void peephole_init(void) {
+    if (ph_mnemonic_slots[ph_mnemonic_slot(ph_mnemonic_key("mov", 3))].key) return;
+    for (size_t k = 0; k < sizeof(ph_mnemonics) / sizeof(ph_mnemonics[0]); k++)
+        ph_mnemonic_add(ph_mnemonics[k].name, ph_mnemonics[k].op, 0);
+    for (int cc = 0; cc < PH_CC_COUNT; cc++) {
+        char set[8];
+        snprintf(set, sizeof(set), "set%s", ph_ccs[cc]);
+        ph_mnemonic_add(ph_jccs[cc], PHOP_JCC, cc);
+        ph_mnemonic_add(set, PHOP_SETCC, cc);
+    }
+}
+
+#define PH_BIT(r) (1u << (r))
+#define PH_RAX 0
+#define PH_CALL_READS (PH_BIT(0) | PH_BIT(1) | PH_BIT(2) | PH_BIT(6) | PH_BIT(7) | PH_BIT(8) | PH_BIT(9))
+#define PH_SYSCALL_READS (PH_BIT(0) | PH_BIT(2) | PH_BIT(6) | PH_BIT(7) | PH_BIT(8) | PH_BIT(9) | PH_BIT(10))
+
+// Register number of the name at [s, s+len) in any width, or -1
+int ph_reg(const char* s, int len, int* size) {
+    static const char pairs[] = "axcxdxbxspbpsidi";
+    static const char low[] = "acdb";
+    if (len < 2 || len > 4) return -1;
+    if (s[0] == 'r' && s[1] >= '0' && s[1] <= '9') {
+        int n = 0, k = 1;
+        while (k < len && s[k] >= '0' && s[k] <= '9') n = n * 10 + s[k++] - '0';
+        if (n < 8 || n > 15 || len - k > 1) return -1;
+        *size = k == len ? 8 : s[k] == 'd' ? 4 : s[k] == 'w' ? 2 : s[k] == 'b' ? 1 : 0;
+        return *size ? n : -1;
+    }
+    const char* b = s;
+    if (len == 3 && (s[0] == 'r' || s[0] == 'e')) {
+        *size = s[0] == 'r' ? 8 : 4;
+        b = s + 1;
+    } else if (len == 3 && s[2] == 'l') {
+        *size = 1;  // sil, dil, spl, bpl
+    } else if (len == 2 && s[1] == 'l') {
+        const char* p = memchr(low, s[0], 4);
+        *size = 1;
+        return p ? (int)(p - low) : -1;
+    } else if (len == 2) {
+        *size = 2;
+    } else {
+        return -1;
+    }
+    // The pairs ending in b[1] are together
+    for (int i = b[1] == 'x' ? 0 : b[1] == 'p' ? 4 : b[1] == 'i' ? 6 : 8; i < 8 && pairs[2 * i + 1] == b[1]; i++)
+        if (b[0] == pairs[2 * i]) return i;
+    return -1;
+}
+
+int ph_ident_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '.';
+}
+
+// One operand from p up to `end` in the text at `src`; returns 0 if it is
+// not understood
+int ph_operand(const char* src, const char* p, const char* end, PhOperand* o) {
+    o->kind = PHO_NONE;
+    o->size = 0;
+    o->reg = -1;
+    o->uses = 0;
+    while (end > p && end[-1] == ' ') end--;
+    if (end - p > UINT16_MAX) return 0;
+    o->at = p - src;
+    o->len = end - p;
+    if (end - p > 5 && (*p == 'b' || *p == 'w' || *p == 'd' || *p == 'q')) {
+        static const char* sizes[] = {"byte ", "word ", "dword ", "qword "};
+        for (int i = 0; i < 4; i++) {
+            int n = 5 + (i >= 2);
+            if (end - p > n && !memcmp(p, sizes[i], n)) {
+                o->size = 1 << i;
+                p += n;
+                break;
+            }
+        }
+    }
+    if (p == end) return 0;
+    if (*p == '[') {
+        o->kind = PHO_MEM;
+        for (const char* q = p + 1; q < end;) {
+            if (!ph_ident_char(*q)) { q++; continue; }
+            const char* s = q;
+            while (q < end && ph_ident_char(*q)) q++;
+            int size, r = ph_reg(s, q - s, &size);
+            if (r >= 0) o->uses |= PH_BIT(r);
+        }
+        return end[-1] == ']';
+    }
+    if (*p == '-' || (*p >= '0' && *p <= '9')) {
+        o->kind = PHO_IMM;
+        return 1;
+    }
+    int size;
+    o->reg = ph_reg(p, end - p, &size);
+    if (o->reg >= 0) {
+        o->kind = PHO_REG;
+        o->size = size;
+        return 1;
+    }
+    for (const char* q = p; q < end; q++)
+        if (!ph_ident_char(*q)) return 0;
+    o->kind = PHO_SYM;
+    return 1;
+}
+
+// An instruction line after its indentation; an operand it cannot read
+// turns the instruction into PHOP_OTHER
+void ph_parse_insn(Peephole* ph, PhInsn* in, const char* p, const char* end) {
+    uint64_t key = 0;
+    int len = 0;
+    for (; p < end && *p != ' '; p++, len++) key |= (uint64_t)(unsigned char)*p << (8 * (len & 7));
+    in->kind = PH_INSN;
+    in->op = PHOP_OTHER;
+    if (len <= 8) {
+        PhMnemonicSlot* s = &ph_mnemonic_slots[ph_mnemonic_slot(key)];
+        in->op = s->key ? s->op : PHOP_OTHER;
+        in->cc = s->cc;
+    }
+    if (in->op == PHOP_OTHER) return;
+    PhOperand third;
+    for (int k = 0; k < 2; k++) in->o[k].kind = PHO_NONE;
+    while (p < end && *p == ' ') p++;
+    while (p < end && *p != ';') {
+        const char* e = p;
+        while (e < end && *e != ',' && *e != ';') e++;
+        if (in->nops == 3 || !ph_operand(ph->src, p, e, in->nops < 2 ? &in->o[in->nops] : &third)) {
+            in->op = PHOP_OTHER;
+            return;
+        }
+        in->nops++;
+        p = e < end && *e == ',' ? e + 1 : e;
+        while (p < end && *p == ' ') p++;
+    }
+}
+
+unsigned ph_uses(PhOperand* o) {
+    return o->kind == PHO_REG ? PH_BIT(o->reg) : o->kind == PHO_MEM ? o->uses : 0;
+}
+
+// Registers instruction in reads and writes whole; 0 if it is not known.
+// A partial register write counts as a read as well.
+int ph_effects(PhInsn* in, unsigned* rd, unsigned* wr) {
+    PhOperand* a = &in->o[0];
+    PhOperand* b = &in->o[1];
+    unsigned ua = ph_uses(a), ub = ph_uses(b), da = a->kind == PHO_REG ? PH_BIT(a->reg) : 0;
+    *rd = *wr = 0;
+    switch (in->op) {
+        case PHOP_MOV: case PHOP_MOVX: case PHOP_LEA:
+            *rd = ub | (a->kind == PHO_MEM ? ua : 0) | (a->size < 4 ? da : 0);
+            *wr = da;
+            return 1;
+        case PHOP_XOR:
+            if (da && a->size >= 4 && b->kind == PHO_REG && a->reg == b->reg) {
+                *wr = da;
+                return 1;
             }
+            // fallthrough
+        case PHOP_ALU: case PHOP_UNARY: case PHOP_SETCC:
+            *rd = ua | ub;
+            *wr = da;
+            return 1;
+        case PHOP_IMUL:
+            if (in->nops == 1) break;
+            *rd = (in->nops == 3 ? 0 : ua) | ub;
+            *wr = da;
+            return 1;
+        case PHOP_CMP: case PHOP_TEST: case PHOP_PUSH:
+            *rd = ua | ub;
+            return 1;
+        case PHOP_POP:
+            *rd = a->kind == PHO_MEM ? ua : 0;
+            *wr = da;
+            return 1;
+        case PHOP_DIV:
+            *rd = ua | PH_BIT(0) | PH_BIT(2);
+            *wr = PH_BIT(0) | PH_BIT(2);
+            return 1;
+        case PHOP_CQO:
+            *rd = PH_BIT(0);
+            *wr = PH_BIT(2);
+            return 1;
+        case PHOP_SYSCALL:
+            *rd = PH_SYSCALL_READS;
+            *wr = PH_BIT(1) | PH_BIT(11);
+            return 1;
+        case PHOP_CALL:
+            // Arguments go in rdi..r9 (rax for the runtime helpers); rbx,
+            // r10 and r11 are never expected to survive a call
+            *rd = PH_CALL_READS;
+            *wr = PH_BIT(3) | PH_BIT(10) | PH_BIT(11);
+            return 1;
+        case PHOP_LEAVE:
+            *rd = PH_BIT(5);
+            return 1;
+        case PHOP_NOP:
+            return 1;
+    }
+    return 0;
+}
+
+#define PH_ALL 0xffffu
+
+// How liveness passes through in: live = (live after & keep) | rd, plus
+// what is live at line `to` (a jump's label) when to >= 0. A jump's is set
+// again once its label is known.
+void ph_set_flow(PhInsn* in) {
+    unsigned rd, wr;
+    in->keep = PH_ALL;
+    in->rd = 0;
+    if (in->kind == PH_COMMENT || in->kind == PH_LABEL) return;
+    int op = in->op;
+    if (op == PHOP_JMP || op == PHOP_JCC) {
+        if (in->to < 0) in->rd = PH_ALL;
+        if (op == PHOP_JMP) in->keep = 0;
+    } else if (op == PHOP_RET) {
+        in->keep = 0;
+        in->rd = PH_BIT(PH_RAX);
+    } else if (!ph_effects(in, &rd, &wr)) {
+        in->rd = PH_ALL;
+    } else {
+        in->keep = ~wr;
+        in->rd = rd;
+    }
+}
+
+unsigned ph_label_hash(const char* s, int len) {
+    unsigned h = 2166136261u;
+    for (int i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 16777619u;
+    return h;
+}
+
+// Instruction index of the label named by operand o, or -1
+int ph_label(Peephole* ph, PhOperand* o) {
+    if (o->kind != PHO_SYM) return -1;
+    unsigned mask = ph->label_mask;
+    const char* name = ph->src + o->at;
+    for (unsigned h = ph_label_hash(name, o->len) & mask;; h = (h + 1) & mask) {
+        int i = ph->labels[h] - 1;
+        if (i < 0) return -1;
+        if (ph->insns[i].len - 2 == o->len && !memcmp(ph->src + ph->insns[i].at, name, o->len)) return i;
+    }
+}
+
+// The PhLine slot for an indented line under PH_LINE_MAX bytes starting at
+// p, with its key in key; NULL for any other line. Reads PH_LINE_MAX bytes.
+PhLine* ph_line_slot(Peephole* ph, const char* p, uint64_t* key) {
+    const uint64_t ones = 0x0101010101010101ull;
+    if (*p != ' ') return NULL;
+    memcpy(key, p, PH_LINE_MAX);
+    int nl = PH_LINE_MAX * 8;  // Bit offset of the first newline
+    for (int k = PH_LINE_MAX / 8 - 1; k >= 0; k--) {
+        uint64_t x = key[k] ^ (ones * '\n');
+        uint64_t found = (x - ones) & ~x & (ones << 7);
+        if (found) nl = 64 * k + (__builtin_ctzll(found) & ~7);
+    }
+    if (nl == PH_LINE_MAX * 8) return NULL;
+    for (int k = 0; k < PH_LINE_MAX / 8; k++) {
+        int bits = nl - 64 * k;
+        key[k] &= bits >= 64 ? ~0ull : bits <= 0 ? 0 : ~(~0ull << bits);
+    }
+    uint64_t h = key[0] ^ key[1] ^ key[2] ^ key[3];
+    return &ph->lines[(h * 0x9e3779b97f4a7c15ull) >> (64 - PH_LINE_BITS)];
+}
+
+void ph_parse(Peephole* ph, const char* p, const char* end) {
+    int nlabels = 0;
+    ph->n = 0;
+    ph->live_valid = 0;
+    if (!ph->lines) ph->lines = calloc(PH_LINE_SLOTS, sizeof(PhLine));
+    size_t other = 0;  // What is left of a line too long for PhInsn.len
+    while (p < end) {
+        if (ph->n == ph->cap) ir_reserve(&ph->insns, &ph->cap, ph->n + 1, sizeof(PhInsn));
+        PhInsn* in = &ph->insns[ph->n++];
+        uint64_t key[PH_LINE_MAX / 8];
+        PhLine* line = !other && end - p > PH_LINE_MAX ? ph_line_slot(ph, p, key) : NULL;
+        if (line && line->insn.len && !((line->key[0] ^ key[0]) | (line->key[1] ^ key[1]) |
+                                         (line->key[2] ^ key[2]) | (line->key[3] ^ key[3]))) {
+            *in = line->insn;
+            in->at = p - ph->src;
+            for (int k = 0; k < in->nops; k++) in->o[k].at += in->at;
+            p += in->len;
+            continue;
         }
-    } else if (n->type == AST_ASSIGN) {
-        gen_expr(cg, n->children[0]);
-        // Try local variable first
-        int off = symtab_lookup(cg->symtab, n->name);
-        if (off) {
-            emit(cg, "    mov [rbp%d], rax\n", off);
+        const char* nl = memchr(p, '\n', end - p);
+        const char* eol = nl ? nl : end;
+        in->dead = in->changed = in->nops = 0;
+        in->op = PHOP_OTHER;
+        in->at = p - ph->src;
+        in->to = -1;
+        if (!other && (size_t)((nl ? nl + 1 : end) - p) > UINT16_MAX) other = (nl ? nl + 1 : end) - p;
+        if (other) {
+            // Kept as written, in pieces
+            in->kind = PH_OTHER;
+            in->len = other > UINT16_MAX ? UINT16_MAX : other;
+            other -= in->len;
+            ph_set_flow(in);
+            p += in->len;
+            continue;
+        }
+        in->len = (nl ? nl + 1 : end) - p;
+        const char* s = p;
+        while (s < eol && *s == ' ') s++;
+        if (s == eol || *s == ';') {
+            in->kind = PH_COMMENT;
+        } else if (s > p) {
+            ph_parse_insn(ph, in, s, eol);
+        } else if (eol[-1] == ':' && nl) {
+            in->kind = PH_LABEL;
+            nlabels++;
         } else {
-            // Try global variable
-            GlobalVar* gvar = global_symtab_lookup(cg->global_symtab, n->name);
-            if (gvar) {
-                emit(cg, "    mov [%s], rax\n", gvar->name);
-            }
+            in->kind = PH_OTHER;
         }
-    } else if (n->type == AST_BINOP) {
-        // Strength reduction optimization (O2+): Check if right operand is power of 2
-        AstNode* right = n->children[1];
-        int use_shift = 0;
-        long right_val = 0;
-        int shift_amount = 0;
+        ph_set_flow(in);
+        // Jumps name a different label nearly every time
+        if (line && in->op != PHOP_JMP && in->op != PHOP_JCC) {
+            memcpy(line->key, key, sizeof(key));
+            line->insn = *in;
+            line->insn.at = 0;
+            for (int k = 0; k < in->nops; k++) line->insn.o[k].at -= in->at;
+        }
+        p += in->len;
+    }
+    int cap = 16;
+    while (cap < 2 * nlabels) cap *= 2;
+    if (cap > ph->label_cap) {
+        ph->labels = safe_realloc(ph->labels, sizeof(int) * cap);
+        ph->label_cap = cap;
+    }
+    memset(ph->labels, 0, sizeof(int) * cap);
+    unsigned mask = ph->label_mask = cap - 1;
+    for (int i = 0; i < ph->n; i++) {
+        if (ph->insns[i].kind != PH_LABEL) continue;
+        unsigned h = ph_label_hash(ph->src + ph->insns[i].at, ph->insns[i].len - 2) & mask;
+        while (ph->labels[h]) h = (h + 1) & mask;
+        ph->labels[h] = i + 1;
+    }
+    for (int i = 0; i < ph->n; i++) {
+        PhInsn* in = &ph->insns[i];
+        if (in->op != PHOP_JMP && in->op != PHOP_JCC) continue;
+        in->to = ph_label(ph, &in->o[0]);
+        ph_set_flow(in);
+    }
+}
 
-        if (optimization_level >= 2 && right && right->type == AST_NUMBER) {
-            right_val = atol(right->value);
-            if (is_power_of_2(right_val)) {
-                use_shift = 1;
-                shift_amount = get_log2(right_val);
+// Backward over the lines; again while jumps back still add to it. Past
+// the end, and at anything not understood, every register is live.
+void ph_liveness(Peephole* ph) {
+    ir_reserve(&ph->live, &ph->live_cap, ph->n + 1, sizeof(uint16_t));
+    ph->live[ph->n] = PH_ALL;
+    int back = 0;
+    for (int i = ph->n - 1; i >= 0; i--) {
+        PhInsn* in = &ph->insns[i];
+        if (in->dead) {
+            ph->live[i] = ph->live[i + 1];
+            continue;
+        }
+        back |= in->to >= 0 && in->to <= i;
+        ph->live[i] = (ph->live[i + 1] & in->keep) | in->rd | (in->to > i ? ph->live[in->to] : 0);
+    }
+    for (int pass = 0, changed = back; changed; pass++) {
+        if (pass == 16) {
+            for (int i = 0; i < ph->n; i++) ph->live[i] = PH_ALL;
+            break;
+        }
+        changed = 0;
+        for (int i = ph->n - 1; i >= 0; i--) {
+            PhInsn* in = &ph->insns[i];
+            unsigned live = in->dead ? ph->live[i + 1]
+                                     : (ph->live[i + 1] & in->keep) | in->rd | (in->to >= 0 ? ph->live[in->to] : 0);
+            if (live != ph->live[i]) {
+                ph->live[i] = live;
+                changed = 1;
             }
         }
+    }
+    ph->live_valid = 1;
+}
 
-        gen_expr(cg, n->children[0]);
+// Is register r's value unused from line i on?
+int ph_dead(Peephole* ph, int i, int r) {
+    if (!ph->live_valid) ph_liveness(ph);
+    return i >= ph->n || !(ph->live[i] >> r & 1);
+}
 
-        if (use_shift && n->op[0] == '*') {
-            // Multiplication by power of 2: use left shift
-            emit(cg, "    ; Optimized: x * %ld => x << %d\n", right_val, shift_amount);
-            emit(cg, "    shl rax, %d\n", shift_amount);
-        } else if (use_shift && n->op[0] == '/') {
-            // Division by power of 2: use arithmetic right shift
-            emit(cg, "    ; Optimized: x / %ld => x >> %d\n", right_val, shift_amount);
-            emit(cg, "    sar rax, %d\n", shift_amount);
-        } else if (use_shift && n->op[0] == '%') {
-            // Modulo by power of 2: use AND mask
-            long mask = right_val - 1;
-            emit(cg, "    ; Optimized: x %% %ld => x & %ld\n", right_val, mask);
-            emit(cg, "    and rax, %ld\n", mask);
-        } else {
-            // Normal codegen
-            emit(cg, "    push rax\n");
-            gen_expr(cg, n->children[1]);
-            emit(cg, "    mov rbx, rax\n    pop rax\n");
-            if (n->op[0] == '+') emit(cg, "    add rax, rbx\n");
-            else if (n->op[0] == '-') emit(cg, "    sub rax, rbx\n");
-            else if (n->op[0] == '*') emit(cg, "    imul rax, rbx\n");
-            else if (n->op[0] == '/') {
-            // Division by zero check
-            int skip_label = new_label(cg);
-            emit(cg, "    test rbx, rbx\n");
-            emit(cg, "    jnz .L%d\n", skip_label);
-            emit(cg, "    ; Division by zero - return 0\n");
-            emit(cg, "    xor rax, rax\n");
-            emit(cg, "    jmp .L%d_end\n", skip_label);
-            emit(cg, ".L%d:\n", skip_label);
-            emit(cg, "    xor rdx, rdx\n    idiv rbx\n");
-            emit(cg, ".L%d_end:\n", skip_label);
-        }
-        else if (n->op[0] == '%') {
-            // Modulo operation (remainder after division)
-            int skip_label = new_label(cg);
-            emit(cg, "    test rbx, rbx\n");
-            emit(cg, "    jnz .L%d\n", skip_label);
-            emit(cg, "    ; Modulo by zero - return 0\n");
-            emit(cg, "    xor rax, rax\n");
-            emit(cg, "    jmp .L%d_end\n", skip_label);
-            emit(cg, ".L%d:\n", skip_label);
-            emit(cg, "    xor rdx, rdx\n    idiv rbx\n");
-            emit(cg, "    mov rax, rdx  ; Move remainder to rax\n");
-            emit(cg, ".L%d_end:\n", skip_label);
-            }
-        }
-    } else if (n->type == AST_COMPARE) {
-        gen_expr(cg, n->children[0]);
-        emit(cg, "    push rax\n");
-        gen_expr(cg, n->children[1]);
-        emit(cg, "    mov rbx, rax\n    pop rax\n");
-        emit(cg, "    cmp rax, rbx\n");
-        if (!strcmp(n->op, "==")) emit(cg, "    sete al\n");
-        else if (!strcmp(n->op, "!=")) emit(cg, "    setne al\n");
-        else if (!strcmp(n->op, "<")) emit(cg, "    setl al\n");
-        else if (!strcmp(n->op, ">")) emit(cg, "    setg al\n");
-        else if (!strcmp(n->op, "<=")) emit(cg, "    setle al\n");
-        else if (!strcmp(n->op, ">=")) emit(cg, "    setge al\n");
-        emit(cg, "    movzx rax, al\n");
-    } else if (n->type == AST_LOGICAL) {
-        if (!strcmp(n->op, "&&")) {
-            // Short-circuit AND: if left is false (0), don't evaluate right
-            int false_label = new_label(cg);
-            int end_label = new_label(cg);
+// A rewrite that moves a read of `regs` later, to line `to`, keeps them
+// live from line `from`; deleted reads and writes only leave live too large
+void ph_live_add(Peephole* ph, int from, int to, unsigned regs) {
+    if (!ph->live_valid) return;
+    for (int k = from; k <= to && k < ph->n; k++) ph->live[k] |= regs;
+}
 
-            gen_expr(cg, n->children[0]);  // Evaluate left
-            emit(cg, "    test rax, rax\n");
-            emit(cg, "    jz .L%d  ; Jump if left is false\n", false_label);
+// Next instruction, label or other line after i, skipping comments and
+// deleted instructions; -1 at the end
+int ph_next(Peephole* ph, int i) {
+    for (i++; i < ph->n; i++)
+        if (!ph->insns[i].dead && ph->insns[i].kind != PH_COMMENT) return i;
+    return -1;
+}
 
-            gen_expr(cg, n->children[1]);  // Evaluate right
-            emit(cg, "    test rax, rax\n");
-            emit(cg, "    jz .L%d  ; Jump if right is false\n", false_label);
+PhInsn* ph_insn(Peephole* ph, int i, int op) {
+    return i >= 0 && ph->insns[i].op == op ? &ph->insns[i] : NULL;
+}
 
-            emit(cg, "    mov rax, 1  ; Both true\n");
-            emit(cg, "    jmp .L%d\n", end_label);
+int ph_reg64(PhOperand* o) { return o->kind == PHO_REG && o->size == 8; }
 
-            emit(cg, ".L%d:\n", false_label);
-            emit(cg, "    xor rax, rax  ; Result is false\n");
-            emit(cg, ".L%d:\n", end_label);
-        } else if (!strcmp(n->op, "||")) {
-            // Short-circuit OR: if left is true (non-zero), don't evaluate right
-            int true_label = new_label(cg);
-            int end_label = new_label(cg);
+int ph_same(Peephole* ph, PhOperand* a, PhOperand* b) {
+    return a->kind == b->kind && a->len == b->len && !memcmp(ph->src + a->at, ph->src + b->at, a->len);
+}
 
-            gen_expr(cg, n->children[0]);  // Evaluate left
-            emit(cg, "    test rax, rax\n");
-            emit(cg, "    jnz .L%d  ; Jump if left is true\n", true_label);
+// A qword memory operand (no size given means the register's, here 8)
+int ph_mem64(PhOperand* o) { return o->kind == PHO_MEM && (!o->size || o->size == 8); }
 
-            gen_expr(cg, n->children[1]);  // Evaluate right
-            emit(cg, "    test rax, rax\n");
-            emit(cg, "    jnz .L%d  ; Jump if right is true\n", true_label);
+void ph_kill(PhInsn* in) { in->dead = 1; }
 
-            emit(cg, "    xor rax, rax  ; Both false\n");
-            emit(cg, "    jmp .L%d\n", end_label);
+void ph_set_mov(PhInsn* in, PhOperand* dst, PhOperand* src) {
+    PhOperand d = *dst, s = *src;
+    in->op = PHOP_MOV;
+    in->nops = 2;
+    in->o[0] = d;
+    in->o[1] = s;
+    in->changed = 1;
+    ph_set_flow(in);
+}
 
-            emit(cg, ".L%d:\n", true_label);
-            emit(cg, "    mov rax, 1  ; Result is true\n");
-            emit(cg, ".L%d:\n", end_label);
+// ---- Rules ----
+// Each rule looks at the instructions starting at i and returns 1 if it
+// rewrote anything.
+
+// jmp to a label that follows it, with only labels in between
+int ph_jump_next(Peephole* ph, int i) {
+    PhInsn* in = ph_insn(ph, i, PHOP_JMP);
+    if (!in) return 0;
+    int t = in->to;
+    for (int j = ph_next(ph, i); j >= 0 && ph->insns[j].kind == PH_LABEL; j = ph_next(ph, j)) {
+        if (j == t) {
+            ph_kill(in);
+            return 1;
         }
-    } else if (n->type == AST_CALL) {
-        gen_builtin_call(cg, n);
-    } else if (n->type == AST_ARRAY_LITERAL) {
-        emit(cg, "    ; array literal\n");
-        if (cg->symtab && cg->symtab->count > 0) {
-            Symbol* sym = &cg->symtab->symbols[cg->symtab->count - 1];
-            for (int i = 0; i < n->child_count; i++) {
-                gen_expr(cg, n->children[i]);
-                int elem_off = sym->offset + (i * 8);
-                emit(cg, "    mov [rbp%d], rax\n", elem_off);
+    }
+    return 0;
+}
+
+// Instructions after jmp or ret that no label leads to (data directives
+// and anything else not understood stay)
+int ph_unreachable(Peephole* ph, int i) {
+    if (!ph_insn(ph, i, PHOP_JMP) && !ph_insn(ph, i, PHOP_RET)) return 0;
+    int j, hit = 0;
+    while ((j = ph_next(ph, i)) >= 0 && ph->insns[j].kind == PH_INSN && ph->insns[j].op != PHOP_OTHER) {
+        ph_kill(&ph->insns[j]);
+        hit = 1;
+    }
+    return hit;
+}
+
+// push x; pop y => mov y, x
+int ph_push_pop(Peephole* ph, int i) {
+    PhInsn* in = ph_insn(ph, i, PHOP_PUSH);
+    PhInsn* out = ph_insn(ph, ph_next(ph, i), PHOP_POP);
+    if (!in || !out || !ph_reg64(&out->o[0])) return 0;
+    if (!ph_reg64(&in->o[0]) && in->o[0].kind != PHO_IMM) return 0;
+    ph_live_add(ph, i + 1, out - ph->insns, ph_uses(&in->o[0]));
+    if (in->o[0].kind == PHO_REG && in->o[0].reg == out->o[0].reg) ph_kill(out);
+    else ph_set_mov(out, &out->o[0], &in->o[0]);
+    ph_kill(in);
+    return 1;
+}
+
+// mov [m], r; mov s, [m] => mov [m], r; mov s, r
+int ph_store_load(Peephole* ph, int i) {
+    PhInsn* st = ph_insn(ph, i, PHOP_MOV);
+    PhInsn* ld = ph_insn(ph, ph_next(ph, i), PHOP_MOV);
+    if (!st || !ld || !ph_mem64(&st->o[0]) || !ph_reg64(&st->o[1]) || !ph_reg64(&ld->o[0])) return 0;
+    if (!ph_same(ph, &st->o[0], &ld->o[1])) return 0;
+    ph_live_add(ph, i + 1, ld - ph->insns, ph_uses(&st->o[1]));
+    if (ld->o[0].reg == st->o[1].reg) ph_kill(ld);
+    else ph_set_mov(ld, &ld->o[0], &st->o[1]);
+    return 1;
+}
+
+// mov a, b; mov b, a => mov a, b
+int ph_reload(Peephole* ph, int i) {
+    PhInsn* x = ph_insn(ph, i, PHOP_MOV);
+    PhInsn* y = ph_insn(ph, ph_next(ph, i), PHOP_MOV);
+    if (!x || !y || !ph_reg64(&x->o[0]) || !ph_same(ph, &x->o[0], &y->o[1]) || !ph_same(ph, &x->o[1], &y->o[0])) return 0;
+    if (!ph_reg64(&x->o[1]) && !ph_mem64(&x->o[1])) return 0;
+    if (x->o[1].kind == PHO_REG) ph_live_add(ph, i + 1, y - ph->insns, ph_uses(&x->o[1]));
+    ph_kill(y);
+    return 1;
+}
+
+int ph_self_move(Peephole* ph, int i) {
+    PhInsn* in = ph_insn(ph, i, PHOP_MOV);
+    if (!in || !ph_reg64(&in->o[0]) || !ph_reg64(&in->o[1]) || in->o[0].reg != in->o[1].reg) return 0;
+    ph_kill(in);
+    return 1;
+}
+
+// setcc al; movzx rax, al; test rax, rax; jz/jnz l => jncc/jcc l, when
+// nothing reads the 0 or 1 in rax afterwards
+int ph_compare_branch(Peephole* ph, int i) {
+    PhInsn* set = ph_insn(ph, i, PHOP_SETCC);
+    if (!set || set->o[0].kind != PHO_REG || set->o[0].reg != PH_RAX || set->o[0].size != 1) return 0;
+    int j = ph_next(ph, i), k = ph_next(ph, j), l = ph_next(ph, k);
+    PhInsn* ext = ph_insn(ph, j, PHOP_MOVX);
+    PhInsn* test = ph_insn(ph, k, PHOP_TEST);
+    PhInsn* jcc = ph_insn(ph, l, PHOP_JCC);
+    if (!ext || !test || !jcc) return 0;
+    if (!ph_reg64(&ext->o[0]) || ext->o[0].reg != PH_RAX || ext->o[1].kind != PHO_REG || ext->o[1].reg != PH_RAX) return 0;
+    if (!ph_reg64(&test->o[0]) || test->o[0].reg != PH_RAX || !ph_same(ph, &test->o[0], &test->o[1])) return 0;
+    if (jcc->cc > 3) return 0;  // jz, je, jnz, jne
+    int t = jcc->to;
+    if (t < 0 || !ph_dead(ph, t + 1, PH_RAX) || !ph_dead(ph, l + 1, PH_RAX)) return 0;
+    jcc->cc = jcc->cc & 1 ? set->cc : set->cc ^ 1;
+    jcc->changed = 1;
+    ph_kill(set);
+    ph_kill(ext);
+    ph_kill(test);
+    return 1;
+}
+
+// mov r, x; [one instruction not involving r or changing x]; mov s, r
+// => mov s, x, when r is not read afterwards
+int ph_copy_forward(Peephole* ph, int i) {
+    PhInsn* def = ph_insn(ph, i, PHOP_MOV);
+    if (!def || !ph_reg64(&def->o[0])) return 0;
+    PhOperand* x = &def->o[1];
+    int r = def->o[0].reg;
+    if (!(ph_reg64(x) && x->reg != r && x->reg != 4) && x->kind != PHO_IMM && !ph_mem64(x)) return 0;
+    int j = ph_next(ph, i);
+    PhInsn* use = ph_insn(ph, j, PHOP_MOV);
+    if (!use || use->o[1].kind != PHO_REG || use->o[1].reg != r) {
+        // One instruction in between, when x is not memory
+        unsigned rd, wr;
+        if (j < 0 || ph->insns[j].kind != PH_INSN || x->kind == PHO_MEM) return 0;
+        int op = ph->insns[j].op;
+        if (op == PHOP_JMP || op == PHOP_JCC || op == PHOP_CALL || op == PHOP_RET) return 0;
+        if (!ph_effects(&ph->insns[j], &rd, &wr) || ((rd | wr) >> r & 1)) return 0;
+        if (x->kind == PHO_REG && (wr >> x->reg & 1)) return 0;
+        j = ph_next(ph, j);
+        use = ph_insn(ph, j, PHOP_MOV);
+        if (!use || use->o[1].kind != PHO_REG || use->o[1].reg != r) return 0;
+    }
+    if (!ph_reg64(&use->o[1]) || (use->o[0].kind == PHO_MEM && (use->o[0].uses >> r & 1))) return 0;
+    // Memory to memory and immediates into memory have no mov form here
+    if (use->o[0].kind == PHO_MEM ? x->kind != PHO_REG : !ph_reg64(&use->o[0])) return 0;
+    if (!ph_dead(ph, j + 1, r)) return 0;
+    ph_live_add(ph, i + 1, j, ph_uses(x));
+    ph_set_mov(use, &use->o[0], x);
+    ph_kill(def);
+    return 1;
+}
+
+typedef struct {
+    const char* name;
+    int (*run)(Peephole* ph, int i);
+    unsigned ops;      // PH_BIT of the opcodes the pattern starts with
+} PhRule;
+
+PhRule ph_rules[] = {
+    {"jump-next", ph_jump_next, PH_BIT(PHOP_JMP)},
+    {"unreachable", ph_unreachable, PH_BIT(PHOP_JMP) | PH_BIT(PHOP_RET)},
+    {"push-pop", ph_push_pop, PH_BIT(PHOP_PUSH)},
+    {"store-load", ph_store_load, PH_BIT(PHOP_MOV)},
+    {"reload", ph_reload, PH_BIT(PHOP_MOV)},
+    {"self-move", ph_self_move, PH_BIT(PHOP_MOV)},
+    {"compare-branch", ph_compare_branch, PH_BIT(PHOP_SETCC)},
+    {"copy-forward", ph_copy_forward, PH_BIT(PHOP_MOV)},
+};
+#define PH_RULE_COUNT (int)(sizeof(ph_rules) / sizeof(ph_rules[0]))
+
+void ph_emit_operand(Codegen* cg, Peephole* ph, PhOperand* o) { emit_raw(cg, ph->src + o->at, o->len); }
+
+// Rewrite the function text cg->code_buf[start, code_len) in place
+void peephole_func(Codegen* cg, int start) {
+    if (!cg->peephole) {
+        cg->peephole = safe_realloc(NULL, sizeof(Peephole));
+        memset(cg->peephole, 0, sizeof(Peephole));
+    }
+    Peephole* ph = cg->peephole;
+    int len = cg->code_len - start;
+    ir_reserve(&ph->src, &ph->src_cap, len, 1);
+    memcpy(ph->src, cg->code_buf + start, len);
+    ph_parse(ph, ph->src, ph->src + len);
+
+    // One pass; after a rewrite, back up over the instructions a pattern
+    // ending at the rewritten ones could start from
+    for (int i = 0; i < ph->n; i++) {
+        PhInsn* in = &ph->insns[i];
+        if (in->dead || in->kind != PH_INSN) continue;
+        for (int r = 0; r < PH_RULE_COUNT && r < PH_MAX_RULES; r++) {
+            if (!(ph_rules[r].ops >> in->op & 1) || !ph_rules[r].run(ph, i)) continue;
+            cg->peephole_hits[r]++;
+            for (int back = 0; back < 3 && i > 0; back++) {
+                do i--; while (i > 0 && (ph->insns[i].dead || ph->insns[i].kind == PH_COMMENT));
             }
-            emit(cg, "    lea rax, [rbp%d]\n", sym->offset);
+            i--;
+            break;
         }
-    } else if (n->type == AST_INDEX) {
-        gen_array_index(cg, n);
-    } else if (n->type == AST_STRUCT_LITERAL) {
-        emit(cg, "    ; struct literal %s\n", n->struct_type);
-        if (cg->symtab && cg->symtab->count > 0) {
-            Symbol* sym = &cg->symtab->symbols[cg->symtab->count - 1];
-            for (int i = 0; i < n->child_count; i++) {
-                AstNode* field_assign = n->children[i];
-                char* field_name = field_assign->name;
-                AstNode* field_value = field_assign->children[0];
+    }
 
-                int field_off = typetab_field_offset(cg->types, n->struct_type, field_name);
-                gen_expr(cg, field_value);
-                emit(cg, "    mov [rbp%d], rax\n", sym->offset + field_off);
-            }
-            emit(cg, "    lea rax, [rbp%d]\n", sym->offset);
+    // Unchanged lines go out a run at a time, straight from the copy
+    cg->code_len = start;
+    const char* run = NULL;
+    for (int i = 0; i < ph->n; i++) {
+        PhInsn* in = &ph->insns[i];
+        if (!in->dead && !in->changed) {
+            if (!run) run = ph->src + in->at;
+            continue;
+        }
+        if (run) emit_raw(cg, run, ph->src + in->at - run);
+        run = NULL;
+        if (in->dead) {
+            continue;
+        } else if (in->op == PHOP_JCC) {
+            emit_s(cg, "    ", ph_jccs[in->cc], " ");
+            ph_emit_operand(cg, ph, &in->o[0]);
+            emit_lit(cg, "\n");
+        } else {
+            emit_lit(cg, "    mov ");
+            ph_emit_operand(cg, ph, &in->o[0]);
+            emit_lit(cg, ", ");
+            ph_emit_operand(cg, ph, &in->o[1]);
+            emit_lit(cg, "\n");
         }
-    } else if (n->type == AST_FIELD_ACCESS) {
-        AstNode* obj = n->children[0];
-        char* field_name = n->name;
+    }
+    if (run) emit_raw(cg, run, ph->src + len - run);
+}
 
-        // Check if object is a dereference (pointer access)
-        if (obj->type == AST_DEREF) {
-            // ptr->field case (already desugared)
-            AstNode* ptr = obj->children[0];
-            Symbol* sym = symtab_lookup_symbol(cg->symtab, ptr->name);
-            if (sym && sym->is_pointer && sym->type_name) {
-                int field_off = typetab_field_offset(cg->types, sym->type_name, field_name);
-                if (field_off >= 0) {
-                    emit(cg, "    mov rax, [rbp%d]\n", sym->offset);  // Load pointer
-                    emit(cg, "    mov rax, [rax+%d]\n", field_off);   // Access field
-                }
-            }
-        } else if (obj->type == AST_IDENT) {
-            // Regular struct field access from identifier
-            Symbol* sym = symtab_lookup_symbol(cg->symtab, obj->name);
-            if (sym && sym->type_name) {
-                // Get the actual struct type name (remove pointer if present)
-                char* struct_type = sym->type_name;
-                int is_pointer = 0;
-                if (struct_type[0] == '*') {
-                    struct_type = struct_type + 1;  // Skip the '*'
-                    is_pointer = 1;
-                }
+void peephole_free(Peephole* ph) {
+    if (!ph) return;
+    free(ph->src);
+    free(ph->insns);
+    free(ph->labels);
+    free(ph->live);
+    free(ph->lines);
+    free(ph);
+}
 
-                int field_off = typetab_field_offset(cg->types, struct_type, field_name);
-                if (field_off >= 0) {
-                    if (is_pointer) {
-                        // For pointers: load pointer, then load field
-                        emit(cg, "    mov rax, [rbp%d]\n", sym->offset);  // Load pointer
-                        if (field_off == 0) {
-                            emit(cg, "    mov rax, [rax]\n");  // Load field at offset 0
-                        } else {
-                            emit(cg, "    mov rax, [rax+%d]\n", field_off);  // Load field
-                        }
-                    } else {
-                        // For direct structs: load directly
-                        emit(cg, "    mov rax, [rbp%d]\n", sym->offset + field_off);
-                    }
-                }
+// ==== ASSEMBLER ====
+// Encodes the instruction subset codegen emits (and the usual forms around
+// it), reading the same NASM text that --emit=asm writes. Jumps to labels
+// start as rel8 and are widened to rel32 only where the target is out of
+// range; symbol operands become RIP-relative so nothing needs an absolute
+// relocation.
+#define ASM_JMP 0xff
+
+typedef struct { const char* name; uint8_t num, size, rex; } AsmReg;  // rex: 1 needs, 2 forbids
+
+AsmReg asm_regs[] = {
+    {"rax", 0, 8, 0}, {"rcx", 1, 8, 0}, {"rdx", 2, 8, 0}, {"rbx", 3, 8, 0},
+    {"rsp", 4, 8, 0}, {"rbp", 5, 8, 0}, {"rsi", 6, 8, 0}, {"rdi", 7, 8, 0},
+    {"r8", 8, 8, 0}, {"r9", 9, 8, 0}, {"r10", 10, 8, 0}, {"r11", 11, 8, 0},
+    {"r12", 12, 8, 0}, {"r13", 13, 8, 0}, {"r14", 14, 8, 0}, {"r15", 15, 8, 0},
+    {"eax", 0, 4, 0}, {"ecx", 1, 4, 0}, {"edx", 2, 4, 0}, {"ebx", 3, 4, 0},
+    {"esp", 4, 4, 0}, {"ebp", 5, 4, 0}, {"esi", 6, 4, 0}, {"edi", 7, 4, 0},
+    {"r8d", 8, 4, 0}, {"r9d", 9, 4, 0}, {"r10d", 10, 4, 0}, {"r11d", 11, 4, 0},
+    {"r12d", 12, 4, 0}, {"r13d", 13, 4, 0}, {"r14d", 14, 4, 0}, {"r15d", 15, 4, 0},
+    {"ax", 0, 2, 0}, {"cx", 1, 2, 0}, {"dx", 2, 2, 0}, {"bx", 3, 2, 0},
+    {"sp", 4, 2, 0}, {"bp", 5, 2, 0}, {"si", 6, 2, 0}, {"di", 7, 2, 0},
+    {"r8w", 8, 2, 0}, {"r9w", 9, 2, 0}, {"r10w", 10, 2, 0}, {"r11w", 11, 2, 0},
+    {"r12w", 12, 2, 0}, {"r13w", 13, 2, 0}, {"r14w", 14, 2, 0}, {"r15w", 15, 2, 0},
+    {"al", 0, 1, 0}, {"cl", 1, 1, 0}, {"dl", 2, 1, 0}, {"bl", 3, 1, 0},
+    {"ah", 4, 1, 2}, {"ch", 5, 1, 2}, {"dh", 6, 1, 2}, {"bh", 7, 1, 2},
+    {"spl", 4, 1, 1}, {"bpl", 5, 1, 1}, {"sil", 6, 1, 1}, {"dil", 7, 1, 1},
+    {"r8b", 8, 1, 0}, {"r9b", 9, 1, 0}, {"r10b", 10, 1, 0}, {"r11b", 11, 1, 0},
+    {"r12b", 12, 1, 0}, {"r13b", 13, 1, 0}, {"r14b", 14, 1, 0}, {"r15b", 15, 1, 0},
+};
+
+typedef enum {
+    I_ALU, I_MOV, I_TEST, I_GRP3, I_INCDEC, I_SHIFT, I_IMUL, I_PUSH, I_POP,
+    I_JMP, I_JCC, I_CALL, I_SETCC, I_MOVX, I_MOVSXD, I_LEA, I_FIXED,
+    I_DATA, I_RES
+} AsmInsnClass;
+
+// a: ModRM extension, condition code, opcode or element size; b/n: bytes
+// of fixed instructions
+typedef struct { const char* name; uint8_t cls, a, b, n; } AsmInsn;
+
+AsmInsn asm_insns[] = {
+    {"add", I_ALU, 0, 0, 0}, {"or", I_ALU, 1, 0, 0},
+    {"adc", I_ALU, 2, 0, 0}, {"sbb", I_ALU, 3, 0, 0},
+    {"and", I_ALU, 4, 0, 0}, {"sub", I_ALU, 5, 0, 0},
+    {"xor", I_ALU, 6, 0, 0}, {"cmp", I_ALU, 7, 0, 0},
+    {"mov", I_MOV, 0, 0, 0}, {"test", I_TEST, 0, 0, 0},
+    {"not", I_GRP3, 2, 0, 0}, {"neg", I_GRP3, 3, 0, 0}, {"mul", I_GRP3, 4, 0, 0},
+    {"div", I_GRP3, 6, 0, 0}, {"idiv", I_GRP3, 7, 0, 0},
+    {"inc", I_INCDEC, 0, 0, 0}, {"dec", I_INCDEC, 1, 0, 0},
+    {"rol", I_SHIFT, 0, 0, 0}, {"ror", I_SHIFT, 1, 0, 0},
+    {"shl", I_SHIFT, 4, 0, 0}, {"sal", I_SHIFT, 4, 0, 0},
+    {"shr", I_SHIFT, 5, 0, 0}, {"sar", I_SHIFT, 7, 0, 0},
+    {"imul", I_IMUL, 0, 0, 0}, {"push", I_PUSH, 0, 0, 0}, {"pop", I_POP, 0, 0, 0},
+    {"jmp", I_JMP, 0, 0, 0}, {"call", I_CALL, 0, 0, 0},
+    {"jo", I_JCC, 0, 0, 0}, {"jno", I_JCC, 1, 0, 0}, {"jb", I_JCC, 2, 0, 0},
+    {"jc", I_JCC, 2, 0, 0}, {"jnae", I_JCC, 2, 0, 0},
+    {"jae", I_JCC, 3, 0, 0}, {"jnb", I_JCC, 3, 0, 0}, {"jnc", I_JCC, 3, 0, 0},
+    {"je", I_JCC, 4, 0, 0}, {"jz", I_JCC, 4, 0, 0},
+    {"jne", I_JCC, 5, 0, 0}, {"jnz", I_JCC, 5, 0, 0},
+    {"jbe", I_JCC, 6, 0, 0}, {"jna", I_JCC, 6, 0, 0},
+    {"ja", I_JCC, 7, 0, 0}, {"jnbe", I_JCC, 7, 0, 0},
+    {"js", I_JCC, 8, 0, 0}, {"jns", I_JCC, 9, 0, 0},
+    {"jp", I_JCC, 10, 0, 0}, {"jpe", I_JCC, 10, 0, 0},
+    {"jnp", I_JCC, 11, 0, 0}, {"jpo", I_JCC, 11, 0, 0},
+    {"jl", I_JCC, 12, 0, 0}, {"jnge", I_JCC, 12, 0, 0},
+    {"jge", I_JCC, 13, 0, 0}, {"jnl", I_JCC, 13, 0, 0},
+    {"jle", I_JCC, 14, 0, 0}, {"jng", I_JCC, 14, 0, 0},
+    {"jg", I_JCC, 15, 0, 0}, {"jnle", I_JCC, 15, 0, 0},
+    {"seto", I_SETCC, 0, 0, 0}, {"setno", I_SETCC, 1, 0, 0},
+    {"setb", I_SETCC, 2, 0, 0}, {"setc", I_SETCC, 2, 0, 0},
+    {"setae", I_SETCC, 3, 0, 0}, {"setnc", I_SETCC, 3, 0, 0},
+    {"sete", I_SETCC, 4, 0, 0}, {"setz", I_SETCC, 4, 0, 0},
+    {"setne", I_SETCC, 5, 0, 0}, {"setnz", I_SETCC, 5, 0, 0},
+    {"setbe", I_SETCC, 6, 0, 0}, {"seta", I_SETCC, 7, 0, 0},
+    {"sets", I_SETCC, 8, 0, 0}, {"setns", I_SETCC, 9, 0, 0},
+    {"setp", I_SETCC, 10, 0, 0}, {"setnp", I_SETCC, 11, 0, 0},
+    {"setl", I_SETCC, 12, 0, 0}, {"setge", I_SETCC, 13, 0, 0},
+    {"setle", I_SETCC, 14, 0, 0}, {"setg", I_SETCC, 15, 0, 0},
+    {"movzx", I_MOVX, 0xB6, 0, 0}, {"movsx", I_MOVX, 0xBE, 0, 0},
+    {"movsxd", I_MOVSXD, 0, 0, 0}, {"lea", I_LEA, 0, 0, 0},
+    {"ret", I_FIXED, 0xC3, 0, 1}, {"leave", I_FIXED, 0xC9, 0, 1}, {"nop", I_FIXED, 0x90, 0, 1},
+    {"cqo", I_FIXED, 0x48, 0x99, 2}, {"cdq", I_FIXED, 0x99, 0, 1},
+    {"syscall", I_FIXED, 0x0F, 0x05, 2},
+    {"db", I_DATA, 1, 0, 0}, {"dw", I_DATA, 2, 0, 0},
+    {"dd", I_DATA, 4, 0, 0}, {"dq", I_DATA, 8, 0, 0},
+    {"resb", I_RES, 1, 0, 0}, {"resw", I_RES, 2, 0, 0},
+    {"resd", I_RES, 4, 0, 0}, {"resq", I_RES, 8, 0, 0},
+};
+
+// Atom -> table index + 1, for the register and mnemonic names
+uint8_t* asm_reg_of;
+uint8_t* asm_insn_of;
+int asm_names_count;    // Atoms below this were looked up
+
+void asm_tables_init() {
+    if (asm_reg_of) return;
+    for (int i = 0; i < (int)(sizeof(asm_regs) / sizeof(asm_regs[0])); i++)
+        atom_intern(asm_regs[i].name, strlen(asm_regs[i].name));
+    for (int i = 0; i < (int)(sizeof(asm_insns) / sizeof(asm_insns[0])); i++)
+        atom_intern(asm_insns[i].name, strlen(asm_insns[i].name));
+    asm_names_count = atom_count;
+    asm_reg_of = arena_alloc(&compiler_arena, asm_names_count);
+    asm_insn_of = arena_alloc(&compiler_arena, asm_names_count);
+    for (int i = 0; i < (int)(sizeof(asm_regs) / sizeof(asm_regs[0])); i++)
+        asm_reg_of[atom_intern(asm_regs[i].name, strlen(asm_regs[i].name))] = i + 1;
+    for (int i = 0; i < (int)(sizeof(asm_insns) / sizeof(asm_insns[0])); i++)
+        asm_insn_of[atom_intern(asm_insns[i].name, strlen(asm_insns[i].name))] = i + 1;
+}
+
+void asm_init(Asm* a) {
+    memset(a, 0, sizeof(*a));
+    asm_tables_init();
+}
+
+void asm_free(Asm* a) {
+    for (int i = 0; i < SEC_COUNT; i++) {
+        free(a->sec[i].buf);
+        free(a->sec[i].br);
+        free(a->sec[i].grow);
+    }
+    free(a->syms);
+    free(a->sym_of);
+    free(a->fix);
+    free(a->locals);
+    free(a->local_slots);
+    free(a->local_names);
+}
+
+__attribute__((format(printf, 2, 3)))
+void asm_error(Asm* a, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "Assembler error at line %d: ", a->line);
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    cache_assembly_failed();
+    exit(1);
+}
+
+void asm_byte(Asm* a, int b) {
+    AsmSection* s = &a->sec[a->cur];
+    if (s->len == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 4096;
+        s->buf = safe_realloc(s->buf, s->cap);
+    }
+    s->buf[s->len++] = b;
+}
+
+void asm_le(Asm* a, uint64_t v, int n) {
+    for (int i = 0; i < n; i++) asm_byte(a, (v >> (8 * i)) & 0xff);
+}
+
+void asm_bytes(Asm* a, const void* p, long n) {
+    AsmSection* s = &a->sec[a->cur];
+    if (s->len + n > s->cap) {
+        while (s->len + n > s->cap) s->cap = s->cap ? s->cap * 2 : 4096;
+        s->buf = safe_realloc(s->buf, s->cap);
+    }
+    memcpy(s->buf + s->len, p, n);
+    s->len += n;
+}
+
+// Symbols are found by atom
+int asm_sym(Asm* a, Atom name) {
+    if (name >= a->sym_of_cap) {
+        int cap = a->sym_of_cap ? a->sym_of_cap : 1024;
+        while (cap <= (int)name) cap *= 2;
+        a->sym_of = safe_realloc(a->sym_of, sizeof(int) * cap);
+        memset(a->sym_of + a->sym_of_cap, 0, sizeof(int) * (cap - a->sym_of_cap));
+        a->sym_of_cap = cap;
+    }
+    if (a->sym_of[name]) return a->sym_of[name] - 1;
+    if (a->nsyms == a->symcap) {
+        a->symcap = a->symcap ? a->symcap * 2 : 256;
+        a->syms = safe_realloc(a->syms, sizeof(AsmSymbol) * a->symcap);
+    }
+    AsmSymbol* y = &a->syms[a->nsyms];
+    memset(y, 0, sizeof(*y));
+    y->name = name;
+    y->sec = -1;
+    a->sym_of[name] = ++a->nsyms;
+    return a->nsyms - 1;
+}
+
+void asm_local_rehash(Asm* a, int cap) {
+    a->local_slots = safe_realloc(a->local_slots, sizeof(int) * cap);
+    memset(a->local_slots, 0, sizeof(int) * cap);
+    a->local_slot_cap = cap;
+    for (int l = 0; l < a->nlocals; l++) {
+        unsigned i = a->locals[l].hash & (cap - 1);
+        while (a->local_slots[i]) i = (i + 1) & (cap - 1);
+        a->local_slots[i] = l + 1;
+    }
+}
+
+// The current function's label ".name", added on first mention
+int asm_local(Asm* a, const char* s, int len) {
+    if (a->nlocals * 2 >= a->local_slot_cap) asm_local_rehash(a, a->local_slot_cap ? a->local_slot_cap * 2 : 64);
+    unsigned h = str_hash(s, len), mask = a->local_slot_cap - 1, i = h & mask;
+    for (; a->local_slots[i]; i = (i + 1) & mask) {
+        AsmLocal* l = &a->locals[a->local_slots[i] - 1];
+        if (l->hash == h && l->len == len && !memcmp(a->local_names + l->name, s, len)) return a->local_slots[i] - 1;
+    }
+    if (a->nlocals == a->localcap) {
+        a->localcap = a->localcap ? a->localcap * 2 : 64;
+        a->locals = safe_realloc(a->locals, sizeof(AsmLocal) * a->localcap);
+    }
+    if (a->names_len + len > a->names_cap) {
+        while (a->names_len + len > a->names_cap) a->names_cap = a->names_cap ? a->names_cap * 2 : 1024;
+        a->local_names = safe_realloc(a->local_names, a->names_cap);
+    }
+    memcpy(a->local_names + a->names_len, s, len);
+    a->locals[a->nlocals] = (AsmLocal){a->names_len, len, h, -1, 0, 0};
+    a->names_len += len;
+    a->local_slots[i] = ++a->nlocals;
+    return a->nlocals - 1;
+}
+
+// Size the current function's jumps in section si (rel8 where the target is
+// in range, else rel32) and put them into its bytes, last first, moving the
+// bytes after each up to their place
+void asm_place_branches(Asm* a, int si) {
+    AsmSection* s = &a->sec[si];
+    for (;;) {
+        long g = 0;
+        for (int i = 0; i < s->nbr; i++) {
+            s->grow[i] = g;
+            g += s->br[i].is_long ? (s->br[i].cc == ASM_JMP ? 5 : 6) : 2;
+        }
+        s->grow[s->nbr] = g;
+        int changed = 0;
+        for (int i = 0; i < s->nbr; i++) {
+            AsmBranch* b = &s->br[i];
+            AsmLocal* t = &a->locals[b->sym];
+            if (t->sec != si) {
+                asm_error(a, "jump to '%s%.*s' in another section", atom_str(a->scope), t->len,
+                          a->local_names + t->name);
             }
+            long d = t->pos + s->grow[t->nbr] - (b->pos + s->grow[i] + 2);
+            if (!b->is_long && (d < -128 || d > 127)) {
+                b->is_long = 1;
+                changed = 1;
+            }
+        }
+        if (!changed) break;
+    }
+    long size = s->len + s->grow[s->nbr];
+    if (size > s->cap) {
+        while (size > s->cap) s->cap = s->cap ? s->cap * 2 : 4096;
+        s->buf = safe_realloc(s->buf, s->cap);
+    }
+    long from = s->len;
+    for (int i = s->nbr - 1; i >= 0; i--) {
+        AsmBranch* b = &s->br[i];
+        AsmLocal* t = &a->locals[b->sym];
+        int len = b->is_long ? (b->cc == ASM_JMP ? 5 : 6) : 2;
+        long to = b->pos + s->grow[i];
+        memmove(s->buf + to + len, s->buf + b->pos, from - b->pos);
+        from = b->pos;
+        long d = t->pos + s->grow[t->nbr] - (to + len);
+        uint8_t* out = s->buf + to;
+        if (!b->is_long) {
+            out[0] = b->cc == ASM_JMP ? 0xEB : 0x70 + b->cc;
+            out[1] = d;
+            continue;
+        }
+        if (b->cc == ASM_JMP) {
+            *out++ = 0xE9;
         } else {
-            // Field access from expression (e.g., array[index].field)
-            // Generate the expression first (should leave struct address in rax)
-            gen_expr(cg, obj);
+            *out++ = 0x0F;
+            *out++ = 0x80 + b->cc;
+        }
+        for (int k = 0; k < 4; k++) out[k] = (uint32_t)d >> (8 * k);
+    }
+    for (int k = a->scope_fix; k < a->nfix; k++) {
+        AsmFixup* f = &a->fix[k];
+        if (f->sec != si) continue;
+        f->pos += s->grow[f->nbr];
+        f->nbr = 0;
+    }
+    s->len = size;
+    s->nbr = 0;
+}
 
-            // Now rax contains the address of the struct
-            // We need to know the struct type to get field offset
-            // For now, we'll try to infer it from the expression
-            // This is a simplified approach - full implementation needs type inference
+// The end of a function, at the next plain label or the end of the text:
+// its jumps go in and its labels are forgotten
+void asm_end_scope(Asm* a) {
+    for (int l = 0; l < a->nlocals; l++) {
+        AsmLocal* y = &a->locals[l];
+        if (y->sec < 0) asm_error(a, "undefined symbol '%s%.*s'", atom_str(a->scope), y->len, a->local_names + y->name);
+    }
+    for (int si = 0; si < SEC_COUNT; si++)
+        if (a->sec[si].nbr) asm_place_branches(a, si);
+    a->scope_fix = a->nfix;
+    unsigned mask = a->local_slot_cap - 1;
+    for (int l = 0; l < a->nlocals; l++) {
+        unsigned i = a->locals[l].hash & mask;
+        while (a->local_slots[i] != l + 1) i = (i + 1) & mask;
+        a->local_slots[i] = 0;
+    }
+    a->nlocals = 0;
+    a->names_len = 0;
+}
 
-            // Try to get type from INDEX expression
-            if (obj->type == AST_INDEX && obj->children && obj->child_count > 0) {
-                AstNode* base = obj->children[0];
-                char* struct_type = NULL;
+void asm_label(Asm* a, const char* s, int len) {
+    AsmSection* sec = &a->sec[a->cur];
+    if (s[0] == '.') {
+        int i = asm_local(a, s, len);
+        AsmLocal* l = &a->locals[i];
+        if (l->sec >= 0) asm_error(a, "symbol '%s%.*s' redefined", atom_str(a->scope), len, s);
+        l->sec = a->cur;
+        l->pos = a->cur == SEC_BSS ? sec->bss : sec->len;
+        l->nbr = sec->nbr;
+        return;
+    }
+    asm_end_scope(a);
+    Atom name = atom_intern(s, len);
+    a->scope = name;
+    int i = asm_sym(a, name);
+    AsmSymbol* y = &a->syms[i];
+    if (y->sec >= 0) asm_error(a, "symbol '%s' redefined", atom_str(name));
+    y->sec = a->cur;
+    y->pos = a->cur == SEC_BSS ? sec->bss : sec->len;
+}
 
-                if (base->type == AST_IDENT) {
-                    // Simple case: array[index].field
-                    Symbol* base_sym = symtab_lookup_symbol(cg->symtab, base->name);
-                    if (base_sym && base_sym->type_name) {
-                        struct_type = base_sym->type_name;
-                        // Remove pointer prefix if present
-                        if (struct_type[0] == '*') struct_type++;
-                    }
-                } else if (base->type == AST_FIELD_ACCESS) {
-                    // Complex case: struct.field[index].field
-                    // E.g., container.tokens[0].value
-                    // base is AST_FIELD_ACCESS for "container.tokens"
-                    // Now we CAN determine the element type using type tracking!
+// rel32 field at the current position, patched once `sym` has an address
+void asm_fixup(Asm* a, int sym, long addend) {
+    if (a->nfix == a->fixcap) {
+        a->fixcap = a->fixcap ? a->fixcap * 2 : 256;
+        a->fix = safe_realloc(a->fix, sizeof(AsmFixup) * a->fixcap);
+    }
+    AsmSection* s = &a->sec[a->cur];
+    a->fix[a->nfix++] = (AsmFixup){a->cur, s->len, s->nbr, sym, addend};
+    asm_le(a, 0, 4);
+}
 
-                    if (base->children && base->child_count > 0) {
-                        AstNode* struct_obj = base->children[0];
-                        char* field_name_inner = base->name;  // "tokens"
+// A jump to a label of the current function, placed at its end
+void asm_branch(Asm* a, int cc, int sym) {
+    AsmSection* s = &a->sec[a->cur];
+    if (a->cur == SEC_DATA || a->cur == SEC_BSS) asm_error(a, "jump outside a code section");
+    if (s->nbr == s->brcap) {
+        s->brcap = s->brcap ? s->brcap * 2 : 256;
+        s->br = safe_realloc(s->br, sizeof(AsmBranch) * s->brcap);
+        s->grow = safe_realloc(s->grow, sizeof(long) * (s->brcap + 1));
+    }
+    s->br[s->nbr++] = (AsmBranch){s->len, sym, cc, 0};
+}
 
-                        if (struct_obj->type == AST_IDENT) {
-                            // Look up the struct variable
-                            Symbol* struct_sym = symtab_lookup_symbol(cg->symtab, struct_obj->name);
-                            if (struct_sym && struct_sym->type_name) {
-                                // Get the struct type (e.g., "Container" or "*Container")
-                                char* container_type = struct_sym->type_name;
-                                if (container_type[0] == '*') container_type++;
+// ---- Operands ----
+typedef enum { OPD_NONE, OPD_REG, OPD_IMM, OPD_MEM, OPD_SYM } AsmOperandKind;
 
-                                // Get the type of the field (e.g., "*Token" for tokens field)
-                                char* field_type = typetab_field_type(cg->types, container_type, field_name_inner);
-                                if (field_type) {
-                                    // If it's a pointer type, extract base type
-                                    if (field_type[0] == '*') {
-                                        struct_type = field_type + 1;  // Skip '*' to get "Token"
-                                    } else {
-                                        struct_type = field_type;
-                                    }
-                                }
-                            }
-                        }
-                    }
-                }
+typedef struct {
+    uint8_t kind;
+    uint8_t size;      // Register or memory size in bytes; 0 if not given
+    uint8_t rex;       // For byte registers, as in AsmReg
+    int8_t reg, base, index;
+    uint8_t scale;
+    long imm;          // Immediate, or displacement
+    int sym;           // -1 if none
+    uint8_t local;     // sym is a label of the current function (Asm.locals)
+} AsmOperand;
+
+int asm_ident_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '.';
+}
 
-                if (struct_type) {
-                    int field_off = typetab_field_offset(cg->types, struct_type, field_name);
-                    if (field_off >= 0) {
-                        if (field_off == 0) {
-                            emit(cg, "    mov rax, [rax]\n");
-                        } else {
-                            emit(cg, "    mov rax, [rax+%d]\n", field_off);
-                        }
+const char* asm_skip(const char* p) {
+    while (*p == ' ' || *p == '\t') p++;
+    return p;
+}
+
+int asm_eol(const char* p) { return *p == '\n' || *p == '\0' || *p == ';' || *p == '\r'; }
+
+// Decimal, or hex with 0x; NASM reads a leading 0 as decimal too
+const char* asm_number(Asm* a, const char* p, long* v) {
+    int neg = 0;
+    if (*p == '-') { neg = 1; p = asm_skip(p + 1); }
+    unsigned long u = 0;
+    if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+        p += 2;
+        if (!isxdigit((unsigned char)*p)) asm_error(a, "bad number");
+        while (isxdigit((unsigned char)*p)) {
+            u = u * 16 + (*p <= '9' ? *p - '0' : (*p | 0x20) - 'a' + 10);
+            p++;
+        }
+    } else {
+        if (*p < '0' || *p > '9') asm_error(a, "bad number");
+        while (*p >= '0' && *p <= '9') u = u * 10 + (*p++ - '0');
+    }
+    *v = neg ? -(long)u : (long)u;
+    return p;
+}
+
+// Register table entry for the identifier at [s, s+len), or NULL
+AsmReg* asm_reg(const char* s, int len) {
+    if (len > 4) return NULL;
+    Atom at = atom_intern(s, len);
+    if ((int)at >= asm_names_count || !asm_reg_of[at]) return NULL;
+    return &asm_regs[asm_reg_of[at] - 1];
+}
+
+// Symbol named in an operand: a label of the current function, or a symbol
+void asm_ref(Asm* a, const char* s, int len, AsmOperand* o) {
+    o->local = s[0] == '.';
+    o->sym = o->local ? asm_local(a, s, len) : asm_sym(a, atom_intern(s, len));
+}
+
+const char* asm_operand(Asm* a, const char* p, AsmOperand* o) {
+    memset(o, 0, sizeof(*o));
+    o->reg = o->base = o->index = -1;
+    o->sym = -1;
+    p = asm_skip(p);
+    const char* q = p;
+    while (asm_ident_char(*q)) q++;
+    static const char* sizes[] = {"byte", "word", "dword", "qword"};
+    for (int i = 0; i < 4; i++) {
+        if (q - p == (int)strlen(sizes[i]) && !memcmp(p, sizes[i], q - p)) {
+            o->size = 1 << i;
+            p = asm_skip(q);
+            break;
+        }
+    }
+    if (*p == '[') {
+        o->kind = OPD_MEM;
+        p = asm_skip(p + 1);
+        int sign = 1;
+        for (;;) {
+            if (*p == '-' || (*p >= '0' && *p <= '9')) {
+                long v;
+                if (*p == '-') { sign = -sign; p = asm_skip(p + 1); }
+                p = asm_number(a, p, &v);
+                o->imm += sign * v;
+            } else if (asm_ident_char(*p)) {
+                q = p;
+                while (asm_ident_char(*q)) q++;
+                AsmReg* r = asm_reg(p, q - p);
+                if (r) {
+                    if (r->size != 8 || sign < 0) asm_error(a, "bad address register");
+                    int scale = 1;
+                    const char* t = asm_skip(q);
+                    if (*t == '*') {
+                        t = asm_skip(t + 1);
+                        scale = *t - '0';
+                        if (scale != 1 && scale != 2 && scale != 4 && scale != 8) asm_error(a, "bad scale");
+                        q = t + 1;
                     }
+                    if (o->base < 0 && scale == 1) o->base = r->num;
+                    else if (o->index < 0) { o->index = r->num; o->scale = scale; }
+                    else asm_error(a, "too many address registers");
+                } else {
+                    if (o->sym >= 0 || sign < 0) asm_error(a, "bad address");
+                    asm_ref(a, p, q - p, o);
                 }
+                p = q;
+            } else {
+                asm_error(a, "bad address");
             }
+            p = asm_skip(p);
+            if (*p == ']') break;
+            if (*p == '+') sign = 1;
+            else if (*p == '-') sign = -1;
+            else asm_error(a, "bad address");
+            p = asm_skip(p + 1);
         }
-    } else if (n->type == AST_ARRAY_ASSIGN) {
-        // Array assignment: array[index] = value
-        // children[0] = array base
-        // children[1] = index expression
-        // children[2] = value expression
-
-        if (!n->children || n->child_count < 3) return;
-        AstNode* arr = n->children[0];
-        AstNode* index_expr = n->children[1];
-        AstNode* value_expr = n->children[2];
-
-        if (!arr || !arr->name) return;
+        if (o->index == 4) {
+            if (o->scale != 1 || o->base == 4) asm_error(a, "rsp can't be an index");
+            o->index = o->base;
+            o->base = 4;
+        }
+        if (o->index >= 0 && !o->scale) o->scale = 1;
+        return asm_skip(p + 1);
+    }
+    if (*p == '-' || (*p >= '0' && *p <= '9')) {
+        o->kind = OPD_IMM;
+        return asm_skip(asm_number(a, p, &o->imm));
+    }
+    q = p;
+    while (asm_ident_char(*q)) q++;
+    if (q == p) asm_error(a, "bad operand");
+    AsmReg* r = asm_reg(p, q - p);
+    if (r) {
+        o->kind = OPD_REG;
+        o->reg = r->num;
+        o->size = r->size;
+        o->rex = r->rex;
+    } else {
+        o->kind = OPD_SYM;
+        asm_ref(a, p, q - p, o);
+    }
+    return asm_skip(q);
+}
 
-        // Evaluate value expression and save it
-        gen_expr(cg, value_expr);
-        emit(cg, "    push rax\n");  // Save value
+// ---- Encoding ----
+// Prefixes, opcode and ModRM/SIB/displacement. `reg` is the register or
+// opcode extension in ModRM.reg; `imm` counts the immediate bytes that
+// follow, which RIP-relative displacements are measured past.
+void asm_modrm(Asm* a, int size, int op_len, const uint8_t* op, int reg, int reg_rex, AsmOperand* rm, int imm) {
+    if (size == 2) asm_byte(a, 0x66);
+    int rex = (size == 8 ? 8 : 0) | (reg & 8 ? 4 : 0);
+    if (rm->kind == OPD_REG) {
+        rex |= rm->reg & 8 ? 1 : 0;
+    } else {
+        if (rm->index >= 0 && (rm->index & 8)) rex |= 2;
+        if (rm->base >= 0 && (rm->base & 8)) rex |= 1;
+    }
+    int byte_rex = reg_rex | (rm->kind == OPD_REG ? rm->rex : 0);
+    if ((rex || (byte_rex & 1)) && (byte_rex & 2)) asm_error(a, "ah/bh/ch/dh can't be used here");
+    if (rex || (byte_rex & 1)) asm_byte(a, 0x40 | rex);
+    for (int i = 0; i < op_len; i++) asm_byte(a, op[i]);
+
+    int r = (reg & 7) << 3;
+    if (rm->kind == OPD_REG) {
+        asm_byte(a, 0xC0 | r | (rm->reg & 7));
+        return;
+    }
+    if (rm->sym >= 0) {
+        if (rm->base >= 0 || rm->index >= 0) asm_error(a, "symbol with a base register");
+        if (rm->local) asm_error(a, "a local label can only be jumped to");
+        asm_byte(a, 0x05 | r);
+        asm_fixup(a, rm->sym, rm->imm - 4 - imm);
+        return;
+    }
+    if (rm->imm != (int32_t)rm->imm) asm_error(a, "displacement out of range");
+    if (rm->base < 0) {
+        // [disp32] or [index*scale+disp32]: SIB with no base
+        asm_byte(a, 0x04 | r);
+        int ss = rm->scale == 8 ? 3 : rm->scale == 4 ? 2 : rm->scale == 2 ? 1 : 0;
+        asm_byte(a, rm->index >= 0 ? (ss << 6) | ((rm->index & 7) << 3) | 5 : 0x25);
+        asm_le(a, rm->imm, 4);
+        return;
+    }
+    int mod = (rm->imm == 0 && (rm->base & 7) != 5) ? 0 : (rm->imm == (int8_t)rm->imm) ? 1 : 2;
+    if (rm->index >= 0 || (rm->base & 7) == 4) {
+        int ss = rm->scale == 8 ? 3 : rm->scale == 4 ? 2 : rm->scale == 2 ? 1 : 0;
+        asm_byte(a, (mod << 6) | r | 4);
+        asm_byte(a, (ss << 6) | (((rm->index >= 0 ? rm->index : 4) & 7) << 3) | (rm->base & 7));
+    } else {
+        asm_byte(a, (mod << 6) | r | (rm->base & 7));
+    }
+    if (mod == 1) asm_byte(a, rm->imm);
+    else if (mod == 2) asm_le(a, rm->imm, 4);
+}
 
-        // Evaluate index expression
-        gen_expr(cg, index_expr);
+void asm_op1(Asm* a, int size, int op, int reg, int reg_rex, AsmOperand* rm, int imm) {
+    uint8_t b = op;
+    asm_modrm(a, size, 1, &b, reg, reg_rex, rm, imm);
+}
 
-        // Try local array/pointer first
-        Symbol* sym = symtab_lookup_symbol(cg->symtab, arr->name);
-        if (sym) {
-            // Check if this is a pointer (not an array)
-            if (sym->is_pointer) {
-                // Pointer assignment: ptr[index] = value
-                // Determine element size from type_name
-                int elem_size = 8;  // Default to i64
-                if (sym->type_name) {
-                    char* base_type = sym->type_name;
-                    if (base_type[0] == '*') base_type++;  // Skip '*'
+void asm_op2(Asm* a, int size, int op, int reg, int reg_rex, AsmOperand* rm, int imm) {
+    uint8_t b[2] = {0x0F, op};
+    asm_modrm(a, size, 2, b, reg, reg_rex, rm, imm);
+}
 
-                    if (!strcmp(base_type, "i8") || !strcmp(base_type, "u8")) elem_size = 1;
-                    else if (!strcmp(base_type, "i16")) elem_size = 2;
-                    else if (!strcmp(base_type, "i32") || !strcmp(base_type, "u32")) elem_size = 4;
-                    else if (!strcmp(base_type, "i64") || !strcmp(base_type, "u64")) elem_size = 8;
-                }
+// n-byte immediate; n = -4 for an imm32 the CPU sign-extends to 64 bits
+void asm_imm(Asm* a, long v, int n) {
+    if (n == -4 ? v != (int32_t)v
+                : n < 8 && (v < -(1L << (8 * n - 1)) || v > (long)(0xffffffffUL >> (32 - 8 * n))))
+        asm_error(a, "immediate out of range");
+    asm_le(a, v, n < 0 ? -n : n);
+}
 
-                // Scale index by element size
-                if (elem_size > 1) {
-                    emit(cg, "    imul rax, %d\n", elem_size);
-                }
+// Width of the operation from the operands; memory-only forms need a size
+int asm_size(Asm* a, AsmOperand* x, AsmOperand* y) {
+    if (x->kind == OPD_REG) {
+        if (y && y->kind == OPD_REG && y->size != x->size) asm_error(a, "operand sizes differ");
+        return x->size;
+    }
+    if (y && y->kind == OPD_REG) {
+        if (x->size && x->size != y->size) asm_error(a, "operand sizes differ");
+        return y->size;
+    }
+    if (!x->size) asm_error(a, "operation size not specified");
+    return x->size;
+}
 
-                // Load pointer and add offset
-                emit(cg, "    mov rbx, [rbp%d]\n", sym->offset);  // Load pointer
-                emit(cg, "    add rbx, rax\n");  // Add scaled index
-                emit(cg, "    pop rax\n");  // Restore value
+int asm_is_rm(AsmOperand* o) { return o->kind == OPD_REG || o->kind == OPD_MEM; }
 
-                // Store with correct width
-                if (elem_size == 1) {
-                    emit(cg, "    mov byte [rbx], al\n");
-                } else if (elem_size == 2) {
-                    emit(cg, "    mov word [rbx], ax\n");
-                } else if (elem_size == 4) {
-                    emit(cg, "    mov dword [rbx], eax\n");
+void asm_insn(Asm* a, AsmInsn* in, int n, AsmOperand* o) {
+    AsmOperand* x = &o[0];
+    AsmOperand* y = &o[1];
+    int size;
+    switch (in->cls) {
+        case I_ALU:
+            if (n != 2 || !asm_is_rm(x)) break;
+            if (y->kind == OPD_REG) {
+                size = asm_size(a, x, y);
+                asm_op1(a, size, in->a * 8 + (size == 1 ? 0 : 1), y->reg, y->rex, x, 0);
+                return;
+            }
+            if (y->kind == OPD_MEM && x->kind == OPD_REG) {
+                size = x->size;
+                asm_op1(a, size, in->a * 8 + (size == 1 ? 2 : 3), x->reg, x->rex, y, 0);
+                return;
+            }
+            if (y->kind == OPD_IMM) {
+                size = asm_size(a, x, NULL);
+                if (size == 1) {
+                    asm_op1(a, 1, 0x80, in->a, 0, x, 1);
+                    asm_imm(a, y->imm, 1);
+                } else if (y->imm == (int8_t)y->imm) {
+                    asm_op1(a, size, 0x83, in->a, 0, x, 1);
+                    asm_imm(a, y->imm, 1);
+                } else if (x->kind == OPD_REG && x->reg == 0) {
+                    // Short accumulator form: add rax, imm32 -> 48 05 id
+                    int n_imm = size == 2 ? 2 : 4;
+                    if (size == 2) asm_byte(a, 0x66);
+                    if (size == 8) asm_byte(a, 0x48);
+                    asm_byte(a, in->a * 8 + 5);
+                    asm_imm(a, y->imm, size == 8 ? -4 : n_imm);
                 } else {
-                    emit(cg, "    mov qword [rbx], rax\n");
-                }
-            } else {
-                // Local array assignment
-                // Determine element size from type_name
-                int elem_size = 8;  // Default to 8 bytes (i64)
-                if (sym->type_name) {
-                    if (!strcmp(sym->type_name, "i8") || !strcmp(sym->type_name, "u8")) elem_size = 1;
-                    else if (!strcmp(sym->type_name, "i16")) elem_size = 2;
-                    else if (!strcmp(sym->type_name, "i32") || !strcmp(sym->type_name, "u32")) elem_size = 4;
-                    else if (!strcmp(sym->type_name, "i64") || !strcmp(sym->type_name, "u64")) elem_size = 8;
-                }
-
-                // Local array assignment with correct element size
-                if (elem_size > 1) {
-                    emit(cg, "    imul rax, %d\n", elem_size);
+                    int n_imm = size == 2 ? 2 : 4;
+                    asm_op1(a, size, 0x81, in->a, 0, x, n_imm);
+                    asm_imm(a, y->imm, size == 8 ? -4 : n_imm);
                 }
-                emit(cg, "    mov rbx, rax\n");
-                emit(cg, "    pop rax\n");  // Restore value
-
-                // Store with correct width
-                if (elem_size == 1) {
-                    emit(cg, "    mov byte [rbp%d+rbx], al\n", sym->offset);
-                } else if (elem_size == 2) {
-                    emit(cg, "    mov word [rbp%d+rbx], ax\n", sym->offset);
-                } else if (elem_size == 4) {
-                    emit(cg, "    mov dword [rbp%d+rbx], eax\n", sym->offset);
+                return;
+            }
+            break;
+        case I_MOV:
+            if (n != 2) break;
+            if (x->kind == OPD_REG && y->kind == OPD_SYM) {
+                // Address of a symbol: lea reg, [rel sym]
+                if (x->size != 8) asm_error(a, "symbol address needs a 64-bit register");
+                y->kind = OPD_MEM;
+                asm_op1(a, 8, 0x8D, x->reg, 0, y, 0);
+                return;
+            }
+            if (asm_is_rm(x) && y->kind == OPD_REG) {
+                size = asm_size(a, x, y);
+                asm_op1(a, size, size == 1 ? 0x88 : 0x89, y->reg, y->rex, x, 0);
+                return;
+            }
+            if (x->kind == OPD_REG && y->kind == OPD_MEM) {
+                asm_op1(a, x->size, x->size == 1 ? 0x8A : 0x8B, x->reg, x->rex, y, 0);
+                return;
+            }
+            if (x->kind == OPD_REG && y->kind == OPD_IMM) {
+                size = x->size;
+                long v = y->imm;
+                if (size == 8 && v != (int32_t)v && (v < 0 || v > 0xffffffffL)) {
+                    asm_byte(a, 0x48 | (x->reg & 8 ? 1 : 0));
+                    asm_byte(a, 0xB8 | (x->reg & 7));
+                    asm_le(a, v, 8);
+                } else if (size == 8 && v < 0) {
+                    asm_op1(a, 8, 0xC7, 0, 0, x, 4);
+                    asm_imm(a, v, -4);
                 } else {
-                    emit(cg, "    mov qword [rbp%d+rbx], rax\n", sym->offset);
+                    // mov r32, imm32 zero-extends, so it covers 0..2^32-1 for r64
+                    if (size == 2) asm_byte(a, 0x66);
+                    if ((x->reg & 8) || (x->rex & 1)) asm_byte(a, 0x40 | (x->reg & 8 ? 1 : 0));
+                    asm_byte(a, (size == 1 ? 0xB0 : 0xB8) | (x->reg & 7));
+                    asm_imm(a, v, size == 8 ? 4 : size);
                 }
+                return;
             }
-        } else {
-            // Try global array
-            GlobalVar* gvar = global_symtab_lookup(cg->global_symtab, arr->name);
-            if (gvar && gvar->is_array) {
-                // Calculate element size
-                int elem_size = 1;  // i8
-                if (gvar->elem_type) {
-                    if (!strcmp(gvar->elem_type, "i32")) elem_size = 4;
-                    else if (!strcmp(gvar->elem_type, "i64")) elem_size = 8;
-                    else if (!strcmp(gvar->elem_type, "i16")) elem_size = 2;
+            if (x->kind == OPD_MEM && y->kind == OPD_IMM) {
+                size = asm_size(a, x, NULL);
+                int n_imm = size == 8 ? 4 : size;
+                asm_op1(a, size, size == 1 ? 0xC6 : 0xC7, 0, 0, x, n_imm);
+                asm_imm(a, y->imm, size == 8 ? -4 : n_imm);
+                return;
+            }
+            break;
+        case I_TEST:
+            if (n != 2) break;
+            if (x->kind == OPD_REG && y->kind == OPD_MEM) { AsmOperand t = *x; *x = *y; *y = t; }
+            if (asm_is_rm(x) && y->kind == OPD_REG) {
+                size = asm_size(a, x, y);
+                asm_op1(a, size, size == 1 ? 0x84 : 0x85, y->reg, y->rex, x, 0);
+                return;
+            }
+            if (asm_is_rm(x) && y->kind == OPD_IMM) {
+                size = asm_size(a, x, NULL);
+                int n_imm = size == 8 ? 4 : size;
+                if (x->kind == OPD_REG && x->reg == 0) {
+                    if (size == 2) asm_byte(a, 0x66);
+                    if (size == 8) asm_byte(a, 0x48);
+                    asm_byte(a, size == 1 ? 0xA8 : 0xA9);
+                } else {
+                    asm_op1(a, size, size == 1 ? 0xF6 : 0xF7, 0, 0, x, n_imm);
                 }
-
-                // Calculate offset
-                if (elem_size > 1) {
-                    emit(cg, "    imul rax, %d\n", elem_size);
+                asm_imm(a, y->imm, size == 8 ? -4 : n_imm);
+                return;
+            }
+            break;
+        case I_GRP3:
+        case I_INCDEC:
+            if (n != 1 || !asm_is_rm(x)) break;
+            size = asm_size(a, x, NULL);
+            asm_op1(a, size, (in->cls == I_GRP3 ? 0xF6 : 0xFE) + (size != 1), in->a, 0, x, 0);
+            return;
+        case I_SHIFT:
+            if (n != 2 || !asm_is_rm(x)) break;
+            size = asm_size(a, x, NULL);
+            if (y->kind == OPD_REG && y->reg == 1 && y->size == 1) {
+                asm_op1(a, size, 0xD2 + (size != 1), in->a, 0, x, 0);
+            } else if (y->kind == OPD_IMM && y->imm == 1) {
+                asm_op1(a, size, 0xD0 + (size != 1), in->a, 0, x, 0);
+            } else if (y->kind == OPD_IMM) {
+                asm_op1(a, size, 0xC0 + (size != 1), in->a, 0, x, 1);
+                asm_imm(a, y->imm, 1);
+            } else {
+                break;
+            }
+            return;
+        case I_IMUL:
+            if (n == 1 && asm_is_rm(x)) {
+                size = asm_size(a, x, NULL);
+                asm_op1(a, size, size == 1 ? 0xF6 : 0xF7, 5, 0, x, 0);
+                return;
+            }
+            if (x->kind != OPD_REG || x->size == 1) break;
+            if (n == 2 && asm_is_rm(y)) {
+                asm_size(a, x, y);
+                asm_op2(a, x->size, 0xAF, x->reg, 0, y, 0);
+                return;
+            }
+            if (n == 2 && y->kind == OPD_IMM) { o[2] = *y; *y = *x; n = 3; }
+            if (n == 3 && asm_is_rm(y) && o[2].kind == OPD_IMM) {
+                asm_size(a, x, y);
+                long v = o[2].imm;
+                int n_imm = v == (int8_t)v ? 1 : x->size == 2 ? 2 : 4;
+                asm_op1(a, x->size, n_imm == 1 ? 0x6B : 0x69, x->reg, 0, y, n_imm);
+                asm_imm(a, v, x->size == 8 && n_imm == 4 ? -4 : n_imm);
+                return;
+            }
+            break;
+        case I_PUSH:
+        case I_POP:
+            if (n != 1) break;
+            if (x->kind == OPD_REG && x->size == 8) {
+                if (x->reg & 8) asm_byte(a, 0x41);
+                asm_byte(a, (in->cls == I_PUSH ? 0x50 : 0x58) | (x->reg & 7));
+                return;
+            }
+            if (x->kind == OPD_MEM) {
+                asm_op1(a, 4, in->cls == I_PUSH ? 0xFF : 0x8F, in->cls == I_PUSH ? 6 : 0, 0, x, 0);
+                return;
+            }
+            if (x->kind == OPD_IMM && in->cls == I_PUSH) {
+                int short_imm = x->imm == (int8_t)x->imm;
+                asm_byte(a, short_imm ? 0x6A : 0x68);
+                asm_imm(a, x->imm, short_imm ? 1 : 4);
+                return;
+            }
+            break;
+        case I_JMP:
+        case I_JCC:
+        case I_CALL:
+            if (n != 1) break;
+            if (x->kind == OPD_SYM) {
+                if (x->local && in->cls != I_CALL) {
+                    asm_branch(a, in->cls == I_JMP ? ASM_JMP : in->a, x->sym);
+                    return;
                 }
-                emit(cg, "    lea rbx, [%s]\n", gvar->name);
-                emit(cg, "    add rbx, rax\n");
-                emit(cg, "    pop rax\n");  // Restore value
-
-                // Store with correct width
-                if (elem_size == 1) {
-                    emit(cg, "    mov byte [rbx], al\n");
-                } else if (elem_size == 2) {
-                    emit(cg, "    mov word [rbx], ax\n");
-                } else if (elem_size == 4) {
-                    emit(cg, "    mov dword [rbx], eax\n");
+                if (x->local) asm_error(a, "a local label can only be jumped to");
+                // Calls, and jumps out of the function, are rel32 fixups
+                if (in->cls == I_JCC) {
+                    asm_byte(a, 0x0F);
+                    asm_byte(a, 0x80 + in->a);
                 } else {
-                    emit(cg, "    mov qword [rbx], rax\n");
+                    asm_byte(a, in->cls == I_CALL ? 0xE8 : 0xE9);
                 }
+                asm_fixup(a, x->sym, -4);
+                return;
             }
-        }
-    } else if (n->type == AST_FIELD_ASSIGN) {
-        // Field assignment: struct.field = value or array[index].field = value
-        // name = field name
-        // children[0] = struct object or array index expression
-        // children[1] = value expression
-
-        if (!n->children || n->child_count < 2) return;
-        AstNode* obj = n->children[0];
-        AstNode* value_expr = n->children[1];
-        char* field_name = n->name;
-
-        if (!obj || !field_name) return;
-
-        // Evaluate value expression
-        gen_expr(cg, value_expr);
-        emit(cg, "    push rax\n");  // Save value
-
-        // Check if object is an array index expression (e.g., arr[0])
-        if (obj->type == AST_INDEX) {
-            // Field assignment to array element: arr[index].field = value
-            if (!obj->children || obj->child_count < 2) return;
-            AstNode* arr_base = obj->children[0];
-            AstNode* index_expr = obj->children[1];
-
-            if (!arr_base || !arr_base->name) return;
+            if (in->cls != I_JCC && asm_is_rm(x)) {
+                if (x->kind == OPD_REG && x->size != 8) break;
+                asm_op1(a, 4, 0xFF, in->cls == I_CALL ? 2 : 4, 0, x, 0);
+                return;
+            }
+            break;
+        case I_SETCC:
+            if (n != 1 || !asm_is_rm(x) || (x->size && x->size != 1)) break;
+            asm_op2(a, 1, 0x90 + in->a, 0, 0, x, 0);
+            return;
+        case I_MOVX:
+            if (n != 2 || x->kind != OPD_REG || !asm_is_rm(y)) break;
+            if (y->size != 1 && y->size != 2) asm_error(a, "%s source must be a byte or word", in->name);
+            if (x->size <= y->size) break;
+            asm_op2(a, x->size, in->a + (y->size == 2), x->reg, 0, y, 0);
+            return;
+        case I_MOVSXD:
+            if (n != 2 || x->kind != OPD_REG || x->size != 8 || !asm_is_rm(y) || (y->size && y->size != 4)) break;
+            asm_op1(a, 8, 0x63, x->reg, 0, y, 0);
+            return;
+        case I_LEA:
+            if (n != 2 || x->kind != OPD_REG || x->size < 2 || y->kind != OPD_MEM) break;
+            asm_op1(a, x->size, 0x8D, x->reg, 0, y, 0);
+            return;
+        case I_FIXED:
+            if (n) break;
+            asm_byte(a, in->a);
+            if (in->n > 1) asm_byte(a, in->b);
+            return;
+    }
+    asm_error(a, "unsupported operands for '%s'", in->name);
+}
 
-            // Evaluate index expression
-            gen_expr(cg, index_expr);
-            emit(cg, "    push rax\n");  // Save index
+// db/dw/dd/dq operands, `times` copies over
+const char* asm_data(Asm* a, const char* p, int size, long times) {
+    if (a->cur == SEC_BSS) asm_error(a, "initialized data in .bss");
+    long start = a->sec[a->cur].len;
+    for (;;) {
+        p = asm_skip(p);
+        if (*p == '"' || *p == '\'') {
+            char q = *p++;
+            const char* e = strchr(p, q);
+            if (!e || memchr(p, '\n', e - p)) asm_error(a, "unterminated string");
+            for (const char* c = p; c < e; c++) asm_byte(a, *c);
+            for (long pad = (e - p) % size; pad && pad < size; pad++) asm_byte(a, 0);
+            p = e + 1;
+        } else {
+            long v;
+            p = asm_number(a, p, &v);
+            asm_imm(a, v, size);
+        }
+        p = asm_skip(p);
+        if (*p != ',') break;
+        p++;
+    }
+    long len = a->sec[a->cur].len - start;
+    for (long t = 1; t < times; t++)
+        for (long i = 0; i < len; i++) asm_byte(a, a->sec[a->cur].buf[start + i]);
+    return p;
+}
 
-            // Look up array in symbol table
-            Symbol* sym = symtab_lookup_symbol(cg->symtab, arr_base->name);
-            if (sym && sym->type_name) {
-                char* type_name = sym->type_name;
+// Assemble NASM text: one statement per line, `label:` prefixes allowed
+void asm_text(Asm* a, const char* p) {
+    AsmOperand ops[3];
+    while (*p) {
+        a->line++;
+        const char* line = p;
+        p = strchr(p, '\n');
+        p = p ? p + 1 : line + strlen(line);
+        const char* c = asm_skip(line);
+        if (asm_eol(c)) continue;
+
+        const char* w = c;
+        while (asm_ident_char(*c)) c++;
+        if (c == w) asm_error(a, "syntax error");
+        if (*c == ':') {
+            asm_label(a, w, c - w);
+            c = asm_skip(c + 1);
+            if (asm_eol(c)) continue;
+            w = c;
+            while (asm_ident_char(*c)) c++;
+        }
+        int wlen = c - w;
+        c = asm_skip(c);
+
+        if (wlen == 7 && !memcmp(w, "section", 7)) {
+            const char* e = c;
+            while (!asm_eol(e) && *e != ' ' && *e != '\t') e++;
+            int len = e - c;
+            if (len == 5 && !memcmp(c, ".text", 5)) a->cur = SEC_TEXT;
+            else if (len == 14 && !memcmp(c, ".text.unlikely", 14)) a->cur = SEC_COLD;
+            else if (len == 5 && !memcmp(c, ".data", 5)) a->cur = SEC_DATA;
+            else if (len == 4 && !memcmp(c, ".bss", 4)) a->cur = SEC_BSS;
+            else asm_error(a, "unknown section '%.*s'", len, c);
+            continue;
+        }
+        // extern only declares: an undefined symbol is left to the linker
+        if (wlen == 6 && (!memcmp(w, "global", 6) || !memcmp(w, "extern", 6))) {
+            for (;;) {
+                const char* e = c;
+                while (asm_ident_char(*e)) e++;
+                if (e == c || *c == '.') asm_error(a, "bad %.6s", w);
+                int y = asm_sym(a, atom_intern(c, e - c));
+                if (w[0] == 'g') a->syms[y].global = 1;
+                c = asm_skip(e);
+                if (*c != ',') break;
+                c = asm_skip(c + 1);
+            }
+            continue;
+        }
+        long times = 1;
+        if (wlen == 5 && !memcmp(w, "times", 5)) {
+            c = asm_skip(asm_number(a, c, &times));
+            if (times < 0) asm_error(a, "negative times count");
+            w = c;
+            while (asm_ident_char(*c)) c++;
+            wlen = c - w;
+            c = asm_skip(c);
+        }
 
-                // Determine element size and struct type
-                int elem_size = 8;
-                char* struct_type = type_name;
+        Atom at = atom_intern(w, wlen);
+        if ((int)at >= asm_names_count || !asm_insn_of[at]) asm_error(a, "unknown instruction '%.*s'", wlen, w);
+        AsmInsn* in = &asm_insns[asm_insn_of[at] - 1];
+        if (in->cls == I_DATA) {
+            c = asm_data(a, c, in->a, times);
+        } else if (in->cls == I_RES) {
+            long count;
+            c = asm_skip(asm_number(a, c, &count));
+            if (count < 0) asm_error(a, "negative reserve count");
+            if (a->cur == SEC_BSS) a->sec[SEC_BSS].bss += count * in->a * times;
+            else for (long i = 0; i < count * in->a * times; i++) asm_byte(a, 0);
+        } else {
+            if (times != 1) asm_error(a, "times is only supported for data");
+            int n = 0;
+            while (!asm_eol(c)) {
+                if (n == 3) asm_error(a, "too many operands");
+                c = asm_operand(a, c, &ops[n++]);
+                if (*c == ',') c++;
+                else if (!asm_eol(c)) asm_error(a, "expected ','");
+            }
+            asm_insn(a, in, n, ops);
+        }
+        if (!asm_eol(c)) asm_error(a, "junk at end of line");
+    }
+}
 
-                // Check if it's a struct type
-                StructType* st = typetab_lookup(cg->types, type_name);
-                if (st) {
-                    elem_size = st->size;
-                    struct_type = type_name;
-                }
+// The end of the text: the last function's jumps go in, and the sections
+// have their final sizes
+void asm_finish(Asm* a) {
+    asm_end_scope(a);
+    for (int si = 0; si < SEC_COUNT; si++) a->sec[si].size = si == SEC_BSS ? a->sec[si].bss : a->sec[si].len;
+}
 
-                // Get field offset
-                int field_off = typetab_field_offset(cg->types, struct_type, field_name);
-                if (field_off >= 0) {
-                    emit(cg, "    pop rbx\n");  // Restore index
-                    emit(cg, "    ; Array element field assignment: %s[index].%s (elem_size=%d, offset %d)\n",
-                         arr_base->name, field_name, elem_size, field_off);
+// Apply the fixups whose targets have addresses now: all of them once the
+// writer has placed every section, or only same-section ones for a .o.
+// Returns the number left unresolved.
+int asm_resolve(Asm* a, int same_section_only) {
+    int left = 0;
+    for (int i = 0; i < a->nfix; i++) {
+        AsmFixup* f = &a->fix[i];
+        AsmSymbol* t = &a->syms[f->sym];
+        if (t->sec < 0 || (same_section_only && t->sec != f->sec)) {
+            a->fix[left++] = *f;
+            continue;
+        }
+        long v = a->sec[t->sec].addr + t->pos + f->addend - (a->sec[f->sec].addr + f->pos);
+        if (same_section_only) v = t->pos + f->addend - f->pos;
+        if (v != (int32_t)v) {
+            fprintf(stderr, "Assembler error: '%s' is out of rel32 range\n", atom_str(t->name));
+            exit(1);
+        }
+        memcpy(a->sec[f->sec].buf + f->pos, &(int32_t){v}, 4);
+    }
+    a->nfix = left;
+    return left;
+}
 
-                    // Calculate array element address
-                    if (elem_size > 1) {
-                        emit(cg, "    imul rbx, %d\n", elem_size);
-                    }
-                    emit(cg, "    lea rcx, [rbp%d+rbx]\n", sym->offset);  // rcx = address of array element
+// Symbol index of a global name, or -1 if the program does not define it
+int asm_lookup(Asm* a, const char* name) {
+    Atom atom = atom_intern(name, strlen(name));
+    int i = atom < a->sym_of_cap ? a->sym_of[atom] - 1 : -1;
+    return i >= 0 && a->syms[i].sec >= 0 ? i : -1;
+}
 
-                    // Add field offset
-                    if (field_off > 0) {
-                        emit(cg, "    add rcx, %d\n", field_off);
-                    }
+// A linked image must not reference anything it does not define
+void asm_check_defined(Asm* a) {
+    for (int i = 0; i < a->nsyms; i++) {
+        if (a->syms[i].sec < 0) {
+            fprintf(stderr, "Error: undefined symbol '%s'\n", atom_str(a->syms[i].name));
+            exit(1);
+        }
+    }
+}
 
-                    emit(cg, "    pop rax\n");  // Restore value
-                    emit(cg, "    mov [rcx], rax\n");  // Store value at field location
-                }
-            }
-        } else if (obj->name) {
-            // Simple struct field assignment: struct.field = value
-            // Look up struct object in symbol table
-            Symbol* sym = symtab_lookup_symbol(cg->symtab, obj->name);
-            if (sym && sym->type_name) {
-                // Get the actual struct type name (remove pointer if present)
-                char* struct_type = sym->type_name;
-                int is_pointer = 0;
-                if (struct_type[0] == '*') {
-                    struct_type = struct_type + 1;  // Skip the '*'
-                    is_pointer = 1;
-                }
+// ==== OUTPUT FILES ====
+// A new output, or one replacing a regular file, is written under a
+// temporary name in the destination's directory and renamed into place: a
+// concurrent reader never sees half a file, and replacing an executable
+// that is running does not hit ETXTBSY. Anything else at the path (a
+// device such as /dev/null, a FIFO, a symlink) is opened and written
+// directly, so it stays what it is; *tmp is then NULL.
+// mkstemp creates 0600 files; a replaced file keeps its mode, a new one
+// gets the usual mode minus the umask
+mode_t current_umask() {
+    static mode_t mask = (mode_t)-1;
+    if (mask == (mode_t)-1) {
+        mask = umask(022);
+        umask(mask);
+    }
+    return mask;
+}
 
-                // Get field offset
-                int field_off = typetab_field_offset(cg->types, struct_type, field_name);
-                if (field_off >= 0) {
-                    emit(cg, "    pop rcx\n");  // Restore value into rcx
-                    emit(cg, "    ; Field assignment: %s.%s (offset %d)\n", obj->name, field_name, field_off);
+FILE* output_open(const char* path, char** tmp) {
+    struct stat st;
+    FILE* f;
+    if (!lstat(path, &st) && !S_ISREG(st.st_mode)) {
+        *tmp = NULL;
+        f = fopen(path, "w");
+    } else {
+        *tmp = safe_realloc(NULL, strlen(path) + 8);
+        sprintf(*tmp, "%s.XXXXXX", path);
+        int fd = mkstemp(*tmp);
+        f = fd < 0 ? NULL : fdopen(fd, "w");
+    }
+    if (!f) {
+        fprintf(stderr, "Error: cannot write %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    return f;
+}
 
-                    if (is_pointer) {
-                        // For pointers: load pointer, add offset, store
-                        emit(cg, "    mov rbx, [rbp%d]\n", sym->offset);  // Load pointer
-                        if (field_off == 0) {
-                            emit(cg, "    mov [rbx], rcx\n");  // Store through pointer (no offset)
-                        } else {
-                            emit(cg, "    mov [rbx+%d], rcx\n", field_off);  // Store through pointer with offset
-                        }
-                    } else {
-                        // For direct structs: store directly
-                        emit(cg, "    mov [rbp%d], rcx\n", sym->offset + field_off);
-                    }
-                }
-            }
-        }
+void output_commit(FILE* f, char* tmp, const char* path, int mode) {
+    struct stat st;
+    int err = ferror(f);
+    if (tmp) {
+        mode = !lstat(path, &st) && S_ISREG(st.st_mode) ? st.st_mode & 07777 : mode & ~current_umask();
+        err |= fchmod(fileno(f), mode);
     }
+    err |= fclose(f);
+    if (err || (tmp && rename(tmp, path) < 0)) {
+        fprintf(stderr, "Error: cannot write %s: %s\n", path, strerror(errno));
+        if (tmp) unlink(tmp);
+        exit(1);
+    }
+    free(tmp);
 }
 
-void gen_stmt(Codegen* cg, AstNode* n);
+// Run an external tool and wait for it. Its output goes straight to ours;
+// returns 0 only if it ran and exited with status 0.
+extern char** environ;
 
-void gen_stmt(Codegen* cg, AstNode* n) {
-    if (!n) return;  // Null safety
-    if (n->type == AST_BLOCK) {
-        // Handle block statements (for 'for' loop desugaring)
-        for (int i = 0; i < n->child_count; i++) {
-            gen_stmt(cg, n->children[i]);
+int run_tool(char* const* argv) {
+    pid_t pid;
+    int err = posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ);
+    if (err) {
+        fprintf(stderr, "Error: cannot run %s: %s\n", argv[0], strerror(err));
+        return -1;
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            perror("waitpid");
+            return -1;
         }
-        return;
     }
-    if (n->type == AST_RETURN) {
-        if (n->child_count > 0) gen_expr(cg, n->children[0]);
-        else emit(cg, "    xor rax, rax\n");
-        emit(cg, "    leave\n    ret\n");
-    } else if (n->type == AST_LET) {
-        int size = 1;
-        char* type_name = NULL;
-
-        // Check if this is a typed array: let arr: [i32; 10];
-        if (n->struct_type && !strcmp(n->struct_type, "__array__")) {
-            // Calculate size based on element type and array count
-            int elem_size = 8;  // Default to 8 bytes
-            if (n->value) {
-                if (!strcmp(n->value, "i8") || !strcmp(n->value, "u8")) elem_size = 1;
-                else if (!strcmp(n->value, "i16")) elem_size = 2;
-                else if (!strcmp(n->value, "i32") || !strcmp(n->value, "u32")) elem_size = 4;
-                else if (!strcmp(n->value, "i64") || !strcmp(n->value, "u64")) elem_size = 8;
-            }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) return 0;
+    if (WIFEXITED(status)) fprintf(stderr, "Error: %s failed with exit status %d\n", argv[0], WEXITSTATUS(status));
+    else fprintf(stderr, "Error: %s killed by signal %d\n", argv[0], WTERMSIG(status));
+    return -1;
+}
 
-            int total_size = elem_size * n->array_size;
-            int off = symtab_add(cg->symtab, n->name, n->array_size);  // Use array_size as count
+// ==== ELF OUTPUT ====
+// Static executable (ld-style layout: headers and code in one R+X segment at
+// 0x400000, .data and .bss in an RW segment on the following pages) or a
+// relocatable object. Both carry a symbol table for debuggers.
+#define ELF_BASE 0x400000
 
-            // Store element type in symbol table for later use
-            if (cg->symtab && cg->symtab->count > 0) {
-                cg->symtab->symbols[cg->symtab->count - 1].type_name = n->value;  // Store element type
-            }
+const char* asm_sec_names[SEC_COUNT] = {".text", ".text.unlikely", ".data", ".bss"};
 
-            emit(cg, "    ; Array local: %s: [%s; %d] (%d bytes total)\n", n->name, n->value ? n->value : "i64", n->array_size, total_size);
+typedef struct {
+    uint8_t* buf;
+    long len, cap;
+    FILE* f;              // Written straight out instead when set
+} ElfBuf;
+
+long elf_put(ElfBuf* b, const void* p, long n) {
+    if (b->f) {
+        static const uint8_t zeros[4096];
+        if (p) fwrite(p, 1, n, b->f);
+        for (long k = 0; !p && k < n; k += sizeof(zeros))
+            fwrite(zeros, 1, n - k < (long)sizeof(zeros) ? n - k : (long)sizeof(zeros), b->f);
+        b->len += n;
+        return b->len - n;
+    }
+    while (b->len + n > b->cap) {
+        b->cap = b->cap ? b->cap * 2 : 65536;
+        b->buf = safe_realloc(b->buf, b->cap);
+    }
+    if (p) memcpy(b->buf + b->len, p, n);
+    else memset(b->buf + b->len, 0, n);
+    b->len += n;
+    return b->len - n;
+}
 
-            // If there's an initializer, generate it
-            if (n->child_count > 0) {
-                gen_expr(cg, n->children[0]);
-            }
-            return;
-        }
+// Zero-fill up to file offset `off`, then put n bytes there
+void elf_put_at(ElfBuf* b, long off, const void* p, long n) {
+    elf_put(b, NULL, off - b->len);
+    elf_put(b, p, n);
+}
 
-        // Check if this is a struct type: let p: Point;
-        if (n->struct_type && strcmp(n->struct_type, "__array__") != 0) {
-            StructType* st = typetab_lookup(cg->types, n->struct_type);
-            if (st) {
-                emit(cg, "    ; Struct local: %s: %s (%d bytes)\n", n->name, n->struct_type, st->size);
-                int off = symtab_add_struct(cg->symtab, n->name, n->struct_type, st->size);
+// File offset for `size` bytes aligned to `align` after *end, which moves past them
+long elf_place(long* end, long align, long size) {
+    long off = (*end + align - 1) & -align;
+    *end = off + size;
+    return off;
+}
 
-                // If there's an initializer (struct literal), generate it
-                if (n->child_count > 0) {
-                    gen_expr(cg, n->children[0]);
-                }
-                return;
-            }
+// Named, non-dotted symbols: locals first, as ELF wants. `first_shndx` is
+// the section header index of .text; sections follow in SEC_* order.
+// Returns the index of the first global.
+int elf_symbols(Asm* a, ElfBuf* symtab, ElfBuf* strtab, int first_shndx, int section_syms, int* index_of) {
+    Elf64_Sym sym;
+    memset(&sym, 0, sizeof(sym));
+    elf_put(symtab, &sym, sizeof(sym));
+    elf_put(strtab, "", 1);
+    int n = 1;
+    if (section_syms) {
+        for (int si = 0; si < SEC_COUNT; si++) {
+            memset(&sym, 0, sizeof(sym));
+            sym.st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+            sym.st_shndx = first_shndx + si;
+            elf_put(symtab, &sym, sizeof(sym));
+            n++;
         }
-
-        if (n->child_count > 0) {
-            if (n->children[0]->type == AST_ARRAY_LITERAL) {
-                size = n->children[0]->array_size;
-            } else if (n->children[0]->type == AST_STRUCT_LITERAL) {
-                type_name = n->children[0]->struct_type;
-                StructType* st = typetab_lookup(cg->types, type_name);
-                if (st) {
-                    int off = symtab_add_struct(cg->symtab, n->name, type_name, st->size);
-                    gen_expr(cg, n->children[0]);
-                    return;
-                }
-            }
+    }
+    int first_global = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1) first_global = n;
+        for (int i = 0; i < a->nsyms; i++) {
+            AsmSymbol* y = &a->syms[i];
+            int global = y->global || y->sec < 0;
+            if (y->dotted || global != pass) continue;
+            memset(&sym, 0, sizeof(sym));
+            sym.st_name = elf_put(strtab, atom_str(y->name), atom_tab[y->name].len + 1);
+            sym.st_info = ELF64_ST_INFO(global ? STB_GLOBAL : STB_LOCAL, STT_NOTYPE);
+            sym.st_shndx = y->sec < 0 ? SHN_UNDEF : first_shndx + y->sec;
+            sym.st_value = y->sec < 0 ? 0 : a->sec[y->sec].addr + y->pos;
+            elf_put(symtab, &sym, sizeof(sym));
+            if (index_of) index_of[i] = n;
+            n++;
         }
+    }
+    return first_global;
+}
 
-        // Check if pointer type
-        if (n->is_pointer) {
-            int off = symtab_add_pointer(cg->symtab, n->name);
+Elf64_Shdr elf_shdr(int name, int type, long flags, long addr, long off, long size, int link, int info, long align, long entsize) {
+    Elf64_Shdr sh;
+    memset(&sh, 0, sizeof(sh));
+    sh.sh_name = name;
+    sh.sh_type = type;
+    sh.sh_flags = flags;
+    sh.sh_addr = addr;
+    sh.sh_offset = off;
+    sh.sh_size = size;
+    sh.sh_link = link;
+    sh.sh_info = info;
+    sh.sh_addralign = align;
+    sh.sh_entsize = entsize;
+    return sh;
+}
 
-            // Store type name for element size calculation
-            if (n->value && cg->symtab && cg->symtab->count > 0) {
-                // Build type_name as "*BaseType"
-                char* type_buf = malloc(strlen(n->value) + 2);
-                sprintf(type_buf, "*%s", n->value);
-                cg->symtab->symbols[cg->symtab->count - 1].type_name = type_buf;
-            }
+long elf_sec_flags(int si) {
+    return si == SEC_TEXT || si == SEC_COLD ? SHF_ALLOC | SHF_EXECINSTR : SHF_ALLOC | SHF_WRITE;
+}
 
-            if (n->child_count > 0) {
-                gen_expr(cg, n->children[0]);
-                emit(cg, "    mov [rbp%d], rax\n", off);
-            }
-            return;
-        }
+Elf64_Ehdr elf_header(int type) {
+    Elf64_Ehdr eh;
+    memset(&eh, 0, sizeof(eh));
+    memcpy(eh.e_ident, ELFMAG, SELFMAG);
+    eh.e_ident[EI_CLASS] = ELFCLASS64;
+    eh.e_ident[EI_DATA] = ELFDATA2LSB;
+    eh.e_ident[EI_VERSION] = EV_CURRENT;
+    eh.e_type = type;
+    eh.e_machine = EM_X86_64;
+    eh.e_version = EV_CURRENT;
+    eh.e_ehsize = sizeof(Elf64_Ehdr);
+    eh.e_shentsize = sizeof(Elf64_Shdr);
+    return eh;
+}
 
-        int off = symtab_add(cg->symtab, n->name, size);
-        if (n->child_count > 0) {
-            gen_expr(cg, n->children[0]);
-            if (n->children[0]->type != AST_ARRAY_LITERAL) {
-                emit(cg, "    mov [rbp%d], rax\n", off);
+// The file is laid out first and then written front to back, section by
+// section, so it is never held whole in memory and may go to a pipe
+void elf_write_exec(Asm* a, const char* path) {
+    Elf64_Ehdr eh = elf_header(ET_EXEC);
+    Elf64_Phdr ph[2];
+    memset(ph, 0, sizeof(ph));
+
+    // Lay out the file; section addresses follow from the offsets
+    long end = sizeof(eh) + sizeof(ph), off[SEC_COUNT];
+    for (int si = SEC_TEXT; si <= SEC_COLD; si++) {
+        off[si] = elf_place(&end, 16, a->sec[si].size);
+        a->sec[si].addr = ELF_BASE + off[si];
+    }
+    long text_end = end;
+    long data_page = ELF_BASE + ((text_end + 0xfff) & ~0xfffL);
+    off[SEC_DATA] = elf_place(&end, 16, a->sec[SEC_DATA].size);
+    a->sec[SEC_DATA].addr = data_page + (off[SEC_DATA] & 0xfff);
+    a->sec[SEC_BSS].addr = (a->sec[SEC_DATA].addr + a->sec[SEC_DATA].size + 15) & ~15L;
+    off[SEC_BSS] = end;
+
+    asm_check_defined(a);
+    asm_resolve(a, 0);
+
+    int start_sym = asm_lookup(a, "_start");
+    if (start_sym < 0) {
+        fprintf(stderr, "Error: no _start symbol\n");
+        exit(1);
+    }
+    eh.e_entry = a->sec[a->syms[start_sym].sec].addr + a->syms[start_sym].pos;
+
+    ph[0].p_type = PT_LOAD;
+    ph[0].p_flags = PF_R | PF_X;
+    ph[0].p_vaddr = ph[0].p_paddr = ELF_BASE;
+    ph[0].p_filesz = ph[0].p_memsz = text_end;
+    ph[0].p_align = 0x1000;
+    ph[1].p_type = PT_LOAD;
+    ph[1].p_flags = PF_R | PF_W;
+    ph[1].p_offset = off[SEC_DATA];
+    ph[1].p_vaddr = ph[1].p_paddr = a->sec[SEC_DATA].addr;
+    ph[1].p_filesz = a->sec[SEC_DATA].size;
+    ph[1].p_memsz = a->sec[SEC_BSS].addr + a->sec[SEC_BSS].size - a->sec[SEC_DATA].addr;
+    ph[1].p_align = 0x1000;
+
+    // Symbols and section headers
+    ElfBuf symtab = {0}, strtab = {0}, shstr = {0};
+    elf_put(&shstr, "", 1);
+    int first_global = elf_symbols(a, &symtab, &strtab, 1, 0, NULL);
+    Elf64_Shdr sh[SEC_COUNT + 4];
+    memset(&sh[0], 0, sizeof(sh[0]));
+    for (int si = 0; si < SEC_COUNT; si++) {
+        int name = elf_put(&shstr, asm_sec_names[si], strlen(asm_sec_names[si]) + 1);
+        sh[1 + si] = elf_shdr(name, si == SEC_BSS ? SHT_NOBITS : SHT_PROGBITS, elf_sec_flags(si),
+                              a->sec[si].addr, off[si], a->sec[si].size, 0, 0, 16, 0);
+    }
+    int n = 1 + SEC_COUNT;
+    sh[n] = elf_shdr(elf_put(&shstr, ".symtab", 8), SHT_SYMTAB, 0, 0,
+                     elf_place(&end, 8, symtab.len), symtab.len, n + 1, first_global, 8, sizeof(Elf64_Sym));
+    n++;
+    sh[n] = elf_shdr(elf_put(&shstr, ".strtab", 8), SHT_STRTAB, 0, 0,
+                     elf_place(&end, 1, strtab.len), strtab.len, 0, 0, 1, 0);
+    n++;
+    int shstr_name = elf_put(&shstr, ".shstrtab", 10);
+    sh[n] = elf_shdr(shstr_name, SHT_STRTAB, 0, 0, elf_place(&end, 1, shstr.len), shstr.len, 0, 0, 1, 0);
+    n++;
+    eh.e_shoff = elf_place(&end, 8, sizeof(Elf64_Shdr) * n);
+    eh.e_shnum = n;
+    eh.e_shstrndx = n - 1;
+    eh.e_phoff = sizeof(eh);
+    eh.e_phentsize = sizeof(Elf64_Phdr);
+    eh.e_phnum = 2;
+
+    char* tmp;
+    ElfBuf b = {0};
+    b.f = output_open(path, &tmp);
+    elf_put(&b, &eh, sizeof(eh));
+    elf_put(&b, ph, sizeof(ph));
+    for (int si = SEC_TEXT; si <= SEC_DATA; si++) elf_put_at(&b, off[si], a->sec[si].buf, a->sec[si].size);
+    elf_put_at(&b, sh[1 + SEC_COUNT].sh_offset, symtab.buf, symtab.len);
+    elf_put_at(&b, sh[2 + SEC_COUNT].sh_offset, strtab.buf, strtab.len);
+    elf_put_at(&b, sh[3 + SEC_COUNT].sh_offset, shstr.buf, shstr.len);
+    elf_put_at(&b, eh.e_shoff, sh, sizeof(Elf64_Shdr) * n);
+    output_commit(b.f, tmp, path, 0755);
+    free(symtab.buf);
+    free(strtab.buf);
+    free(shstr.buf);
+}
+
+void elf_write_obj(Asm* a, const char* path) {
+    for (int si = 0; si < SEC_COUNT; si++) a->sec[si].addr = 0;
+    asm_resolve(a, 1);
+
+    Elf64_Ehdr eh = elf_header(ET_REL);
+    long end = sizeof(eh);
+    ElfBuf symtab = {0}, strtab = {0}, shstr = {0}, rela[2] = {{0}};
+    elf_put(&shstr, "", 1);
+    int* index_of = calloc(a->nsyms + 1, sizeof(int));
+    int first_global = elf_symbols(a, &symtab, &strtab, 1, 1, index_of);
+
+    // Section headers: null, the four sections, two .rela, symtab, strtab, shstrtab
+    Elf64_Shdr sh[SEC_COUNT + 6];
+    memset(&sh[0], 0, sizeof(sh[0]));
+    for (int si = 0; si < SEC_COUNT; si++) {
+        long off = elf_place(&end, 16, si == SEC_BSS ? 0 : a->sec[si].size);
+        int name = elf_put(&shstr, asm_sec_names[si], strlen(asm_sec_names[si]) + 1);
+        sh[1 + si] = elf_shdr(name, si == SEC_BSS ? SHT_NOBITS : SHT_PROGBITS, elf_sec_flags(si),
+                              0, off, a->sec[si].size, 0, 0, 16, 0);
+    }
+    int symtab_ndx = 1 + SEC_COUNT + 2;
+    for (int si = SEC_TEXT; si <= SEC_COLD; si++) {
+        for (int i = 0; i < a->nfix; i++) {
+            AsmFixup* f = &a->fix[i];
+            if (f->sec != si) continue;
+            AsmSymbol* t = &a->syms[f->sym];
+            Elf64_Rela r;
+            r.r_offset = f->pos;
+            if (t->sec >= 0 && !t->global) {
+                r.r_info = ELF64_R_INFO(1 + t->sec, R_X86_64_PC32);  // Section symbol
+                r.r_addend = t->pos + f->addend;
+            } else {
+                r.r_info = ELF64_R_INFO(index_of[f->sym], R_X86_64_PC32);
+                r.r_addend = f->addend;
             }
+            elf_put(&rela[si], &r, sizeof(r));
         }
-    } else if (n->type == AST_IF) {
-        int else_lab = new_label(cg);
-        int end_lab = new_label(cg);
-        gen_expr(cg, n->children[0]);
-        emit(cg, "    test rax, rax\n    jz .L%d\n", else_lab);
-        for (int i = 0; i < n->children[1]->child_count; i++)
-            gen_stmt(cg, n->children[1]->children[i]);
-        emit(cg, "    jmp .L%d\n.L%d:\n", end_lab, else_lab);
-        if (n->child_count > 2) {
-            for (int i = 0; i < n->children[2]->child_count; i++)
-                gen_stmt(cg, n->children[2]->children[i]);
-        }
-        emit(cg, ".L%d:\n", end_lab);
-    } else if (n->type == AST_WHILE) {
-        int start_lab = new_label(cg);
-        int end_lab = new_label(cg);
-        emit(cg, ".L%d:\n", start_lab);
-        gen_expr(cg, n->children[0]);
-        emit(cg, "    test rax, rax\n    jz .L%d\n", end_lab);
-        for (int i = 0; i < n->children[1]->child_count; i++)
-            gen_stmt(cg, n->children[1]->children[i]);
-        emit(cg, "    jmp .L%d\n.L%d:\n", start_lab, end_lab);
-    } else if (n->type == AST_CALL || n->type == AST_ASSIGN || n->type == AST_ARRAY_ASSIGN || n->type == AST_FIELD_ASSIGN) {
-        gen_expr(cg, n);
+        char name[32];
+        snprintf(name, sizeof(name), ".rela%s", asm_sec_names[si]);
+        sh[1 + SEC_COUNT + si] = elf_shdr(elf_put(&shstr, name, strlen(name) + 1), SHT_RELA, SHF_INFO_LINK,
+                                          0, elf_place(&end, 8, rela[si].len), rela[si].len, symtab_ndx, 1 + si,
+                                          8, sizeof(Elf64_Rela));
     }
+    sh[symtab_ndx] = elf_shdr(elf_put(&shstr, ".symtab", 8), SHT_SYMTAB, 0, 0,
+                              elf_place(&end, 8, symtab.len), symtab.len, symtab_ndx + 1, first_global,
+                              8, sizeof(Elf64_Sym));
+    sh[symtab_ndx + 1] = elf_shdr(elf_put(&shstr, ".strtab", 8), SHT_STRTAB, 0, 0,
+                                  elf_place(&end, 1, strtab.len), strtab.len, 0, 0, 1, 0);
+    int shstr_name = elf_put(&shstr, ".shstrtab", 10);
+    sh[symtab_ndx + 2] = elf_shdr(shstr_name, SHT_STRTAB, 0, 0, elf_place(&end, 1, shstr.len),
+                                  shstr.len, 0, 0, 1, 0);
+    eh.e_shoff = elf_place(&end, 8, sizeof(sh));
+    eh.e_shnum = symtab_ndx + 3;
+    eh.e_shstrndx = symtab_ndx + 2;
+
+    char* tmp;
+    ElfBuf b = {0};
+    b.f = output_open(path, &tmp);
+    elf_put(&b, &eh, sizeof(eh));
+    for (int si = SEC_TEXT; si <= SEC_DATA; si++) elf_put_at(&b, sh[1 + si].sh_offset, a->sec[si].buf, a->sec[si].size);
+    for (int si = SEC_TEXT; si <= SEC_COLD; si++) elf_put_at(&b, sh[1 + SEC_COUNT + si].sh_offset, rela[si].buf, rela[si].len);
+    elf_put_at(&b, sh[symtab_ndx].sh_offset, symtab.buf, symtab.len);
+    elf_put_at(&b, sh[symtab_ndx + 1].sh_offset, strtab.buf, strtab.len);
+    elf_put_at(&b, sh[symtab_ndx + 2].sh_offset, shstr.buf, shstr.len);
+    elf_put_at(&b, eh.e_shoff, sh, sizeof(sh));
+    output_commit(b.f, tmp, path, 0644);
+    free(index_of);
+    free(rela[0].buf);
+    free(rela[1].buf);
+    free(symtab.buf);
+    free(strtab.buf);
+    free(shstr.buf);
 }
 
-void gen_func(Codegen* cg, AstNode* n) {
-    if (!n || !n->name) return;  // Null safety
-    emit(cg, "\n%s:\n", n->name);
-    emit(cg, "    push rbp\n    mov rbp, rsp\n");
-
-    int param_count = n->child_count - 1;
-    const char* regs[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+// ==== MODULE LINKING ====
+// An executable (or --run) takes in the objects of the modules it imports
+// before layout: each object section is appended to ours, the object's
+// global symbols become ours, and its relocations become fixups. What
+// elf_write_obj writes is understood: the four sections, rel32
+// relocations, section and global symbols.
+int module_link_count;
+
+void module_link_object(Asm* a, const char* path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Error: cannot read module object %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    long size = st.st_size;
+    uint8_t* buf = mmap(NULL, size ? size : 1, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    Elf64_Ehdr* eh = (Elf64_Ehdr*)buf;
+    if (buf == MAP_FAILED || size < (long)sizeof(*eh) || memcmp(eh->e_ident, ELFMAG, SELFMAG) ||
+        eh->e_ident[EI_CLASS] != ELFCLASS64 || eh->e_type != ET_REL || eh->e_machine != EM_X86_64 ||
+        eh->e_shentsize != sizeof(Elf64_Shdr) || eh->e_shoff > (uint64_t)size ||
+        eh->e_shnum > (size - eh->e_shoff) / sizeof(Elf64_Shdr) || eh->e_shstrndx >= eh->e_shnum) {
+        fprintf(stderr, "Error: %s is not an x86-64 relocatable object\n", path);
+        exit(1);
+    }
+    Elf64_Shdr* sh = (Elf64_Shdr*)(buf + eh->e_shoff);
+    for (int k = 0; k < eh->e_shnum; k++) {
+        if (sh[k].sh_type != SHT_NOBITS && (sh[k].sh_offset > (uint64_t)size || sh[k].sh_size > size - sh[k].sh_offset)) {
+            fprintf(stderr, "Error: %s: section %d lies outside the file\n", path, k);
+            exit(1);
+        }
+    }
+    const char* shstr = (const char*)buf + sh[eh->e_shstrndx].sh_offset;
+
+    // Place the sections; a dotted symbol marks where each one starts
+    int* anchor = safe_realloc(NULL, sizeof(int) * eh->e_shnum);
+    Elf64_Shdr* symsec = NULL;
+    for (int k = 0; k < eh->e_shnum; k++) {
+        anchor[k] = -1;
+        if (sh[k].sh_type == SHT_SYMTAB) symsec = &sh[k];
+        if (!(sh[k].sh_flags & SHF_ALLOC)) continue;
+        int si = 0;
+        while (si < SEC_COUNT && strcmp(shstr + sh[k].sh_name, asm_sec_names[si])) si++;
+        if (si == SEC_COUNT || (si == SEC_BSS) != (sh[k].sh_type == SHT_NOBITS)) {
+            if (!sh[k].sh_size) continue;
+            fprintf(stderr, "Error: %s: unsupported section '%s'\n", path, shstr + sh[k].sh_name);
+            exit(1);
+        }
+        AsmSection* s = &a->sec[si];
+        long align = sh[k].sh_addralign > 1 ? sh[k].sh_addralign : 1;
+        long pos;
+        a->cur = si;
+        if (si == SEC_BSS) {
+            s->bss = (s->bss + align - 1) / align * align;
+            pos = s->bss;
+            s->bss += sh[k].sh_size;
+        } else {
+            while (s->len % align) asm_byte(a, si == SEC_DATA ? 0 : 0x90);
+            pos = s->len;
+            asm_bytes(a, buf + sh[k].sh_offset, sh[k].sh_size);
+        }
+        char name[32];
+        snprintf(name, sizeof(name), ".module%d.%d", module_link_count, k);
+        anchor[k] = asm_sym(a, atom_intern(name, strlen(name)));
+        a->syms[anchor[k]] = (AsmSymbol){a->syms[anchor[k]].name, si, 0, 1, pos};
+    }
+    module_link_count++;
+    if (!symsec || symsec->sh_link >= eh->e_shnum) {
+        fprintf(stderr, "Error: %s has no symbol table\n", path);
+        exit(1);
+    }
 
-    SymbolTable* old_symtab = cg->symtab;
-    cg->symtab = symtab_new();
+    // Object symbol -> our symbol plus an offset from it
+    Elf64_Sym* syms = (Elf64_Sym*)(buf + symsec->sh_offset);
+    long nsyms = symsec->sh_size / sizeof(Elf64_Sym);
+    const char* strtab = (const char*)buf + sh[symsec->sh_link].sh_offset;
+    int* sym_of = safe_realloc(NULL, sizeof(int) * (nsyms + 1));
+    long* sym_add = safe_realloc(NULL, sizeof(long) * (nsyms + 1));
+    for (long j = 0; j < nsyms; j++) {
+        Elf64_Sym* y = &syms[j];
+        int bind = ELF64_ST_BIND(y->st_info);
+        const char* name = strtab + y->st_name;
+        sym_of[j] = -1;
+        sym_add[j] = 0;
+        if (j == 0) continue;
+        if (y->st_shndx != SHN_UNDEF && (y->st_shndx >= eh->e_shnum || anchor[y->st_shndx] < 0)) {
+            if (bind == STB_LOCAL) continue;
+            fprintf(stderr, "Error: %s: symbol '%s' is in an unsupported section\n", path, name);
+            exit(1);
+        }
+        if (bind == STB_LOCAL) {
+            if (y->st_shndx == SHN_UNDEF) continue;
+            sym_of[j] = anchor[y->st_shndx];
+            sym_add[j] = y->st_value;
+            continue;
+        }
+        sym_of[j] = asm_sym(a, atom_intern(name, strlen(name)));
+        if (y->st_shndx == SHN_UNDEF) continue;
+        AsmSymbol* def = &a->syms[sym_of[j]];
+        if (def->sec >= 0) {
+            fprintf(stderr, "Error: '%s' in %s is already defined\n", name, path);
+            exit(1);
+        }
+        AsmSymbol* at = &a->syms[anchor[y->st_shndx]];
+        def->sec = at->sec;
+        def->global = 1;
+        def->pos = at->pos + y->st_value;
+    }
 
-    for (int i = 0; i < param_count && i < 6; i++) {
-        int off;
-        if (n->children[i]->is_pointer) {
-            off = symtab_add_pointer(cg->symtab, n->children[i]->name);
-            // Set the type_name for pointer parameters (needed for struct field access)
-            if (n->children[i]->value && cg->symtab && cg->symtab->count > 0) {
-                char* type_with_ptr = malloc(strlen(n->children[i]->value) + 2);
-                sprintf(type_with_ptr, "*%s", n->children[i]->value);
-                cg->symtab->symbols[cg->symtab->count - 1].type_name = type_with_ptr;
+    for (int k = 0; k < eh->e_shnum; k++) {
+        if (sh[k].sh_type != SHT_RELA && sh[k].sh_type != SHT_REL) continue;
+        if (sh[k].sh_info >= eh->e_shnum || anchor[sh[k].sh_info] < 0) continue;
+        if (sh[k].sh_type == SHT_REL || &sh[sh[k].sh_link] != symsec) {
+            fprintf(stderr, "Error: %s: unsupported relocation section '%s'\n", path, shstr + sh[k].sh_name);
+            exit(1);
+        }
+        AsmSymbol* at = &a->syms[anchor[sh[k].sh_info]];
+        Elf64_Rela* rel = (Elf64_Rela*)(buf + sh[k].sh_offset);
+        for (long r = 0; r < (long)(sh[k].sh_size / sizeof(Elf64_Rela)); r++) {
+            long type = ELF64_R_TYPE(rel[r].r_info);
+            long sym = ELF64_R_SYM(rel[r].r_info);
+            if ((type != R_X86_64_PC32 && type != R_X86_64_PLT32) || sym <= 0 || sym >= nsyms || sym_of[sym] < 0) {
+                fprintf(stderr, "Error: %s: unsupported relocation (type %ld); "
+                        "build modules with the built-in assembler\n", path, type);
+                exit(1);
             }
-        } else {
-            off = symtab_add(cg->symtab, n->children[i]->name, 1);
-            // Set the type_name for non-pointer parameters
-            if (n->children[i]->value && cg->symtab && cg->symtab->count > 0) {
-                cg->symtab->symbols[cg->symtab->count - 1].type_name = strdup(n->children[i]->value);
+            if (a->nfix == a->fixcap) {
+                a->fixcap = a->fixcap ? a->fixcap * 2 : 256;
+                a->fix = safe_realloc(a->fix, sizeof(AsmFixup) * a->fixcap);
             }
+            a->fix[a->nfix++] = (AsmFixup){at->sec, at->pos + (long)rel[r].r_offset, 0,
+                                           sym_of[sym], rel[r].r_addend + sym_add[sym]};
         }
-        emit(cg, "    mov [rbp%d], %s\n", off, regs[i]);
     }
+    free(anchor);
+    free(sym_of);
+    free(sym_add);
+    munmap(buf, size ? size : 1);
+}
 
-    // Allocate stack space based on actual usage (aligned to 16 bytes)
-    int stack_size = cg->symtab->stack_size;
-    // Add 1024 bytes for temporary operations (print_int buffer, debug code, etc.)
-    stack_size += 1024;
-    // Align to 16 bytes (required by x86-64 ABI)
-    stack_size = ((stack_size + 15) / 16) * 16;
-    if (stack_size > 0) {
-        emit(cg, "    sub rsp, %d\n", stack_size);
+// Objects of every imported module, into the program being assembled once
+// its last function is finished
+void module_link(Asm* a) {
+    asm_end_scope(a);
+    for (int i = 0; i < modules.count; i++) module_link_object(a, modules.mods[i].obj);
+    a->cur = SEC_TEXT;
+}
+
+// ==== JIT ====
+// --run: load the assembled sections into one anonymous mapping (code first,
+// then .data/.bss on the next page, so every rel32 reaches) and enter main
+// the way _start does. Nothing is written to disk.
+void jit_run(Asm* a) {
+    asm_check_defined(a);
+    int main_sym = asm_lookup(a, "main");
+    if (main_sym < 0) {
+        fprintf(stderr, "Error: no main function\n");
+        exit(1);
     }
 
-    AstNode* body = n->children[param_count];
-    for (int i = 0; i < body->child_count; i++)
-        gen_stmt(cg, body->children[i]);
+    long page = sysconf(_SC_PAGESIZE);
+    long code_size = 0;
+    for (int si = SEC_TEXT; si <= SEC_COLD; si++)
+        code_size = ((code_size + 15) & ~15L) + a->sec[si].size;
+    code_size = (code_size + page - 1) & ~(page - 1);
+    long data_size = ((a->sec[SEC_DATA].size + 15) & ~15L) + a->sec[SEC_BSS].size;
+    data_size = (data_size + page - 1) & ~(page - 1);
+    uint8_t* base = mmap(NULL, code_size + data_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
 
-    emit(cg, "    xor rax, rax\n    leave\n    ret\n");
+    long off = 0;
+    for (int si = SEC_TEXT; si <= SEC_COLD; si++) {
+        off = (off + 15) & ~15L;
+        a->sec[si].addr = (long)base + off;
+        off += a->sec[si].size;
+    }
+    a->sec[SEC_DATA].addr = (long)base + code_size;
+    a->sec[SEC_BSS].addr = (a->sec[SEC_DATA].addr + a->sec[SEC_DATA].size + 15) & ~15L;
+    asm_resolve(a, 0);
+    for (int si = SEC_TEXT; si <= SEC_DATA; si++)
+        memcpy((void*)a->sec[si].addr, a->sec[si].buf, a->sec[si].size);
+    if (mprotect(base, code_size, PROT_READ | PROT_EXEC) < 0) {
+        perror("mprotect");
+        exit(1);
+    }
 
-    cg->symtab = old_symtab;
+    // Same as _start: aligned stack, call main, exit with its return value.
+    // The generated code does not preserve callee-saved registers, so there
+    // is no coming back to C; flush anything stdio still holds first.
+    void* entry = (void*)(a->sec[a->syms[main_sym].sec].addr + a->syms[main_sym].pos);
+    fflush(NULL);
+    __asm__ volatile("and $-16, %%rsp\n\t"
+                     "call *%0\n\t"
+                     "mov %%rax, %%rdi\n\t"
+                     "mov $60, %%eax\n\t"
+                     "syscall"
+                     : : "r"(entry) : "memory");
+    __builtin_unreachable();
 }
 
-void gen_helpers(Codegen* cg) {
-    emit(cg, "\n__print_int:\n");
-    emit(cg, "    push rbp\n    mov rbp, rsp\n");
-    emit(cg, "    sub rsp, 32\n");
-
-    emit(cg, "    mov rbx, rax\n");
-    emit(cg, "    test rbx, rbx\n");
-    emit(cg, "    jns .positive\n");
-    emit(cg, "    neg rbx\n");
-    emit(cg, "    push rbx\n");
-    emit(cg, "    mov byte [rbp-1], 45\n");
-    emit(cg, "    lea rsi, [rbp-1]\n");
-    emit(cg, "    mov rdi, 1\n    mov rdx, 1\n    mov rax, 1\n    syscall\n");
-    emit(cg, "    pop rbx\n");
-
-    emit(cg, ".positive:\n");
-    emit(cg, "    lea rdi, [rbp-32]\n");
-    emit(cg, "    mov rax, rbx\n");
-    emit(cg, "    mov rcx, 10\n");
-
-    emit(cg, ".loop:\n");
-    emit(cg, "    xor rdx, rdx\n");
-    emit(cg, "    div rcx\n");
-    emit(cg, "    add dl, 48\n");
-    emit(cg, "    mov [rdi], dl\n");
-    emit(cg, "    inc rdi\n");
-    emit(cg, "    test rax, rax\n");
-    emit(cg, "    jnz .loop\n");
-
-    emit(cg, "    mov r8, rdi\n");
-    emit(cg, "    dec rdi\n");
-    emit(cg, ".print_loop:\n");
-    emit(cg, "    lea rax, [rbp-32]\n");
-    emit(cg, "    cmp rdi, rax\n");
-    emit(cg, "    jl .done\n");
-    emit(cg, "    push rdi\n");
-    emit(cg, "    mov rsi, rdi\n");
-    emit(cg, "    mov rdi, 1\n    mov rdx, 1\n    mov rax, 1\n    syscall\n");
-    emit(cg, "    pop rdi\n");
-    emit(cg, "    dec rdi\n");
-    emit(cg, "    jmp .print_loop\n");
-
-    emit(cg, ".done:\n");
-    emit(cg, "    leave\n    ret\n");
-
-    // __strcmp: Compare two strings
-    // Input: rdi = s1, rsi = s2
-    // Output: rax = 0 if equal, -1 if s1 < s2, 1 if s1 > s2
-    emit(cg, "\n__strcmp:\n");
-    emit(cg, "    push rbp\n    mov rbp, rsp\n");
-    emit(cg, ".strcmp_loop:\n");
-    emit(cg, "    mov al, [rdi]\n");
-    emit(cg, "    mov bl, [rsi]\n");
-    emit(cg, "    cmp al, bl\n");
-    emit(cg, "    jne .strcmp_diff\n");
-    emit(cg, "    test al, al\n");
-    emit(cg, "    jz .strcmp_equal\n");
-    emit(cg, "    inc rdi\n");
-    emit(cg, "    inc rsi\n");
-    emit(cg, "    jmp .strcmp_loop\n");
-    emit(cg, ".strcmp_equal:\n");
-    emit(cg, "    xor rax, rax\n");
-    emit(cg, "    leave\n    ret\n");
-    emit(cg, ".strcmp_diff:\n");
-    emit(cg, "    movzx rax, al\n");
-    emit(cg, "    movzx rbx, bl\n");
-    emit(cg, "    sub rax, rbx\n");
-    emit(cg, "    leave\n    ret\n");
-
-    // __strcpy: Copy string from src to dest
-    // Input: rdi = dest, rsi = src
-    // Output: rax = dest
-    emit(cg, "\n__strcpy:\n");
-    emit(cg, "    push rbp\n    mov rbp, rsp\n");
-    emit(cg, "    mov rax, rdi\n");  // Save dest for return
-    emit(cg, ".strcpy_loop:\n");
-    emit(cg, "    mov bl, [rsi]\n");
-    emit(cg, "    mov [rdi], bl\n");
-    emit(cg, "    test bl, bl\n");
-    emit(cg, "    jz .strcpy_done\n");
-    emit(cg, "    inc rdi\n");
-    emit(cg, "    inc rsi\n");
-    emit(cg, "    jmp .strcpy_loop\n");
-    emit(cg, ".strcpy_done:\n");
-    emit(cg, "    leave\n    ret\n");
-
-    // __strlen: Get string length
-    // Input: rdi = s
-    // Output: rax = length
-    emit(cg, "\n__strlen:\n");
-    emit(cg, "    push rbp\n    mov rbp, rsp\n");
-    emit(cg, "    xor rax, rax\n");
-    emit(cg, ".strlen_loop:\n");
-    emit(cg, "    cmp byte [rdi+rax], 0\n");
-    emit(cg, "    jz .strlen_done\n");
-    emit(cg, "    inc rax\n");
-    emit(cg, "    jmp .strlen_loop\n");
-    emit(cg, ".strlen_done:\n");
-    emit(cg, "    leave\n    ret\n");
-}
-
-void build_type_table(TypeTable* tt, AstNode* ast) {
-    for (int i = 0; i < ast->child_count; i++) {
-        if (ast->children[i]->type == AST_STRUCT_DEF) {
-            AstNode* struct_def = ast->children[i];
-            typetab_add(tt, struct_def->name);
-
-            for (int j = 0; j < struct_def->child_count; j++) {
-                AstNode* field = struct_def->children[j];
-                // field->name = field name
-                // field->value = base type (e.g., "i64", "Token")
-                // field->is_pointer = 1 if pointer type
-                char* field_type = field->value;
-                int is_ptr = field->is_pointer;
+// ==== TIME REPORT ====
+// -ftime-report: wall and CPU time, allocations and sizes per phase.
+// phase_begin() closes the running phase and charges it; CPU time of the
+// children (nasm, ld) is charged to the phase that waited for them.
+double phase_wall0, phase_cpu0;
+
+double cpu_sec() {
+    struct rusage self, kids;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &kids);
+    return self.ru_utime.tv_sec + self.ru_stime.tv_sec + kids.ru_utime.tv_sec + kids.ru_stime.tv_sec +
+           (self.ru_utime.tv_usec + self.ru_stime.tv_usec + kids.ru_utime.tv_usec + kids.ru_stime.tv_usec) * 1e-6;
+}
 
-                // Build full type name for pointer types (e.g., "*Token")
-                char* full_type = NULL;
-                if (is_ptr && field_type) {
-                    full_type = malloc(strlen(field_type) + 2);
-                    sprintf(full_type, "*%s", field_type);
-                } else if (field_type) {
-                    full_type = strdup(field_type);
-                }
+void phase_begin(CompilePhase next) {
+    double wall = now_sec(), cpu = cpu_sec();
+    PhaseStats* s = &phase_stats[compile_phase];
+    if (phase_wall0) {
+        s->wall += wall - phase_wall0;
+        s->cpu += cpu - phase_cpu0;
+        s->entered = 1;
+    }
+    phase_wall0 = wall;
+    phase_cpu0 = cpu;
+    compile_phase = next;
+}
 
-                typetab_add_field(tt, struct_def->name, field->name, full_type, is_ptr);
+long peak_rss_kb() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
 
-                if (full_type) free(full_type);
-            }
-        }
+// Functions and the local symbols they declare (parameters and lets)
+void count_locals(Node prog) {
+    CompileCounts* c = &compile_counts;
+    for (int i = 0; i < ast.nkids[prog]; i++) {
+        Node fn = ast_child(prog, i);
+        if (ast.kind[fn] != AST_FUNCTION || ast_decl(fn)->is_forward_decl) continue;
+        long lets = 0;
+        for (Node n = ast.kids[fn], end = program_item_end(prog, i); n < end; n++)
+            lets += ast.kind[n] == AST_LET;
+        long locals = ast.nkids[fn] - 1 + lets;
+        c->functions++;
+        c->params += ast.nkids[fn] - 1;
+        c->lets += lets;
+        if (locals > c->max_locals) c->max_locals = locals;
     }
 }
 
-void codegen(AstNode* ast, const char* file, StringTable* strtab, TypeTable* types) {
-    Codegen cg;
-    cg.out = NULL;
-    cg.label_count = 0;
-    cg.symtab = NULL;
-    cg.strtab = strtab;
-    cg.types = types;
-    cg.code_buf = NULL;
-    cg.code_len = 0;
-    cg.code_cap = 0;
+void time_report_text(FILE* f) {
+    CompileCounts* c = &compile_counts;
+    PhaseStats total = {0};
+    fprintf(f, "Time report:\n");
+    fprintf(f, "  %-10s %10s %10s %10s %12s\n", "phase", "wall ms", "cpu ms", "allocs", "alloc KB");
+    for (int ph = 0; ph < PHASE_COUNT; ph++) {
+        PhaseStats* s = &phase_stats[ph];
+        if (!s->entered) continue;
+        fprintf(f, "  %-10s %10.3f %10.3f %10ld %12.1f\n", phase_names[ph], s->wall * 1e3, s->cpu * 1e3,
+                s->allocs, s->alloc_bytes / 1024.0);
+        total.wall += s->wall;
+        total.cpu += s->cpu;
+        total.allocs += s->allocs;
+        total.alloc_bytes += s->alloc_bytes;
+    }
+    fprintf(f, "  %-10s %10.3f %10.3f %10ld %12.1f\n", "total", total.wall * 1e3, total.cpu * 1e3,
+            total.allocs, total.alloc_bytes / 1024.0);
+    fprintf(f, "  tokens %ld, AST nodes %ld, names %ld, globals %ld (%ld constant), struct types %ld, strings %ld\n",
+            c->tokens, c->nodes, c->atoms, c->globals, c->const_globals, c->types, c->strings);
+    fprintf(f, "  functions %ld, locals %ld (%ld parameters, %ld lets), at most %ld in one function\n",
+            c->functions, c->params + c->lets, c->params, c->lets, c->max_locals);
+    fprintf(f, "  assembly %ld bytes; .text %ld, .text.unlikely %ld, .data %ld, .bss %ld; output %ld bytes\n",
+            c->asm_bytes, c->sec_bytes[SEC_TEXT], c->sec_bytes[SEC_COLD], c->sec_bytes[SEC_DATA],
+            c->sec_bytes[SEC_BSS], c->out_bytes);
+    if (codegen_cache_path) {
+        long n = c->cache_hits + c->cache_misses;
+        fprintf(f, "  codegen cache: %ld of %ld functions reused (%.1f%%), %ld generated\n",
+                c->cache_hits, n, n ? 100.0 * c->cache_hits / n : 0.0, c->cache_misses);
+    }
+    if (optimization_level >= 1 && c->ir.funcs + c->ir.fallback) {
+        fprintf(f, "  IR: %ld of %ld functions, %ld by the AST code generator (%ld with nothing to fold);",
+                c->ir.funcs, c->ir.funcs + c->ir.fallback, c->ir.fallback, c->ir.straight);
+        for (int i = 0; i < IR_PASS_COUNT; i++) fprintf(f, " %s %ld changes;", ir_passes[i].name, c->ir.pass_changes[i]);
+        fprintf(f, " %ld values spilled\n", c->ir.spilled);
+    }
+    if (optimization_level >= 1) {
+        fprintf(f, "  peephole:");
+        for (int i = 0; i < PH_RULE_COUNT; i++)
+            fprintf(f, "%s %s %ld", i ? "," : "", ph_rules[i].name, c->peephole_hits[i]);
+        fprintf(f, "\n");
+    }
+    fprintf(f, "  peak RSS %ld KB\n", peak_rss_kb());
+}
 
-    // Initialize global symbol table
-    GlobalSymbolTable global_symtab;
-    global_symtab_init(&global_symtab);
-    cg.global_symtab = &global_symtab;
+void time_report_json(FILE* f, const char* file) {
+    CompileCounts* c = &compile_counts;
+    fprintf(f, "{\"file\": \"");
+    for (const char* p = file; *p; p++) {
+        if (*p == '"' || *p == '\\') fputc('\\', f);
+        if ((unsigned char)*p >= 0x20) fputc(*p, f);
+    }
+    fprintf(f, "\", \"opt_level\": %d, \"phases\": [", optimization_level);
+    int first = 1;
+    for (int ph = 0; ph < PHASE_COUNT; ph++) {
+        PhaseStats* s = &phase_stats[ph];
+        if (!s->entered) continue;
+        fprintf(f, "%s{\"name\": \"%s\", \"wall_ms\": %.3f, \"cpu_ms\": %.3f, \"allocs\": %ld, \"alloc_bytes\": %ld}",
+                first ? "" : ", ", phase_names[ph], s->wall * 1e3, s->cpu * 1e3, s->allocs, s->alloc_bytes);
+        first = 0;
+    }
+    fprintf(f, "], \"counts\": {\"tokens\": %ld, \"ast_nodes\": %ld, \"names\": %ld, \"globals\": %ld, "
+               "\"const_globals\": %ld, \"struct_types\": %ld, \"strings\": %ld, \"functions\": %ld, "
+               "\"locals\": %ld, \"params\": %ld, \"lets\": %ld, \"max_locals\": %ld}, ",
+            c->tokens, c->nodes, c->atoms, c->globals, c->const_globals, c->types, c->strings,
+            c->functions, c->params + c->lets, c->params, c->lets, c->max_locals);
+    fprintf(f, "\"bytes\": {\"asm\": %ld, \"text\": %ld, \"text_unlikely\": %ld, \"data\": %ld, \"bss\": %ld, "
+               "\"output\": %ld}, ",
+            c->asm_bytes, c->sec_bytes[SEC_TEXT], c->sec_bytes[SEC_COLD], c->sec_bytes[SEC_DATA],
+            c->sec_bytes[SEC_BSS], c->out_bytes);
+    if (codegen_cache_path) {
+        fprintf(f, "\"cache\": {\"hits\": %ld, \"misses\": %ld}, ", c->cache_hits, c->cache_misses);
+    }
+    if (optimization_level >= 1 && c->ir.funcs + c->ir.fallback) {
+        fprintf(f, "\"ir\": {\"functions\": %ld, \"fallback\": %ld, \"straight\": %ld, \"spilled\": %ld, \"passes\": {",
+                c->ir.funcs, c->ir.fallback, c->ir.straight, c->ir.spilled);
+        for (int i = 0; i < IR_PASS_COUNT; i++)
+            fprintf(f, "%s\"%s\": %ld", i ? ", " : "", ir_passes[i].name, c->ir.pass_changes[i]);
+        fprintf(f, "}}, ");
+    }
+    if (optimization_level >= 1) {
+        fprintf(f, "\"peephole\": {");
+        for (int i = 0; i < PH_RULE_COUNT; i++)
+            fprintf(f, "%s\"%s\": %ld", i ? ", " : "", ph_rules[i].name, c->peephole_hits[i]);
+        fprintf(f, "}, ");
+    }
+    fprintf(f, "\"peak_rss_kb\": %ld}\n", peak_rss_kb());
+}
 
-    // First pass: process global variables
-    for (int i = 0; i < ast->child_count; i++) {
-        if (ast->children[i]->type == AST_GLOBAL_VAR) {
-            AstNode* gvar = ast->children[i];
-            char* type_name = gvar->value;  // Base type
-            int is_initialized = (gvar->child_count > 0);
-            char* init_value = NULL;
+// Close the running phase and print the report to stderr (1 = table, 2 = JSON)
+void time_report(int mode, const char* file) {
+    phase_begin(compile_phase);
+    if (mode == 2) time_report_json(stderr, file);
+    else time_report_text(stderr);
+}
 
-            // Extract type info from AST
-            int is_array = (gvar->struct_type && !strcmp(gvar->struct_type, "__array__"));
-            int array_count = gvar->array_size;
-            int is_pointer = (gvar->is_pointer & 1);
-            int is_mutable = (gvar->is_pointer & 2) >> 1;
+long file_size(const char* path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? st.st_size : 0;
+}
 
-            // If initialized, get the value
-            if (is_initialized && gvar->children[0]->type == AST_NUMBER) {
-                init_value = gvar->children[0]->value;
-            }
+// --bench-codegen: run codegen over the parsed program until a second has
+// passed and report source and assembly throughput
+void bench_codegen(Node prog, TypeTable* types, long size) {
+    long text = 0;
+    int runs = 0;
+    FILE* out = fopen("/dev/null", "w");
+    double start = now_sec(), elapsed;
+    do {
+        text = codegen(prog, out, NULL, strtab_new(), types);
+        runs++;
+        elapsed = now_sec() - start;
+    } while (elapsed < 1.0 || runs < 3);
+    fclose(out);
+    printf("Codegen benchmark: %.2f MB source, %.2f MB .text\n", size / 1e6, text / 1e6);
+    printf("  %9.1f MB/s source  %9.1f MB/s asm  (%.2f ms/run, %d runs)\n",
+           size * runs / elapsed / 1e6, text * runs / elapsed / 1e6, elapsed * 1e3 / runs, runs);
+}
 
-            global_symtab_add_full(&global_symtab, gvar->name, type_name, 0, is_initialized, init_value,
-                                   is_array, array_count, is_pointer, is_mutable);
+// ==== COMPILE SERVER ====
+// chronos --server <socket> [-O0|-O1|-O2] [prelude.ch ...] parses the
+// prelude files once and then serves compiles on a UNIX socket. Each
+// request runs in a process forked from the server, so it starts with the
+// prelude's names and parsed items in memory and parses only its own file
+// after them, as if the prelude had been pasted in front of it. Constant
+// folding happens while parsing, so a request at another -O level than the
+// server's parses the prelude again.
+//
+// chronos --connect <socket> <arguments> is the client: it sends its working
+// directory and arguments, passes its stdin, stdout and stderr along, and
+// exits with the status of the compile (or of the program, with --run).
+typedef struct {
+    char* text;          // Prelude files, each followed by a NUL
+    long size;
+    long* starts;        // Where each file starts in `text`
+    int count;
+    int mark;            // AST stack position of the first prelude item
+    int opt_level;       // -O the items were parsed at
+} Prelude;
+
+Prelude prelude;
+
+int compile(int argc, char** argv);
+
+// Parse the file at `start` in src_text onto the AST stack; returns the
+// number of tokens
+long parse_file_at(long start) {
+    Parser p;
+    parser_init(&p, src_text);
+    p.lex.cur = src_text + start;
+    src_origin = start;
+    line_starts = NULL;
+    line_count = 0;
+    parse_items(&p);
+    return p.lexed;
+}
 
-            // If array initialization, extract values
-            if (is_initialized && gvar->children[0]->type == AST_ARRAY_LITERAL) {
-                AstNode* arr_lit = gvar->children[0];
-                GlobalVar* gv = global_symtab_lookup(&global_symtab, gvar->name);
-                if (gv) {
-                    gv->array_init_count = arr_lit->child_count;
-                    gv->array_init_values = malloc(sizeof(char*) * arr_lit->child_count);
-                    for (int j = 0; j < arr_lit->child_count; j++) {
-                        if (arr_lit->children[j]->type == AST_NUMBER) {
-                            gv->array_init_values[j] = strdup(arr_lit->children[j]->value);
-                        } else {
-                            gv->array_init_values[j] = strdup("0");  // Default
-                        }
-                    }
-                }
-            }
-            // If string literal initialization for byte array
-            else if (is_initialized && gvar->children[0]->type == AST_STRING) {
-                AstNode* str_lit = gvar->children[0];
-                GlobalVar* gv = global_symtab_lookup(&global_symtab, gvar->name);
-                if (gv && is_array) {
-                    // Convert string to array of bytes
-                    char* str_val = str_lit->value;
-                    int str_len = strlen(str_val);
-                    gv->array_init_count = str_len + 1;  // Include null terminator
-                    gv->array_init_values = malloc(sizeof(char*) * (str_len + 1));
-                    for (int j = 0; j < str_len; j++) {
-                        char buf[8];
-                        sprintf(buf, "%d", (unsigned char)str_val[j]);
-                        gv->array_init_values[j] = strdup(buf);
-                    }
-                    gv->array_init_values[str_len] = strdup("0");  // Null terminator
-                }
-            }
+void prelude_load(char** files, int count) {
+    prelude.starts = safe_realloc(NULL, sizeof(long) * (count + 1));
+    for (int i = 0; i < count; i++) {
+        SourceFile sf;
+        if (source_open(&sf, files[i]) < 0) {
+            fprintf(stderr, "Error: cannot read prelude %s: %s\n", files[i], strerror(errno));
+            exit(1);
         }
+        prelude.text = safe_realloc(prelude.text, prelude.size + sf.size + 1);
+        prelude.starts[prelude.count++] = prelude.size;
+        memcpy(prelude.text + prelude.size, sf.text, sf.size);
+        prelude.size += sf.size;
+        prelude.text[prelude.size++] = '\0';
+        source_close(&sf);
     }
+}
 
-    emit(&cg, "\nsection .text\n    global _start\n\n");
-    emit(&cg, "_start:\n    call main\n    mov rdi, rax\n");
-    emit(&cg, "    mov rax, 60\n    syscall\n");
+// Parse the prelude's items; src_text must start with the prelude text
+void prelude_parse() {
+    prelude.mark = ast_mark();
+    for (int i = 0; i < prelude.count; i++) parse_file_at(prelude.starts[i]);
+    prelude.opt_level = optimization_level;
+}
 
-    gen_helpers(&cg);
+// Text of a request: the prelude followed by the file, so offsets into the
+// prelude stay valid
+char* prelude_join(SourceFile* sf) {
+    char* text = safe_realloc(NULL, prelude.size + sf->size + 1);
+    memcpy(text, prelude.text, prelude.size);
+    memcpy(text + prelude.size, sf->text, sf->size);
+    text[prelude.size + sf->size] = '\0';
+    return text;
+}
 
-    for (int i = 0; i < ast->child_count; i++) {
-        if (ast->children[i]->type == AST_FUNCTION) {
-            // Skip forward declarations, only generate code for full definitions
-            if (!ast->children[i]->is_forward_decl) {
-                gen_func(&cg, ast->children[i]);
-            }
-        }
+// Parse the request file after the prelude's items
+Node prelude_program() {
+    if (prelude.opt_level != optimization_level) {
+        ast_init();
+        prelude_parse();
     }
+    compile_counts.tokens = parse_file_at(prelude.size);
+    return ast_finish(ast_node(AST_PROGRAM, prelude.mark));
+}
 
-    cg.out = fopen(file, "w");
-    fprintf(cg.out, "; CHRONOS v0.11 - Global Variables\n\n");
-    fprintf(cg.out, "section .data\n");
-
-    // Emit string literals
-    for (int i = 0; i < strtab->count; i++) {
-        fprintf(cg.out, "%s: db ", strtab->strings[i].label);
-        for (int j = 0; j < strtab->strings[i].len; j++) {
-            fprintf(cg.out, "%d", (unsigned char)strtab->strings[i].value[j]);
-            fprintf(cg.out, ", ");
+// Request: a 4-byte length, then the working directory and the arguments,
+// each NUL terminated, with the client's stdin, stdout and stderr attached
+// to the first byte (SCM_RIGHTS). Reply: the 4-byte exit status.
+#define SERVER_MAX_REQUEST (1 << 20)
+
+void server_handle(int conn) {
+    uint32_t len;
+    int fds[3];
+    char ctl[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {&len, sizeof(len)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl, .msg_controllen = sizeof(ctl)};
+    struct cmsghdr* cm;
+    if (recvmsg(conn, &msg, MSG_WAITALL) != sizeof(len) || !(cm = CMSG_FIRSTHDR(&msg)) ||
+        cm->cmsg_type != SCM_RIGHTS || cm->cmsg_len != CMSG_LEN(sizeof(fds)) || len > SERVER_MAX_REQUEST) {
+        _exit(1);
+    }
+    memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+    char* req = safe_realloc(NULL, len + 1);
+    if (recv(conn, req, len, MSG_WAITALL) != (ssize_t)len) _exit(1);
+    req[len] = '\0';
+
+    // cwd, then argv (argv[0] included)
+    char** args = safe_realloc(NULL, sizeof(char*) * (len + 2));
+    int argc = 0;
+    for (char* q = req + strlen(req) + 1; q < req + len; q += strlen(q) + 1) args[argc++] = q;
+    args[argc] = NULL;
+
+    signal(SIGCHLD, SIG_DFL);
+    pid_t pid = fork();
+    if (pid == 0) {
+        for (int i = 0; i < 3; i++) dup2(fds[i], i);
+        for (int i = 0; i < 3; i++) if (fds[i] > 2) close(fds[i]);
+        close(conn);
+        if (chdir(req)) {
+            fprintf(stderr, "Error: %s: %s\n", req, strerror(errno));
+            _exit(1);
         }
-        fprintf(cg.out, "0\n");  // Null terminator
+        // The report covers this compile only
+        memset(phase_stats, 0, sizeof(phase_stats));
+        memset(sym_stats, 0, sizeof(sym_stats));
+        memset(&compile_counts, 0, sizeof(compile_counts));
+        phase_wall0 = 0;
+        exit(compile(argc, args));
     }
+    for (int i = 0; i < 3; i++) close(fds[i]);
+    int status = 1;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0) status = 1 << 8;
+    int32_t code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    if (write(conn, &code, sizeof(code))) {}
+    _exit(0);
+}
 
-    // Emit initialized global variables
-    for (int i = 0; i < global_symtab.count; i++) {
-        GlobalVar* gv = &global_symtab.vars[i];
-        if (gv->is_initialized) {
-            // Array with initialization values
-            if (gv->is_array && gv->array_init_values && gv->array_init_count > 0) {
-                const char* directive = type_asm_directive(gv->elem_type);
-                fprintf(cg.out, "%s: %s ", gv->name, directive);
-
-                // FIX Bug #11: Use declared array_count, not just array_init_count
-                // This allows: let buf: [i8; 1000] = "hello"; to allocate full 1000 bytes
-                int total_count = (gv->array_count > gv->array_init_count) ? gv->array_count : gv->array_init_count;
-
-                for (int j = 0; j < total_count; j++) {
-                    if (j < gv->array_init_count) {
-                        // Emit initialized value
-                        fprintf(cg.out, "%s", gv->array_init_values[j]);
-                    } else {
-                        // Pad remaining elements with zeros
-                        fprintf(cg.out, "0");
-                    }
-                    if (j < total_count - 1) {
-                        fprintf(cg.out, ", ");
-                    }
-                }
-                fprintf(cg.out, "\n");
-            }
-            // Scalar or single value
-            else if (gv->init_value) {
-                const char* directive = type_asm_directive(gv->type_name);
-                fprintf(cg.out, "%s: %s %s\n", gv->name, directive, gv->init_value);
-            }
+int server_main(int argc, char** argv) {
+    const char* path = argv[2];
+    char** files = argv + 3;
+    int nfiles = 0;
+    for (int i = 3; i < argc; i++) {
+        if (argv[i][0] == '-' && argv[i][1] == 'O' && argv[i][2] >= '0' && argv[i][2] <= '2' && !argv[i][3]) {
+            optimization_level = argv[i][2] - '0';
+        } else {
+            files[nfiles++] = argv[i];
         }
     }
 
-    // Emit uninitialized global variables (.bss section)
-    int has_bss = 0;
-    for (int i = 0; i < global_symtab.count; i++) {
-        GlobalVar* gv = &global_symtab.vars[i];
-        if (!gv->is_initialized) {
-            if (!has_bss) {
-                fprintf(cg.out, "\nsection .bss\n");
-                has_bss = 1;
-            }
-
-            // Calculate appropriate directive
-            const char* directive;
-            int count;
-            if (gv->is_array) {
-                // Array: reserve N elements of appropriate size
-                int elem_size = type_size(gv->elem_type);
-                if (elem_size == 1) directive = "resb";
-                else if (elem_size == 2) directive = "resw";
-                else if (elem_size == 4) directive = "resd";
-                else directive = "resq";
-                count = gv->array_count;
-            } else {
-                // Scalar or pointer: reserve appropriate size
-                int size = gv->is_pointer ? 8 : gv->size;
-                if (size == 1) { directive = "resb"; count = 1; }
-                else if (size == 2) { directive = "resw"; count = 1; }
-                else if (size == 4) { directive = "resd"; count = 1; }
-                else { directive = "resq"; count = 1; }
-            }
+    atoms_init();
+    lex_tables_init();
+    ast_init();
+    prelude_load(files, nfiles);
+    src_text = prelude.text;
+    for (int i = 0; i < nfiles; i++) printf("Prelude: %s\n", files[i]);
+    prelude_parse();
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: socket path too long: %s\n", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    // Only a socket left by an earlier server is replaced
+    struct stat st;
+    if (!lstat(path, &st)) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "Error: %s exists and is not a socket\n", path);
+            return 1;
+        }
+        unlink(path);
+    }
+    // Mode 0600: connecting needs write access, so only this user can
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t mask = umask(077);
+    int bound = fd >= 0 && !bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    umask(mask);
+    if (!bound || listen(fd, 128)) {
+        fprintf(stderr, "Error: cannot listen on %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    printf("✅ Serving on %s (-O%d, %d prelude items)\n", path, optimization_level, ast_mark() - prelude.mark);
+    fflush(stdout);
 
-            fprintf(cg.out, "%s: %s %d\n", gv->name, directive, count);
+    signal(SIGCHLD, SIG_IGN);  // Request handlers are never waited for
+    for (;;) {
+        int conn = accept(fd, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("accept");
+            return 1;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fd);
+            server_handle(conn);
         }
+        if (pid < 0) perror("fork");
+        close(conn);
     }
+}
 
-    fprintf(cg.out, "%s", cg.code_buf);
+int client_main(int argc, char** argv) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(argv[2]) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: socket path too long: %s\n", argv[2]);
+        return 1;
+    }
+    strcpy(addr.sun_path, argv[2]);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        fprintf(stderr, "Error: cannot connect to %s: %s\n", argv[2], strerror(errno));
+        return 1;
+    }
 
-    fclose(cg.out);
-    free(cg.code_buf);
-    free(global_symtab.vars);
+    // cwd, then "chronos" and the arguments after the socket
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) { perror("getcwd"); return 1; }
+    uint32_t len = strlen(cwd) + 1 + sizeof("chronos");
+    for (int i = 3; i < argc; i++) len += strlen(argv[i]) + 1;
+    char* req = safe_realloc(NULL, sizeof(len) + len);
+    char* q = req + sizeof(len);
+    memcpy(req, &len, sizeof(len));
+    q = stpcpy(q, cwd) + 1;
+    q = stpcpy(q, "chronos") + 1;
+    for (int i = 3; i < argc; i++) q = stpcpy(q, argv[i]) + 1;
+
+    int fds[3] = {0, 1, 2};
+    char ctl[CMSG_SPACE(sizeof(fds))];
+    memset(ctl, 0, sizeof(ctl));
+    struct iovec iov = {req, sizeof(len) + len};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl, .msg_controllen = sizeof(ctl)};
+    struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+    if (sendmsg(fd, &msg, 0) != (ssize_t)(sizeof(len) + len)) {
+        fprintf(stderr, "Error: cannot send request to %s: %s\n", argv[2], strerror(errno));
+        return 1;
+    }
+    int32_t code;
+    if (recv(fd, &code, sizeof(code), MSG_WAITALL) != sizeof(code)) {
+        fprintf(stderr, "Error: no reply from %s\n", argv[2]);
+        return 1;
+    }
+    return code;
 }
 
-int main(int argc, char** argv) {
-    // Parse optimization flags
-    int file_arg = 1;
-    if (argc >= 3 && argv[1][0] == '-' && argv[1][1] == 'O') {
-        if (argv[1][2] == '0') optimization_level = 0;
-        else if (argv[1][2] == '1') optimization_level = 1;
-        else if (argv[1][2] == '2') optimization_level = 2;
-        file_arg = 2;
+int compile(int argc, char** argv) {
+    // Parse command line flags
+    int file_arg = 0;
+    int show_symtab_stats = 0;
+    int bench_lex = 0;
+    int bench_cg = 0;
+    enum { EMIT_EXE, EMIT_OBJ, EMIT_ASM, EMIT_RUN } emit_kind = EMIT_EXE;
+    int use_nasm = 0;
+    int time_report_mode = 0;
+    const char* out_path = NULL;
+    const char* cache_dir = NULL;
+    phase_begin(PHASE_READ);
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-' && argv[i][1] == 'O') {
+            if (argv[i][2] == '0') optimization_level = 0;
+            else if (argv[i][2] == '1') optimization_level = 1;
+            else if (argv[i][2] == '2') optimization_level = 2;
+        } else if (!strcmp(argv[i], "--symtab-stats")) {
+            show_symtab_stats = 1;
+        } else if (!strcmp(argv[i], "--bench-lexer")) {
+            bench_lex = 1;
+        } else if (!strcmp(argv[i], "--bench-codegen")) {
+            bench_cg = 1;
+        } else if (!strcmp(argv[i], "--emit=exe")) {
+            emit_kind = EMIT_EXE;
+        } else if (!strcmp(argv[i], "--emit=obj") || !strcmp(argv[i], "-c")) {
+            emit_kind = EMIT_OBJ;
+        } else if (!strcmp(argv[i], "--emit=asm") || !strcmp(argv[i], "-S")) {
+            emit_kind = EMIT_ASM;
+        } else if (!strcmp(argv[i], "--nasm")) {
+            use_nasm = 1;
+        } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            out_path = argv[++i];
+        } else if (!strcmp(argv[i], "--run")) {
+            emit_kind = EMIT_RUN;
+        } else if (!strncmp(argv[i], "-j", 2) && (argv[i][2] || i + 1 < argc)) {
+            codegen_jobs = atoi(argv[i][2] ? argv[i] + 2 : argv[++i]);
+            if (codegen_jobs < 1) codegen_jobs = 1;
+        } else if (!strcmp(argv[i], "--cache-dir") && i + 1 < argc) {
+            cache_dir = argv[++i];
+        } else if (!strncmp(argv[i], "-I", 2) && (argv[i][2] || i + 1 < argc)) {
+            MODULE_GROW(modules.search, modules.nsearch, modules.search_cap);
+            modules.search[modules.nsearch++] = argv[i][2] ? argv[i] + 2 : argv[++i];
+        } else if (!strcmp(argv[i], "-ftime-report")) {
+            time_report_mode = 1;
+        } else if (!strcmp(argv[i], "-ftime-report=json")) {
+            time_report_mode = 2;
+        } else if (argv[i][0] != '-' && !file_arg) {
+            file_arg = i;
+        } else {
+            file_arg = 0;
+            break;
+        }
     }
 
-    if (argc < 2 || (file_arg == 2 && argc < 3)) {
-        printf("Usage: chronos [-O0|-O1|-O2] <file.ch>\n");
+    if (!file_arg) {
+        printf("Usage: chronos [-O0|-O1|-O2] [--symtab-stats] [--bench-lexer] [--bench-codegen] [-c|-S] [-o <file>] [--nasm] [--run] [-j N] [--cache-dir <dir>] [-I <dir>] [-ftime-report[=json]] <file.ch>\n");
         printf("  -O0: No optimizations (default)\n");
         printf("  -O1: Basic (constant folding)\n");
         printf("  -O2: Aggressive (constant folding + strength reduction)\n");
+        printf("  --symtab-stats: Report symbol table lookups/probes per phase\n");
+        printf("  --bench-lexer: Measure lexer throughput on <file.ch> and exit\n");
+        printf("  --bench-codegen: Measure codegen throughput on <file.ch> and exit\n");
+        printf("  -c, --emit=obj: Write a relocatable object (default output.o) and its module interface (.chi)\n");
+        printf("  -S, --emit=asm: Write NASM assembly (default output.asm)\n");
+        printf("  -o <file>: Output path (default chronos_program for an executable)\n");
+        printf("  --nasm: Assemble and link with nasm and ld instead of the built-in assembler\n");
+        printf("  --run: Compile in memory and run the program; exits with its status\n");
+        printf("  -j N: Generate code for functions on N threads (default: one per CPU for large programs)\n");
+        printf("  --cache-dir <dir>: Reuse the code of unchanged functions from earlier compiles\n");
+        printf("  -I <dir>: Also look for imported module interfaces (.chi) in <dir>\n");
+        printf("  -ftime-report: Print time, allocations and sizes per phase to stderr (=json for JSON)\n");
+        printf("chronos --server <socket> [-O0|-O1|-O2] [prelude.ch ...]: Keep the prelude parsed and serve compiles\n");
+        printf("chronos --connect <socket> <options> <file.ch>: Compile through a server (file follows the prelude)\n");
         return 1;
     }
 
-    FILE* f = fopen(argv[file_arg], "r");
-    if (!f) { perror("Error"); return 1; }
-    fseek(f, 0, SEEK_END);
-    long size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    char* src = malloc(size + 1);
-    fread(src, 1, size, f);
-    src[size] = '\0';
-    fclose(f);
+    if (!out_path) {
+        out_path = emit_kind == EMIT_ASM ? "output.asm" : emit_kind == EMIT_OBJ ? "output.o" : "chronos_program";
+    }
+    // --cache-dir: nothing to do if the files the same command read and
+    // wrote last time are all as it left them
+    char* stamp_path = NULL;
+    uint64_t stamp_key = 0, src_state = 0;
+    if (cache_dir && emit_kind != EMIT_RUN && !bench_lex && !bench_cg && !prelude.size) {
+        stamp_path = cache_stamp_path(cache_path_for(cache_dir, argv[file_arg]));
+        stamp_key = cache_stamp_key(argc, argv);
+        src_state = cache_file_state(argv[file_arg]);
+        if (src_state && cache_stamp_fresh(stamp_path, stamp_key)) {
+            printf("Compiling: %s\n", argv[file_arg]);
+            printf("✅ Up to date: %s\n", out_path);
+            compile_counts.out_bytes = file_size(out_path);
+            if (time_report_mode) time_report(time_report_mode, argv[file_arg]);
+            return 0;
+        }
+    }
 
-    printf("🔥 CHRONOS v0.17 - COMPILER OPTIMIZATIONS\n");
-    printf("Constant folding, strength reduction, -O flags\n");
-    printf("Optimization level: -O%d\n", optimization_level);
-    printf("Compiling: %s\n", argv[file_arg]);
+    SourceFile input;
+    if (source_open(&input, argv[file_arg]) < 0) { perror("Error"); return 1; }
+    char* src = input.text;
+    long size = input.size;
+    src_text = prelude.size ? prelude_join(&input) : src;
 
-    int count;
-    Tok* toks = tokenize(src, &count);
-    Parser parser = {toks, 0, count};
-    AstNode* ast = parse(&parser);
+    if (!prelude.size) {
+        atoms_init();
+        lex_tables_init();
+    }
+    if (bench_lex) {
+        bench_lexer(src, size);
+        return 0;
+    }
 
-    TypeTable* types = typetab_new();
-    build_type_table(types, ast);
+    // With --run, stdout belongs to the program
+    int quiet = emit_kind == EMIT_RUN;
+    if (!quiet) {
+        printf("🔥 CHRONOS v0.17 - COMPILER OPTIMIZATIONS\n");
+        printf("Constant folding, strength reduction, -O flags\n");
+        printf("Optimization level: -O%d\n", optimization_level);
+        printf("Compiling: %s\n", argv[file_arg]);
+    }
 
+    phase_begin(PHASE_PARSE);
+    Node prog;
+    if (prelude.size) {
+        prog = prelude_program();
+    } else {
+        Parser parser;
+        parser_init(&parser, src);
+        ast_init();
+        prog = parse(&parser);
+        compile_counts.tokens = parser.lexed;
+    }
+    compile_counts.nodes = ast.count - 1;
+
+    phase_begin(PHASE_TYPES);
+    TypeTable* types = typetab_new();
+    build_type_table(types, prog);
+    modules_load_imports(types, prog, argv[file_arg]);
+    compile_counts.types = types->count;
+    if (time_report_mode) count_locals(prog);
+    compile_counts.atoms = atom_count - 1;
+
+    phase_begin(PHASE_CODEGEN);
+    if (bench_cg) {
+        bench_codegen(prog, types, size);
+        return 0;
+    }
     StringTable* strtab = strtab_new();
-    codegen(ast, "output.asm", strtab, types);
+    codegen_exports = emit_kind == EMIT_OBJ;
+    codegen_assembles = emit_kind != EMIT_ASM;
+    codegen_drops_ast = 1;
+    size_t chi_len = 0;
+    char* chi = codegen_exports ? module_interface(out_path, prog, types, &chi_len) : NULL;
+    if (cache_dir) codegen_cache_path = cache_path_for(cache_dir, argv[file_arg]);
+    if (emit_kind == EMIT_ASM) {
+        char* tmp;
+        FILE* out = output_open(out_path, &tmp);
+        codegen(prog, out, NULL, strtab, types);
+        phase_begin(PHASE_OUTPUT);
+        output_commit(out, tmp, out_path, 0644);
+
+        print_code_generated();
+        if (show_symtab_stats) print_symtab_stats();
+        printf("✅ Compilation complete: %s\n", out_path);
+    } else if (use_nasm && emit_kind != EMIT_RUN) {
+        // Intermediates live in a directory of our own, so concurrent
+        // compiles never share output.asm/output.o
+        const char* tmpdir = getenv("TMPDIR");
+        char dir[4096], asm_path[4200], obj_path[4200];
+        snprintf(dir, sizeof(dir), "%s/chronos-XXXXXX", tmpdir && *tmpdir ? tmpdir : "/tmp");
+        if (!mkdtemp(dir)) {
+            fprintf(stderr, "Error: cannot create temporary directory: %s\n", strerror(errno));
+            return 1;
+        }
+        snprintf(asm_path, sizeof(asm_path), "%s/output.asm", dir);
+        snprintf(obj_path, sizeof(obj_path), "%s/output.o", dir);
+        FILE* out = fopen(asm_path, "w");
+        if (!out) { perror(asm_path); return 1; }
+        codegen(prog, out, NULL, strtab, types);
+        fclose(out);
+
+        print_code_generated();
+        if (show_symtab_stats) print_symtab_stats();
+        const char* obj = emit_kind == EMIT_OBJ ? out_path : obj_path;
+        char* nasm_argv[] = {"nasm", "-f", "elf64", asm_path, "-o", (char*)obj, NULL};
+        // The objects of imported modules go to ld after ours
+        char** ld_argv = safe_realloc(NULL, sizeof(char*) * (modules.count + 5));
+        int ld_argc = 0;
+        ld_argv[ld_argc++] = "ld";
+        ld_argv[ld_argc++] = obj_path;
+        for (int mi = 0; mi < modules.count; mi++) ld_argv[ld_argc++] = modules.mods[mi].obj;
+        ld_argv[ld_argc++] = "-o";
+        ld_argv[ld_argc++] = (char*)out_path;
+        ld_argv[ld_argc] = NULL;
+        phase_begin(PHASE_NASM);
+        int failed = run_tool(nasm_argv);
+        if (failed) cache_assembly_failed();
+        if (!failed && emit_kind == EMIT_EXE) {
+            phase_begin(PHASE_LD);
+            failed = run_tool(ld_argv);
+        }
+        free(ld_argv);
+        unlink(asm_path);
+        unlink(obj_path);
+        rmdir(dir);
+        if (failed) return 1;
+        if (emit_kind == EMIT_OBJ) module_write_interface(out_path, chi, chi_len);
+        printf("✅ Compilation complete: %s\n", out_path);
+    } else {
+        // Assemble the same text in memory, as codegen hands it over, and
+        // write the ELF file directly
+        Asm as;
+        asm_init(&as);
+        codegen(prog, NULL, &as, strtab, types);
+
+        if (!quiet) print_code_generated();
+        if (show_symtab_stats) print_symtab_stats();
+        phase_begin(PHASE_ASSEMBLE);
+        if (emit_kind != EMIT_OBJ) module_link(&as);
+        asm_finish(&as);
+        for (int si = 0; si < SEC_COUNT; si++) compile_counts.sec_bytes[si] = as.sec[si].size;
+        compile_counts.strings = strtab->count;
+        phase_begin(PHASE_OUTPUT);
+        if (emit_kind == EMIT_RUN) {
+            source_close(&input);
+            if (time_report_mode) time_report(time_report_mode, argv[file_arg]);
+            jit_run(&as);
+        } else if (emit_kind == EMIT_OBJ) {
+            elf_write_obj(&as, out_path);
+            module_write_interface(out_path, chi, chi_len);
+            printf("✅ Compilation complete: %s\n", out_path);
+        } else {
+            elf_write_exec(&as, out_path);
+            printf("✅ Compilation complete: %s\n", out_path);
+        }
+        asm_free(&as);
+    }
 
-    printf("✅ Code generated\n");
-    system("nasm -f elf64 output.asm -o output.o 2>&1 | head -5");
-    system("ld output.o -o chronos_program 2>&1 | head -5");
-    printf("✅ Compilation complete: ./chronos_program\n");
+    compile_counts.strings = strtab->count;
+    compile_counts.out_bytes = file_size(out_path);
+    if (stamp_path) {
+        CacheStamp st = {0};
+        int ok = cache_stamp_add(&st, argv[file_arg], src_state);
+        for (int mi = 0; mi < modules.count; mi++) {
+            ok &= cache_stamp_add(&st, modules.mods[mi].chi, 0);
+            if (emit_kind == EMIT_EXE) ok &= cache_stamp_add(&st, modules.mods[mi].obj, 0);
+        }
+        ok &= cache_stamp_add(&st, out_path, 0);
+        if (emit_kind == EMIT_OBJ) ok &= cache_stamp_add(&st, module_interface_path(out_path), 0);
+        if (ok) cache_stamp_write(stamp_path, stamp_key, &st);
+        else unlink(stamp_path);
+        free(st.paths);
+        free(st.states);
+    }
+    if (time_report_mode) time_report(time_report_mode, argv[file_arg]);
 
+    free(chi);
+    ast_release();
+    arena_release(&compiler_arena);
+    source_close(&input);
     return 0;
 }
+
+int main(int argc, char** argv) {
+    if (argc >= 3 && !strcmp(argv[1], "--server")) return server_main(argc, argv);
+    if (argc >= 3 && !strcmp(argv[1], "--connect")) return client_main(argc, argv);
+    return compile(argc, argv);
+}
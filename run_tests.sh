@@ -21,6 +21,17 @@ TOTAL_COUNT=0
 # Start time
 START_TIME=$(date +%s)
 
+# The tests run a compiler built from the current source, not the checked-in
+# binary, which may predate it
+BUILD_DIR=$(mktemp -d)
+trap 'rm -rf "$BUILD_DIR"' EXIT
+CHRONOS=$BUILD_DIR/chronos_v10
+echo "Building $CHRONOS from compiler/bootstrap-c/chronos_v10.c..."
+if ! gcc -O2 -pthread -o "$CHRONOS" compiler/bootstrap-c/chronos_v10.c; then
+    echo -e "${RED}❌ Could not build the compiler${NC}"
+    exit 1
+fi
+
 echo "========================================"
 echo "  CHRONOS COMPREHENSIVE TEST SUITE"
 echo "========================================"
@@ -77,10 +88,10 @@ echo "━━━━━━━━━━━━━━━━━━━━━━━━
 echo ""
 
 run_test "1.1" "Compile compiler_main.ch" "0" \
-    "./compiler/bootstrap-c/chronos_v10 compiler/chronos/compiler_main.ch"
+    "$CHRONOS compiler/chronos/compiler_main.ch"
 
 run_test "1.2" "Compile toolchain.ch" "0" \
-    "./compiler/bootstrap-c/chronos_v10 compiler/chronos/toolchain.ch"
+    "$CHRONOS compiler/chronos/toolchain.ch"
 
 echo ""
 echo "━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━"
@@ -211,7 +222,7 @@ echo "━━━━━━━━━━━━━━━━━━━━━━━━
 echo ""
 
 # Recompile toolchain
-./compiler/bootstrap-c/chronos_v10 compiler/chronos/toolchain.ch > /dev/null 2>&1
+$CHRONOS compiler/chronos/toolchain.ch > /dev/null 2>&1
 
 # Test mov instructions
 cat > output.asm << 'EOF'
@@ -331,10 +342,10 @@ fn main() -> i64 {
 }
 EOF
 
-./compiler/bootstrap-c/chronos_v10 compiler/chronos/compiler_main.ch > /dev/null 2>&1
+$CHRONOS compiler/chronos/compiler_main.ch > /dev/null 2>&1
 ./chronos_program /tmp/test_e2e1.ch > /dev/null 2>&1
 
-./compiler/bootstrap-c/chronos_v10 compiler/chronos/toolchain.ch > /dev/null 2>&1
+$CHRONOS compiler/chronos/toolchain.ch > /dev/null 2>&1
 cat > output.asm << 'EOF'
 section .text
     global _start
@@ -447,7 +458,7 @@ echo ""
 # Compile both components 10 times
 SUCCESS=true
 for i in {1..10}; do
-    ./compiler/bootstrap-c/chronos_v10 compiler/chronos/compiler_main.ch > /dev/null 2>&1
+    $CHRONOS compiler/chronos/compiler_main.ch > /dev/null 2>&1
     if [ $? -ne 0 ]; then
         SUCCESS=false
         break
@@ -493,6 +504,24 @@ else
 fi
 TOTAL_COUNT=$((TOTAL_COUNT + 1))
 
+echo ""
+echo "━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━"
+echo "SECTION 8: MODULE TESTS"
+echo "━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━"
+echo ""
+
+# Modules compile separately (-c writes the object and its .chi interface);
+# the program imports net, which imports bytes
+MODULES=$(pwd)/tests/modules
+MOD_DIR=$(mktemp -d)
+run_test "8.1" "Compile modules (bytes, net)" "0" \
+    "(cd $MOD_DIR && $CHRONOS -c $MODULES/bytes.ch -o bytes.o && $CHRONOS -c $MODULES/net.ch -I . -o net.o)"
+run_test "8.2" "Link program against modules" "0" \
+    "(cd $MOD_DIR && $CHRONOS -I . $MODULES/test_import.ch -o prog && ./prog; [ \$? -eq 42 ])"
+run_test "8.3" "Run program importing modules" "0" \
+    "$CHRONOS -I $MOD_DIR --run $MODULES/test_import.ch; [ \$? -eq 42 ]"
+rm -rf "$MOD_DIR"
+
 echo ""
 echo "========================================"
 echo "  TEST SUMMARY"
@@ -19,6 +19,12 @@ TOTAL_COUNT=0
 # Start time
 START_TIME=$(date +%s)
 
+# The compiler is not checked in; build it from the current source
+if ! gcc -O2 -pthread -o compiler/bootstrap-c/chronos_v10 compiler/bootstrap-c/chronos_v10.c; then
+    echo "❌ Could not build the compiler"
+    exit 1
+fi
+
 echo "========================================"
 echo "  CHRONOS COMPREHENSIVE TEST SUITE v2"
 echo "========================================"
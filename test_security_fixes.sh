@@ -11,6 +11,12 @@ echo ""
 PASS=0
 FAIL=0
 
+# The compiler is not checked in; build it from the current source
+if ! gcc -O2 -pthread -o compiler/bootstrap-c/chronos_v10 compiler/bootstrap-c/chronos_v10.c; then
+    echo "❌ Could not build the compiler"
+    exit 1
+fi
+
 # Test 1: Compile toolchain with fixes
 echo "Test 1: Compile toolchain.ch with security fixes..."
 if ./compiler/bootstrap-c/chronos_v10 compiler/chronos/toolchain.ch > /dev/null 2>&1; then